@@ -36,6 +36,7 @@
 
 #include "s3backer.h"
 #include "block_cache.h"
+#include "compress.h"
 #include "dcache.h"
 #include "hash.h"
 #include "util.h"
@@ -58,17 +59,29 @@
  * used to most recently used (where 'used' means either read or written). CLEAN2 is the
  * same as CLEAN except that the data must be ETag verified before being used.
  *
- * The linked list for CLEAN/CLEAN2 blocks is actually two lists, hi_cleans and lo_cleans.
- * This allows us to evict "low priority" blocks before "high priority" blocks.
+ * The linked list for CLEAN/CLEAN2 blocks is actually one list per priority class (normal, high,
+ * and pinned; see block_cache_prio()). This allows us to evict "normal" blocks before "high" priority
+ * blocks. Pinned blocks are never evicted or timed out; at startup, a background thread pre-loads them.
  *
  * Blocks in the DIRTY state are linked in a list in the order they should be written.
- * A pool of worker threads picks them off and writes them through to the underlying
+ * A pool of writeback worker threads picks them off and writes them through to the underlying
  * s3backer_store; while being written they are in state WRITING, or WRITING2 if another
  * write to the same block happens during that time. If the write is unsuccessful, the
  * block goes back to DIRTY and to the head of the DIRTY list: the result is that failed
  * writes of DIRTY blocks will retry indefinitely. If the write is successful, the
  * block moves to CLEAN if still in state WRITING, or DIRTY if in WRITING2.
  *
+ * Optionally (config->write_batch > 1), when a DIRTY block is due to be written, the worker
+ * thread also claims the DIRTY blocks adjacent to it and writes them all, in block order. Only
+ * neighbors that have already waited out at least half of their write delay are claimed, so a
+ * block that was dirtied a moment ago still gets its chance to be coalesced with further writes.
+ * Claimed blocks that are waiting for their turn are in state WRITING (or WRITING2 if modified
+ * meanwhile), and their data is copied just before each write, so the latest data is always written.
+ * The claimed blocks are not all written by the claiming thread: they wait in a shared queue
+ * ('wb_batch', or 'recover_batch' for recovery threads), which idle threads drain in block order
+ * before claiming anything else. So a batch is submitted as a run of adjacent blocks, but its
+ * writes still proceed in parallel.
+ *
  * Because we allow writes to update the data in a block while that block is being
  * written, the worker threads always write from the original buffer, and a new buffer
  * will get created on demand when a block moves to state WRITING2. When it completes
@@ -77,8 +90,136 @@
  *
  * Blocks in the READING/READING2 and WRITING/WRITING2 states are not in either list.
  *
+ * Threads that need to wait for a particular block to leave the READING/READING2 or
+ * WRITING/WRITING2 states wait on a condition variable from a small table indexed by
+ * block number, rather than a single global one, so that completing a read or write
+ * only wakes up the threads interested in that block (plus any hash collisions).
+ *
+ * Threads waiting for free space in the cache are woken up with a broadcast: a woken thread may
+ * find it no longer needs the space (e.g., another thread has meanwhile read in the block it
+ * wanted), so waking up just one thread could leave the others waiting even though there is space.
+ *
  * Only CLEAN and CLEAN2 blocks are eligible to be evicted from the cache. We evict entries
  * either when they timeout or the cache is full and we need to add a new entry to it.
+ *
+ * With a cache file, a block's data is read from or written to the file without holding the mutex, so
+ * transfers of different blocks proceed in parallel. Meanwhile the entry is busy ('io_readers' or
+ * 'io_writing'): it is not evicted, moved, or discarded, a write waits for any other reads and writes of
+ * its data to finish, and a read waits for any write. Before writing the data of a WRITING entry, the
+ * thread moves it to WRITING2, so the worker thread writing it out knows to do so again. Threads waiting
+ * for a busy entry use the same per-block condition variables.
+ *
+ * Read-ahead is performed by a separate pool of read-ahead worker threads, so that bursts of
+ * writeback and slow writes don't delay read-ahead, and vice versa. Each pool has its own
+ * condition variable: 'worker_work' for writeback (and clean entry expiry), 'ra_work' for read-ahead.
+ * Read-ahead threads are started on demand, one at a time, when there is read-ahead to do and all
+ * of the existing ones are busy, so a mount that never reads sequentially never starts any.
+ *
+ * Read-ahead is driven by a small table of independent sequential read streams, so that
+ * multiple concurrent sequential readers don't reset each other's read-ahead state. Each
+ * stream has its own trigger count and read-ahead window; when a read doesn't continue any
+ * existing stream, the least recently used stream is recycled. Blocks brought into the
+ * cache by read-ahead are flagged (along with the stream that read them) until first accessed.
+ *
+ * Each stream's read-ahead window adapts: it starts at config->read_ahead blocks, grows by one
+ * block for every read-ahead block that is subsequently read (so a fully consumed window roughly
+ * doubles), and is halved whenever a read-ahead block is evicted without ever being read, but it
+ * always stays between config->read_ahead and config->read_ahead_max. When a worker thread claims
+ * a read-ahead block and more remain, it wakes up another read-ahead worker, so a window is
+ * fetched in parallel by all idle read-ahead workers rather than one block at a time.
+ *
+ * Optionally, streams may also follow descending block numbers (config->read_ahead_reverse)
+ * or a constant stride of up to config->read_ahead_stride blocks in either direction. A stream's
+ * stride is established by its second read; because any two nearby reads can look like a stride,
+ * strides other than +/-1 must be confirmed by at least MIN_STRIDE_TRIGGER reads before triggering.
+ *
+ * Optionally (config->compress_size > 0, in-memory cache only), CLEAN blocks that are evicted to make
+ * room for other blocks are compressed and kept in a separate compressed tier, which has its own hash
+ * table and LRU list and is limited by total bytes rather than number of blocks. A block is never in
+ * both the main cache and the compressed tier: a read miss that finds the block in the compressed tier
+ * takes it out and decompresses it (in state READING, without holding the mutex) instead of reading
+ * it from the underlying s3backer_store, and a write miss simply discards any compressed copy.
+ * Evicted blocks are compressed from a copy without holding the mutex; in-progress compressions are
+ * tracked on the 'zpending' list so a write miss can invalidate them too.
+ *
+ * Optionally (config->dedup, in-memory cache only), CLEAN blocks having identical content share a
+ * single data buffer. Every data buffer is then preceded by a 'struct dedup_buf' header; when a block
+ * becomes CLEAN, a fast 128-bit (non-cryptographic) hash of its content is computed (while not holding
+ * the mutex) and looked up in a separate hash table keyed by a prefix of that hash. Buffers whose hashes
+ * share the same prefix are chained together, and a buffer only matches if both its full hash and its
+ * data are the same. If an identical buffer is found, the entry's own buffer is freed and the entry
+ * points to the shared buffer instead. Shared buffers are reference counted and are copied (if still
+ * shared) when a CLEAN block goes DIRTY. Only CLEAN blocks use shared buffers.
+ *
+ * Optionally (config->skip_unchanged), we remember the ETag and the MD5 of the content of each block as
+ * last read from or written to the underlying s3backer_store (the 'stored' flag). When a worker thread
+ * is about to write a block whose content MD5 matches, the write is skipped and the block goes straight
+ * to CLEAN (or stays DIRTY if it was modified meanwhile), as if the write had succeeded.
+ *
+ * Optionally (config->partial_writes, in-memory cache only), a sector-aligned partial write to a block
+ * that is not cached creates a new DIRTY entry right away, instead of first reading the block from the
+ * underlying s3backer_store. Such an entry is 'partial': a separate hash table holds a bitmap of its
+ * valid (i.e., written) sectors. The rest of the block is fetched (once) only when a read touches an
+ * invalid sector, when a write isn't sector-aligned, or when the block is about to be written back;
+ * the fetched data then fills in the invalid sectors and the entry is no longer partial. An entry also
+ * stops being partial when writes have covered all of its sectors. Only DIRTY, WRITING, and WRITING2
+ * entries may be partial; they can't become CLEAN (and so can't be evicted) before being filled in.
+ *
+ * Optionally (config->recover_threads > 0), dirty blocks recovered from the cache file at startup are
+ * not put on the normal dirty list, but on a separate list sorted by block number. A dedicated pool of
+ * recovery threads writes them out in that order, so the writeback worker threads remain available for
+ * newly written blocks. To give foreground I/O priority, all but one recovery thread pause while there
+ * has been a foreground read or write within the last RECOVER_IDLE_MILLIS, or while a normal dirty block
+ * is due to be written. On shutdown, the writeback worker threads help write out any remaining blocks.
+ *
+ * On shutdown, the remaining dirty blocks are sorted by block number and written out by the writeback
+ * worker threads, plus config->shutdown_threads extra threads started just for this. Progress is logged
+ * every SHUTDOWN_PROGRESS_MILLIS. If config->shutdown_timeout is non-zero (cache file only) and the flush
+ * takes longer than that, we stop writing once the writes in progress complete; the remaining dirty blocks
+ * stay recorded in the cache file, and the mount token is left set so they can be recovered next time.
+ *
+ * Optionally (config->min_size > 0, in-memory cache only), the cache adapts its size to memory pressure.
+ * A resize thread periodically reads the "some avg10" value from the PSI-format file config->pressure_file.
+ * While it is at least config->pressure percent, the target size shrinks by 1/RESIZE_SHRINK_DIVISOR each
+ * period (but never below config->min_size or the number of dirty blocks) and CLEAN blocks are evicted down
+ * to it; once it falls below half that, the target grows back toward config->cache_size. New entries are
+ * only created while the cache is smaller than the target size.
+ *
+ * With a cache file, each new block is placed just after (or else near) the dslot of the previous block,
+ * if that block is cached, so sequentially read blocks stay together on disk. Optionally (config->defrag),
+ * the cache file maintenance thread also repairs fragmentation once there has been no foreground read or
+ * write for DEFRAG_IDLE_MILLIS: it scans the cache file for CLEAN[2] blocks not stored just after their
+ * predecessor, moving one such block there (trading places with any CLEAN[2] block in that dslot) every
+ * DEFRAG_PAUSE_MILLIS.
+ *
+ * Optionally (config->checksums), the cache file keeps a checksum for each clean block, and clean blocks left
+ * by a previous run are verified the first time their data is used. A CLEAN block that fails verification is
+ * evicted and then read again from the underlying store. If in addition config->trusted, and the cache file(s)
+ * were closed normally the last time, clean blocks are loaded as CLEAN instead of CLEAN2, i.e., their ETags
+ * are not verified with the underlying store.
+ *
+ * Optionally (config->memory_size > 0, cache file only), a memory tier holds copies of the data of recently
+ * read blocks, so their reads don't have to touch the cache file. The memory tier has its own hash table and
+ * LRU list, and is limited to config->memory_size bytes. It is inclusive: the cache file still holds every
+ * block, and the memory copy always matches the data in the block's dslot (writes to the dslot update it), so
+ * a block evicted from the memory tier is simply dropped, and a block evicted from the cache is also dropped
+ * from the memory tier. A block is copied into the memory tier when a read of its data is served from the cache
+ * file, i.e., on its second use, so a large sequential read doesn't flush out the working set. READING[2] and
+ * CLEAN2 blocks are never in the memory tier.
+ *
+ * With a cache file, the cache size can be changed while mounted (block_cache_resize()), up to config->max_size
+ * blocks, for which the cache file always has room. Only the dslots below the current size are allocated. Growing
+ * takes effect immediately. Shrinking evicts CLEAN[2] blocks down to the new size right away; then the cache
+ * file maintenance thread relocates the blocks still stored beyond the new size to free dslots below it (or
+ * evicts them if there is no room), one every SHRINK_PAUSE_MILLIS, waiting for any that are not CLEAN[2] to
+ * become so. Freed dslots beyond the new size have their data deallocated, so the cache file's disk usage shrinks.
+ *
+ * With a cache file, the cache file maintenance thread also reclaims disk space in the background (if the platform
+ * supports it): every RECLAIM_PAUSE_MILLIS while there is any, it deallocates the data of up to RECLAIM_STEP_MAX runs
+ * of free dslots, or dslots written with some all-zero filesystem blocks (see s3b_dcache_reclaim()); otherwise it
+ * checks again every RECLAIM_CHECK_MILLIS. It does not hold the mutex while reclaiming, so this doesn't hold up
+ * foreground I/O; relocating and defragmenting move one block at a time with the mutex held. Shrinking takes
+ * precedence over defragmenting.
  */
 
 // Cache entry states
@@ -110,6 +251,7 @@
  *  READING     NO                  NO       YES              0     allocated
  *  READING2    NO                  NO       YES              1     allocated
  *  DIRTY       YES: priv->dirties  YES      ?                ?     allocated
+ *                   or recovers
  *  WRITING     NO                  NO       NO               ?     allocated
  *  WRITING2    NO                  YES      NO               ?     allocated
  *
@@ -117,21 +259,36 @@
  * This is so we can jam them into 30 bits instead of 64. It's possible for the time value
  * to wrap after about two years; the effect would be mis-timed writes and evictions.
  *
- * In state CLEAN2 only, the ETag to verify immediately follows the structure.
+ * In state CLEAN2 only, the ETag to verify immediately follows the structure. If config->skip_unchanged,
+ * there is always room for the ETag followed by the content MD5, both valid when 'stored' is set.
  */
 struct cache_entry {
     s3b_block_t                     block_num;      // block number - MUST BE FIRST
     u_int                           dirty:1;        // indicates state DIRTY or WRITING2
     u_int                           verify:1;       // data should be verified first
     uint32_t                        timeout:30;     // when to evict (CLEAN[2]) or write (DIRTY)
+    u_int                           ra:1;           // block was read ahead and not yet accessed (CLEAN)
+    u_int                           ra_stream:8;    // read-ahead stream index, valid when 'ra' is set
+    u_int                           ra_pattern:2;   // read-ahead pattern, valid when 'ra' is set
+    u_int                           stored:1;       // ETag and content MD5 of the stored block are known
+    u_int                           partial:1;      // only some sectors are valid (DIRTY, WRITING[2])
+    u_int                           recovered:1;    // on priv->recovers instead of priv->dirties (DIRTY)
+    u_int                           flushing:1;     // block may be in a flush group (DIRTY, WRITING[2])
+    u_int                           io_readers:8;   // # threads reading the data from the cache file
+    u_int                           io_writing:1;   // a thread is writing the data to the cache file
     TAILQ_ENTRY(cache_entry)        link;           // next in list (cleans or dirties)
     union {
         void                        *data;          // data buffer in memory
         u_int                       dslot;          // disk cache data slot
     }                               u;
-    u_char                          etag[0];        // ETag (looks like an MD5 checksum) (CLEAN2)
+    u_char                          etag[0];        // ETag (looks like an MD5 checksum) (CLEAN2 or 'stored')
 };
+#define ENTRY_STORED_MD5(entry)             ((entry)->etag + MD5_DIGEST_LENGTH)
+#define ENTRY_EXTRA(config)                 ((config)->skip_unchanged ? 2 * MD5_DIGEST_LENGTH : 0)
 #define ENTRY_IN_LIST(entry)                ((entry)->link.tqe_prev != NULL)
+#define ENTRY_IO_READERS_MAX                255
+#define ENTRY_IO_BUSY(entry)                ((entry)->io_readers > 0 || (entry)->io_writing)
+#define ENTRY_IO_READ_OK(entry)             (!(entry)->io_writing && (entry)->io_readers < ENTRY_IO_READERS_MAX)
 #define ENTRY_RESET_LINK(entry)             do { (entry)->link.tqe_prev = NULL; } while (0)
 #define ENTRY_GET_STATE(entry)              (ENTRY_IN_LIST(entry) ?                             \
                                                 ((entry)->dirty ? DIRTY :                       \
@@ -149,40 +306,224 @@ struct cache_entry {
 // Special timeout value for entries in state READING and READING2
 #define READING_TIMEOUT             ((uint32_t)0x3fffffff)
 
+// The list a DIRTY entry is on
+#define ENTRY_DIRTY_LIST(priv, entry)       ((entry)->recovered ? &(priv)->recovers : &(priv)->dirties)
+
+// Read-ahead patterns
+#define RA_FORWARD                  0               // ascending sequential
+#define RA_REVERSE                  1               // descending sequential
+#define RA_STRIDE                   2               // constant stride other than +/-1
+
+// Minimum number of reads required to trigger read-ahead for a stride pattern
+#define MIN_STRIDE_TRIGGER          3
+
+// Granularity of valid data tracking in partially written blocks
+#define PARTIAL_SECTOR_SIZE         512
+#define PARTIAL_ALIGNED(off, len)   ((off) % PARTIAL_SECTOR_SIZE == 0 && (len) % PARTIAL_SECTOR_SIZE == 0)
+
+// How often to log progress while flushing dirty blocks on shutdown
+#define SHUTDOWN_PROGRESS_MILLIS    10000
+
+// How long foreground I/O must be idle before all recovery threads write
+#define RECOVER_IDLE_MILLIS         1000
+
+// How often to check memory pressure, and how quickly to shrink and grow the target size in response
+#define RESIZE_INTERVAL_MILLIS      1000
+#define RESIZE_SHRINK_DIVISOR       8               // shrink by 1/8 of the current target size
+#define RESIZE_GROW_DIVISOR         16              // grow by 1/16 of the maximum size
+
+// How long foreground I/O must be idle before defragmenting, how long to pause between moves, and how many dslots to scan per step
+#define DEFRAG_IDLE_MILLIS          5000
+#define DEFRAG_PAUSE_MILLIS         20
+#define DEFRAG_SCAN_MAX             4096
+
+// How long to pause between relocations when shrinking the cache file, how long to wait when nothing could be relocated,
+// and how many dslots to scan per step
+#define SHRINK_PAUSE_MILLIS         5
+#define SHRINK_RETRY_MILLIS         1000
+#define SHRINK_SCAN_MAX             4096
+
+// How many runs of dslots to reclaim disk space from per step, how long to pause between steps, and how often to check for more
+#define RECLAIM_STEP_MAX            8
+#define RECLAIM_PAUSE_MILLIS        10
+#define RECLAIM_CHECK_MILLIS        1000
+
+// How many clean blocks the lazy load thread loads from the cache file each time it grabs the mutex
+#define LAZY_LOAD_CHUNK             256
+
+// Size of the hashed table of per-block wait condition variables (must be a power of two)
+#define BLOCK_WAIT_TABLE_SIZE       64
+
+// Get the condition variable to wait on for a state change in the given block
+#define BLOCK_WAIT(priv, block_num) (&(priv)->block_waits[(block_num) & (BLOCK_WAIT_TABLE_SIZE - 1)])
+
 // Declare the list "head" struct
 TAILQ_HEAD(list_head, cache_entry);
 
+// One sequential read stream tracked for read-ahead purposes
+struct ra_stream {
+    s3b_block_t                     seq_last;       // last block read in sequence by upper layer
+    u_int                           seq_count;      // # of blocks read in sequence by upper layer
+    u_int                           ra_count;       // # of blocks of read-ahead initiated
+    u_int                           window;         // current read-ahead window size in blocks
+    int                             stride;         // block number delta between reads (1 = sequential)
+    TAILQ_ENTRY(ra_stream)          link;           // next in LRU list
+};
+TAILQ_HEAD(ra_stream_head, ra_stream);
+
+// One compressed CLEAN block in the compressed tier
+struct zcache_entry {
+    s3b_block_t                     block_num;      // block number - MUST BE FIRST
+    uint32_t                        timeout;        // when to evict (inherited from the evicted CLEAN entry)
+    size_t                          zlen;           // length of compressed data
+    void                            *zdata;         // compressed data
+    TAILQ_ENTRY(zcache_entry)       link;           // next in LRU list
+};
+TAILQ_HEAD(zcache_head, zcache_entry);
+
+// A block being compressed for the compressed tier (without holding the mutex)
+struct zcache_pending {
+    s3b_block_t                     block_num;      // block number
+    int                             stale;          // the block was written meanwhile, so discard the result
+    TAILQ_ENTRY(zcache_pending)     link;           // next in list
+};
+TAILQ_HEAD(zcache_pending_head, zcache_pending);
+
+// One block's data in the memory tier in front of the cache file
+struct mtier_entry {
+    s3b_block_t                     block_num;      // block number - MUST BE FIRST
+    TAILQ_ENTRY(mtier_entry)        link;           // next in LRU list
+    uint64_t                        data[0];        // block data
+};
+TAILQ_HEAD(mtier_head, mtier_entry);
+
+// Header preceding each in-memory data buffer when deduplication is enabled
+struct dedup_buf {
+    s3b_block_t                     key;            // hash table key (hash prefix) - MUST BE FIRST
+    u_int                           refs;           // # of CLEAN entries sharing this buffer, or zero if private
+    struct dedup_buf                *next;          // next sharable buffer with the same key (valid if refs > 0)
+    u_char                          hash[HASH128_LENGTH];// hash of the data (valid if refs > 0)
+    uint64_t                        data[0];        // block data
+};
+
+// Valid sector bitmap for a partially written block
+struct partial_map {
+    s3b_block_t                     block_num;      // block number - MUST BE FIRST
+    u_int                           num_valid;      // number of valid sectors
+    int                             filling;        // a thread is fetching the rest of the block
+    bitmap_t                        valid[0];       // valid sectors
+};
+
+// The set of blocks being waited on by one invocation of block_cache_flush_blocks()
+struct flush_group {
+    s3b_block_t                     *blocks;        // the blocks, sorted and unique
+    bitmap_t                        *done;          // which of the blocks have been written
+    u_int                           num_blocks;     // length of 'blocks'
+    u_int                           pending;        // number of blocks not yet written
+    pthread_cond_t                  cond;           // signaled when 'pending' reaches zero
+    TAILQ_ENTRY(flush_group)        link;           // next in list
+};
+TAILQ_HEAD(flush_group_head, flush_group);
+
+// Blocks claimed together for writing, in state WRITING or WRITING2, that no thread has started writing yet
+struct write_batch {
+    s3b_block_t                     next;           // the next block to write
+    u_int                           left;           // number of blocks remaining, starting with 'next'
+};
+
+#define DEDUP_BUF(ptr)              ((struct dedup_buf *)((char *)(ptr) - offsetof(struct dedup_buf, data)))
+
 // Private data
 struct block_cache_private {
     struct block_cache_conf         *config;        // configuration
     struct s3backer_store           *inner;         // underlying s3backer store
     struct block_cache_stats        stats;          // statistics
-    struct list_head                lo_cleans;      // list of low priority clean blocks (LRU order)
-    struct list_head                hi_cleans;      // list of high priority clean blocks (LRU order)
+    struct list_head                cleans[BLOCK_CACHE_NUM_PRIOS];  // lists of clean blocks per priority class (LRU order)
     struct list_head                dirties;        // list of dirty blocks (write order)
+    struct list_head                recovers;       // list of recovered dirty blocks (block order)
+    struct flush_group_head         flush_groups;   // flush groups being waited on
+    struct write_batch              wb_batch;       // claimed batch blocks waiting for a writeback worker thread
+    struct write_batch              recover_batch;  // claimed batch blocks waiting for a recovery thread
     struct s3b_hash                 *hashtable;     // hashtable of all cached blocks
     struct s3b_dcache               *dcache;        // on-disk persistent cache
-    u_int                           num_cleans;     // combined lengths of 'lo_cleans' and 'hi_cleans'
+    u_int                           num_cleans;     // combined lengths of the 'cleans' lists
     u_int                           num_dirties;    // # blocks that are DIRTY, WRITING, or WRITING2
+    u_int                           num_recovers;   // length of the 'recovers' list
+    u_int                           prio_blocks[BLOCK_CACHE_NUM_PRIOS]; // # cached blocks per priority class
+    u_int                           recover_total;  // # dirty blocks recovered from the cache file
+    u_int                           recover_written;// # recovered dirty blocks written by recovery threads
+    u_int                           num_unloaded;   // # clean blocks in the cache file not yet loaded (lazy loading)
     u_int64_t                       start_time;     // when we started
     u_int32_t                       clean_timeout;  // timeout for clean entries in time units
     u_int32_t                       dirty_timeout;  // timeout for dirty entries in time units
     double                          max_dirty_ratio;// dirty ratio at which we write immediately
-    s3b_block_t                     seq_last;       // last block read in sequence by upper layer
-    u_int                           seq_count;      // # of blocks read in sequence by upper layer
-    u_int                           ra_count;       // # of blocks of read-ahead initiated
+    struct ra_stream                *ra_streams;    // read-ahead stream table
+    struct ra_stream_head           ra_lru;         // read-ahead streams in LRU order
+    struct s3b_hash                 *zhashtable;    // hashtable of compressed blocks, or NULL if disabled
+    struct zcache_head              zlru;           // compressed blocks in LRU order
+    struct zcache_pending_head      zpending;       // blocks being compressed
+    u_int                           zmax;           // maximum number of compressed blocks
+    size_t                          zbytes;         // total memory used by compressed blocks
+    uint64_t                        zdecompress_micros;// cumulative time spent decompressing
+    struct s3b_hash                 *mhashtable;    // hashtable of memory tier blocks, or NULL if disabled
+    struct mtier_head               mlru;           // memory tier blocks in LRU order
+    u_int                           mmax;           // maximum number of memory tier blocks
+    struct s3b_hash                 *dhashtable;    // hashtable of shared data buffers, or NULL if dedup disabled
+    u_int                           dedup_refs;     // total references to shared data buffers
+    u_int                           dedup_bufs;     // number of sharable data buffers
+    struct s3b_hash                 *phashtable;    // hashtable of partial entries' valid sectors, or NULL if disabled
+    u_int                           sectors_per_block;// number of sectors in a block (for partial entries)
     u_int                           thread_id;      // next thread id
-    u_int                           num_threads;    // number of alive worker threads
-    pthread_t                       *threads;       // worker threads
+    u_int                           num_threads;    // number of alive writeback worker threads
+    u_int                           num_ra_threads; // number of alive read-ahead worker threads
+    u_int                           ra_started;     // number of read-ahead worker threads started
+    u_int                           num_recover_threads;// number of alive recovery threads
+    u_int                           shutdown_started;// number of extra shutdown flush threads started
+    pthread_t                       *threads;       // writeback, read-ahead, preload, resize or load, maintenance,
+                                                    // recovery & shutdown
+    int                             preload_started;// pinned block preload thread was started
+    int                             preloading;     // pinned block preload thread is running
+    int                             resize_started; // memory pressure resize thread was started
+    int                             resizing;       // memory pressure resize thread is running
+    int                             load_started;   // lazy load thread was started
+    int                             loading;        // lazy load thread is running
+    int                             maint_started;  // cache file maintenance thread was started
+    int                             maintaining;    // cache file maintenance thread is running
+    u_int                           recover_started;// number of recovery threads started
+    u_int                           recover_thread_id;// next recovery thread index
+    uint64_t                        fg_millis;      // time of most recent foreground read or write
+    int                             trusted;        // clean blocks in the cache file don't need ETag verification
+    u_int                           defrag_cursor;  // next dslot for defragmentation to inspect
+    int                             defrag_moved;   // defragmentation moved a block during the current pass
+    int                             defrag_pending; // blocks may have been allocated out of place since the last pass
+    u_int                           target_size;    // current target cache size (at most max_size)
+    u_int                           max_size;       // maximum cache size (config->cache_size unless resizable)
+    int                             shrink_pending; // blocks remain beyond the end of the shrunken cache file
+    u_int                           shrink_cursor;  // next dslot for shrinking to inspect
+    uint64_t                        shrink_millis;  // when to do the next shrink step
+    uint64_t                        reclaim_millis; // when to do the next disk space reclamation step
+    int                             evict_waiting;  // a thread is waiting for a busy CLEAN[2] entry to become evictable
+    double                          pressure;       // most recently observed memory pressure
+    u_int                           wb_busy;        // # writeback worker threads currently writing
+    u_int                           ra_busy;        // # read-ahead worker threads currently reading
+    uint64_t                        wb_busy_millis; // cumulative time spent writing by writeback worker threads
+    uint64_t                        ra_busy_millis; // cumulative time spent reading by read-ahead worker threads
+    uint64_t                        stats_time;     // when statistics were last cleared
     int                             stopping;       // signals worker threads to exit
+    int                             flush_expired;  // shutdown flush deadline passed; stop writing dirty blocks
     block_list_func_t               *survey_callback;// non-zero survey is running and this is the callback
     void                            *survey_arg;    // non-zero survey is running and this is the arg
     pthread_mutex_t                 mutex;          // my mutex
     pthread_cond_t                  space_avail;    // there is new space available in cache
-    pthread_cond_t                  end_reading;    // some entry in state READING[2] changed state
-    pthread_cond_t                  worker_work;    // there is new work for worker thread(s)
+    pthread_cond_t                  worker_work;    // there is new work for writeback worker thread(s)
+    pthread_cond_t                  ra_work;        // there is new work for read-ahead worker thread(s)
     pthread_cond_t                  worker_exit;    // a worker thread has exited
-    pthread_cond_t                  write_complete; // a write has completed
+    pthread_cond_t                  write_complete; // a write has completed (for max_dirty waiters)
+    pthread_cond_t                  resize_work;    // wakes up the resize thread (at shutdown)
+    pthread_cond_t                  recover_work;   // wakes up paused recovery threads (at shutdown)
+    pthread_cond_t                  maint_work;     // wakes up the cache file maintenance thread
+    pthread_cond_t                  block_waits[BLOCK_WAIT_TABLE_SIZE];   // a READING[2] or WRITING[2] entry changed state,
+                                                                            // or an entry is no longer busy
 };
 
 // s3backer_store functions
@@ -208,19 +549,82 @@ static int block_cache_read(struct block_cache_private *priv, s3b_block_t block_
 static int block_cache_do_read(struct block_cache_private *priv, s3b_block_t block_num, u_int off, u_int len, void *dest, int stats);
 static int block_cache_write(struct block_cache_private *priv, s3b_block_t block_num, u_int off, u_int len, const void *src);
 static void *block_cache_worker_main(void *arg);
+static void *block_cache_ra_worker_main(void *arg);
+static void block_cache_ra_wakeup(struct block_cache_private *priv);
+static void *block_cache_preload_main(void *arg);
+static void *block_cache_resize_main(void *arg);
+static void *block_cache_load_main(void *arg);
+static void *block_cache_maint_main(void *arg);
+static int block_cache_load_block(struct block_cache_private *priv, s3b_block_t block_num);
+static int block_cache_load_next(struct block_cache_private *priv, u_int max);
+static int block_cache_read_pressure(struct block_cache_conf *config, double *pressurep);
+static void *block_cache_recover_main(void *arg);
+static int block_cache_recover_yield(struct block_cache_private *priv);
+static int block_cache_sort_dirties(struct block_cache_private *priv, struct list_head *list);
+static int block_cache_entry_cmp(const void *ptr1, const void *ptr2);
+static void block_cache_flush_done(struct block_cache_private *priv, struct cache_entry *entry);
+static int block_cache_block_num_cmp(const void *ptr1, const void *ptr2);
+static void block_cache_claim_batch(struct block_cache_private *priv, struct cache_entry *entry, uint32_t limit,
+  struct write_batch *batch);
+static struct cache_entry *block_cache_batch_next(struct block_cache_private *priv, struct write_batch *batch);
+static void block_cache_unclaim_batch(struct block_cache_private *priv, struct write_batch *batch);
+static void block_cache_unclaim_entry(struct block_cache_private *priv, struct cache_entry *entry);
+static int block_cache_write_entry(struct block_cache_private *priv, struct cache_entry *entry, void *buf, uint32_t now);
 static int block_cache_check_cancel(void *arg, s3b_block_t block_num);
-static int block_cache_get_entry(struct block_cache_private *priv, struct cache_entry **entryp, void **datap);
+static int block_cache_get_entry(struct block_cache_private *priv, s3b_block_t block_num, struct cache_entry **entryp,
+  void **datap);
 static void block_cache_free_entry(struct block_cache_private *priv, struct cache_entry **entryp);
+static void block_cache_discard_corrupt(struct block_cache_private *priv, struct cache_entry *entry);
+static int block_cache_defrag(struct block_cache_private *priv, void *buf);
+static int block_cache_shrink(struct block_cache_private *priv, void *buf);
+static int block_cache_reclaim(struct block_cache_private *priv, void *buf);
+static int block_cache_set_size(struct block_cache_private *priv, u_int size);
+static int block_cache_defrag_improves(struct block_cache_private *priv, struct cache_entry *entry,
+  struct cache_entry *other_entry, u_int new_dslot);
+static int block_cache_defrag_follows(struct block_cache_private *priv, s3b_block_t block_num,
+  struct cache_entry *entry1, u_int dslot1, struct cache_entry *entry2, u_int dslot2);
 static s3b_hash_visit_t block_cache_free_one;
 static struct cache_entry *block_cache_verified(struct block_cache_private *priv, struct cache_entry *entry);
 static double block_cache_dirty_ratio(struct block_cache_private *priv);
 static void block_cache_worker_wait(struct block_cache_private *priv, struct cache_entry *entry);
 static int block_cache_cond_timedwait(struct block_cache_private *priv, pthread_cond_t *cond, uint64_t wake_time_millis);
 static struct list_head *block_cache_cleans_list(struct block_cache_private *priv, s3b_block_t block_num);
-static int block_cache_high_prio(struct block_cache_conf *conf, s3b_block_t block_num);
+static u_int block_cache_prio(struct block_cache_conf *conf, s3b_block_t block_num);
+static u_int block_cache_num_pinned(struct block_cache_conf *conf);
+static int block_cache_have_space(struct block_cache_private *priv);
+static void block_cache_ra_update(struct block_cache_private *priv, s3b_block_t block_num);
+static struct ra_stream *block_cache_ra_pending(struct block_cache_private *priv);
+static int block_cache_ra_triggered(struct block_cache_conf *config, const struct ra_stream *stream);
+static void block_cache_ra_hit(struct block_cache_private *priv, struct cache_entry *entry);
+static void block_cache_ra_wasted(struct block_cache_private *priv, struct cache_entry *entry);
+static int block_cache_ra_stride_ok(struct block_cache_conf *config, int64_t delta);
+static int block_cache_ra_next_block(struct block_cache_conf *config, const struct ra_stream *stream, s3b_block_t *blockp);
 static uint32_t block_cache_get_time(struct block_cache_private *priv);
 static uint64_t block_cache_get_time_millis(void);
+static uint64_t block_cache_get_time_micros(void);
+static void block_cache_zcache_put(struct block_cache_private *priv, struct cache_entry *entry);
+static struct zcache_entry *block_cache_zcache_take(struct block_cache_private *priv, s3b_block_t block_num);
+static void block_cache_zcache_discard(struct block_cache_private *priv, s3b_block_t block_num);
+static void block_cache_zcache_free(struct block_cache_private *priv, struct zcache_entry *zentry);
+static void block_cache_mtier_promote(struct block_cache_private *priv, struct cache_entry *entry, const void *src,
+  u_int off, u_int len);
+static void block_cache_mtier_update(struct block_cache_private *priv, struct cache_entry *entry, const void *src,
+  u_int off, u_int len, int r);
+static void block_cache_mtier_free(struct block_cache_private *priv, struct mtier_entry *mentry);
+static void *block_cache_alloc_data(struct block_cache_private *priv);
+static void block_cache_free_data(struct block_cache_private *priv, void *data);
+static void block_cache_dedup(struct block_cache_private *priv, struct cache_entry *entry, const u_char *hash);
+static void block_cache_dedup_remove(struct block_cache_private *priv, struct dedup_buf *dbuf);
+static int block_cache_unshare(struct block_cache_private *priv, struct cache_entry *entry);
+static int block_cache_partial_ok(struct block_cache_private *priv, s3b_block_t block_num, u_int off, u_int len);
+static int block_cache_partial_init(struct block_cache_private *priv, struct cache_entry *entry);
+static int block_cache_partial_valid(struct block_cache_private *priv, struct cache_entry *entry, u_int off, u_int len);
+static void block_cache_partial_mark(struct block_cache_private *priv, struct cache_entry *entry, u_int off, u_int len);
+static int block_cache_partial_fill(struct block_cache_private *priv, struct cache_entry *entry);
+static void block_cache_partial_free(struct block_cache_private *priv, struct cache_entry *entry);
 static int block_cache_read_data(struct block_cache_private *priv, struct cache_entry *entry, void *dest, u_int off, u_int len);
+static void block_cache_io_done(struct block_cache_private *priv, struct cache_entry *entry);
+static struct cache_entry *block_cache_evictable(struct block_cache_private *priv);
 static int block_cache_write_data(struct block_cache_private *priv, struct cache_entry *entry, const void *src, u_int off,
   u_int len);
 
@@ -245,6 +649,7 @@ block_cache_create(struct block_cache_conf *config, struct s3backer_store *inner
     struct s3backer_store *s3b;
     struct block_cache_private *priv;
     struct cache_entry *entry;
+    u_int i;
     int r;
 
     // Initialize s3backer_store structure
@@ -275,27 +680,83 @@ block_cache_create(struct block_cache_conf *config, struct s3backer_store *inner
     priv->config = config;
     priv->inner = inner;
     priv->start_time = block_cache_get_time_millis();
+    priv->stats_time = priv->start_time;
     priv->clean_timeout = (config->timeout + TIME_UNIT_MILLIS - 1) / TIME_UNIT_MILLIS;
     priv->dirty_timeout = (config->write_delay + TIME_UNIT_MILLIS - 1) / TIME_UNIT_MILLIS;
+    priv->target_size = config->cache_size;
+    priv->max_size = config->cache_file != NULL && config->max_size > config->cache_size ? config->max_size : config->cache_size;
+    priv->defrag_pending = config->defrag;
     if ((r = pthread_mutex_init(&priv->mutex, NULL)) != 0)
         goto fail2;
     if ((r = pthread_cond_init(&priv->space_avail, NULL)) != 0)
         goto fail3;
-    if ((r = pthread_cond_init(&priv->end_reading, NULL)) != 0)
-        goto fail4;
+    for (i = 0; i < BLOCK_WAIT_TABLE_SIZE; i++) {
+        if ((r = pthread_cond_init(&priv->block_waits[i], NULL)) != 0) {
+            while (i > 0)
+                pthread_cond_destroy(&priv->block_waits[--i]);
+            goto fail4;
+        }
+    }
     if ((r = pthread_cond_init(&priv->worker_work, NULL)) != 0)
         goto fail5;
     if ((r = pthread_cond_init(&priv->worker_exit, NULL)) != 0)
         goto fail6;
     if ((r = pthread_cond_init(&priv->write_complete, NULL)) != 0)
         goto fail7;
-    if ((priv->threads = calloc(config->num_threads, sizeof(*priv->threads))) == NULL)
+    if ((r = pthread_cond_init(&priv->ra_work, NULL)) != 0)
         goto fail8;
-    TAILQ_INIT(&priv->lo_cleans);
-    TAILQ_INIT(&priv->hi_cleans);
-    TAILQ_INIT(&priv->dirties);
-    if ((r = s3b_hash_create(&priv->hashtable, config->cache_size)) != 0)
+    if ((r = pthread_cond_init(&priv->resize_work, NULL)) != 0)
         goto fail9;
+    if ((r = pthread_cond_init(&priv->recover_work, NULL)) != 0)
+        goto fail10;
+    if ((r = pthread_cond_init(&priv->maint_work, NULL)) != 0)
+        goto fail11;
+    if ((priv->threads = calloc(config->num_threads + config->read_ahead_threads + 3 + config->recover_threads
+      + config->shutdown_threads, sizeof(*priv->threads))) == NULL)
+        goto fail12;
+    if ((priv->ra_streams = calloc(config->read_ahead_streams, sizeof(*priv->ra_streams))) == NULL)
+        goto fail13;
+    TAILQ_INIT(&priv->ra_lru);
+    for (i = 0; i < config->read_ahead_streams; i++) {
+        priv->ra_streams[i].window = config->read_ahead;
+        priv->ra_streams[i].stride = 1;
+        TAILQ_INSERT_TAIL(&priv->ra_lru, &priv->ra_streams[i], link);
+    }
+    for (i = 0; i < BLOCK_CACHE_NUM_PRIOS; i++)
+        TAILQ_INIT(&priv->cleans[i]);
+    TAILQ_INIT(&priv->dirties);
+    TAILQ_INIT(&priv->recovers);
+    TAILQ_INIT(&priv->flush_groups);
+    TAILQ_INIT(&priv->zlru);
+    TAILQ_INIT(&priv->zpending);
+    TAILQ_INIT(&priv->mlru);
+    if ((r = s3b_hash_create(&priv->hashtable, priv->max_size)) != 0)
+        goto fail14;
+    if (config->compress_size > 0 && config->cache_file == NULL) {
+        priv->zmax = config->compress_size / config->block_size * BLOCK_CACHE_MAX_COMPRESSION_RATIO;
+        if (priv->zmax == 0)
+            priv->zmax = 1;
+        if ((r = s3b_hash_create(&priv->zhashtable, priv->zmax)) != 0)
+            goto fail15;
+    }
+    if (config->dedup && config->cache_file == NULL) {
+        if ((r = s3b_hash_create(&priv->dhashtable, config->cache_size)) != 0)
+            goto fail16;
+    }
+    if (config->partial_writes && config->cache_file == NULL && config->block_size >= PARTIAL_SECTOR_SIZE) {
+        priv->sectors_per_block = config->block_size / PARTIAL_SECTOR_SIZE;
+        if ((r = s3b_hash_create(&priv->phashtable, config->cache_size)) != 0)
+            goto fail17;
+    }
+    if (config->memory_size > 0 && config->cache_file != NULL) {
+        priv->mmax = config->memory_size / config->block_size;
+        if (priv->mmax > config->cache_size)
+            priv->mmax = config->cache_size;
+        if (priv->mmax == 0)
+            priv->mmax = 1;
+        if ((r = s3b_hash_create(&priv->mhashtable, priv->mmax)) != 0)
+            goto fail17;
+    }
     s3b->data = priv;
 
     // Compute dirty ratio at which we will be writing immediately
@@ -305,13 +766,28 @@ block_cache_create(struct block_cache_conf *config, struct s3backer_store *inner
 
     // Initialize on-disk cache and read in directory
     if (config->cache_file != NULL) {
+        if (config->trusted && s3b_dcache_trusted(config)) {
+            (*config->log)(LOG_INFO, "cache file \"%s\" was closed cleanly; clean blocks will not be verified",
+              config->cache_file);
+            priv->trusted = 1;
+        }
         if ((r = s3b_dcache_open(&priv->dcache, config, block_cache_dcache_load, priv, config->perform_flush)) != 0)
-            goto fail10;
+            goto fail17;
         if (config->perform_flush && priv->num_dirties > 0) {
             (*config->log)(LOG_INFO, "%u dirty blocks in cache file \"%s\" will be recovered",
               priv->num_dirties, config->cache_file);
         }
-        priv->stats.initial_size = priv->num_cleans + priv->num_dirties;
+        if (priv->num_recovers > 0 && (r = block_cache_sort_dirties(priv, &priv->recovers)) != 0)
+            goto fail17;
+        priv->num_unloaded = s3b_dcache_num_unloaded(priv->dcache);
+        priv->stats.initial_size = priv->num_cleans + priv->num_dirties + priv->num_unloaded;
+
+        // If resizable, the cache file has room for the maximum size, but we start out at the configured size
+        if (priv->max_size > config->cache_size && (r = block_cache_set_size(priv, config->cache_size)) != 0) {
+            (*config->log)(LOG_ERR, "can't limit cache file \"%s\" to %u blocks: %s",
+              config->cache_file, config->cache_size, strerror(r));
+            goto fail17;
+        }
     }
 
     // Grab lock
@@ -322,22 +798,44 @@ block_cache_create(struct block_cache_conf *config, struct s3backer_store *inner
     CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
     return s3b;
 
-fail10:
+fail17:
     if (config->cache_file != NULL) {
-        while ((entry = TAILQ_FIRST(&priv->lo_cleans)) != NULL) {
-            TAILQ_REMOVE(&priv->lo_cleans, entry, link);
-            free(entry);
+        for (i = 0; i < BLOCK_CACHE_NUM_PRIOS; i++) {
+            while ((entry = TAILQ_FIRST(&priv->cleans[i])) != NULL) {
+                TAILQ_REMOVE(&priv->cleans[i], entry, link);
+                free(entry);
+            }
         }
-        while ((entry = TAILQ_FIRST(&priv->hi_cleans)) != NULL) {
-            TAILQ_REMOVE(&priv->hi_cleans, entry, link);
+        while ((entry = TAILQ_FIRST(&priv->recovers)) != NULL) {
+            TAILQ_REMOVE(&priv->recovers, entry, link);
             free(entry);
         }
         if (priv->dcache != NULL)
             s3b_dcache_close(priv->dcache);
     }
+    if (priv->mhashtable != NULL)
+        s3b_hash_destroy(priv->mhashtable);
+    if (priv->phashtable != NULL)
+        s3b_hash_destroy(priv->phashtable);
+    if (priv->dhashtable != NULL)
+        s3b_hash_destroy(priv->dhashtable);
+fail16:
+    if (priv->zhashtable != NULL)
+        s3b_hash_destroy(priv->zhashtable);
+fail15:
     s3b_hash_destroy(priv->hashtable);
-fail9:
+fail14:
+    free(priv->ra_streams);
+fail13:
     free(priv->threads);
+fail12:
+    pthread_cond_destroy(&priv->maint_work);
+fail11:
+    pthread_cond_destroy(&priv->recover_work);
+fail10:
+    pthread_cond_destroy(&priv->resize_work);
+fail9:
+    pthread_cond_destroy(&priv->ra_work);
 fail8:
     pthread_cond_destroy(&priv->write_complete);
 fail7:
@@ -345,7 +843,8 @@ fail7:
 fail6:
     pthread_cond_destroy(&priv->worker_work);
 fail5:
-    pthread_cond_destroy(&priv->end_reading);
+    for (i = 0; i < BLOCK_WAIT_TABLE_SIZE; i++)
+        pthread_cond_destroy(&priv->block_waits[i]);
 fail4:
     pthread_cond_destroy(&priv->space_avail);
 fail3:
@@ -386,7 +885,8 @@ block_cache_dcache_load(void *arg, s3b_block_t dslot, s3b_block_t block_num, con
 
     // Create a new cache entry
     assert(config->cache_file != NULL);
-    if ((entry = calloc(1, sizeof(*entry) + (!config->no_verify ? MD5_DIGEST_LENGTH : 0))) == NULL) {
+    if ((entry = calloc(1, sizeof(*entry) + (ENTRY_EXTRA(config) != 0 ? ENTRY_EXTRA(config) :
+      !config->no_verify ? MD5_DIGEST_LENGTH : 0))) == NULL) {
         r = errno;
         (*config->log)(LOG_ERR, "can't allocate block cache entry: %s", strerror(r));
         priv->stats.out_of_memory_errors++;
@@ -399,18 +899,24 @@ block_cache_dcache_load(void *arg, s3b_block_t dslot, s3b_block_t block_num, con
     // Mark as clean or dirty accordingly
     if (dirty) {
         entry->dirty = 1;
-        TAILQ_INSERT_TAIL(&priv->dirties, entry, link);
+        if (config->recover_threads > 0) {              // recovery threads will write these, in block order
+            entry->recovered = 1;
+            priv->num_recovers++;
+            priv->recover_total++;
+        }
+        TAILQ_INSERT_TAIL(ENTRY_DIRTY_LIST(priv, entry), entry, link);
         priv->num_dirties++;
         assert(ENTRY_GET_STATE(entry) == DIRTY);
     } else {
-        entry->verify = !config->no_verify;
+        entry->verify = !config->no_verify && !priv->trusted;
         if (entry->verify)
             memcpy(&entry->etag, etag, MD5_DIGEST_LENGTH);
         TAILQ_INSERT_TAIL(cleans_list, entry, link);
         priv->num_cleans++;
-        assert(ENTRY_GET_STATE(entry) == (config->no_verify ? CLEAN : CLEAN2));
+        assert(ENTRY_GET_STATE(entry) == (entry->verify ? CLEAN2 : CLEAN));
     }
     s3b_hash_put_new(priv->hashtable, entry);
+    priv->prio_blocks[block_cache_prio(config, entry->block_num)]++;
     return 0;
 }
 
@@ -429,13 +935,69 @@ block_cache_create_threads(struct s3backer_store *s3b)
     pthread_mutex_lock(&priv->mutex);
     S3BCACHE_CHECK_INVARIANTS(priv, 0);
 
-    // Create threads
+    // Create writeback threads
     while (priv->num_threads < config->num_threads) {
         if ((r = pthread_create(&priv->threads[priv->num_threads], NULL, block_cache_worker_main, priv)) != 0)
             goto fail;
         priv->num_threads++;
     }
 
+    // Create pinned block preload thread
+    if (!priv->preload_started && block_cache_num_pinned(config) > 0) {
+        if ((r = pthread_create(&priv->threads[config->num_threads + config->read_ahead_threads],
+          NULL, block_cache_preload_main, priv)) != 0)
+            goto fail;
+        priv->preload_started = 1;
+        priv->preloading = 1;
+    }
+
+    // Create memory pressure resize thread, if we can read the memory pressure
+    if (!priv->resize_started && config->min_size > 0 && config->cache_file == NULL) {
+        if ((r = block_cache_read_pressure(config, &priv->pressure)) != 0) {
+            (*config->log)(LOG_WARNING, "can't read memory pressure from \"%s\": %s; block cache resizing disabled",
+              config->pressure_file, strerror(r));
+            r = 0;
+        } else {
+            if ((r = pthread_create(&priv->threads[config->num_threads + config->read_ahead_threads + 1],
+              NULL, block_cache_resize_main, priv)) != 0)
+                goto fail;
+            priv->resize_started = 1;
+            priv->resizing = 1;
+        }
+    }
+
+    // Create lazy load thread (it shares the resize thread's slot; that thread only runs without a cache file)
+    if (!priv->load_started && priv->num_unloaded > 0) {
+        assert(!priv->resize_started);
+        if ((r = pthread_create(&priv->threads[config->num_threads + config->read_ahead_threads + 1],
+          NULL, block_cache_load_main, priv)) != 0)
+            goto fail;
+        priv->load_started = 1;
+        priv->loading = 1;
+    }
+
+    // Create cache file maintenance thread
+    if (!priv->maint_started && priv->dcache != NULL) {
+        if ((r = pthread_create(&priv->threads[config->num_threads + config->read_ahead_threads + 2],
+          NULL, block_cache_maint_main, priv)) != 0)
+            goto fail;
+        priv->maint_started = 1;
+        priv->maintaining = 1;
+    }
+
+    // Create recovery threads, if there are recovered dirty blocks to write
+    if (!priv->recover_started && priv->num_recovers > 0) {
+        (*config->log)(LOG_INFO, "writing %u recovered dirty blocks using %u threads",
+          priv->num_recovers, config->recover_threads);
+        while (priv->recover_started < config->recover_threads) {
+            if ((r = pthread_create(&priv->threads[config->num_threads + config->read_ahead_threads + 3
+              + priv->recover_started], NULL, block_cache_recover_main, priv)) != 0)
+                goto fail;
+            priv->recover_started++;
+            priv->num_recover_threads++;
+        }
+    }
+
 fail:
     CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
     return r;
@@ -453,8 +1015,16 @@ static int
 block_cache_set_mount_token(struct s3backer_store *s3b, int32_t *old_valuep, int32_t new_value)
 {
     struct block_cache_private *const priv = s3b->data;
+    struct block_cache_conf *const config = priv->config;
     int r;
 
+    // If we gave up flushing dirty blocks on shutdown, don't clear the mount token, so they can be recovered
+    if (new_value == 0 && priv->flush_expired) {
+        (*config->log)(LOG_WARNING, "not clearing mount token: %u dirty blocks remain in cache file \"%s\"",
+          priv->num_dirties, config->cache_file);
+        return 0;
+    }
+
     // Set flag in lower layer
     if ((r = (*priv->inner->set_mount_token)(priv->inner, old_valuep, new_value)) != 0)
         return r;
@@ -491,6 +1061,11 @@ block_cache_flush_blocks(struct s3backer_store *s3b, const s3b_block_t *block_nu
             if ((r = block_list_append(&block_list, entry->block_num)) != 0)
                 break;
         }
+        for (entry = TAILQ_FIRST(&priv->recovers); r == 0 && entry != NULL; entry = TAILQ_NEXT(entry, link)) {
+            assert(ENTRY_GET_STATE(entry) == DIRTY);
+            if ((r = block_list_append(&block_list, entry->block_num)) != 0)
+                break;
+        }
 
         // Release lock
         CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
@@ -517,10 +1092,12 @@ static int
 block_cache_flush_blocks2(struct s3backer_store *s3b, const s3b_block_t *const block_nums, const u_int num_blocks, long timeout)
 {
     struct block_cache_private *const priv = s3b->data;
+    struct block_cache_conf *const config = priv->config;
     const uint32_t now = block_cache_get_time(priv);
+    struct flush_group group;
     struct cache_entry *entry;
     uint64_t absolute_timeout;
-    int need_signal = 0;
+    int state;
     int r = 0;
     u_int i;
 
@@ -530,77 +1107,83 @@ block_cache_flush_blocks2(struct s3backer_store *s3b, const s3b_block_t *const b
     // Calculate absolute timeout
     absolute_timeout = timeout > 0 ? block_cache_get_time_millis() + timeout : 0;
 
+    // Initialize flush group
+    memset(&group, 0, sizeof(group));
+    if ((group.blocks = malloc((num_blocks > 0 ? num_blocks : 1) * sizeof(*group.blocks))) == NULL
+      || (group.done = calloc(bitmap_size(num_blocks > 0 ? num_blocks : 1), sizeof(*group.done))) == NULL) {
+        r = errno;
+        (*config->log)(LOG_ERR, "can't allocate flush group: %s", strerror(r));
+        free(group.blocks);
+        return r;
+    }
+    if ((r = pthread_cond_init(&group.cond, NULL)) != 0) {
+        free(group.done);
+        free(group.blocks);
+        return r;
+    }
+
     // Grab lock and sanity check
     pthread_mutex_lock(&priv->mutex);
     S3BCACHE_CHECK_INVARIANTS(priv, 0);
 
-    // Move all DIRTY blocks to the front of the queue (in the order given to us) so they will be written first
-    for (i = num_blocks; i > 0; i--) {
-        const s3b_block_t block_num = block_nums[i - 1];
-
-        // Check if block exists and is DIRTY
-        if ((entry = s3b_hash_get(priv->hashtable, block_num)) == NULL)
+    // Gather the blocks that are dirty (DIRTY, WRITING, or WRITING2), in block order
+    for (i = 0; i < num_blocks; i++) {
+        if ((entry = s3b_hash_get(priv->hashtable, block_nums[i])) == NULL)
             continue;
+        state = ENTRY_GET_STATE(entry);
+        if (state == DIRTY || state == WRITING || state == WRITING2)
+            group.blocks[group.num_blocks++] = block_nums[i];
+    }
+    qsort(group.blocks, group.num_blocks, sizeof(*group.blocks), block_cache_block_num_cmp);
+    for (i = 0; i < group.num_blocks; i++) {
+        if (group.pending == 0 || group.blocks[i] != group.blocks[group.pending - 1])
+            group.blocks[group.pending++] = group.blocks[i];
+    }
+    group.num_blocks = group.pending;
+
+    // Mark them as being flushed, and move the DIRTY ones to the front of the queue (in block order) for immediate write
+    for (i = group.num_blocks; i > 0; i--) {
+        entry = s3b_hash_get(priv->hashtable, group.blocks[i - 1]);
+        assert(entry != NULL);
+        entry->flushing = 1;
         if (ENTRY_GET_STATE(entry) != DIRTY)
             continue;
-
-        // Move it to the front of the queue if not there already
-        if (entry != TAILQ_FIRST(&priv->dirties)) {
-            TAILQ_REMOVE(&priv->dirties, entry, link);
-            TAILQ_INSERT_HEAD(&priv->dirties, entry, link);
+        TAILQ_REMOVE(ENTRY_DIRTY_LIST(priv, entry), entry, link);
+        if (entry->recovered) {                 // take it from the recovery threads
+            priv->num_recovers--;
+            entry->recovered = 0;
         }
-
-        // Set for immediate write timeout
+        TAILQ_INSERT_HEAD(&priv->dirties, entry, link);
         entry->timeout = now;
-        need_signal = 1;
     }
-    if (need_signal)
-        pthread_cond_signal(&priv->worker_work);
 
-    // Wait for each block in our list to become clean
-    for (i = 0; i < num_blocks; ) {
-        const s3b_block_t block_num = block_nums[i];
-
-        // Check for stopping condition; this shouldn't ever happen but if it does we don't want to hang
-        if (priv->stopping != 0) {
-            r = EINTR;
-            break;
-        }
+    // Wait for the worker threads to write them all
+    if (group.pending > 0) {
+        TAILQ_INSERT_TAIL(&priv->flush_groups, &group, link);
+        pthread_cond_broadcast(&priv->worker_work);
+        while (group.pending > 0) {
 
-        // Is this block in the cache?
-        if ((entry = s3b_hash_get(priv->hashtable, block_num)) == NULL) {
-            i++;                                // this block is not in the cache - advance to the next block
-            continue;
-        }
+            // Check for stopping condition; this shouldn't ever happen but if it does we don't want to hang
+            if (priv->stopping != 0) {
+                r = EINTR;
+                break;
+            }
 
-        // Check its state
-        switch (ENTRY_GET_STATE(entry)) {
-        case CLEAN:
-        case CLEAN2:
-        case READING:
-        case READING2:                          // this block is clean - advance to the next block
-            i++;
-            continue;
-        case DIRTY:                             // this block is waiting for a worker thread to get to it
-            break;
-        case WRITING:
-        case WRITING2:                          // a worker thread is currently writing out this block
-            break;
-        default:
-            assert(0);
-            break;
+            // Wait for the last block to be written
+            if (timeout > 0) {
+                if ((r = block_cache_cond_timedwait(priv, &group.cond, absolute_timeout)) != 0)
+                    break;
+            } else
+                pthread_cond_wait(&group.cond, &priv->mutex);
         }
-
-        // Wait for ANY block to finish being written, then reevaluate
-        if (timeout > 0) {
-            if ((r = block_cache_cond_timedwait(priv, &priv->write_complete, absolute_timeout)) != 0)
-                break;
-        } else
-            pthread_cond_wait(&priv->write_complete, &priv->mutex);
+        TAILQ_REMOVE(&priv->flush_groups, &group, link);
     }
 
     // Release lock
     CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    pthread_cond_destroy(&group.cond);
+    free(group.done);
+    free(group.blocks);
 
     // Now flush them in the next layer down
     if (r == 0) {
@@ -622,7 +1205,16 @@ block_cache_shutdown(struct s3backer_store *const s3b)
 {
     struct block_cache_private *const priv = s3b->data;
     struct block_cache_conf *const config = priv->config;
+    const u_int extra_base = config->num_threads + config->read_ahead_threads + 3 + config->recover_threads;
+    struct flush_group *group;
+    const uint64_t start_millis = block_cache_get_time_millis();
+    uint64_t deadline_millis = 0;
+    uint64_t progress_millis;
+    uint64_t wake_millis;
+    uint64_t now_millis;
     u_int orig_num_threads;
+    u_int initial_dirties;
+    double rate;
     int i;
     int r;
 
@@ -630,23 +1222,124 @@ block_cache_shutdown(struct s3backer_store *const s3b)
     pthread_mutex_lock(&priv->mutex);
     S3BCACHE_CHECK_INVARIANTS(priv, 0);
 
-    // Wait for all dirty blocks to be written and all worker threads to exit
+    // Tell threads to stop; from now on, dirty blocks are written immediately
     orig_num_threads = priv->num_threads;
+    initial_dirties = priv->num_dirties;
     priv->stopping = 1;
-    while (TAILQ_FIRST(&priv->dirties) != NULL || priv->num_threads > 0) {
+
+    // Write the remaining dirty blocks in block order, with extra threads if so configured
+    if (priv->num_dirties > 0) {
+        (*config->log)(LOG_INFO, "flushing %u dirty blocks", priv->num_dirties);
+        if (TAILQ_FIRST(&priv->dirties) != NULL && block_cache_sort_dirties(priv, &priv->dirties) != 0)
+            (*config->log)(LOG_WARNING, "can't sort dirty blocks; flushing them in unsorted order");
+        while (orig_num_threads > 0 && priv->shutdown_started < config->shutdown_threads) {
+            if ((r = pthread_create(&priv->threads[extra_base + priv->shutdown_started],
+              NULL, block_cache_worker_main, priv)) != 0) {
+                (*config->log)(LOG_ERR, "can't create shutdown flush thread: %s", strerror(r));
+                break;
+            }
+            priv->shutdown_started++;
+            priv->num_threads++;
+        }
+        if (config->shutdown_timeout > 0 && config->cache_file != NULL)
+            deadline_millis = start_millis + config->shutdown_timeout;
+    }
+    progress_millis = start_millis + SHUTDOWN_PROGRESS_MILLIS;
+
+    // Wait for all dirty blocks to be written (or the deadline to pass) and all worker threads to exit
+    while (((TAILQ_FIRST(&priv->dirties) != NULL || TAILQ_FIRST(&priv->recovers) != NULL) && !priv->flush_expired)
+      || priv->num_threads > 0 || priv->num_ra_threads > 0 || priv->preloading || priv->resizing
+      || priv->loading || priv->maintaining || priv->num_recover_threads > 0) {
         pthread_cond_broadcast(&priv->worker_work);
-        pthread_cond_wait(&priv->worker_exit, &priv->mutex);
+        pthread_cond_broadcast(&priv->ra_work);
+        pthread_cond_broadcast(&priv->space_avail);
+        pthread_cond_broadcast(&priv->resize_work);
+        pthread_cond_broadcast(&priv->recover_work);
+        pthread_cond_broadcast(&priv->maint_work);
+        TAILQ_FOREACH(group, &priv->flush_groups, link)
+            pthread_cond_broadcast(&group->cond);
+        wake_millis = progress_millis;
+        if (deadline_millis != 0 && !priv->flush_expired && deadline_millis < wake_millis)
+            wake_millis = deadline_millis;
+        (void)block_cache_cond_timedwait(priv, &priv->worker_exit, wake_millis);
+        now_millis = block_cache_get_time_millis();
+
+        // Check the deadline
+        if (deadline_millis != 0 && !priv->flush_expired && now_millis >= deadline_millis && priv->num_dirties > 0)
+            priv->flush_expired = 1;
+
+        // Report progress
+        if (now_millis >= progress_millis) {
+            if (priv->num_dirties > 0 && !priv->flush_expired) {
+                rate = initial_dirties > priv->num_dirties ?
+                  (initial_dirties - priv->num_dirties) * 1000.0 / (now_millis - start_millis) : 0.0;
+                if (rate > 0.0) {
+                    (*config->log)(LOG_INFO, "flushing dirty blocks: %u remaining, %.1f blocks/sec, ETA %.0f seconds",
+                      priv->num_dirties, rate, priv->num_dirties / rate);
+                } else
+                    (*config->log)(LOG_INFO, "flushing dirty blocks: %u remaining", priv->num_dirties);
+            }
+            progress_millis = now_millis + SHUTDOWN_PROGRESS_MILLIS;
+        }
+    }
+    if (priv->flush_expired && priv->num_dirties == 0)       // the writes in progress were the last ones
+        priv->flush_expired = 0;
+    if (priv->flush_expired) {
+        (*config->log)(LOG_WARNING, "flush deadline reached; %u dirty blocks remain in cache file \"%s\"",
+          priv->num_dirties, config->cache_file);
+    } else if (initial_dirties > 0) {
+        (*config->log)(LOG_INFO, "flushed %u dirty blocks in %.3f seconds",
+          initial_dirties, (block_cache_get_time_millis() - start_millis) / 1000.0);
     }
     for (i = 0; i < orig_num_threads; i++) {
         if ((r = pthread_join(priv->threads[i], NULL)) != 0)
             (*config->log)(LOG_ERR, "pthread_join: %s", strerror(r));
     }
+    for (i = 0; i < priv->ra_started; i++) {
+        if ((r = pthread_join(priv->threads[config->num_threads + i], NULL)) != 0)
+            (*config->log)(LOG_ERR, "pthread_join: %s", strerror(r));
+    }
+    priv->ra_started = 0;
+    if (priv->preload_started) {
+        if ((r = pthread_join(priv->threads[config->num_threads + config->read_ahead_threads], NULL)) != 0)
+            (*config->log)(LOG_ERR, "pthread_join: %s", strerror(r));
+        priv->preload_started = 0;
+    }
+    if (priv->resize_started) {
+        if ((r = pthread_join(priv->threads[config->num_threads + config->read_ahead_threads + 1], NULL)) != 0)
+            (*config->log)(LOG_ERR, "pthread_join: %s", strerror(r));
+        priv->resize_started = 0;
+    }
+    if (priv->load_started) {
+        if ((r = pthread_join(priv->threads[config->num_threads + config->read_ahead_threads + 1], NULL)) != 0)
+            (*config->log)(LOG_ERR, "pthread_join: %s", strerror(r));
+        priv->load_started = 0;
+    }
+    if (priv->maint_started) {
+        if ((r = pthread_join(priv->threads[config->num_threads + config->read_ahead_threads + 2], NULL)) != 0)
+            (*config->log)(LOG_ERR, "pthread_join: %s", strerror(r));
+        priv->maint_started = 0;
+    }
+    if (priv->recover_started > 0) {
+        for (i = 0; i < priv->recover_started; i++) {
+            if ((r = pthread_join(priv->threads[config->num_threads + config->read_ahead_threads + 3 + i], NULL)) != 0)
+                (*config->log)(LOG_ERR, "pthread_join: %s", strerror(r));
+        }
+        priv->recover_started = 0;
+    }
+    for (i = 0; i < priv->shutdown_started; i++) {
+        if ((r = pthread_join(priv->threads[extra_base + i], NULL)) != 0)
+            (*config->log)(LOG_ERR, "pthread_join: %s", strerror(r));
+    }
+    priv->shutdown_started = 0;
 
     // Release lock
     CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
 
     // Propagate to lower layer
-    return (*priv->inner->shutdown)(priv->inner);
+    if ((r = (*priv->inner->shutdown)(priv->inner)) != 0)
+        return r;
+    return priv->flush_expired ? ETIMEDOUT : 0;
 }
 
 static void
@@ -654,11 +1347,16 @@ block_cache_destroy(struct s3backer_store *const s3b)
 {
     struct block_cache_private *const priv = s3b->data;
     struct block_cache_conf *const config = priv->config;
+    struct zcache_entry *zentry;
+    struct mtier_entry *mentry;
+    u_int i;
 
     // Grab lock and sanity check
     pthread_mutex_lock(&priv->mutex);
     S3BCACHE_CHECK_INVARIANTS(priv, 1);
-    assert(TAILQ_FIRST(&priv->dirties) == NULL && priv->num_threads == 0);
+    assert(priv->num_threads == 0 && priv->num_ra_threads == 0 && !priv->preloading && !priv->resizing);
+    assert(!priv->loading && !priv->maintaining && priv->num_recover_threads == 0);
+    assert(priv->flush_expired || (TAILQ_FIRST(&priv->dirties) == NULL && TAILQ_FIRST(&priv->recovers) == NULL));
 
     // Destroy inner store
     (*priv->inner->destroy)(priv->inner);
@@ -668,13 +1366,37 @@ block_cache_destroy(struct s3backer_store *const s3b)
         s3b_dcache_close(priv->dcache);
     s3b_hash_foreach(priv->hashtable, block_cache_free_one, priv);
     s3b_hash_destroy(priv->hashtable);
+    if (priv->dhashtable != NULL) {
+        assert(s3b_hash_size(priv->dhashtable) == 0);
+        s3b_hash_destroy(priv->dhashtable);
+    }
+    if (priv->phashtable != NULL) {
+        assert(s3b_hash_size(priv->phashtable) == 0);
+        s3b_hash_destroy(priv->phashtable);
+    }
+    if (priv->zhashtable != NULL) {
+        while ((zentry = TAILQ_FIRST(&priv->zlru)) != NULL)
+            block_cache_zcache_free(priv, zentry);
+        s3b_hash_destroy(priv->zhashtable);
+    }
+    if (priv->mhashtable != NULL) {
+        while ((mentry = TAILQ_FIRST(&priv->mlru)) != NULL)
+            block_cache_mtier_free(priv, mentry);
+        s3b_hash_destroy(priv->mhashtable);
+    }
+    pthread_cond_destroy(&priv->maint_work);
+    pthread_cond_destroy(&priv->recover_work);
+    pthread_cond_destroy(&priv->resize_work);
+    pthread_cond_destroy(&priv->ra_work);
     pthread_cond_destroy(&priv->write_complete);
     pthread_cond_destroy(&priv->worker_exit);
     pthread_cond_destroy(&priv->worker_work);
-    pthread_cond_destroy(&priv->end_reading);
+    for (i = 0; i < BLOCK_WAIT_TABLE_SIZE; i++)
+        pthread_cond_destroy(&priv->block_waits[i]);
     pthread_cond_destroy(&priv->space_avail);
     CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
     pthread_mutex_destroy(&priv->mutex);
+    free(priv->ra_streams);
     free(priv->threads);
     free(priv);
     free(s3b);
@@ -684,11 +1406,90 @@ void
 block_cache_get_stats(struct s3backer_store *s3b, struct block_cache_stats *stats)
 {
     struct block_cache_private *const priv = s3b->data;
+    struct block_cache_conf *const config = priv->config;
+    struct s3b_dcache_stats dstats[BLOCK_CACHE_MAX_FILES];
+    uint64_t elapsed;
+    u_int i;
 
     pthread_mutex_lock(&priv->mutex);
     memcpy(stats, &priv->stats, sizeof(*stats));
-    stats->current_size = s3b_hash_size(priv->hashtable);
+    stats->current_size = s3b_hash_size(priv->hashtable) + priv->num_unloaded;
     stats->dirty_ratio = block_cache_dirty_ratio(priv);
+    stats->read_ahead_streams = 0;
+    stats->read_ahead_window = 0;
+    stats->read_ahead_queue = 0;
+    for (i = 0; i < config->read_ahead_streams; i++) {
+        const struct ra_stream *const stream = &priv->ra_streams[i];
+
+        if (block_cache_ra_triggered(config, stream)) {
+            stats->read_ahead_streams++;
+            if (stream->window > stats->read_ahead_window)
+                stats->read_ahead_window = stream->window;
+            if (stream->ra_count < stream->window)
+                stats->read_ahead_queue += stream->window - stream->ra_count;
+        }
+    }
+    stats->writeback_queue = priv->num_dirties - priv->wb_busy;
+    stats->writeback_busy = priv->wb_busy;
+    stats->read_ahead_threads = priv->num_ra_threads;
+    stats->read_ahead_busy = priv->ra_busy;
+    elapsed = block_cache_get_time_millis() - priv->stats_time;
+    stats->writeback_utilization = 0.0;
+    stats->read_ahead_utilization = 0.0;
+    if (elapsed > 0 && config->num_threads > 0)
+        stats->writeback_utilization = (double)priv->wb_busy_millis / ((double)elapsed * config->num_threads);
+    if (elapsed > 0 && priv->ra_started > 0)
+        stats->read_ahead_utilization = (double)priv->ra_busy_millis / ((double)elapsed * priv->ra_started);
+    stats->compressed_blocks = 0;
+    stats->compressed_bytes = priv->zbytes;
+    stats->compressed_ratio = 0.0;
+    stats->decompress_micros = 0.0;
+    if (priv->zhashtable != NULL)
+        stats->compressed_blocks = s3b_hash_size(priv->zhashtable);
+    if (priv->zbytes > 0)
+        stats->compressed_ratio = (double)stats->compressed_blocks * config->block_size / (double)priv->zbytes;
+    if (stats->compressed_hits > 0)
+        stats->decompress_micros = (double)priv->zdecompress_micros / (double)stats->compressed_hits;
+    stats->memory_blocks = priv->mhashtable != NULL ? s3b_hash_size(priv->mhashtable) : 0;
+    stats->dedup_blocks = priv->dedup_refs;
+    stats->dedup_buffers = priv->dedup_bufs;
+    stats->dedup_ratio = 0.0;
+    if (stats->dedup_buffers > 0)
+        stats->dedup_ratio = (double)stats->dedup_blocks / (double)stats->dedup_buffers;
+    memcpy(stats->prio_blocks, priv->prio_blocks, sizeof(stats->prio_blocks));
+    stats->pinned_blocks = block_cache_num_pinned(config);
+    stats->partial_blocks = priv->phashtable != NULL ? s3b_hash_size(priv->phashtable) : 0;
+    stats->recover_total = priv->recover_total;
+    stats->recover_written = priv->recover_written;
+    stats->recover_remaining = priv->num_recovers;
+    stats->lazy_remaining = priv->num_unloaded;
+    stats->shrink_remaining = priv->dcache != NULL ? s3b_dcache_num_excess(priv->dcache) : 0;
+    stats->reclaim_pending = priv->dcache != NULL ? s3b_dcache_reclaim_pending(priv->dcache) : 0;
+    stats->num_files = 0;
+    if (priv->dcache != NULL)
+        stats->num_files = s3b_dcache_get_stats(priv->dcache, dstats, BLOCK_CACHE_MAX_FILES);
+    for (i = 0; i < stats->num_files; i++) {
+        struct block_cache_file_stats *const fstats = &stats->files[i];
+        const struct s3b_dcache_stats *const dstat = &dstats[i];
+
+        memset(fstats, 0, sizeof(*fstats));
+        fstats->size = dstat->size;
+        fstats->used = dstat->used;
+        fstats->reads = dstat->reads;
+        fstats->writes = dstat->writes;
+        if (elapsed > 0) {
+            fstats->read_rate = (double)dstat->read_bytes * 1000.0 / (double)elapsed;
+            fstats->write_rate = (double)dstat->write_bytes * 1000.0 / (double)elapsed;
+        }
+        if (dstat->reads > 0)
+            fstats->read_latency = (double)dstat->read_micros / (double)dstat->reads;
+        if (dstat->writes > 0)
+            fstats->write_latency = (double)dstat->write_micros / (double)dstat->writes;
+        fstats->reclaimed_bytes = dstat->reclaimed_bytes;
+        fstats->disk_bytes = dstat->disk_bytes;
+    }
+    stats->target_size = priv->target_size;
+    stats->memory_pressure = priv->pressure;
     CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
 }
 
@@ -699,7 +1500,55 @@ block_cache_clear_stats(struct s3backer_store *s3b)
 
     pthread_mutex_lock(&priv->mutex);
     memset(&priv->stats, 0, sizeof(priv->stats));
+    priv->wb_busy_millis = 0;
+    priv->ra_busy_millis = 0;
+    priv->zdecompress_micros = 0;
+    if (priv->dcache != NULL)
+        s3b_dcache_clear_stats(priv->dcache);
+    priv->stats_time = block_cache_get_time_millis();
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+}
+
+/*
+ * Change the cache size while mounted (cache file only). The new size must be between the number
+ * of cache files and the maximum size; see block_cache_set_size().
+ */
+int
+block_cache_resize(struct s3backer_store *s3b, u_int size)
+{
+    struct block_cache_private *const priv = s3b->data;
+    struct block_cache_conf *const config = priv->config;
+    u_int old_size;
+    int r;
+
+    // Sanity check
+    if (config->cache_file == NULL)
+        return ENOTSUP;
+    if (size < config->num_cache_files || size > priv->max_size)
+        return EINVAL;
+    if (size <= block_cache_num_pinned(config))                 // pinned blocks must leave room for everything else
+        return EINVAL;
+
+    // Grab lock
+    pthread_mutex_lock(&priv->mutex);
+    S3BCACHE_CHECK_INVARIANTS(priv, 1);
+
+    // Resize
+    old_size = priv->target_size;
+    if ((r = block_cache_set_size(priv, size)) != 0) {
+        (*config->log)(LOG_ERR, "can't resize block cache from %u to %u blocks: %s", old_size, size, strerror(r));
+        goto done;
+    }
+    if (size < old_size)
+        priv->stats.resize_shrinks++;
+    else if (size > old_size)
+        priv->stats.resize_grows++;
+    (*config->log)(LOG_INFO, "resized block cache from %u to %u blocks (%u blocks to relocate)",
+      old_size, size, s3b_dcache_num_excess(priv->dcache));
+
+done:
     CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return r;
 }
 
 static int
@@ -803,20 +1652,16 @@ block_cache_read(struct block_cache_private *const priv, s3b_block_t block_num,
         goto done;
     }
 
+    // Note foreground activity while recovering dirty blocks or defragmenting
+    if (priv->num_recovers > 0 || config->defrag)
+        priv->fg_millis = block_cache_get_time_millis();
+
     // Update count of block(s) read sequentially by the upper layer
-    if (block_num == priv->seq_last + 1) {
-        priv->seq_count++;
-        if (priv->ra_count > 0)
-            priv->ra_count--;
-    } else if (block_num != priv->seq_last) {
-        priv->seq_count = 1;
-        priv->ra_count = 0;
-    }
-    priv->seq_last = block_num;
-
-    // Wakeup a worker thread to read the next read-ahead block if needed
-    if (priv->seq_count >= config->read_ahead_trigger && priv->ra_count < config->read_ahead)
-        pthread_cond_signal(&priv->worker_work);
+    block_cache_ra_update(priv, block_num);
+
+    // Wakeup a read-ahead worker thread to read the next read-ahead block if needed
+    if (block_cache_ra_pending(priv) != NULL)
+        block_cache_ra_wakeup(priv);
 
     // Peform the read
     r = block_cache_do_read(priv, block_num, off, len, dest, 1);
@@ -837,9 +1682,13 @@ block_cache_do_read(struct block_cache_private *const priv, s3b_block_t block_nu
 {
     struct block_cache_conf *const config = priv->config;
     struct list_head *const cleans_list = block_cache_cleans_list(priv, block_num);
+    struct zcache_entry *zentry = NULL;
     struct cache_entry *entry;
     u_char etag[MD5_DIGEST_LENGTH];
+    u_char md5[MD5_DIGEST_LENGTH];
+    u_char dhash[HASH128_LENGTH];
     int verified_but_not_read = 0;
+    uint64_t start_micros = 0;
     void *data = NULL;
     int r;
 
@@ -855,7 +1704,7 @@ again:
         switch (ENTRY_GET_STATE(entry)) {
         case READING:       // Wait for other thread already reading this block to finish
         case READING2:
-            pthread_cond_wait(&priv->end_reading, &priv->mutex);
+            pthread_cond_wait(BLOCK_WAIT(priv, block_num), &priv->mutex);
             goto again;
         case CLEAN2:        // Go into READING2 state to read/verify the data
 
@@ -870,6 +1719,8 @@ again:
                 data = entry->u.data;
 
             // Change from CLEAN2 to READING2
+            assert(priv->mhashtable == NULL || s3b_hash_get(priv->mhashtable, block_num) == NULL);
+            assert(!ENTRY_IO_BUSY(entry));
             if (config->cache_file != NULL) {
                 if ((r = s3b_dcache_erase_block(priv->dcache, entry->u.dslot)) != 0)
                     (*config->log)(LOG_ERR, "can't erase cached block! %s", strerror(r));
@@ -891,20 +1742,52 @@ again:
         case DIRTY:         // Copy the cached data
         case WRITING:
         case WRITING2:
-            if ((r = block_cache_read_data(priv, entry, dest, off, len)) != 0)
+            if (entry->partial && !block_cache_partial_valid(priv, entry, off, len)) {
+                if ((r = block_cache_partial_fill(priv, entry)) != 0)
+                    return r;
+                goto again;
+            }
+            if (!ENTRY_IO_READ_OK(entry)) {         // wait for the data to be written to the cache file
+                pthread_cond_wait(BLOCK_WAIT(priv, block_num), &priv->mutex);
+                goto again;
+            }
+            if ((r = block_cache_read_data(priv, entry, dest, off, len)) != 0) {
+                if (r == EBADMSG && ENTRY_GET_STATE(entry) == CLEAN) {
+                    if (ENTRY_IO_BUSY(entry))       // another thread is still reading it
+                        pthread_cond_wait(BLOCK_WAIT(priv, block_num), &priv->mutex);
+                    else
+                        block_cache_discard_corrupt(priv, entry);
+                    goto again;
+                }
                 return r;
+            }
+            if (stats && priv->mhashtable != NULL)
+                block_cache_mtier_promote(priv, entry, dest, off, len);
             break;
         default:
             assert(0);
             break;
         }
-        if (stats)
+        if (stats) {
             priv->stats.read_hits++;
+            if (entry->ra)
+                block_cache_ra_hit(priv, entry);
+        }
         return 0;
     }
 
+    // The block may be in the cache file but not loaded yet
+    if (priv->num_unloaded > 0) {
+        if ((r = block_cache_load_block(priv, block_num)) == 0)
+            goto again;
+        if (r != ENOENT)
+            return r;
+    }
+
     // Create a new cache entry in state READING
-    if ((r = block_cache_get_entry(priv, &entry, &data)) != 0)
+    if ((r = block_cache_get_entry(priv, block_num, &entry, &data)) == EAGAIN)
+        goto again;
+    if (r != 0)
         return r;
     if (entry == NULL) {                                            // no free entries right now
         pthread_cond_wait(&priv->space_avail, &priv->mutex);
@@ -913,14 +1796,25 @@ again:
     entry->block_num = block_num;
     entry->dirty = 0;
     entry->verify = 0;
+    entry->ra = 0;
+    entry->stored = 0;
     entry->timeout = READING_TIMEOUT;
     ENTRY_RESET_LINK(entry);
     s3b_hash_put_new(priv->hashtable, entry);
+    priv->prio_blocks[block_cache_prio(config, entry->block_num)]++;
     assert(ENTRY_GET_STATE(entry) == READING);
 
+    // Take the compressed copy of the block, if any (after getting an entry, whose eviction could have discarded it)
+    if (priv->zhashtable != NULL)
+        zentry = block_cache_zcache_take(priv, block_num);
+
     // Update stats
-    if (stats)
-        priv->stats.read_misses++;
+    if (stats) {
+        if (zentry != NULL)
+            priv->stats.read_hits++;
+        else
+            priv->stats.read_misses++;
+    }
 
     // Conservatively disqualify this block as zero in any ongoing non-zero survey
     if (priv->survey_callback != NULL)
@@ -930,9 +1824,36 @@ read:
     // Read the block from the underlying s3backer_store
     assert(ENTRY_GET_STATE(entry) == READING || ENTRY_GET_STATE(entry) == READING2);
     CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
-    r = (*priv->inner->read_block)(priv->inner, block_num, data, etag, entry->verify ? entry->etag : NULL, 0);
+    if (zentry != NULL) {
+        size_t dlen = config->block_size;
+
+        // Decompress our compressed copy instead; if that somehow fails, just read the block normally
+        start_micros = block_cache_get_time_micros();
+        if ((r = (*config->compress_alg->dfunc)(config->log, zentry->zdata, zentry->zlen, data, &dlen)) == 0
+          && dlen != config->block_size) {
+            (*config->log)(LOG_ERR, "decompressed cached block has the wrong length %ju != %u",
+              (uintmax_t)dlen, config->block_size);
+            r = EIO;
+        }
+        free(zentry->zdata);
+        free(zentry);
+        if (r != 0)
+            zentry = NULL;
+    }
+    if (zentry == NULL)
+        r = (*priv->inner->read_block)(priv->inner, block_num, data, etag, entry->verify ? entry->etag : NULL, 0);
+    if (config->cache_file != NULL && r == 0)
+        r = s3b_dcache_write_block(priv->dcache, entry->u.dslot, data, 0, config->block_size);
+    if (config->skip_unchanged && r == 0)
+        md5_quick(data, config->block_size, md5);
+    if (priv->dhashtable != NULL && r == 0)
+        hash128_quick(data, config->block_size, dhash);
     pthread_mutex_lock(&priv->mutex);
-    S3BCACHE_CHECK_INVARIANTS(priv, 0);
+    S3BCACHE_CHECK_INVARIANTS(priv, 1);                 // a worker thread's read-ahead may overlap shutdown
+    if (zentry != NULL) {
+        priv->stats.compressed_hits++;
+        priv->zdecompress_micros += block_cache_get_time_micros() - start_micros;
+    }
 
     // The entry should still exist and be in state READING[2]
     assert(s3b_hash_get(priv->hashtable, block_num) == entry);
@@ -944,8 +1865,8 @@ read:
      * change from READING[2] and we will create new available space
      * in the cache. Wake up any threads waiting on those events.
      */
-    pthread_cond_broadcast(&priv->end_reading);
-    pthread_cond_signal(&priv->space_avail);
+    pthread_cond_broadcast(BLOCK_WAIT(priv, block_num));
+    pthread_cond_broadcast(&priv->space_avail);
 
     // Check for unexpected error from underlying s3backer_store
     if (r != 0 && !(entry->verify && r == EEXIST))
@@ -971,14 +1892,9 @@ read:
     if (!verified_but_not_read)
         memcpy(dest, (char *)data + off, len);
 
-    // Copy data into the disk cache and free temporary buffer (if necessary)
-    if (config->cache_file != NULL) {
-        if (!verified_but_not_read) {
-            if ((r = s3b_dcache_write_block(priv->dcache, entry->u.dslot, data, 0, config->block_size)) != 0)
-                goto fail;
-        }
+    // Free temporary buffer (if necessary); the data was copied into the disk cache above
+    if (config->cache_file != NULL)
         free(data);
-    }
 
     // Change entry from READING to CLEAN
     assert(ENTRY_GET_STATE(entry) == READING);
@@ -992,6 +1908,18 @@ read:
     priv->num_cleans++;
     assert(ENTRY_GET_STATE(entry) == CLEAN);
 
+    // Share the data buffer with other blocks having the same content, if any
+    if (priv->dhashtable != NULL)
+        block_cache_dedup(priv, entry, dhash);
+
+    // Remember what the stored block looks like (the ETag only matters with the disk cache, which has no compressed tier)
+    if (config->skip_unchanged && !verified_but_not_read) {
+        if (zentry == NULL)
+            memcpy(entry->etag, etag, MD5_DIGEST_LENGTH);
+        memcpy(ENTRY_STORED_MD5(entry), md5, MD5_DIGEST_LENGTH);
+        entry->stored = 1;
+    }
+
     // If data was only verified, we have to actually go read it now
     if (verified_but_not_read)
         goto again;
@@ -1005,7 +1933,8 @@ fail:
     if (config->cache_file != NULL)
         s3b_dcache_free_block(priv->dcache, entry->u.dslot);
     s3b_hash_remove(priv->hashtable, entry->block_num);
-    free(data);
+    priv->prio_blocks[block_cache_prio(config, entry->block_num)]--;
+    block_cache_free_data(priv, data);
     free(entry);
     return r;
 }
@@ -1047,6 +1976,7 @@ block_cache_write(struct block_cache_private *const priv, s3b_block_t block_num,
     struct list_head *const cleans_list = block_cache_cleans_list(priv, block_num);
     struct cache_entry *entry;
     int partial_miss = 0;
+    int partial;
     int r;
 
     // Sanity check
@@ -1057,6 +1987,10 @@ block_cache_write(struct block_cache_private *const priv, s3b_block_t block_num,
     // Grab lock
     pthread_mutex_lock(&priv->mutex);
 
+    // Note foreground activity while recovering dirty blocks or defragmenting
+    if (priv->num_recovers > 0 || config->defrag)
+        priv->fg_millis = block_cache_get_time_millis();
+
 again:
     // Sanity check
     S3BCACHE_CHECK_INVARIANTS(priv, 0);
@@ -1069,15 +2003,28 @@ again:
     // Find cache entry
     if ((entry = s3b_hash_get(priv->hashtable, block_num)) != NULL) {
         assert(entry->block_num == block_num);
+        if (ENTRY_IO_BUSY(entry)) {             // wait for other reads and writes of the data in the cache file
+            pthread_cond_wait(BLOCK_WAIT(priv, block_num), &priv->mutex);
+            goto again;
+        }
         switch (ENTRY_GET_STATE(entry)) {
         case READING:               // wait for entry to leave READING
         case READING2:
-            pthread_cond_wait(&priv->end_reading, &priv->mutex);
+            pthread_cond_wait(BLOCK_WAIT(priv, block_num), &priv->mutex);
             goto again;
         case CLEAN2:                // convert to CLEAN, then proceed
-            entry = block_cache_verified(priv, entry);
-            // FALLTHROUGH
-        case CLEAN:                // update data, move to state DIRTY
+        case CLEAN:                 // update data, move to state DIRTY
+
+            // The rest of the block will be kept after a partial write, so make sure it's not corrupt
+            if (config->cache_file != NULL && (off != 0 || len != config->block_size)
+              && (r = s3b_dcache_verify_block(priv->dcache, entry->u.dslot)) != 0) {
+                if (r != EBADMSG)
+                    goto fail;
+                block_cache_discard_corrupt(priv, entry);
+                goto again;
+            }
+            if (ENTRY_GET_STATE(entry) == CLEAN2)
+                entry = block_cache_verified(priv, entry);
 
             // If there are too many dirty blocks, we have to wait
             if (config->max_dirty != 0 && priv->num_dirties >= config->max_dirty) {
@@ -1086,6 +2033,10 @@ again:
                 goto again;
             }
 
+            // Get a private copy of the data if it's shared with other blocks
+            if (priv->dhashtable != NULL && (r = block_cache_unshare(priv, entry)) != 0)
+                goto fail;
+
             // Record dirty disk cache entry
             if (config->cache_file != NULL) {
                 if ((r = s3b_dcache_record_block(priv->dcache, entry->u.dslot, entry->block_num, NULL)) != 0)
@@ -1095,6 +2046,7 @@ again:
             // Change from CLEAN to DIRTY
             TAILQ_REMOVE(cleans_list, entry, link);
             priv->num_cleans--;
+            entry->ra = 0;
             TAILQ_INSERT_TAIL(&priv->dirties, entry, link);
             priv->num_dirties++;
             entry->timeout = block_cache_get_time(priv) + priv->dirty_timeout;
@@ -1103,9 +2055,18 @@ again:
         case WRITING2:              // update data, stay in state WRITING2
         case WRITING:               // update data, move to state WRITING2
         case DIRTY:                 // update data, stay in state DIRTY
+
+            // We can only track whole sectors, so if this write isn't aligned we need the rest of the block first
+            if (entry->partial && !PARTIAL_ALIGNED(off, len)) {
+                if ((r = block_cache_partial_fill(priv, entry)) != 0)
+                    goto fail;
+                goto again;
+            }
+            entry->dirty = 1;
             if ((r = block_cache_write_data(priv, entry, src, off, len)) != 0)
                 (*config->log)(LOG_ERR, "error updating dirty block! %s", strerror(r));
-            entry->dirty = 1;
+            if (entry->partial)
+                block_cache_partial_mark(priv, entry, off, len);
             if (!partial_miss)
                 priv->stats.write_hits++;
             break;
@@ -1116,15 +2077,24 @@ again:
         goto success;
     }
 
+    // The block may be in the cache file but not loaded yet
+    if (priv->num_unloaded > 0) {
+        if ((r = block_cache_load_block(priv, block_num)) == 0)
+            goto again;
+        if (r != ENOENT)
+            goto fail;
+    }
+
     // Conservatively disqualify any non-zero block as being zero in any ongoing non-zero survey
     if (src != NULL && priv->survey_callback != NULL)
         (*priv->survey_callback)(priv->survey_arg, &block_num, 1);
 
     /*
-     * The block is not in the cache. If we're writing a partial block,
-     * we have to read it into the cache first.
+     * The block is not in the cache. If we're writing a partial block, we have to
+     * read it into the cache first, unless we can track which parts have been written.
      */
-    if (off != 0 || len != config->block_size) {
+    partial = off != 0 || len != config->block_size;
+    if (partial && !block_cache_partial_ok(priv, block_num, off, len)) {
         if ((r = block_cache_do_read(priv, block_num, 0, 0, NULL, 0)) != 0)
             goto fail;
         if (partial_miss++ == 0)
@@ -1140,7 +2110,9 @@ again:
     }
 
     // Get a cache entry, evicting a CLEAN[2] entry if necessary
-    if ((r = block_cache_get_entry(priv, &entry, NULL)) != 0)
+    if ((r = block_cache_get_entry(priv, block_num, &entry, NULL)) == EAGAIN)
+        goto again;
+    if (r != 0)
         goto fail;
 
     // If cache is full, wait for an entry to go CLEAN[2] so we can evict it
@@ -1149,21 +2121,33 @@ again:
         goto again;
     }
 
-    // Record block data
-    if ((r = block_cache_write_data(priv, entry, src, off, len)) != 0)
-        (*config->log)(LOG_ERR, "error updating dirty block! %s", strerror(r));
+    // Discard any compressed copy of the block, which is now stale
+    if (priv->zhashtable != NULL)
+        block_cache_zcache_discard(priv, block_num);
 
-    // Initialize a new DIRTY cache entry
-    priv->stats.write_misses++;
+    // Initialize a new DIRTY cache entry, noting which sectors are valid if only partially written
     entry->block_num = block_num;
-    entry->timeout = block_cache_get_time(priv) + priv->dirty_timeout;
-    entry->dirty = 1;
-    assert(off == 0 && len == config->block_size);
-    s3b_hash_put_new(priv->hashtable, entry);
+    if (partial) {
+        if ((r = block_cache_partial_init(priv, entry)) != 0) {
+            block_cache_free_data(priv, entry->u.data);
+            free(entry);
+            goto fail;
+        }
+        block_cache_partial_mark(priv, entry, off, len);
+    }
+    priv->stats.write_misses++;
+    entry->timeout = block_cache_get_time(priv) + priv->dirty_timeout;
+    entry->dirty = 1;
+    s3b_hash_put_new(priv->hashtable, entry);
+    priv->prio_blocks[block_cache_prio(config, entry->block_num)]++;
     TAILQ_INSERT_TAIL(&priv->dirties, entry, link);
     priv->num_dirties++;
     assert(ENTRY_GET_STATE(entry) == DIRTY);
 
+    // Record block data; the entry must be in the hash table first, as the mutex is released to write to the cache file
+    if ((r = block_cache_write_data(priv, entry, src, off, len)) != 0)
+        (*config->log)(LOG_ERR, "error updating dirty block! %s", strerror(r));
+
     // Record dirty disk cache entry
     if (config->cache_file != NULL) {
         if ((r = s3b_dcache_record_block(priv->dcache, entry->u.dslot, entry->block_num, NULL)) != 0)
@@ -1180,7 +2164,7 @@ success:
             int state;
 
             // Wait for notification
-            pthread_cond_wait(&priv->write_complete, &priv->mutex);
+            pthread_cond_wait(BLOCK_WAIT(priv, block_num), &priv->mutex);
 
             // Sanity check
             S3BCACHE_CHECK_INVARIANTS(priv, 0);
@@ -1213,47 +2197,61 @@ fail:
  * On successful return, *datap will point to a malloc'd buffer for the data. If using
  * the disk cache, this will be a temporary buffer, otherwise it's the in-memory buffer.
  * If datap == NULL, then in the case of the disk cache only, no buffer is allocated.
+ * The block number is used to choose the cache file when striping by block number hash, and
+ * to place the block next to the previous block, if that one is cached.
  *
- * This assumes the mutex is held.
+ * This assumes the mutex is held. If an evicted entry goes to the compressed tier, the mutex is
+ * released while compressing, and EAGAIN is returned; the caller must then start over.
  *
  * Returns non-zero on error.
  */
 static int
-block_cache_get_entry(struct block_cache_private *priv, struct cache_entry **entryp, void **datap)
+block_cache_get_entry(struct block_cache_private *priv, s3b_block_t block_num, struct cache_entry **entryp, void **datap)
 {
     struct block_cache_conf *const config = priv->config;
+    struct cache_entry *prev_entry;
     struct cache_entry *entry;
     void *data = NULL;
+    u_int prev_dslot;
     int r;
 
 again:
     /*
-     * If cache is not full, allocate a new entry. We allocate the structure
+     * If cache is not full (i.e., is smaller than the current target size), allocate a new entry. We allocate the structure
      * and the data separately in hopes that the malloc() implementation will
      * put the data into its own page of virtual memory.
      *
-     * If the cache is full, try to evict a clean entry. Evict low priority
-     * blocks before high priority blocks.
+     * If the cache is full, try to evict a clean entry. Evict normal priority
+     * blocks before high priority blocks, and never evict pinned blocks.
      */
-    if (s3b_hash_size(priv->hashtable) < config->cache_size) {
-        if ((entry = calloc(1, sizeof(*entry))) == NULL) {
+    if (s3b_hash_size(priv->hashtable) + priv->num_unloaded < priv->target_size) {
+        if ((entry = calloc(1, sizeof(*entry) + ENTRY_EXTRA(config))) == NULL) {
             r = errno;
             (*config->log)(LOG_ERR, "can't allocate block cache entry: %s", strerror(r));
             priv->stats.out_of_memory_errors++;
             return r;
         }
-    } else if ((entry = TAILQ_FIRST(&priv->lo_cleans)) != NULL) {
-        block_cache_free_entry(priv, &entry);
-        goto again;
-    } else if ((entry = TAILQ_FIRST(&priv->hi_cleans)) != NULL) {
-        block_cache_free_entry(priv, &entry);
-        goto again;
-    } else
+    } else {
+        if ((entry = block_cache_evictable(priv)) != NULL) {
+            if (priv->zhashtable != NULL && ENTRY_GET_STATE(entry) == CLEAN) {
+                block_cache_zcache_put(priv, entry);                // this releases the mutex while compressing
+                return EAGAIN;
+            }
+            block_cache_free_entry(priv, &entry);
+            goto again;
+        }
+        if (priv->num_unloaded > 0) {                   // load some clean blocks from the cache file so we can evict them
+            if ((r = block_cache_load_next(priv, LAZY_LOAD_CHUNK)) != 0)
+                return r;
+            goto again;
+        }
+        priv->evict_waiting = 1;                        // any clean entries are busy; have them wake us up when done
         goto done;
+    }
 
     // Get associated data buffer
     if (datap != NULL || config->cache_file == NULL) {
-        if ((data = malloc(config->block_size)) == NULL) {
+        if ((data = block_cache_alloc_data(priv)) == NULL) {
             r = errno;
             (*config->log)(LOG_ERR, "can't allocate block cache buffer: %s", strerror(r));
             priv->stats.out_of_memory_errors++;
@@ -1263,16 +2261,22 @@ again:
     }
 
     // Get permanent data buffer
-    if (config->cache_file == NULL)
+    if (config->cache_file == NULL) {
         entry->u.data = data;
-    else if ((r = s3b_dcache_alloc_block(priv->dcache, &entry->u.dslot)) != 0) {    // should not happen
+        goto done;
+    }
+    prev_entry = block_num > 0 ? s3b_hash_get(priv->hashtable, block_num - 1) : NULL;
+    prev_dslot = prev_entry != NULL ? prev_entry->u.dslot : S3B_DCACHE_NO_DSLOT;
+    if ((r = s3b_dcache_alloc_block(priv->dcache, block_num, prev_dslot, &entry->u.dslot)) != 0) {   // should not happen
         (*config->log)(LOG_ERR, "can't alloc cached block! %s", strerror(r));
-        free(data);             // OK if NULL
+        block_cache_free_data(priv, data);      // OK if NULL
         data = NULL;
         free(entry);
         entry = NULL;
         goto done;
     }
+    if (prev_entry == NULL || entry->u.dslot != prev_dslot + 1)
+        priv->defrag_pending = 1;
 
 done:
     // Return what we got
@@ -1291,32 +2295,455 @@ block_cache_free_entry(struct block_cache_private *priv, struct cache_entry **en
     struct block_cache_conf *const config = priv->config;
     struct cache_entry *const entry = *entryp;
     struct list_head *const cleans_list = block_cache_cleans_list(priv, entry->block_num);
+    struct mtier_entry *mentry;
     int r;
 
     // Sanity check
     assert(ENTRY_GET_STATE(entry) == CLEAN || ENTRY_GET_STATE(entry) == CLEAN2);
+    assert(!ENTRY_IO_BUSY(entry));
 
     // Invalidate caller's pointer
     *entryp = NULL;
 
+    // If entry was read ahead but never used, that read-ahead was wasted
+    if (entry->ra)
+        block_cache_ra_wasted(priv, entry);
+
     // Free the data
     if (config->cache_file != NULL) {
+        if (priv->mhashtable != NULL && (mentry = s3b_hash_get(priv->mhashtable, entry->block_num)) != NULL)
+            block_cache_mtier_free(priv, mentry);
         if ((r = s3b_dcache_erase_block(priv->dcache, entry->u.dslot)) != 0)
             (*config->log)(LOG_ERR, "can't erase cached block! %s", strerror(r));
         if ((r = s3b_dcache_free_block(priv->dcache, entry->u.dslot)) != 0)
             (*config->log)(LOG_ERR, "can't free cached block! %s", strerror(r));
     } else
-        free(entry->u.data);
+        block_cache_free_data(priv, entry->u.data);
 
     // Remove entry from the clean list
     TAILQ_REMOVE(cleans_list, entry, link);
     s3b_hash_remove(priv->hashtable, entry->block_num);
+    priv->prio_blocks[block_cache_prio(config, entry->block_num)]--;
     priv->num_cleans--;
 
     // Free the entry
     free(entry);
 }
 
+/*
+ * Evict a CLEAN[2] entry whose data in the cache file failed checksum verification,
+ * so the block will be read again from the underlying store.
+ */
+static void
+block_cache_discard_corrupt(struct block_cache_private *priv, struct cache_entry *entry)
+{
+    struct block_cache_conf *const config = priv->config;
+
+    (*config->log)(LOG_WARNING, "cached block %0*jx failed checksum verification; discarding it",
+      S3B_BLOCK_NUM_DIGITS, (uintmax_t)entry->block_num);
+    priv->stats.checksum_errors++;
+    block_cache_free_entry(priv, &entry);
+    pthread_cond_broadcast(&priv->space_avail);
+}
+
+/*
+ * Do one step of idle defragmentation: scan onward from the defragmentation cursor for a CLEAN[2] block
+ * whose predecessor block is cached but not in the preceding dslot, and move it to the dslot following its
+ * predecessor; if another CLEAN[2] block is there, the two trade places. To guarantee progress, we only do
+ * this if it increases the number of blocks that directly follow their predecessor. A full pass through the
+ * cache file that moves nothing means there's nothing more to do for now.
+ *
+ * The buffer must have room for two blocks.
+ *
+ * Returns non-zero if there may be more to do.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_defrag(struct block_cache_private *priv, void *buf)
+{
+    struct block_cache_conf *const config = priv->config;
+    const u_int num_dslots = s3b_dcache_get_limit(priv->dcache);    // don't use dslots beyond a shrunken cache file
+    struct cache_entry *other_entry;
+    struct cache_entry *prev_entry;
+    struct cache_entry *entry;
+    s3b_block_t other_block_num;
+    s3b_block_t block_num;
+    u_int new_dslot;
+    u_int dslot;
+    u_int i;
+    int r;
+
+    for (i = 0; i < DEFRAG_SCAN_MAX; i++) {
+
+        // At the end of a pass, either start another or stop
+        if (priv->defrag_cursor >= num_dslots) {
+            priv->defrag_cursor = 0;
+            if (!priv->defrag_moved) {
+                priv->defrag_pending = 0;
+                return 0;
+            }
+            priv->defrag_moved = 0;
+        }
+        dslot = priv->defrag_cursor++;
+
+        // Find the block in this dslot and its predecessor
+        if (s3b_dcache_block_at(priv->dcache, dslot, &block_num) != 0 || block_num == 0)
+            continue;
+        if ((entry = s3b_hash_get(priv->hashtable, block_num)) == NULL || entry->u.dslot != dslot)
+            continue;                                   // not loaded yet (lazy loading)
+        if ((ENTRY_GET_STATE(entry) != CLEAN && ENTRY_GET_STATE(entry) != CLEAN2) || ENTRY_IO_BUSY(entry))
+            continue;
+        if ((prev_entry = s3b_hash_get(priv->hashtable, block_num - 1)) == NULL)
+            continue;
+        if ((new_dslot = prev_entry->u.dslot + 1) == dslot || new_dslot >= num_dslots)
+            continue;
+
+        // Find the block we would trade places with, if any, and make sure this would be an improvement
+        other_entry = NULL;
+        if (s3b_dcache_block_at(priv->dcache, new_dslot, &other_block_num) == 0
+          && (other_entry = s3b_hash_get(priv->hashtable, other_block_num)) != NULL
+          && (other_entry->u.dslot != new_dslot
+            || (ENTRY_GET_STATE(other_entry) != CLEAN && ENTRY_GET_STATE(other_entry) != CLEAN2)
+            || ENTRY_IO_BUSY(other_entry)))
+            continue;
+        if (!block_cache_defrag_improves(priv, entry, other_entry, new_dslot))
+            continue;
+
+        // Try to move it
+        switch ((r = s3b_dcache_move_block(priv->dcache, dslot, new_dslot, buf))) {
+        case 0:
+            entry->u.dslot = new_dslot;
+            if (other_entry != NULL)
+                other_entry->u.dslot = dslot;
+            priv->stats.defrag_moves++;
+            priv->defrag_moved = 1;
+            return 1;
+        case EBUSY:
+        case EINVAL:
+            break;
+        default:
+            if (r == EBADMSG)
+                priv->stats.checksum_errors++;
+            (*config->log)(LOG_ERR, "can't move cached block %0*jx: %s",
+              S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num, strerror(r));
+            if (other_entry != NULL)
+                block_cache_free_entry(priv, &other_entry);
+            block_cache_free_entry(priv, &entry);
+            pthread_cond_broadcast(&priv->space_avail);
+            priv->defrag_pending = 0;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Determine whether moving the entry to "new_dslot", trading places with "other_entry" (if not NULL),
+ * would increase the number of blocks that are in the dslot following their predecessor block.
+ * Only the two blocks themselves and their successors can be affected.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_defrag_improves(struct block_cache_private *priv, struct cache_entry *entry,
+  struct cache_entry *other_entry, u_int new_dslot)
+{
+    const u_int old_dslot = entry->u.dslot;
+    s3b_block_t affected[4];
+    u_int num_affected = 0;
+    int before = 0;
+    int after = 0;
+    u_int i;
+    u_int j;
+
+    affected[num_affected++] = entry->block_num;
+    affected[num_affected++] = entry->block_num + 1;
+    if (other_entry != NULL) {
+        affected[num_affected++] = other_entry->block_num;
+        affected[num_affected++] = other_entry->block_num + 1;
+    }
+    for (i = 0; i < num_affected; i++) {
+        for (j = 0; j < i && affected[j] != affected[i]; j++)
+            ;
+        if (j < i || affected[i] == 0)
+            continue;
+        before += block_cache_defrag_follows(priv, affected[i], NULL, 0, NULL, 0);
+        after += block_cache_defrag_follows(priv, affected[i], entry, new_dslot, other_entry, old_dslot);
+    }
+    return after > before;
+}
+
+/*
+ * Determine whether a cached block is in the dslot following its predecessor block, assuming
+ * the two given entries (if not NULL) have been moved to the given dslots.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_defrag_follows(struct block_cache_private *priv, s3b_block_t block_num,
+  struct cache_entry *entry1, u_int dslot1, struct cache_entry *entry2, u_int dslot2)
+{
+    struct cache_entry *entries[2];
+    u_int dslots[2];
+    u_int i;
+
+    assert(block_num > 0);
+    for (i = 0; i < 2; i++) {
+        if ((entries[i] = s3b_hash_get(priv->hashtable, block_num - 1 + i)) == NULL)
+            return 0;
+        if (entries[i] == entry1)
+            dslots[i] = dslot1;
+        else if (entries[i] == entry2)
+            dslots[i] = dslot2;
+        else
+            dslots[i] = entries[i]->u.dslot;
+    }
+    return dslots[1] == dslots[0] + 1;
+}
+
+/*
+ * Change the cache size (cache file only). Only the dslots below the new size are allocated from now on.
+ * When shrinking, CLEAN[2] blocks are evicted (normal before high, never pinned) down to the new size, and
+ * the blocks still stored beyond the new size are left for block_cache_shrink() to relocate.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_set_size(struct block_cache_private *priv, u_int size)
+{
+    struct cache_entry *entry;
+    int r;
+
+    // Sanity check
+    assert(priv->dcache != NULL);
+    assert(size > 0 && size <= priv->max_size);
+
+    // Change the limit on the cache file(s)
+    if ((r = s3b_dcache_set_limit(priv->dcache, size)) != 0)
+        return r;
+    priv->target_size = size;
+
+    // Evict clean blocks down to the new size, loading not yet loaded blocks from the cache file as needed
+    while (s3b_hash_size(priv->hashtable) + priv->num_unloaded > priv->target_size) {
+        if ((entry = block_cache_evictable(priv)) != NULL) {
+            block_cache_free_entry(priv, &entry);
+            continue;
+        }
+        if (priv->num_unloaded == 0)
+            break;
+        if ((r = block_cache_load_next(priv, LAZY_LOAD_CHUNK)) != 0)
+            return r;
+    }
+
+    // Relocate any blocks beyond the new size in the background
+    priv->shrink_cursor = size;
+    priv->shrink_pending = s3b_dcache_num_excess(priv->dcache) > 0;
+    if (priv->shrink_pending)
+        pthread_cond_signal(&priv->maint_work);
+
+    // Wake up anyone waiting for space
+    pthread_cond_broadcast(&priv->space_avail);
+    if (block_cache_ra_pending(priv) != NULL)
+        pthread_cond_signal(&priv->ra_work);
+    return 0;
+}
+
+/*
+ * Do one step of shrinking the cache file: scan onward from the shrink cursor through the dslots beyond the
+ * current size for a CLEAN[2] block, and move it to a free dslot below that size (near its predecessor block,
+ * if cached), or evict it if there is no room. Blocks not loaded yet are loaded first. Blocks in any other
+ * state are revisited on a later pass, after they have been written back. Once there are no blocks left
+ * beyond the current size, we're done.
+ *
+ * The buffer must have room for two blocks.
+ *
+ * Returns non-zero if there may be more to do right away.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_shrink(struct block_cache_private *priv, void *buf)
+{
+    struct block_cache_conf *const config = priv->config;
+    const u_int limit = s3b_dcache_get_limit(priv->dcache);
+    const u_int num_dslots = s3b_dcache_num_dslots(priv->dcache);
+    struct cache_entry *prev_entry;
+    struct cache_entry *entry;
+    s3b_block_t block_num;
+    u_int prev_dslot;
+    u_int new_dslot;
+    u_int dslot;
+    u_int i;
+    int r;
+
+    // Are we done?
+    if (s3b_dcache_num_excess(priv->dcache) == 0) {
+        (*config->log)(LOG_INFO, "finished shrinking block cache to %u blocks", limit);
+        priv->shrink_pending = 0;
+        return 0;
+    }
+
+    if (priv->shrink_cursor < limit)
+        priv->shrink_cursor = limit;
+    for (i = 0; i < SHRINK_SCAN_MAX; i++) {
+
+        // At the end of a pass, start another one later
+        if (priv->shrink_cursor >= num_dslots) {
+            priv->shrink_cursor = limit;
+            return 0;
+        }
+        dslot = priv->shrink_cursor++;
+
+        // Find the block in this dslot, loading it first if necessary (lazy loading)
+        if (s3b_dcache_block_at(priv->dcache, dslot, &block_num) != 0)
+            continue;
+        if ((entry = s3b_hash_get(priv->hashtable, block_num)) == NULL) {
+            switch ((r = block_cache_load_block(priv, block_num))) {
+            case 0:
+                priv->shrink_cursor--;                  // now look at it again
+                return 1;
+            case ENOENT:
+                continue;
+            default:
+                (*config->log)(LOG_ERR, "can't load cached block %0*jx: %s",
+                  S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num, strerror(r));
+                return 1;
+            }
+        }
+        if (entry->u.dslot != dslot || (ENTRY_GET_STATE(entry) != CLEAN && ENTRY_GET_STATE(entry) != CLEAN2)
+          || ENTRY_IO_BUSY(entry))
+            continue;
+
+        // Choose a free dslot below the limit, preferably following the previous block, and move the block there
+        prev_entry = block_num > 0 ? s3b_hash_get(priv->hashtable, block_num - 1) : NULL;
+        prev_dslot = prev_entry != NULL && prev_entry->u.dslot < limit ? prev_entry->u.dslot : S3B_DCACHE_NO_DSLOT;
+        if ((r = s3b_dcache_alloc_block(priv->dcache, block_num, prev_dslot, &new_dslot)) == 0) {
+            (void)s3b_dcache_free_block(priv->dcache, new_dslot);
+            r = s3b_dcache_move_block(priv->dcache, dslot, new_dslot, buf);
+        }
+        switch (r) {
+        case 0:
+            entry->u.dslot = new_dslot;
+            if (prev_dslot == S3B_DCACHE_NO_DSLOT || new_dslot != prev_dslot + 1)
+                priv->defrag_pending = 1;
+            priv->stats.shrink_moves++;
+            return 1;
+        case EBUSY:
+        case EINVAL:
+            break;
+        default:
+            if (r == EBADMSG)
+                priv->stats.checksum_errors++;
+            if (r != ENOMEM) {                          // ENOMEM just means there's no room
+                (*config->log)(LOG_ERR, "can't move cached block %0*jx: %s",
+                  S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num, strerror(r));
+            }
+            block_cache_free_entry(priv, &entry);
+            pthread_cond_broadcast(&priv->space_avail);
+            return 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Do one step of reclaiming disk space in the cache file, if there is any to reclaim.
+ * The mutex is released while doing so; the cache file makes writes to the dslots involved wait.
+ *
+ * The buffer must have room for one block.
+ *
+ * Returns non-zero if there is more to do.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_reclaim(struct block_cache_private *priv, void *buf)
+{
+    struct block_cache_conf *const config = priv->config;
+    int r;
+
+    if (s3b_dcache_reclaim_pending(priv->dcache) == 0)
+        return 0;
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    r = s3b_dcache_reclaim(priv->dcache, buf, RECLAIM_STEP_MAX);
+    pthread_mutex_lock(&priv->mutex);
+    if (r != 0) {
+        (*config->log)(LOG_ERR, "can't reclaim cache file disk space: %s", strerror(r));
+        return 0;
+    }
+    return s3b_dcache_reclaim_pending(priv->dcache) > 0;
+}
+
+/*
+ * Cache file maintenance thread main entry point.
+ *
+ * Reclaims disk space, relocates blocks beyond the end of a shrunken cache file, and defragments,
+ * each at its own pace, so none of this delays the writeback worker threads.
+ */
+static void *
+block_cache_maint_main(void *arg)
+{
+    struct block_cache_private *const priv = arg;
+    struct block_cache_conf *const config = priv->config;
+    uint64_t defrag_millis;
+    uint64_t wake_millis;
+    void *buf;
+
+    // Grab lock
+    pthread_mutex_lock(&priv->mutex);
+
+    // Allocate buffer; moving blocks within the cache file needs room for two blocks
+    if ((buf = malloc((size_t)config->block_size * 2)) == NULL) {
+        (*config->log)(LOG_ERR, "block_cache maintenance thread can't alloc buffer, exiting: %s", strerror(errno));
+        goto done;
+    }
+
+    // Repeatedly do stuff until told to stop
+    while (!priv->stopping) {
+
+        // Sanity check
+        S3BCACHE_CHECK_INVARIANTS(priv, 1);
+
+        // If reclaiming disk space, do a step if it's time (this releases the mutex, so check again afterward)
+        if (block_cache_get_time_millis() >= priv->reclaim_millis) {
+            priv->reclaim_millis = block_cache_get_time_millis()
+              + (block_cache_reclaim(priv, buf) ? RECLAIM_PAUSE_MILLIS : RECLAIM_CHECK_MILLIS);
+            continue;
+        }
+        wake_millis = priv->reclaim_millis;
+
+        // If shrinking the cache file, do a step if it's time; otherwise, if defragmenting, do a step if we've been idle long enough
+        if (priv->shrink_pending) {
+            if (block_cache_get_time_millis() >= priv->shrink_millis) {
+                priv->shrink_millis = block_cache_get_time_millis()
+                  + (block_cache_shrink(priv, buf) ? SHRINK_PAUSE_MILLIS : SHRINK_RETRY_MILLIS);
+            }
+            if (priv->shrink_pending && priv->shrink_millis < wake_millis)
+                wake_millis = priv->shrink_millis;
+        } else if (config->defrag && priv->defrag_pending) {
+            defrag_millis = priv->fg_millis + DEFRAG_IDLE_MILLIS;
+            if (block_cache_get_time_millis() >= defrag_millis && block_cache_defrag(priv, buf))
+                defrag_millis = block_cache_get_time_millis() + DEFRAG_PAUSE_MILLIS;
+            if (priv->defrag_pending && defrag_millis < wake_millis)
+                wake_millis = defrag_millis;
+        }
+
+        // Sleep until the next step is due
+        (void)block_cache_cond_timedwait(priv, &priv->maint_work, wake_millis);
+    }
+
+done:
+    // Mark maintenance thread finished
+    priv->maintaining = 0;
+    pthread_cond_signal(&priv->worker_exit);
+
+    // Done
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    free(buf);
+    return NULL;
+}
+
 /*
  * Worker thread main entry point.
  */
@@ -1327,13 +2754,12 @@ block_cache_worker_main(void *arg)
     struct block_cache_conf *const config = priv->config;
     struct cache_entry *entry;
     struct cache_entry *clean_entry = NULL;
-    struct list_head *cleans_list;
-    u_char etag[MD5_DIGEST_LENGTH];
+    struct zcache_entry *zentry;
     uint32_t adjusted_now;
     uint32_t now;
     u_int thread_id;
     void *buf;
-    int r;
+    u_int prio;
 
     // Grab lock
     pthread_mutex_lock(&priv->mutex);
@@ -1361,227 +2787,1715 @@ block_cache_worker_main(void *arg)
 
         // Evict any CLEAN[2] blocks that have timed out (if enabled)
         if (priv->clean_timeout != 0) {
-            while ((clean_entry = TAILQ_FIRST(&priv->lo_cleans)) != NULL && now >= clean_entry->timeout) {
-                block_cache_free_entry(priv, &clean_entry);
-                pthread_cond_signal(&priv->space_avail);
-            }
-            while ((clean_entry = TAILQ_FIRST(&priv->hi_cleans)) != NULL && now >= clean_entry->timeout) {
-                block_cache_free_entry(priv, &clean_entry);
-                pthread_cond_signal(&priv->space_avail);
+            for (prio = 0; prio < BLOCK_CACHE_PRIO_PINNED; prio++) {         // pinned blocks never time out
+                while ((clean_entry = TAILQ_FIRST(&priv->cleans[prio])) != NULL && now >= clean_entry->timeout) {
+                    if (ENTRY_IO_BUSY(clean_entry)) {                      // being read; try again later
+                        TAILQ_REMOVE(&priv->cleans[prio], clean_entry, link);
+                        TAILQ_INSERT_TAIL(&priv->cleans[prio], clean_entry, link);
+                        clean_entry->timeout = now + priv->clean_timeout;
+                        continue;
+                    }
+                    block_cache_free_entry(priv, &clean_entry);
+                    pthread_cond_broadcast(&priv->space_avail);
+                }
             }
+            while ((zentry = TAILQ_FIRST(&priv->zlru)) != NULL && now >= zentry->timeout)
+                block_cache_zcache_free(priv, zentry);
+        }
+
+        // Help write out the blocks of the current batch, if any, in block order (unless time's up)
+        if (priv->wb_batch.left > 0) {
+            if (priv->flush_expired)
+                block_cache_unclaim_batch(priv, &priv->wb_batch);
+            else
+                (void)block_cache_write_entry(priv, block_cache_batch_next(priv, &priv->wb_batch), buf, now);
+            continue;
         }
 
         // As we approach our maximum dirty block limit, force earlier than planned writes
         adjusted_now = now + (uint32_t)(priv->dirty_timeout * (block_cache_dirty_ratio(priv) / priv->max_dirty_ratio));
 
-        // See if there is a block that needs writing
-        if ((entry = TAILQ_FIRST(&priv->dirties)) != NULL && (priv->stopping || adjusted_now >= entry->timeout)) {
+        // See if there is a block that needs writing; when stopping, help write any remaining recovered blocks
+        if ((entry = TAILQ_FIRST(&priv->dirties)) == NULL && priv->stopping)
+            entry = TAILQ_FIRST(&priv->recovers);
+        if (entry != NULL && !priv->flush_expired && (priv->stopping || adjusted_now >= entry->timeout)) {
 
-            // If we are also supposed to do read-ahead, wake up a sibling to handle it
-            if (priv->seq_count >= config->read_ahead_trigger && priv->ra_count < config->read_ahead)
-                pthread_cond_signal(&priv->worker_work);
+            // Claim the block, along with any adjacent dirty blocks if batching, and wake up idle siblings to help
+            block_cache_claim_batch(priv, entry,
+              priv->stopping ? (uint32_t)~0 : adjusted_now + priv->dirty_timeout / 2, &priv->wb_batch);
+            if (priv->wb_batch.left > 1)
+                pthread_cond_broadcast(&priv->worker_work);
+            continue;
+        }
 
-            // Copy data to our private buffer; it may change while we're writing
-            if ((r = block_cache_read_data(priv, entry, buf, 0, config->block_size)) != 0) {
-                (*config->log)(LOG_ERR, "error reading cached block! %s", strerror(r));
-                sleep(5);
-                continue;
-            }
+        // Are we supposed to stop?
+        if (priv->stopping != 0)
+            break;
 
-            // Move to WRITING state
-            assert(ENTRY_GET_STATE(entry) == DIRTY);
-            TAILQ_REMOVE(&priv->dirties, entry, link);
-            ENTRY_RESET_LINK(entry);
-            entry->dirty = 0;
-            entry->timeout = 0;
-            assert(ENTRY_GET_STATE(entry) == WRITING);
-
-            // Attempt to write the block
-            CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
-            r = (*priv->inner->write_block)(priv->inner, entry->block_num, buf, etag, block_cache_check_cancel, priv);
-            pthread_mutex_lock(&priv->mutex);
-            S3BCACHE_CHECK_INVARIANTS(priv, 1);
+        // There is nothing to do at this time; sleep until there is something to do
+        if (entry == NULL || (clean_entry != NULL && clean_entry->timeout < entry->timeout))
+            entry = clean_entry;
 
-            // Sanity checks
-            assert(ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+        block_cache_worker_wait(priv, entry);
+    }
 
-            // If write attempt failed (or we canceled it), go back to the DIRTY state and try again later
-            if (r != 0) {
-                entry->dirty = 1;
-                TAILQ_INSERT_HEAD(&priv->dirties, entry, link);
-                continue;
-            }
+    // Decrement live worker thread count
+    priv->num_threads--;
+    pthread_cond_signal(&priv->worker_exit);
+
+done:
+    // Done
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Claim a due DIRTY entry for writing, along with up to config->write_batch - 1 DIRTY entries for the
+ * blocks adjacent to it that are due by time "limit", by moving them all to state WRITING. The claimed
+ * entries are queued in "batch" (which must be empty) in block number order, and the batch size is
+ * recorded in the statistics histogram.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_claim_batch(struct block_cache_private *priv, struct cache_entry *entry, uint32_t limit,
+  struct write_batch *batch)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct cache_entry *other;
+    s3b_block_t first;
+    s3b_block_t last;
+    u_int bucket;
+    u_int count;
+    u_int i;
+
+    // Extend the batch in both directions over contiguous DIRTY blocks that are due soon enough
+    assert(ENTRY_GET_STATE(entry) == DIRTY);
+    first = last = entry->block_num;
+    for (count = 1; count < config->write_batch && first > 0; count++, first--) {
+        if ((other = s3b_hash_get(priv->hashtable, first - 1)) == NULL || ENTRY_GET_STATE(other) != DIRTY
+          || other->timeout > limit)
+            break;
+    }
+    for ( ; count < config->write_batch && last < (s3b_block_t)~0; count++, last++) {
+        if ((other = s3b_hash_get(priv->hashtable, last + 1)) == NULL || ENTRY_GET_STATE(other) != DIRTY
+          || other->timeout > limit)
+            break;
+    }
+    assert(count == last - first + 1);
+
+    // Move them all to WRITING state
+    for (i = 0; i < count; i++) {
+        other = s3b_hash_get(priv->hashtable, first + i);
+        assert(other != NULL && ENTRY_GET_STATE(other) == DIRTY);
+        TAILQ_REMOVE(ENTRY_DIRTY_LIST(priv, other), other, link);
+        ENTRY_RESET_LINK(other);
+        if (other->recovered) {
+            priv->num_recovers--;
+            other->recovered = 0;
+        }
+        other->dirty = 0;
+        other->timeout = 0;
+        assert(ENTRY_GET_STATE(other) == WRITING);
+    }
+    assert(batch->left == 0);
+    batch->next = first;
+    batch->left = count;
+
+    // Update histogram
+    for (bucket = 0; bucket < BLOCK_CACHE_WRITE_BATCH_BUCKETS - 1 && count >= (2U << bucket); bucket++)
+        ;
+    priv->stats.write_batches[bucket]++;
+}
+
+/*
+ * Take the next entry to write from a batch claimed by block_cache_claim_batch().
+ *
+ * This assumes the mutex is held.
+ */
+static struct cache_entry *
+block_cache_batch_next(struct block_cache_private *priv, struct write_batch *batch)
+{
+    struct cache_entry *entry;
+
+    assert(batch->left > 0);
+    entry = s3b_hash_get(priv->hashtable, batch->next);
+    assert(entry != NULL);
+    assert(ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+    batch->next++;
+    batch->left--;
+    return entry;
+}
+
+/*
+ * Return all of the entries remaining in a batch claimed by block_cache_claim_batch() to the DIRTY state.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_unclaim_batch(struct block_cache_private *priv, struct write_batch *batch)
+{
+    struct cache_entry *entry;
+
+    while (batch->left > 0) {
+        batch->left--;
+        entry = s3b_hash_get(priv->hashtable, batch->next + batch->left);
+        assert(entry != NULL);
+        block_cache_unclaim_entry(priv, entry);
+    }
+}
+
+/*
+ * Return an entry claimed by block_cache_claim_batch() but not yet written to the DIRTY state.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_unclaim_entry(struct block_cache_private *priv, struct cache_entry *entry)
+{
+    assert(ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+    entry->dirty = 1;
+    TAILQ_INSERT_HEAD(&priv->dirties, entry, link);
+    assert(ENTRY_GET_STATE(entry) == DIRTY);
+}
+
+/*
+ * Write out an entry in state WRITING or WRITING2 claimed by block_cache_claim_batch().
+ * On failure, the entry goes back to the DIRTY state.
+ *
+ * This assumes the mutex is held; it is temporarily released during the write.
+ */
+static int
+block_cache_write_entry(struct block_cache_private *priv, struct cache_entry *entry, void *buf, uint32_t now)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct list_head *cleans_list;
+    u_char etag[MD5_DIGEST_LENGTH];
+    u_char md5[MD5_DIGEST_LENGTH];
+    u_char dhash[HASH128_LENGTH];
+    u_char stored_md5[MD5_DIGEST_LENGTH];
+    uint64_t start_millis;
+    int stored = 0;
+    int skipped = 0;
+    int r;
+
+    // Sanity check
+    assert(ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+
+    // If only part of the block has been written, fetch the rest of it first
+    while (entry->partial) {
+        if ((r = block_cache_partial_fill(priv, entry)) != 0) {
+            (*config->log)(LOG_ERR, "can't read partially written block 0x%0*jx: %s",
+              S3B_BLOCK_NUM_DIGITS, (uintmax_t)entry->block_num, strerror(r));
+            block_cache_unclaim_entry(priv, entry);
+            return r;
+        }
+    }
+
+    /*
+     * Copy data to our private buffer; it may change while we're writing. If the entry was modified
+     * after it was claimed (WRITING2), we are now copying the latest data, so it's back to WRITING.
+     * First wait for any write of the data in the cache file to finish.
+     */
+    while (!ENTRY_IO_READ_OK(entry))
+        pthread_cond_wait(BLOCK_WAIT(priv, entry->block_num), &priv->mutex);
+    if ((r = block_cache_read_data(priv, entry, buf, 0, config->block_size)) != 0) {
+        (*config->log)(LOG_ERR, "error reading cached block! %s", strerror(r));
+        block_cache_unclaim_entry(priv, entry);
+        sleep(5);
+        return r;
+    }
+    entry->dirty = 0;
+    assert(ENTRY_GET_STATE(entry) == WRITING);
+
+    // Note what the stored block looks like, if known; if we skip the write, its ETag stays the same
+    if (entry->stored) {
+        memcpy(etag, entry->etag, MD5_DIGEST_LENGTH);
+        memcpy(stored_md5, ENTRY_STORED_MD5(entry), MD5_DIGEST_LENGTH);
+        stored = 1;
+    }
+
+    // Attempt to write the block, unless the underlying store already has the same content
+    priv->wb_busy++;
+    start_millis = block_cache_get_time_millis();
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    if (config->skip_unchanged)
+        md5_quick(buf, config->block_size, md5);
+    if (priv->dhashtable != NULL)
+        hash128_quick(buf, config->block_size, dhash);
+    if (stored && memcmp(md5, stored_md5, MD5_DIGEST_LENGTH) == 0) {
+        skipped = 1;
+        r = 0;
+    } else
+        r = (*priv->inner->write_block)(priv->inner, entry->block_num, buf, etag, block_cache_check_cancel, priv);
+    pthread_mutex_lock(&priv->mutex);
+    priv->wb_busy--;
+    priv->wb_busy_millis += block_cache_get_time_millis() - start_millis;
+    S3BCACHE_CHECK_INVARIANTS(priv, 1);
+
+    // Sanity checks
+    assert(ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+
+    // If write attempt failed (or we canceled it), go back to the DIRTY state and try again later
+    if (r != 0) {
+        entry->stored = 0;                          // we no longer know what's stored
+        block_cache_unclaim_entry(priv, entry);
+        return r;
+    }
+
+    // Remember what we stored
+    if (skipped)
+        priv->stats.writes_skipped++;
+    if (config->skip_unchanged) {
+        memcpy(entry->etag, etag, MD5_DIGEST_LENGTH);
+        memcpy(ENTRY_STORED_MD5(entry), md5, MD5_DIGEST_LENGTH);
+        entry->stored = 1;
+    }
+
+    // If block was not modified while being written (WRITING), it is now CLEAN
+    if (!entry->dirty) {
+        if (config->cache_file != NULL) {
+            if ((r = s3b_dcache_record_block(priv->dcache, entry->u.dslot, entry->block_num, etag)) != 0)
+                (*config->log)(LOG_ERR, "can't record cached block! %s", strerror(r));
+        }
+        priv->num_dirties--;
+        cleans_list = block_cache_cleans_list(priv, entry->block_num);
+        TAILQ_INSERT_TAIL(cleans_list, entry, link);
+        entry->verify = 0;
+        entry->timeout = block_cache_get_time(priv) + priv->clean_timeout;
+        priv->num_cleans++;
+        assert(ENTRY_GET_STATE(entry) == CLEAN);
+        if (entry->flushing)
+            block_cache_flush_done(priv, entry);
+        if (priv->dhashtable != NULL)
+            block_cache_dedup(priv, entry, dhash);
+        pthread_cond_broadcast(&priv->space_avail);
+        pthread_cond_broadcast(&priv->write_complete);
+        pthread_cond_broadcast(BLOCK_WAIT(priv, entry->block_num));
+
+        // Read-ahead may have been waiting for cache space
+        if (block_cache_ra_pending(priv) != NULL)
+            pthread_cond_signal(&priv->ra_work);
+        return 0;
+    }
+
+    // Block was modified while being written (WRITING2), so it stays DIRTY; write it again right away if being flushed
+    if (entry->flushing) {
+        TAILQ_INSERT_HEAD(&priv->dirties, entry, link);
+        entry->timeout = now;
+        pthread_cond_signal(&priv->worker_work);
+        return 0;
+    }
+    TAILQ_INSERT_TAIL(&priv->dirties, entry, link);
+    entry->timeout = now + priv->dirty_timeout;     // update for 2nd write timing conservatively
+    return 0;
+}
+
+/*
+ * Read-ahead worker thread main entry point.
+ */
+static void *
+block_cache_ra_worker_main(void *arg)
+{
+    struct block_cache_private *const priv = arg;
+    struct cache_entry *entry;
+    struct ra_stream *stream;
+    uint64_t start_millis;
+    s3b_block_t ra_block;
+    int r;
+
+    // Grab lock
+    pthread_mutex_lock(&priv->mutex);
+
+    // Repeatedly do stuff until told to stop
+    while (1) {
+
+        // Sanity check
+        S3BCACHE_CHECK_INVARIANTS(priv, 1);
+
+        // Are we supposed to stop?
+        if (priv->stopping != 0)
+            break;
+
+        // See if there is a read-ahead block that needs to be read; if not, sleep until there is
+        if ((stream = block_cache_ra_pending(priv)) == NULL) {
+            pthread_cond_wait(&priv->ra_work, &priv->mutex);
+            continue;
+        }
+
+        // We will handle read-ahead for the stream's next read-ahead block; claim it now
+        if (!block_cache_ra_next_block(priv->config, stream, &ra_block))
+            continue;
+        stream->ra_count++;
+
+        // If block already exists in the cache, nothing needs to be done
+        if (s3b_hash_get(priv->hashtable, ra_block) != NULL)
+            continue;
+
+        // If there is more read-ahead to do, wake up a sibling to read the next block in parallel
+        priv->ra_busy++;
+        if (block_cache_ra_pending(priv) != NULL)
+            block_cache_ra_wakeup(priv);
+
+        // Perform a speculative read of the block so it will get stored in the cache
+        start_millis = block_cache_get_time_millis();
+        r = block_cache_do_read(priv, ra_block, 0, 0, NULL, 0);
+        priv->ra_busy--;
+        priv->ra_busy_millis += block_cache_get_time_millis() - start_millis;
+        if (r == 0 && (entry = s3b_hash_get(priv->hashtable, ra_block)) != NULL && ENTRY_GET_STATE(entry) == CLEAN) {
+            entry->ra = 1;
+            entry->ra_stream = stream - priv->ra_streams;
+            entry->ra_pattern = stream->stride == 1 ? RA_FORWARD : stream->stride == -1 ? RA_REVERSE : RA_STRIDE;
+            priv->stats.read_ahead_blocks++;
+        }
+    }
+
+    // Decrement live read-ahead worker thread count
+    priv->num_ra_threads--;
+    pthread_cond_signal(&priv->worker_exit);
+
+    // Done
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return NULL;
+}
+
+/*
+ * Wake up a read-ahead worker thread, first starting a new one if all of the existing ones
+ * are busy and the pool is not full yet.
+ *
+ * Assumes the mutex is held.
+ */
+static void
+block_cache_ra_wakeup(struct block_cache_private *priv)
+{
+    struct block_cache_conf *const config = priv->config;
+    int r;
+
+    if (priv->ra_busy == priv->num_ra_threads && priv->ra_started < config->read_ahead_threads && !priv->stopping) {
+        if ((r = pthread_create(&priv->threads[config->num_threads + priv->ra_started],
+          NULL, block_cache_ra_worker_main, priv)) != 0)
+            (*config->log)(LOG_ERR, "can't create read-ahead thread: %s", strerror(r));
+        else {
+            priv->ra_started++;
+            priv->num_ra_threads++;
+        }
+    }
+    pthread_cond_signal(&priv->ra_work);
+}
+
+/*
+ * Pinned block preload thread main entry point.
+ *
+ * Reads into the cache, in block order, each pinned block that is not already there.
+ */
+static void *
+block_cache_preload_main(void *arg)
+{
+    struct block_cache_private *const priv = arg;
+    struct block_cache_conf *const config = priv->config;
+    const struct block_cache_range *range;
+    s3b_block_t block_num;
+    u_int i;
+    int r;
+
+    // Grab lock
+    pthread_mutex_lock(&priv->mutex);
+
+    // Iterate over all pinned blocks until done or told to stop
+    for (i = 0; i < config->num_ranges && !priv->stopping; i++) {
+        range = &config->ranges[i];
+        if (range->prio != BLOCK_CACHE_PRIO_PINNED)
+            continue;
+        block_num = range->min;
+        while (!priv->stopping) {
+
+            // Sanity check
+            S3BCACHE_CHECK_INVARIANTS(priv, 1);
+
+            // Read the block unless already cached; wait for space here, where we can notice a shutdown
+            if (s3b_hash_get(priv->hashtable, block_num) == NULL) {
+                if (!block_cache_have_space(priv)) {
+                    pthread_cond_wait(&priv->space_avail, &priv->mutex);
+                    continue;
+                }
+                if ((r = block_cache_do_read(priv, block_num, 0, 0, NULL, 0)) != 0) {
+                    (*config->log)(LOG_WARNING, "can't preload pinned block 0x%0*jx: %s",
+                      S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num, strerror(r));
+                } else
+                    priv->stats.preload_blocks++;
+            }
+
+            // Advance to the next block
+            if (block_num == range->max)
+                break;
+            block_num++;
+        }
+    }
+    if (!priv->stopping)
+        (*config->log)(LOG_INFO, "finished preloading %u pinned blocks", block_cache_num_pinned(config));
+
+    // Mark preload finished; we may have consumed a wakeup meant for another thread waiting for space
+    priv->preloading = 0;
+    pthread_cond_broadcast(&priv->space_avail);
+    pthread_cond_signal(&priv->worker_exit);
+
+    // Done
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return NULL;
+}
+
+/*
+ * Memory pressure resize thread main entry point.
+ */
+static void *
+block_cache_resize_main(void *arg)
+{
+    struct block_cache_private *const priv = arg;
+    struct block_cache_conf *const config = priv->config;
+    struct cache_entry *entry;
+    uint64_t wake_time_millis;
+    double pressure;
+    int failed = 0;
+    u_int min_size;
+    u_int step;
+    u_int prio;
+    int r;
+
+    // Grab lock
+    pthread_mutex_lock(&priv->mutex);
+
+    // Repeatedly check memory pressure until told to stop
+    while (1) {
+
+        // Sleep until the next check
+        wake_time_millis = block_cache_get_time_millis() + RESIZE_INTERVAL_MILLIS;
+        while (!priv->stopping && block_cache_cond_timedwait(priv, &priv->resize_work, wake_time_millis) != ETIMEDOUT)
+            ;
+
+        // Are we supposed to stop?
+        if (priv->stopping != 0)
+            break;
+
+        // Read the current memory pressure (without holding the mutex)
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        r = block_cache_read_pressure(config, &pressure);
+        pthread_mutex_lock(&priv->mutex);
+        S3BCACHE_CHECK_INVARIANTS(priv, 1);
+        if (r != 0) {
+            if (!failed) {
+                (*config->log)(LOG_WARNING, "can't read memory pressure from \"%s\": %s",
+                  config->pressure_file, strerror(r));
+            }
+            failed = 1;
+            continue;
+        }
+        failed = 0;
+        priv->pressure = pressure;
+
+        // Under pressure, lower the target size and evict clean blocks (normal before high, never pinned) down to it
+        if (pressure >= config->pressure) {
+            min_size = config->min_size > priv->num_dirties ? config->min_size : priv->num_dirties;
+            if (priv->target_size > min_size) {
+                step = priv->target_size / RESIZE_SHRINK_DIVISOR;
+                if (step == 0)
+                    step = 1;
+                priv->target_size = priv->target_size - min_size > step ? priv->target_size - step : min_size;
+                priv->stats.resize_shrinks++;
+            }
+            for (prio = 0; prio < BLOCK_CACHE_PRIO_PINNED; prio++) {
+                while (s3b_hash_size(priv->hashtable) > priv->target_size
+                  && (entry = TAILQ_FIRST(&priv->cleans[prio])) != NULL)
+                    block_cache_free_entry(priv, &entry);
+            }
+            continue;
+        }
+
+        // When pressure subsides, grow the target size back toward the maximum
+        if (pressure < config->pressure / 2.0 && priv->target_size < config->cache_size) {
+            step = config->cache_size / RESIZE_GROW_DIVISOR;
+            if (step == 0)
+                step = 1;
+            priv->target_size = config->cache_size - priv->target_size > step ? priv->target_size + step : config->cache_size;
+            priv->stats.resize_grows++;
+            pthread_cond_broadcast(&priv->space_avail);
+            if (block_cache_ra_pending(priv) != NULL)
+                pthread_cond_signal(&priv->ra_work);
+        }
+    }
+
+    // Mark resize thread finished
+    priv->resizing = 0;
+    pthread_cond_signal(&priv->worker_exit);
+
+    // Done
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return NULL;
+}
+
+/*
+ * Read the current memory pressure, i.e., the "some avg10" percentage from a PSI-format
+ * file such as /proc/pressure/memory or a cgroup's memory.pressure file.
+ *
+ * Returns non-zero on error.
+ */
+static int
+block_cache_read_pressure(struct block_cache_conf *config, double *pressurep)
+{
+    char line[256];
+    FILE *fp;
+    int r = EINVAL;
+
+    if ((fp = fopen(config->pressure_file, "r")) == NULL)
+        return errno;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "some avg10=%lf", pressurep) == 1) {
+            r = 0;
+            break;
+        }
+    }
+    fclose(fp);
+    return r;
+}
+
+/*
+ * Lazy load thread main entry point.
+ *
+ * Loads the clean blocks in the cache file that were left unloaded at startup, a chunk at a time,
+ * releasing the mutex in between so foreground I/O can proceed.
+ */
+static void *
+block_cache_load_main(void *arg)
+{
+    struct block_cache_private *const priv = arg;
+    struct block_cache_conf *const config = priv->config;
+    const uint64_t start_millis = block_cache_get_time_millis();
+    int r;
+
+    // Grab lock
+    pthread_mutex_lock(&priv->mutex);
+
+    // Load blocks until done or told to stop
+    while (!priv->stopping && priv->num_unloaded > 0) {
+        if ((r = block_cache_load_next(priv, LAZY_LOAD_CHUNK)) != 0) {
+            (*config->log)(LOG_WARNING, "error loading blocks from cache file \"%s\": %s; the rest will be loaded on demand",
+              config->cache_file, strerror(r));
+            break;
+        }
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        pthread_mutex_lock(&priv->mutex);
+    }
+    if (priv->num_unloaded == 0) {
+        (*config->log)(LOG_INFO, "finished loading blocks from cache file \"%s\" in %.3f seconds (%u on demand)",
+          config->cache_file, (block_cache_get_time_millis() - start_millis) / 1000.0, priv->stats.lazy_on_demand);
+    }
+
+    // Mark load finished
+    priv->loading = 0;
+    pthread_cond_signal(&priv->worker_exit);
+
+    // Done
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return NULL;
+}
+
+/*
+ * Load a block from the cache file if it's there but not loaded yet.
+ *
+ * This assumes the mutex is held.
+ *
+ * Returns ENOENT if not found.
+ */
+static int
+block_cache_load_block(struct block_cache_private *priv, s3b_block_t block_num)
+{
+    int r;
+
+    r = s3b_dcache_load_block(priv->dcache, block_num, block_cache_dcache_load, priv);
+    priv->num_unloaded = s3b_dcache_num_unloaded(priv->dcache);
+    if (r == 0)
+        priv->stats.lazy_on_demand++;
+    return r;
+}
+
+/*
+ * Load up to "max" not yet loaded blocks from the cache file.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_load_next(struct block_cache_private *priv, u_int max)
+{
+    int r;
+
+    r = s3b_dcache_load_next(priv->dcache, max, block_cache_dcache_load, priv);
+    priv->num_unloaded = s3b_dcache_num_unloaded(priv->dcache);
+    return r;
+}
+
+/*
+ * Recovery thread main entry point. Writes out recovered dirty blocks in block number order.
+ */
+static void *
+block_cache_recover_main(void *arg)
+{
+    struct block_cache_private *const priv = arg;
+    struct block_cache_conf *const config = priv->config;
+    struct cache_entry *entry;
+    u_int thread_index;
+    void *buf;
+
+    // Grab lock
+    pthread_mutex_lock(&priv->mutex);
+
+    // Assign myself an index; only the first recovery thread keeps writing when foreground I/O is busy
+    thread_index = priv->recover_thread_id++;
+
+    // Allocate buffer for outgoing block data
+    if ((buf = malloc(config->block_size)) == NULL) {
+        (*config->log)(LOG_ERR, "block_cache recovery thread %u can't alloc buffer, exiting: %s", thread_index, strerror(errno));
+        goto done;
+    }
+
+    // Write recovered blocks until there are none left
+    while (!priv->flush_expired && (priv->recover_batch.left > 0 || TAILQ_FIRST(&priv->recovers) != NULL)) {
+
+        // Sanity check
+        S3BCACHE_CHECK_INVARIANTS(priv, 1);
+
+        // Give foreground I/O priority (unless we're stopping)
+        if (thread_index > 0 && !priv->stopping && block_cache_recover_yield(priv)) {
+            block_cache_cond_timedwait(priv, &priv->recover_work, block_cache_get_time_millis() + RECOVER_IDLE_MILLIS);
+            continue;
+        }
+
+        // Claim the next block, along with any adjacent dirty blocks if batching, and wake up idle siblings to help
+        if (priv->recover_batch.left == 0) {
+            entry = TAILQ_FIRST(&priv->recovers);
+            block_cache_claim_batch(priv, entry, (uint32_t)~0, &priv->recover_batch);
+            if (priv->recover_batch.left > 1)
+                pthread_cond_broadcast(&priv->recover_work);
+        }
+
+        // Write out the next block of the batch
+        entry = block_cache_batch_next(priv, &priv->recover_batch);
+        if (block_cache_write_entry(priv, entry, buf, block_cache_get_time(priv)) == 0)
+            priv->recover_written++;
+    }
+
+    // If time's up, put back any blocks claimed but not yet written
+    block_cache_unclaim_batch(priv, &priv->recover_batch);
+
+    // Log completion
+    if (priv->num_recover_threads == 1 && TAILQ_FIRST(&priv->recovers) == NULL) {
+        (*config->log)(LOG_INFO, "finished writing recovered dirty blocks (%u written by recovery threads)",
+          priv->recover_written);
+    }
+
+done:
+    // Decrement live recovery thread count
+    priv->num_recover_threads--;
+    pthread_cond_signal(&priv->worker_exit);
+
+    // Done
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Determine whether recovery threads should hold off in favor of foreground I/O, i.e., if there has been
+ * a foreground read or write recently, or if a normal dirty block is due to be written.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_recover_yield(struct block_cache_private *priv)
+{
+    struct cache_entry *const entry = TAILQ_FIRST(&priv->dirties);
+
+    if (block_cache_get_time_millis() < priv->fg_millis + RECOVER_IDLE_MILLIS)
+        return 1;
+    if (entry != NULL && block_cache_get_time(priv) >= entry->timeout)
+        return 1;
+    return 0;
+}
+
+/*
+ * Sort a list of DIRTY entries (priv->dirties or priv->recovers) by block number.
+ *
+ * This assumes the mutex is held or we're still being created.
+ */
+static int
+block_cache_sort_dirties(struct block_cache_private *priv, struct list_head *list)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct cache_entry **entries;
+    struct cache_entry *entry;
+    u_int num_entries = 0;
+    u_int i;
+    int r;
+
+    // Copy the entries into an array
+    for (entry = TAILQ_FIRST(list); entry != NULL; entry = TAILQ_NEXT(entry, link))
+        num_entries++;
+    if ((entries = malloc(num_entries * sizeof(*entries))) == NULL) {
+        r = errno;
+        (*config->log)(LOG_ERR, "can't allocate array of dirty blocks: %s", strerror(r));
+        return r;
+    }
+    for (i = 0; (entry = TAILQ_FIRST(list)) != NULL; i++) {
+        TAILQ_REMOVE(list, entry, link);
+        entries[i] = entry;
+    }
+    assert(i == num_entries);
+
+    // Sort them and put them back
+    qsort(entries, num_entries, sizeof(*entries), block_cache_entry_cmp);
+    for (i = 0; i < num_entries; i++)
+        TAILQ_INSERT_TAIL(list, entries[i], link);
+    free(entries);
+    return 0;
+}
+
+static int
+block_cache_entry_cmp(const void *ptr1, const void *ptr2)
+{
+    const struct cache_entry *const entry1 = *(const struct cache_entry *const *)ptr1;
+    const struct cache_entry *const entry2 = *(const struct cache_entry *const *)ptr2;
+
+    return entry1->block_num < entry2->block_num ? -1 : entry1->block_num > entry2->block_num ? 1 : 0;
+}
+
+/*
+ * Note that a block being flushed has been written, and wake up any flush group waiter(s) who are now done.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_flush_done(struct block_cache_private *priv, struct cache_entry *entry)
+{
+    struct flush_group *group;
+    s3b_block_t *ptr;
+    u_int index;
+
+    assert(entry->flushing);
+    entry->flushing = 0;
+    TAILQ_FOREACH(group, &priv->flush_groups, link) {
+        if ((ptr = bsearch(&entry->block_num, group->blocks, group->num_blocks,
+          sizeof(*group->blocks), block_cache_block_num_cmp)) == NULL)
+            continue;
+        index = ptr - group->blocks;
+        if (bitmap_test(group->done, index))
+            continue;
+        bitmap_set(group->done, index, 1);
+        if (--group->pending == 0)
+            pthread_cond_signal(&group->cond);
+    }
+}
+
+static int
+block_cache_block_num_cmp(const void *ptr1, const void *ptr2)
+{
+    const s3b_block_t block_num1 = *(const s3b_block_t *)ptr1;
+    const s3b_block_t block_num2 = *(const s3b_block_t *)ptr2;
+
+    return block_num1 < block_num2 ? -1 : block_num1 > block_num2 ? 1 : 0;
+}
+
+/*
+ * See if we want to cancel the current write for the given block.
+ */
+static int
+block_cache_check_cancel(void *arg, s3b_block_t block_num)
+{
+    struct block_cache_private *const priv = arg;
+    struct cache_entry *entry;
+    int r;
+
+    // Lock mutex
+    pthread_mutex_lock(&priv->mutex);
+    S3BCACHE_CHECK_INVARIANTS(priv, 1);
+
+    // Find cache entry
+    entry = s3b_hash_get(priv->hashtable, block_num);
+
+    // Sanity check
+    assert(entry != NULL);
+    assert(entry->block_num == block_num);
+    assert(ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+
+    // If block is in the WRITING2 state, cancel the current (obsolete) write operation
+    r = entry->dirty;
+
+    // Unlock mutex
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return r;
+}
+
+/*
+ * Sleep until either the 'worker_work' condition becomes true, or the
+ * entry (if any) times out.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_worker_wait(struct block_cache_private *priv, struct cache_entry *entry)
+{
+    uint64_t wake_time_millis;
+
+    if (entry == NULL) {
+        pthread_cond_wait(&priv->worker_work, &priv->mutex);
+        return;
+    }
+    wake_time_millis = priv->start_time + ((uint64_t)entry->timeout * TIME_UNIT_MILLIS);
+    block_cache_cond_timedwait(priv, &priv->worker_work, wake_time_millis);
+}
+
+/*
+ * Sleep until the specified condition becomes true, or the specified wakeup time is reached.
+ *
+ * Returns ETIMEDOUT if we timed out.
+ */
+static int
+block_cache_cond_timedwait(struct block_cache_private *priv, pthread_cond_t *cond, uint64_t wake_time_millis)
+{
+    struct timespec wake_time;
+
+    wake_time.tv_sec = wake_time_millis / 1000;
+    wake_time.tv_nsec = (wake_time_millis % 1000) * 1000000;
+    return pthread_cond_timedwait(cond, &priv->mutex, &wake_time);
+}
+
+/*
+ * Return current time in units of TIME_UNIT_MILLIS milliseconds since startup.
+ */
+static uint32_t
+block_cache_get_time(struct block_cache_private *priv)
+{
+    uint64_t since_start;
+
+    since_start = block_cache_get_time_millis() - priv->start_time;
+    return (uint32_t)(since_start / TIME_UNIT_MILLIS);
+}
+
+/*
+ * Get the head of the appropriate clean list, based on the block's priority class.
+ */
+static struct list_head *
+block_cache_cleans_list(struct block_cache_private *const priv, s3b_block_t block_num)
+{
+    return &priv->cleans[block_cache_prio(priv->config, block_num)];
+}
+
+/*
+ * Classify a block into a priority class. The configured ranges take precedence;
+ * otherwise, the first config->num_protected blocks are high priority.
+ *
+ * NOTE: this function must always return the same value for any given block number.
+ */
+static u_int
+block_cache_prio(struct block_cache_conf *const config, s3b_block_t block_num)
+{
+    u_int lo = 0;
+    u_int hi = config->num_ranges;
+
+    // Binary search the configured ranges, which are sorted and non-overlapping
+    while (lo < hi) {
+        const u_int mid = lo + (hi - lo) / 2;
+        const struct block_cache_range *const range = &config->ranges[mid];
+
+        if (block_num < range->min)
+            hi = mid;
+        else if (block_num > range->max)
+            lo = mid + 1;
+        else
+            return range->prio;
+    }
+    return block_num < config->num_protected ? BLOCK_CACHE_PRIO_HIGH : BLOCK_CACHE_PRIO_NORMAL;
+}
+
+/*
+ * Get the total number of blocks in pinned ranges.
+ */
+static u_int
+block_cache_num_pinned(struct block_cache_conf *const config)
+{
+    u_int num_pinned = 0;
+    u_int i;
+
+    for (i = 0; i < config->num_ranges; i++) {
+        const struct block_cache_range *const range = &config->ranges[i];
+
+        if (range->prio == BLOCK_CACHE_PRIO_PINNED)
+            num_pinned += range->max - range->min + 1;
+    }
+    return num_pinned;
+}
+
+/*
+ * Determine whether a new entry can be created right now, either because the cache is not
+ * full or because there is a clean entry that we could evict.
+ *
+ * This assumes the mutex is held.
+ */
+static int
+block_cache_have_space(struct block_cache_private *priv)
+{
+    u_int prio;
+
+    if (s3b_hash_size(priv->hashtable) < priv->target_size || priv->num_unloaded > 0)     // unloaded blocks are evictable
+        return 1;
+    for (prio = 0; prio < BLOCK_CACHE_PRIO_PINNED; prio++) {
+        if (TAILQ_FIRST(&priv->cleans[prio]) != NULL)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Update the read-ahead stream state for a block read by the upper layer.
+ *
+ * If the block continues an existing stream, advance that stream; otherwise, recycle the
+ * least recently used stream. Either way the stream becomes the most recently used.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_ra_update(struct block_cache_private *priv, s3b_block_t block_num)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct ra_stream *fresh = NULL;
+    struct ra_stream *stream;
+    int64_t delta = 0;
+
+    /*
+     * Find the stream this block belongs to, if any. Prefer a stream whose established stride this
+     * block continues; otherwise, take a single-read stream from which this block is a valid stride.
+     */
+    for (stream = TAILQ_FIRST(&priv->ra_lru); stream != NULL; stream = TAILQ_NEXT(stream, link)) {
+        delta = (int64_t)block_num - (int64_t)stream->seq_last;
+        if ((delta == 0 && stream->seq_count > 0) || (stream->seq_count > 1 && delta == stream->stride))
+            break;
+        if (fresh == NULL && stream->seq_count == 1 && block_cache_ra_stride_ok(config, delta))
+            fresh = stream;
+    }
+    if (stream == NULL && (stream = fresh) != NULL) {
+        delta = (int64_t)block_num - (int64_t)stream->seq_last;
+        stream->stride = (int)delta;
+    }
+
+    // Update count of block(s) read in sequence in this stream
+    if (stream == NULL) {
+        stream = TAILQ_FIRST(&priv->ra_lru);
+        stream->seq_count = 1;
+        stream->ra_count = 0;
+        stream->window = config->read_ahead;
+        stream->stride = 1;
+    } else if (delta != 0) {
+        stream->seq_count++;
+        if (stream->ra_count > 0)
+            stream->ra_count--;
+    }
+    stream->seq_last = block_num;
+
+    // Move stream to the end of the list to maintain LRU ordering
+    TAILQ_REMOVE(&priv->ra_lru, stream, link);
+    TAILQ_INSERT_TAIL(&priv->ra_lru, stream, link);
+}
+
+/*
+ * Find a read-ahead stream that has been triggered and still has read-ahead blocks to read, if any,
+ * provided there is room in the cache to read them.
+ *
+ * This assumes the mutex is held.
+ */
+static struct ra_stream *
+block_cache_ra_pending(struct block_cache_private *priv)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct ra_stream *stream;
+
+    // Read-ahead must not wait for cache space, otherwise it could tie up the threads needed for writeback
+    if (!block_cache_have_space(priv))
+        return NULL;
+
+    // Find a triggered stream with read-ahead remaining
+    for (stream = TAILQ_FIRST(&priv->ra_lru); stream != NULL; stream = TAILQ_NEXT(stream, link)) {
+        if (block_cache_ra_triggered(config, stream)
+          && stream->ra_count < stream->window && block_cache_ra_next_block(config, stream, NULL))
+            return stream;
+    }
+    return NULL;
+}
+
+/*
+ * Determine whether the given stream has seen enough reads in sequence to trigger read-ahead.
+ */
+static int
+block_cache_ra_triggered(struct block_cache_conf *config, const struct ra_stream *stream)
+{
+    if (config->read_ahead_threads == 0 || stream->window == 0)
+        return 0;
+    if (stream->seq_count < config->read_ahead_trigger)
+        return 0;
+    if (stream->stride != 1 && stream->stride != -1 && stream->seq_count < MIN_STRIDE_TRIGGER)
+        return 0;
+    return 1;
+}
+
+/*
+ * Determine whether the given block number delta between successive reads is a read-ahead pattern we follow.
+ */
+static int
+block_cache_ra_stride_ok(struct block_cache_conf *config, int64_t delta)
+{
+    if (delta == 1)
+        return 1;
+    if (delta == -1)
+        return config->read_ahead_reverse;
+    if (delta < 0)
+        delta = -delta;
+    return delta >= 2 && delta <= config->read_ahead_stride;
+}
+
+/*
+ * Get the next block to read ahead in the given stream, if any. Fails if it would be off either end of the disk.
+ */
+static int
+block_cache_ra_next_block(struct block_cache_conf *config, const struct ra_stream *stream, s3b_block_t *blockp)
+{
+    const int64_t next = (int64_t)stream->seq_last + (int64_t)stream->stride * (int64_t)(stream->ra_count + 1);
+
+    if (next < 0 || next >= (int64_t)config->num_blocks)
+        return 0;
+    if (blockp != NULL)
+        *blockp = (s3b_block_t)next;
+    return 1;
+}
+
+/*
+ * Account for a hit on a read-ahead block: the block's stream gets a larger window.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_ra_hit(struct block_cache_private *priv, struct cache_entry *entry)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct ra_stream *const stream = &priv->ra_streams[entry->ra_stream];
+
+    assert(entry->ra);
+    assert(entry->ra_stream < config->read_ahead_streams);
+    entry->ra = 0;
+    priv->stats.read_ahead_hits++;
+    switch (entry->ra_pattern) {
+    case RA_REVERSE:
+        priv->stats.read_ahead_reverse_hits++;
+        break;
+    case RA_STRIDE:
+        priv->stats.read_ahead_stride_hits++;
+        break;
+    default:
+        break;
+    }
+    if (stream->window < config->read_ahead_max)
+        stream->window++;
+}
+
+/*
+ * Account for a read-ahead block being evicted without ever being read: the block's stream gets a smaller window.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_ra_wasted(struct block_cache_private *priv, struct cache_entry *entry)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct ra_stream *const stream = &priv->ra_streams[entry->ra_stream];
+
+    assert(entry->ra);
+    assert(entry->ra_stream < config->read_ahead_streams);
+    entry->ra = 0;
+    priv->stats.read_ahead_wasted++;
+    stream->window /= 2;
+    if (stream->window < config->read_ahead)
+        stream->window = config->read_ahead;
+}
+
+/*
+ * Return current time in milliseconds.
+ */
+static uint64_t
+block_cache_get_time_millis(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
+}
+
+/*
+ * Return current time in microseconds.
+ */
+static uint64_t
+block_cache_get_time_micros(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+/*
+ * Evict a CLEAN entry from the cache, compressing it and adding it to the compressed tier, evicting
+ * the least recently used compressed blocks as needed to stay within the configured byte budget.
+ * Blocks that don't compress are simply dropped.
+ *
+ * The mutex is released while compressing a copy of the data. If the block is written meanwhile, or is
+ * back in the cache by the time we're done, the compressed copy is discarded.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_zcache_put(struct block_cache_private *priv, struct cache_entry *entry)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct zcache_pending pending;
+    struct zcache_entry *zentry;
+    void *zdata;
+    size_t zlen;
+    void *data;
+    int r;
+
+    // Sanity check
+    assert(ENTRY_GET_STATE(entry) == CLEAN);
+    assert(config->cache_file == NULL);
+    assert(s3b_hash_get(priv->zhashtable, entry->block_num) == NULL);
+
+    // Copy the data and evict the entry
+    pending.block_num = entry->block_num;
+    pending.stale = 0;
+    if ((data = malloc(config->block_size)) != NULL)
+        memcpy(data, entry->u.data, config->block_size);
+    else {
+        (*config->log)(LOG_ERR, "can't allocate block cache buffer: %s", strerror(errno));
+        priv->stats.out_of_memory_errors++;
+    }
+    if ((zentry = malloc(sizeof(*zentry))) != NULL)
+        zentry->timeout = entry->timeout;
+    else {
+        (*config->log)(LOG_ERR, "can't allocate compressed block cache entry: %s", strerror(errno));
+        priv->stats.out_of_memory_errors++;
+    }
+    block_cache_free_entry(priv, &entry);
+    if (data == NULL || zentry == NULL)
+        goto fail;
+
+    // Compress the data without holding the mutex
+    TAILQ_INSERT_TAIL(&priv->zpending, &pending, link);
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    r = (*config->compress_alg->cfunc)(config->log, data, config->block_size, &zdata, &zlen, config->compress_level);
+    pthread_mutex_lock(&priv->mutex);
+    TAILQ_REMOVE(&priv->zpending, &pending, link);
+    if (r != 0)
+        goto fail;
+
+    // Discard the result if it doesn't help, or if the block has been cached again meanwhile
+    if (zlen >= config->block_size || sizeof(*zentry) + zlen > config->compress_size || pending.stale
+      || s3b_hash_get(priv->hashtable, pending.block_num) != NULL
+      || s3b_hash_get(priv->zhashtable, pending.block_num) != NULL) {
+        free(zdata);
+        goto fail;
+    }
+    zentry->block_num = pending.block_num;
+    zentry->zdata = zdata;
+    zentry->zlen = zlen;
+
+    // Make room
+    while (s3b_hash_size(priv->zhashtable) >= priv->zmax || priv->zbytes + sizeof(*zentry) + zlen > config->compress_size)
+        block_cache_zcache_free(priv, TAILQ_FIRST(&priv->zlru));
+
+    // Add it
+    s3b_hash_put_new(priv->zhashtable, zentry);
+    TAILQ_INSERT_TAIL(&priv->zlru, zentry, link);
+    priv->zbytes += sizeof(*zentry) + zlen;
+    free(data);
+    return;
+
+fail:
+    free(zentry);
+    free(data);
+}
+
+/*
+ * Discard any compressed copy of a block, including one still being compressed.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_zcache_discard(struct block_cache_private *priv, s3b_block_t block_num)
+{
+    struct zcache_pending *pending;
+    struct zcache_entry *zentry;
+
+    TAILQ_FOREACH(pending, &priv->zpending, link) {
+        if (pending->block_num == block_num)
+            pending->stale = 1;
+    }
+    if ((zentry = s3b_hash_get(priv->zhashtable, block_num)) != NULL)
+        block_cache_zcache_free(priv, zentry);
+}
+
+/*
+ * Remove and return the compressed copy of a block, if any and not timed out.
+ *
+ * This assumes the mutex is held.
+ */
+static struct zcache_entry *
+block_cache_zcache_take(struct block_cache_private *priv, s3b_block_t block_num)
+{
+    struct zcache_entry *zentry;
+
+    if ((zentry = s3b_hash_get(priv->zhashtable, block_num)) == NULL)
+        return NULL;
+    if (priv->clean_timeout != 0 && block_cache_get_time(priv) >= zentry->timeout) {
+        block_cache_zcache_free(priv, zentry);
+        return NULL;
+    }
+    s3b_hash_remove(priv->zhashtable, block_num);
+    TAILQ_REMOVE(&priv->zlru, zentry, link);
+    priv->zbytes -= sizeof(*zentry) + zentry->zlen;
+    return zentry;
+}
+
+/*
+ * Remove a block from the compressed tier and free it.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_zcache_free(struct block_cache_private *priv, struct zcache_entry *zentry)
+{
+    s3b_hash_remove(priv->zhashtable, zentry->block_num);
+    TAILQ_REMOVE(&priv->zlru, zentry, link);
+    priv->zbytes -= sizeof(*zentry) + zentry->zlen;
+    free(zentry->zdata);
+    free(zentry);
+}
+
+/*
+ * Account for a read of a cached block, which was served from the memory tier if the block is there,
+ * and otherwise copy the block into the memory tier, evicting the least recently used blocks as needed.
+ * If only part of the block was read, the rest is read from the cache file; if that fails, no big deal.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_mtier_promote(struct block_cache_private *priv, struct cache_entry *entry, const void *src,
+  u_int off, u_int len)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct mtier_entry *mentry;
+
+    // Sanity check
+    assert(config->cache_file != NULL);
+    assert(ENTRY_GET_STATE(entry) != READING && ENTRY_GET_STATE(entry) != READING2 && ENTRY_GET_STATE(entry) != CLEAN2);
+
+    // If the block is already in the memory tier, just update its LRU position
+    if ((mentry = s3b_hash_get(priv->mhashtable, entry->block_num)) != NULL) {
+        TAILQ_REMOVE(&priv->mlru, mentry, link);
+        TAILQ_INSERT_TAIL(&priv->mlru, mentry, link);
+        priv->stats.memory_hits++;
+        return;
+    }
+    priv->stats.disk_hits++;
+
+    // If we need to read the whole block but its data is being written meanwhile, try again next time
+    if ((off != 0 || len != config->block_size) && !ENTRY_IO_READ_OK(entry))
+        return;
+
+    // Create new memory tier entry
+    if ((mentry = malloc(sizeof(*mentry) + config->block_size)) == NULL) {
+        priv->stats.out_of_memory_errors++;
+        return;
+    }
+    mentry->block_num = entry->block_num;
+    if (off == 0 && len == config->block_size)
+        memcpy(mentry->data, src, len);
+    else if (block_cache_read_data(priv, entry, mentry->data, 0, config->block_size) != 0
+      || s3b_hash_get(priv->mhashtable, entry->block_num) != NULL) {            // the mutex was released
+        free(mentry);
+        return;
+    }
+
+    // Make room
+    while (s3b_hash_size(priv->mhashtable) >= priv->mmax)
+        block_cache_mtier_free(priv, TAILQ_FIRST(&priv->mlru));
+
+    // Add it
+    s3b_hash_put_new(priv->mhashtable, mentry);
+    TAILQ_INSERT_TAIL(&priv->mlru, mentry, link);
+}
+
+/*
+ * Apply a write of a cached block's dslot to the block's memory tier copy, if any, so the copy keeps
+ * matching the cache file. If the write failed (r != 0), the copy is discarded instead.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_mtier_update(struct block_cache_private *priv, struct cache_entry *entry, const void *src,
+  u_int off, u_int len, int r)
+{
+    struct mtier_entry *mentry;
 
-            // If block was not modified while being written (WRITING), it is now CLEAN
-            if (!entry->dirty) {
-                if (config->cache_file != NULL) {
-                    if ((r = s3b_dcache_record_block(priv->dcache, entry->u.dslot, entry->block_num, etag)) != 0)
-                        (*config->log)(LOG_ERR, "can't record cached block! %s", strerror(r));
-                }
-                priv->num_dirties--;
-                cleans_list = block_cache_cleans_list(priv, entry->block_num);
-                TAILQ_INSERT_TAIL(cleans_list, entry, link);
-                entry->verify = 0;
-                entry->timeout = block_cache_get_time(priv) + priv->clean_timeout;
-                priv->num_cleans++;
-                assert(ENTRY_GET_STATE(entry) == CLEAN);
-                pthread_cond_signal(&priv->space_avail);
-                pthread_cond_broadcast(&priv->write_complete);
-                continue;
-            }
+    if ((mentry = s3b_hash_get(priv->mhashtable, entry->block_num)) == NULL)
+        return;
+    if (r != 0) {
+        block_cache_mtier_free(priv, mentry);
+        return;
+    }
+    if (src == NULL)
+        memset((char *)mentry->data + off, 0, len);
+    else
+        memcpy((char *)mentry->data + off, src, len);
+}
 
-            // Block was modified while being written (WRITING2), so it stays DIRTY
-            TAILQ_INSERT_TAIL(&priv->dirties, entry, link);
-            entry->timeout = now + priv->dirty_timeout;     // update for 2nd write timing conservatively
-            continue;
-        }
+/*
+ * Remove a block from the memory tier and free it.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_mtier_free(struct block_cache_private *priv, struct mtier_entry *mentry)
+{
+    s3b_hash_remove(priv->mhashtable, mentry->block_num);
+    TAILQ_REMOVE(&priv->mlru, mentry, link);
+    free(mentry);
+}
 
-        // Are we supposed to stop?
-        if (priv->stopping != 0)
-            break;
+/*
+ * Allocate an in-memory data buffer (or a temporary buffer for the disk cache).
+ *
+ * Returns NULL and sets errno on failure.
+ */
+static void *
+block_cache_alloc_data(struct block_cache_private *priv)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct dedup_buf *dbuf;
+
+    if (priv->dhashtable == NULL)
+        return malloc(config->block_size);
+    if ((dbuf = malloc(sizeof(*dbuf) + config->block_size)) == NULL)
+        return NULL;
+    dbuf->refs = 0;
+    return dbuf->data;
+}
 
-        // See if there is a read-ahead block that needs to be read
-        if (priv->seq_count >= config->read_ahead_trigger && priv->ra_count < config->read_ahead) {
-            while (priv->ra_count < config->read_ahead) {
-                s3b_block_t ra_block;
+/*
+ * Free a data buffer allocated by block_cache_alloc_data(), or drop a reference to a shared buffer.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_free_data(struct block_cache_private *priv, void *data)
+{
+    struct dedup_buf *dbuf;
 
-                // We will handle read-ahead for the next read-ahead block; claim it now
-                ra_block = priv->seq_last + ++priv->ra_count;
+    if (priv->dhashtable == NULL || data == NULL) {
+        free(data);
+        return;
+    }
+    dbuf = DEDUP_BUF(data);
+    if (dbuf->refs > 0) {
+        priv->dedup_refs--;
+        if (--dbuf->refs > 0)
+            return;
+        block_cache_dedup_remove(priv, dbuf);
+    }
+    free(dbuf);
+}
 
-                // If block already exists in the cache, nothing needs to be done
-                if (s3b_hash_get(priv->hashtable, ra_block) != NULL)
-                    continue;
+/*
+ * Share a newly CLEAN entry's data buffer with other CLEAN entries having the same content.
+ * If there are none, make the entry's buffer available for sharing.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_dedup(struct block_cache_private *priv, struct cache_entry *entry, const u_char *hash)
+{
+    struct block_cache_conf *const config = priv->config;
+    struct dedup_buf *const dbuf = DEDUP_BUF(entry->u.data);
+    struct dedup_buf *other;
+    s3b_block_t key;
 
-                // Perform a speculative read of the block so it will get stored in the cache
-                (void)block_cache_do_read(priv, ra_block, 0, 0, NULL, 0);
-                break;
-            }
-            continue;
+    // Sanity check
+    assert(ENTRY_GET_STATE(entry) == CLEAN);
+    assert(dbuf->refs == 0);
+
+    // Look for an existing buffer with the same content among those with the same key
+    memcpy(&key, hash, sizeof(key));
+    for (other = s3b_hash_get(priv->dhashtable, key); other != NULL; other = other->next) {
+        if (memcmp(other->hash, hash, HASH128_LENGTH) == 0 && memcmp(other->data, dbuf->data, config->block_size) == 0) {
+            free(dbuf);
+            entry->u.data = other->data;
+            other->refs++;
+            priv->dedup_refs++;
+            return;
         }
-
-        // There is nothing to do at this time; sleep until there is something to do
-        if (entry == NULL || (clean_entry != NULL && clean_entry->timeout < entry->timeout))
-            entry = clean_entry;
-        block_cache_worker_wait(priv, entry);
     }
 
-    // Decrement live worker thread count
-    priv->num_threads--;
-    pthread_cond_signal(&priv->worker_exit);
+    // Make this buffer sharable by putting it at the head of the chain for its key
+    dbuf->key = key;
+    memcpy(dbuf->hash, hash, HASH128_LENGTH);
+    dbuf->refs = 1;
+    if ((dbuf->next = s3b_hash_get(priv->dhashtable, key)) != NULL)
+        s3b_hash_remove(priv->dhashtable, key);
+    s3b_hash_put_new(priv->dhashtable, dbuf);
+    priv->dedup_refs++;
+    priv->dedup_bufs++;
+}
 
-done:
-    // Done
-    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
-    free(buf);
-    return NULL;
+/*
+ * Remove a data buffer that is no longer shared from the chain of sharable buffers for its key.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_dedup_remove(struct block_cache_private *priv, struct dedup_buf *dbuf)
+{
+    struct dedup_buf *prev;
+
+    prev = s3b_hash_get(priv->dhashtable, dbuf->key);
+    assert(prev != NULL);
+    if (prev == dbuf) {
+        s3b_hash_remove(priv->dhashtable, dbuf->key);
+        if (dbuf->next != NULL)
+            s3b_hash_put_new(priv->dhashtable, dbuf->next);
+    } else {
+        while (prev->next != dbuf) {
+            prev = prev->next;
+            assert(prev != NULL);
+        }
+        prev->next = dbuf->next;
+    }
+    priv->dedup_bufs--;
 }
 
 /*
- * See if we want to cancel the current write for the given block.
+ * Give a CLEAN entry that is about to be modified its own private data buffer.
+ *
+ * This assumes the mutex is held.
  */
 static int
-block_cache_check_cancel(void *arg, s3b_block_t block_num)
+block_cache_unshare(struct block_cache_private *priv, struct cache_entry *entry)
 {
-    struct block_cache_private *const priv = arg;
-    struct cache_entry *entry;
+    struct block_cache_conf *const config = priv->config;
+    struct dedup_buf *const dbuf = DEDUP_BUF(entry->u.data);
+    void *data;
     int r;
 
-    // Lock mutex
-    pthread_mutex_lock(&priv->mutex);
-    S3BCACHE_CHECK_INVARIANTS(priv, 1);
-
-    // Find cache entry
-    entry = s3b_hash_get(priv->hashtable, block_num);
-
     // Sanity check
-    assert(entry != NULL);
-    assert(entry->block_num == block_num);
-    assert(ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+    assert(ENTRY_GET_STATE(entry) == CLEAN);
 
-    // If block is in the WRITING2 state, cancel the current (obsolete) write operation
-    r = entry->dirty;
+    // Easy cases: not shared, or we are the only user
+    switch (dbuf->refs) {
+    case 0:
+        return 0;
+    case 1:
+        block_cache_dedup_remove(priv, dbuf);
+        dbuf->refs = 0;
+        priv->dedup_refs--;
+        return 0;
+    default:
+        break;
+    }
 
-    // Unlock mutex
-    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
-    return r;
+    // Copy the data to a new private buffer
+    if ((data = block_cache_alloc_data(priv)) == NULL) {
+        r = errno;
+        (*config->log)(LOG_ERR, "can't allocate block cache buffer: %s", strerror(r));
+        priv->stats.out_of_memory_errors++;
+        return r;
+    }
+    memcpy(data, dbuf->data, config->block_size);
+    block_cache_free_data(priv, entry->u.data);
+    entry->u.data = data;
+    return 0;
 }
 
 /*
- * Sleep until either the 'worker_work' condition becomes true, or the
- * entry (if any) times out.
+ * Determine whether a partial write to a block that is not cached can go into a new partial entry.
  *
  * This assumes the mutex is held.
  */
-static void
-block_cache_worker_wait(struct block_cache_private *priv, struct cache_entry *entry)
+static int
+block_cache_partial_ok(struct block_cache_private *priv, s3b_block_t block_num, u_int off, u_int len)
 {
-    uint64_t wake_time_millis;
+    // Partial entries must be enabled and the write must be sector-aligned
+    if (priv->phashtable == NULL || !PARTIAL_ALIGNED(off, len))
+        return 0;
 
-    if (entry == NULL) {
-        pthread_cond_wait(&priv->worker_work, &priv->mutex);
-        return;
-    }
-    wake_time_millis = priv->start_time + ((uint64_t)entry->timeout * TIME_UNIT_MILLIS);
-    block_cache_cond_timedwait(priv, &priv->worker_work, wake_time_millis);
+    // If there's a compressed copy of the block, it's cheaper to just use it
+    if (priv->zhashtable != NULL && s3b_hash_get(priv->zhashtable, block_num) != NULL)
+        return 0;
+
+    // OK
+    return 1;
 }
 
 /*
- * Sleep until the specified condition becomes true, or the specified wakeup time is reached.
+ * Make a new entry partial, with no valid sectors yet.
  *
- * Returns ETIMEDOUT if we timed out.
+ * This assumes the mutex is held.
  */
 static int
-block_cache_cond_timedwait(struct block_cache_private *priv, pthread_cond_t *cond, uint64_t wake_time_millis)
+block_cache_partial_init(struct block_cache_private *priv, struct cache_entry *entry)
 {
-    struct timespec wake_time;
+    struct block_cache_conf *const config = priv->config;
+    struct partial_map *pmap;
+    int r;
 
-    wake_time.tv_sec = wake_time_millis / 1000;
-    wake_time.tv_nsec = (wake_time_millis % 1000) * 1000000;
-    return pthread_cond_timedwait(cond, &priv->mutex, &wake_time);
+    if ((pmap = calloc(1, sizeof(*pmap) + bitmap_size(priv->sectors_per_block) * sizeof(*pmap->valid))) == NULL) {
+        r = errno;
+        (*config->log)(LOG_ERR, "can't allocate block cache sector map: %s", strerror(r));
+        priv->stats.out_of_memory_errors++;
+        return r;
+    }
+    pmap->block_num = entry->block_num;
+    s3b_hash_put_new(priv->phashtable, pmap);
+    entry->partial = 1;
+    return 0;
 }
 
 /*
- * Return current time in units of TIME_UNIT_MILLIS milliseconds since startup.
+ * Determine whether the given range of a partial entry's data is valid.
+ *
+ * This assumes the mutex is held.
  */
-static uint32_t
-block_cache_get_time(struct block_cache_private *priv)
+static int
+block_cache_partial_valid(struct block_cache_private *priv, struct cache_entry *entry, u_int off, u_int len)
 {
-    uint64_t since_start;
-
-    since_start = block_cache_get_time_millis() - priv->start_time;
-    return (uint32_t)(since_start / TIME_UNIT_MILLIS);
+    struct partial_map *const pmap = s3b_hash_get(priv->phashtable, entry->block_num);
+    u_int sector;
+
+    assert(entry->partial && pmap != NULL);
+    if (len == 0)
+        return 1;
+    for (sector = off / PARTIAL_SECTOR_SIZE; sector <= (off + len - 1) / PARTIAL_SECTOR_SIZE; sector++) {
+        if (!bitmap_test(pmap->valid, sector))
+            return 0;
+    }
+    return 1;
 }
 
 /*
- * Get the head of the appropriate clean list, based on whether the block is low or high priority.
+ * Mark the given (sector-aligned) range of a partial entry's data as valid.
+ * If that makes all of the data valid, the entry is no longer partial.
+ *
+ * This assumes the mutex is held.
  */
-static struct list_head *
-block_cache_cleans_list(struct block_cache_private *const priv, s3b_block_t block_num)
+static void
+block_cache_partial_mark(struct block_cache_private *priv, struct cache_entry *entry, u_int off, u_int len)
 {
-    return block_cache_high_prio(priv->config, block_num) ? &priv->hi_cleans : &priv->lo_cleans;
+    struct partial_map *const pmap = s3b_hash_get(priv->phashtable, entry->block_num);
+    u_int sector;
+
+    assert(entry->partial && pmap != NULL);
+    assert(PARTIAL_ALIGNED(off, len));
+    for (sector = off / PARTIAL_SECTOR_SIZE; sector < (off + len) / PARTIAL_SECTOR_SIZE; sector++) {
+        if (!bitmap_test(pmap->valid, sector)) {
+            bitmap_set(pmap->valid, sector, 1);
+            pmap->num_valid++;
+        }
+    }
+    if (pmap->num_valid == priv->sectors_per_block && !pmap->filling) {
+        block_cache_partial_free(priv, entry);
+        priv->stats.partial_completed++;
+    }
 }
 
 /*
- * Classify a block as either low or high priority.
+ * Fetch the rest of a partial entry's block from the underlying s3backer_store and fill in
+ * the invalid sectors, so the entry is no longer partial. If another thread is already doing
+ * that, just wait for it. Either way, the mutex is temporarily released, so the caller must
+ * re-check the state of the entry afterward. The entry itself can't go away in the meantime,
+ * because it can't become CLEAN while it's partial.
  *
- * NOTE: this function must always return the same value for any given block number.
+ * This assumes the mutex is held.
  */
 static int
-block_cache_high_prio(struct block_cache_conf *const config, s3b_block_t block_num)
+block_cache_partial_fill(struct block_cache_private *priv, struct cache_entry *entry)
 {
-    return block_num < config->num_protected;
+    struct block_cache_conf *const config = priv->config;
+    const s3b_block_t block_num = entry->block_num;
+    struct partial_map *const pmap = s3b_hash_get(priv->phashtable, block_num);
+    u_int sector;
+    void *buf;
+    int r;
+
+    // Sanity check
+    assert(entry->partial && pmap != NULL);
+
+    // If another thread is already fetching the block, wait for it
+    if (pmap->filling) {
+        pthread_cond_wait(BLOCK_WAIT(priv, block_num), &priv->mutex);
+        return 0;
+    }
+
+    // Allocate temporary buffer
+    if ((buf = malloc(config->block_size)) == NULL) {
+        r = errno;
+        (*config->log)(LOG_ERR, "can't allocate block cache buffer: %s", strerror(r));
+        priv->stats.out_of_memory_errors++;
+        return r;
+    }
+
+    // Read the block from the underlying s3backer_store
+    pmap->filling = 1;
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    r = (*priv->inner->read_block)(priv->inner, block_num, buf, NULL, NULL, 0);
+    pthread_mutex_lock(&priv->mutex);
+    S3BCACHE_CHECK_INVARIANTS(priv, 1);
+    assert(s3b_hash_get(priv->hashtable, block_num) == entry);
+    assert(entry->partial && s3b_hash_get(priv->phashtable, block_num) == pmap);
+    pmap->filling = 0;
+    pthread_cond_broadcast(BLOCK_WAIT(priv, block_num));
+    if (r != 0)
+        goto done;
+
+    // Fill in the sectors that have not been written (meanwhile, more of them may have been)
+    for (sector = 0; sector < priv->sectors_per_block; sector++) {
+        if (!bitmap_test(pmap->valid, sector)) {
+            memcpy((char *)entry->u.data + sector * PARTIAL_SECTOR_SIZE,
+              (char *)buf + sector * PARTIAL_SECTOR_SIZE, PARTIAL_SECTOR_SIZE);
+        }
+    }
+    block_cache_partial_free(priv, entry);
+    priv->stats.partial_fills++;
+
+done:
+    free(buf);
+    return r;
 }
 
 /*
- * Return current time in milliseconds.
+ * Discard a partial entry's valid sector map; all of its data is now valid.
+ *
+ * This assumes the mutex is held.
  */
-static uint64_t
-block_cache_get_time_millis(void)
+static void
+block_cache_partial_free(struct block_cache_private *priv, struct cache_entry *entry)
 {
-    struct timeval tv;
+    struct partial_map *const pmap = s3b_hash_get(priv->phashtable, entry->block_num);
 
-    gettimeofday(&tv, NULL);
-    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
+    assert(entry->partial && pmap != NULL && !pmap->filling);
+    s3b_hash_remove(priv->phashtable, entry->block_num);
+    free(pmap);
+    entry->partial = 0;
 }
 
 static int
@@ -1592,7 +4506,7 @@ block_cache_free_one(void *arg, void *value)
     struct cache_entry *const entry = value;
 
     if (config->cache_file == NULL)
-        free(entry->u.data);
+        block_cache_free_data(priv, entry->u.data);
     free(entry);
     return 0;
 }
@@ -1610,8 +4524,8 @@ block_cache_verified(struct block_cache_private *priv, struct cache_entry *entry
     assert(entry->verify);
     assert(ENTRY_GET_STATE(entry) == CLEAN2 || ENTRY_GET_STATE(entry) == READING2);
 
-    // Allocate new, smaller entry; if we can't no big deal
-    if ((new_entry = malloc(sizeof(*entry))) == NULL)
+    // Allocate new, smaller entry (unless we need the extra room anyway); if we can't no big deal
+    if (ENTRY_EXTRA(priv->config) != 0 || (new_entry = malloc(sizeof(*entry))) == NULL)
         goto done;
     memcpy(new_entry, entry, sizeof(*entry));
 
@@ -1632,11 +4546,16 @@ done:
 
 /*
  * Read the data from a cached block into a buffer.
+ *
+ * This assumes the mutex is held; with a cache file, it is temporarily released during the read,
+ * while the entry is busy. The caller must ensure ENTRY_IO_READ_OK().
  */
 static int
 block_cache_read_data(struct block_cache_private *priv, struct cache_entry *entry, void *dest, u_int off, u_int len)
 {
     struct block_cache_conf *const config = priv->config;
+    struct mtier_entry *mentry;
+    int r;
 
     // Sanity check
     assert(off <= config->block_size);
@@ -1649,17 +4568,33 @@ block_cache_read_data(struct block_cache_private *priv, struct cache_entry *entr
         return 0;
     }
 
-    // Handle on-disk case
-    return s3b_dcache_read_block(priv->dcache, entry->u.dslot, dest, off, len);
+    // Handle on-disk case, using the memory tier copy if any
+    if (priv->mhashtable != NULL && (mentry = s3b_hash_get(priv->mhashtable, entry->block_num)) != NULL) {
+        memcpy(dest, (char *)mentry->data + off, len);
+        return 0;
+    }
+    assert(ENTRY_IO_READ_OK(entry));
+    entry->io_readers++;
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    r = s3b_dcache_read_block(priv->dcache, entry->u.dslot, dest, off, len);
+    pthread_mutex_lock(&priv->mutex);
+    entry->io_readers--;
+    block_cache_io_done(priv, entry);
+    return r;
 }
 
 /*
  * Write the data in a buffer to a cached block.
+ *
+ * This assumes the mutex is held; with a cache file, it is temporarily released during the write,
+ * while the entry is busy. The caller must ensure the entry is not ENTRY_IO_BUSY(), is in the
+ * hash table, and is not in state WRITING.
  */
 static int
 block_cache_write_data(struct block_cache_private *priv, struct cache_entry *entry, const void *src, u_int off, u_int len)
 {
     struct block_cache_conf *const config = priv->config;
+    int r;
 
     // Sanity check
     assert(off <= config->block_size);
@@ -1675,8 +4610,55 @@ block_cache_write_data(struct block_cache_private *priv, struct cache_entry *ent
         return 0;
     }
 
-    // Handle on-disk case
-    return s3b_dcache_write_block(priv->dcache, entry->u.dslot, src, off, len);
+    // Handle on-disk case, keeping any memory tier copy in sync
+    assert(!ENTRY_IO_BUSY(entry));
+    assert(s3b_hash_get(priv->hashtable, entry->block_num) == entry);
+    assert(ENTRY_GET_STATE(entry) == DIRTY || ENTRY_GET_STATE(entry) == WRITING2);
+    entry->io_writing = 1;
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    r = s3b_dcache_write_block(priv->dcache, entry->u.dslot, src, off, len);
+    pthread_mutex_lock(&priv->mutex);
+    entry->io_writing = 0;
+    block_cache_io_done(priv, entry);
+    if (priv->mhashtable != NULL)
+        block_cache_mtier_update(priv, entry, src, off, len, r);
+    return r;
+}
+
+/*
+ * Wake up the threads waiting for an entry that was busy reading or writing its data in the cache file.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+block_cache_io_done(struct block_cache_private *priv, struct cache_entry *entry)
+{
+    pthread_cond_broadcast(BLOCK_WAIT(priv, entry->block_num));
+    if (priv->evict_waiting && !ENTRY_IO_BUSY(entry)) {
+        priv->evict_waiting = 0;
+        pthread_cond_broadcast(&priv->space_avail);
+    }
+}
+
+/*
+ * Find the CLEAN[2] entry to evict next, if any: the least recently used one, normal priority before high, never
+ * pinned, and skipping any entries busy reading their data from the cache file.
+ *
+ * This assumes the mutex is held.
+ */
+static struct cache_entry *
+block_cache_evictable(struct block_cache_private *priv)
+{
+    struct cache_entry *entry;
+    u_int prio;
+
+    for (prio = 0; prio < BLOCK_CACHE_PRIO_PINNED; prio++) {
+        TAILQ_FOREACH(entry, &priv->cleans[prio], link) {
+            if (!ENTRY_IO_BUSY(entry))
+                return entry;
+        }
+    }
+    return NULL;
 }
 
 /*
@@ -1686,20 +4668,21 @@ block_cache_write_data(struct block_cache_private *priv, struct cache_entry *ent
 static double
 block_cache_dirty_ratio(struct block_cache_private *priv)
 {
-    struct block_cache_conf *const config = priv->config;
-
-    return (double)priv->num_dirties / (double)config->cache_size;
+    return (double)priv->num_dirties / (double)priv->target_size;
 }
 
 #ifndef NDEBUG
 
 // Accounting structure
 struct check_info {
+    struct block_cache_conf *config;
+    u_int   prio_blocks[BLOCK_CACHE_NUM_PRIOS];
     u_int   num_clean;
     u_int   num_dirty;
     u_int   num_reading;
     u_int   num_writing;
     u_int   num_writing2;
+    u_int   num_partial;
 };
 
 static void
@@ -1710,37 +4693,52 @@ block_cache_check_invariants(struct block_cache_private *priv, int allow_stoppin
     struct check_info info;
     int clean_len = 0;
     int dirty_len = 0;
+    u_int recover_len = 0;
+    u_int prio;
+    u_int i;
 
     // Check for stopping
     assert(allow_stopping || !priv->stopping);
 
     // Check CLEANs and CLEAN2s
-    for (entry = TAILQ_FIRST(&priv->lo_cleans); entry != NULL; entry = TAILQ_NEXT(entry, link)) {
-        assert(ENTRY_GET_STATE(entry) == CLEAN || ENTRY_GET_STATE(entry) == CLEAN2);
-        assert(s3b_hash_get(priv->hashtable, entry->block_num) == entry);
-        assert(!block_cache_high_prio(config, entry->block_num));
-        clean_len++;
-    }
-    for (entry = TAILQ_FIRST(&priv->hi_cleans); entry != NULL; entry = TAILQ_NEXT(entry, link)) {
-        assert(ENTRY_GET_STATE(entry) == CLEAN || ENTRY_GET_STATE(entry) == CLEAN2);
-        assert(s3b_hash_get(priv->hashtable, entry->block_num) == entry);
-        assert(block_cache_high_prio(config, entry->block_num));
-        clean_len++;
+    for (prio = 0; prio < BLOCK_CACHE_NUM_PRIOS; prio++) {
+        for (entry = TAILQ_FIRST(&priv->cleans[prio]); entry != NULL; entry = TAILQ_NEXT(entry, link)) {
+            assert(ENTRY_GET_STATE(entry) == CLEAN || ENTRY_GET_STATE(entry) == CLEAN2);
+            assert(s3b_hash_get(priv->hashtable, entry->block_num) == entry);
+            assert(block_cache_prio(config, entry->block_num) == prio);
+            clean_len++;
+        }
     }
     assert(clean_len == priv->num_cleans);
 
     // Check DIRTYs
     for (entry = TAILQ_FIRST(&priv->dirties); entry != NULL; entry = TAILQ_NEXT(entry, link)) {
         assert(ENTRY_GET_STATE(entry) == DIRTY);
+        assert(!entry->recovered);
         assert(s3b_hash_get(priv->hashtable, entry->block_num) == entry);
         dirty_len++;
     }
 
+    // Check recovered DIRTYs
+    for (entry = TAILQ_FIRST(&priv->recovers); entry != NULL; entry = TAILQ_NEXT(entry, link)) {
+        assert(ENTRY_GET_STATE(entry) == DIRTY);
+        assert(entry->recovered);
+        assert(s3b_hash_get(priv->hashtable, entry->block_num) == entry);
+        assert(TAILQ_NEXT(entry, link) == NULL || TAILQ_NEXT(entry, link)->block_num > entry->block_num);
+        recover_len++;
+        dirty_len++;
+    }
+    assert(recover_len == priv->num_recovers);
+
     // Check hash table size
-    assert(s3b_hash_size(priv->hashtable) <= config->cache_size);
+    assert(s3b_hash_size(priv->hashtable) + priv->num_unloaded <= priv->max_size);
+    assert(priv->num_unloaded == 0 || config->cache_file != NULL);
+    assert(priv->target_size > 0 && priv->target_size <= priv->max_size);
+    assert(!priv->shrink_pending || config->cache_file != NULL);
 
     // Check hash table entries
     memset(&info, 0, sizeof(info));
+    info.config = config;
     s3b_hash_foreach(priv->hashtable, block_cache_check_one, &info);
 
     // Check agreement
@@ -1749,9 +4747,68 @@ block_cache_check_invariants(struct block_cache_private *priv, int allow_stoppin
     assert(info.num_clean + info.num_dirty + info.num_reading + info.num_writing + info.num_writing2
       == s3b_hash_size(priv->hashtable));
     assert(priv->num_dirties == info.num_dirty + info.num_writing + info.num_writing2);
+    assert(info.num_partial == (priv->phashtable != NULL ? s3b_hash_size(priv->phashtable) : 0));
+    for (prio = 0; prio < BLOCK_CACHE_NUM_PRIOS; prio++)
+        assert(info.prio_blocks[prio] == priv->prio_blocks[prio]);
+
+    // Check compressed tier
+    if (priv->zhashtable != NULL) {
+        struct zcache_entry *zentry;
+        size_t zbytes = 0;
+        u_int zlen = 0;
+
+        for (zentry = TAILQ_FIRST(&priv->zlru); zentry != NULL; zentry = TAILQ_NEXT(zentry, link)) {
+            assert(s3b_hash_get(priv->zhashtable, zentry->block_num) == zentry);
+            assert(s3b_hash_get(priv->hashtable, zentry->block_num) == NULL);
+            zbytes += sizeof(*zentry) + zentry->zlen;
+            zlen++;
+        }
+        assert(zlen == s3b_hash_size(priv->zhashtable));
+        assert(zbytes == priv->zbytes);
+        assert(zbytes <= config->compress_size);
+    } else
+        assert(priv->zbytes == 0);
+
+    // Check memory tier
+    if (priv->mhashtable != NULL) {
+        struct mtier_entry *mentry;
+        u_int mlen = 0;
+
+        for (mentry = TAILQ_FIRST(&priv->mlru); mentry != NULL; mentry = TAILQ_NEXT(mentry, link)) {
+            assert(s3b_hash_get(priv->mhashtable, mentry->block_num) == mentry);
+            entry = s3b_hash_get(priv->hashtable, mentry->block_num);
+            assert(entry != NULL);
+            assert(ENTRY_GET_STATE(entry) != READING && ENTRY_GET_STATE(entry) != READING2);
+            assert(ENTRY_GET_STATE(entry) != CLEAN2);
+            mlen++;
+        }
+        assert(mlen == s3b_hash_size(priv->mhashtable));
+        assert(mlen <= priv->mmax);
+    }
+
+    // Check shared data buffers; only CLEAN entries may use them
+    if (priv->dhashtable != NULL) {
+        u_int refs = 0;
+
+        for (prio = 0; prio < BLOCK_CACHE_NUM_PRIOS; prio++) {
+            for (entry = TAILQ_FIRST(&priv->cleans[prio]); entry != NULL; entry = TAILQ_NEXT(entry, link))
+                refs += DEDUP_BUF(entry->u.data)->refs > 0;
+        }
+        for (entry = TAILQ_FIRST(&priv->dirties); entry != NULL; entry = TAILQ_NEXT(entry, link))
+            assert(DEDUP_BUF(entry->u.data)->refs == 0);
+        assert(refs == priv->dedup_refs);
+        assert(priv->dedup_bufs <= priv->dedup_refs);
+    } else
+        assert(priv->dedup_refs == 0 && priv->dedup_bufs == 0);
 
     // Check read-ahead
-    assert(priv->ra_count <= config->read_ahead);
+    for (i = 0; i < config->read_ahead_streams; i++) {
+        const struct ra_stream *const stream = &priv->ra_streams[i];
+
+        assert(stream->window >= config->read_ahead);
+        assert(stream->window <= config->read_ahead_max);
+        assert(stream->ra_count <= config->read_ahead_max);
+    }
 }
 
 static int
@@ -1761,6 +4818,21 @@ block_cache_check_one(void *arg, void *value)
     struct check_info *const info = arg;
 
     assert(entry != NULL);
+    assert(!entry->ra || ENTRY_GET_STATE(entry) == CLEAN);
+    assert(!entry->stored || !entry->verify);
+    assert(!entry->recovered || ENTRY_GET_STATE(entry) == DIRTY);
+    assert(!ENTRY_IO_BUSY(entry) || info->config->cache_file != NULL);
+    assert(!entry->io_writing || entry->io_readers == 0);
+    assert(!ENTRY_IO_BUSY(entry) || ENTRY_GET_STATE(entry) == CLEAN || ENTRY_GET_STATE(entry) == DIRTY
+      || ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+    assert(!entry->io_writing || ENTRY_GET_STATE(entry) != CLEAN);
+    info->prio_blocks[block_cache_prio(info->config, entry->block_num)]++;
+    assert(!entry->flushing || ENTRY_GET_STATE(entry) == DIRTY
+      || ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+    if (entry->partial) {
+        assert(ENTRY_GET_STATE(entry) == DIRTY || ENTRY_GET_STATE(entry) == WRITING || ENTRY_GET_STATE(entry) == WRITING2);
+        info->num_partial++;
+    }
     switch (ENTRY_GET_STATE(entry)) {
     case CLEAN:
     case CLEAN2:
@@ -34,26 +34,97 @@
  * also delete it here.
  */
 
+// Maximum number of read-ahead streams (see "ra_stream" in struct cache_entry)
+#define BLOCK_CACHE_MAX_READ_AHEAD_STREAMS      256
+
+// Number of buckets in the writeback batch size histogram (1, 2-3, 4-7, ..., 2^(N-1)+)
+#define BLOCK_CACHE_WRITE_BATCH_BUCKETS         6
+
+// Maximum assumed compression ratio, used to size the compressed tier's hash table
+#define BLOCK_CACHE_MAX_COMPRESSION_RATIO       16
+
+// Maximum number of cache files the disk cache can be striped across
+#define BLOCK_CACHE_MAX_FILES                   16
+
+// Block priority classes, in eviction order; pinned blocks are never evicted
+#define BLOCK_CACHE_PRIO_NORMAL                 0
+#define BLOCK_CACHE_PRIO_HIGH                   1
+#define BLOCK_CACHE_PRIO_PINNED                 2
+#define BLOCK_CACHE_NUM_PRIOS                   3
+
+// A range of blocks having a configured priority class
+struct block_cache_range {
+    s3b_block_t         min;                    // first block in range
+    s3b_block_t         max;                    // last block in range (inclusive)
+    u_int               prio;                   // BLOCK_CACHE_PRIO_*
+};
+
 // Configuration info structure for block_cache
 struct block_cache_conf {
     u_int               block_size;
+    s3b_block_t         num_blocks;
     u_int               cache_size;
+    u_int               max_size;               // cache file capacity for online resizing (if > cache_size)
     u_int               write_delay;
     u_int               max_dirty;
+    u_int               write_batch;
     u_int               synchronous;
     u_int               timeout;
     u_int               num_threads;
     u_int               read_ahead;
     u_int               read_ahead_trigger;
+    u_int               read_ahead_streams;
+    u_int               read_ahead_max;
+    u_int               read_ahead_reverse;
+    u_int               read_ahead_stride;
+    u_int               read_ahead_threads;
     u_int               no_verify;
     u_int               fadvise;
+    u_int               io_uring;
+    u_int               direct_io;
+    u_int               lazy_load;
+    u_int               stripe_hash;
+    u_int               defrag;
+    u_int               checksums;
+    u_int               trusted;
     u_int               recover_dirty_blocks;
     u_int               perform_flush;
+    u_int               recover_threads;
+    u_int               shutdown_threads;
+    u_int               shutdown_timeout;
     u_int               num_protected;
-    const char          *cache_file;
+    struct block_cache_range *ranges;           // sorted and non-overlapping
+    u_int               num_ranges;
+    u_int               min_size;
+    u_int               pressure;
+    const char          *pressure_file;
+    u_int               dedup;
+    u_int               skip_unchanged;
+    u_int               partial_writes;
+    size_t              compress_size;
+    size_t              memory_size;
+    const struct comp_alg *compress_alg;
+    void                *compress_level;
+    const char          *cache_file;            // first (or only) cache file
+    char                **cache_files;          // all cache files (more than one when striping)
+    u_int               num_cache_files;
     log_func_t          *log;
 };
 
+// Statistics for one cache file
+struct block_cache_file_stats {
+    u_int               size;
+    u_int               used;
+    u_int               reads;
+    u_int               writes;
+    double              read_rate;              // bytes per second
+    double              write_rate;             // bytes per second
+    double              read_latency;           // average microseconds
+    double              write_latency;          // average microseconds
+    uint64_t            reclaimed_bytes;        // disk space freed in the background
+    uint64_t            disk_bytes;             // disk space currently allocated
+};
+
 // Statistics structure for block_cache
 struct block_cache_stats {
     u_int               initial_size;
@@ -65,6 +136,55 @@ struct block_cache_stats {
     u_int               write_misses;
     u_int               verified;
     u_int               mismatch;
+    u_int               writes_skipped;
+    u_int               partial_blocks;
+    u_int               partial_fills;
+    u_int               partial_completed;
+    u_int               read_ahead_streams;
+    u_int               read_ahead_blocks;
+    u_int               read_ahead_hits;
+    u_int               read_ahead_reverse_hits;
+    u_int               read_ahead_stride_hits;
+    u_int               read_ahead_wasted;
+    u_int               read_ahead_window;
+    u_int               read_ahead_queue;
+    u_int               read_ahead_threads;
+    u_int               read_ahead_busy;
+    double              read_ahead_utilization;
+    u_int               writeback_queue;
+    u_int               writeback_busy;
+    double              writeback_utilization;
+    u_int               write_batches[BLOCK_CACHE_WRITE_BATCH_BUCKETS];
+    u_int               compressed_blocks;
+    uintmax_t           compressed_bytes;
+    double              compressed_ratio;
+    u_int               compressed_hits;
+    double              decompress_micros;
+    u_int               memory_blocks;
+    u_int               memory_hits;
+    u_int               disk_hits;
+    u_int               dedup_blocks;
+    u_int               dedup_buffers;
+    double              dedup_ratio;
+    u_int               prio_blocks[BLOCK_CACHE_NUM_PRIOS];
+    u_int               pinned_blocks;
+    u_int               preload_blocks;
+    u_int               target_size;
+    u_int               resize_shrinks;
+    u_int               resize_grows;
+    double              memory_pressure;
+    u_int               recover_total;
+    u_int               recover_written;
+    u_int               recover_remaining;
+    u_int               lazy_remaining;
+    u_int               lazy_on_demand;
+    u_int               defrag_moves;
+    u_int               shrink_moves;
+    u_int               shrink_remaining;
+    u_int               reclaim_pending;
+    u_int               checksum_errors;
+    u_int               num_files;
+    struct block_cache_file_stats files[BLOCK_CACHE_MAX_FILES];
     u_int               out_of_memory_errors;
 };
 
@@ -72,4 +192,5 @@ struct block_cache_stats {
 extern struct s3backer_store *block_cache_create(struct block_cache_conf *config, struct s3backer_store *inner);
 extern void block_cache_get_stats(struct s3backer_store *s3b, struct block_cache_stats *stats);
 extern void block_cache_clear_stats(struct s3backer_store *s3b);
+extern int block_cache_resize(struct s3backer_store *s3b, u_int size);
 
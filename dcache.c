@@ -60,22 +60,73 @@
  *  data slot #1
  *  ...
  *  data slot #N-1
+ *
+ * Crash consistency relies on the order in which directory entries and data reach the disk:
+ * a new entry must not be written until its data is on disk, and a dslot's data must not be
+ * overwritten until the erasure of its old entry is on disk. Directory entry updates are
+ * buffered and written out in batches, so that one fdatasync(2) covers many of them: erased
+ * entries are written, then the file is synced, then recorded entries are written. Dirty
+ * entries are written out before s3b_dcache_file_record_block() returns.
+ *
+ * Optionally (HDRFLG_CHECKSUMS), each directory entry for a clean block also holds a CRC-32 checksum
+ * of the block's data. Blocks left in the file by a previous run are verified against their checksums
+ * the first time they are read; a mismatch is reported as EBADMSG so the block can be fetched again.
+ * Such files are also marked (HDRFLG_CLEAN) when closed normally, and unmarked when next opened.
+ *
+ * The cache may be striped across several such files, e.g., on different devices. Each file
+ * is self-contained, holding its share of the total capacity, and the overall dslot numbers
+ * are interleaved: dslot N lives in file N % F as that file's dslot N / F.
+ *
+ * These functions may be called by multiple threads at once. Each file has a mutex protecting its state,
+ * which is not held while block data is being read or written, so transfers of different dslots, in the
+ * same file or in different files, proceed in parallel. The caller must make sure a dslot is not written
+ * while another thread is reading or writing it, and is not freed or moved while in use. Calls to
+ * s3b_dcache_alloc_block(), and calls to s3b_dcache_reclaim(), must each be made by one thread at a time.
+ *
+ * Where fallocate(2) can punch holes, disk space is reclaimed in the background rather than on the
+ * write path: writes always write all of their data, and the dslots that are freed (or were free at
+ * startup) or were written with some filesystem blocks starting with zeros are flagged (a cheap hint).
+ * s3b_dcache_reclaim() later deallocates each run of flagged unused dslots with one FALLOC_FL_PUNCH_HOLE,
+ * once their erasures are on disk, and reads back each flagged dslot in use to find and deallocate its
+ * runs of all-zero filesystem blocks. It does this without holding the file's mutex; meanwhile, writes
+ * to the dslots involved wait. If the filesystem doesn't support punching holes, reclamation is turned off.
  */
 
 // Definitions
 #define DCACHE_SIGNATURE            0xe496f17b
 #define ROUNDUP2(x, y)              (((x) + (y) - 1) & ~((y) - 1))
 #define DIRECTORY_READ_CHUNK        1024
+#define DIRECTORY_SCAN_THREADS      8               // max number of threads scanning the directory at startup
+#define DIRECTORY_SCAN_MIN          65536           // min number of directory entries per scan thread
 #define MIN_FILESYSTEM_BLOCK_SIZE   4096
+#define ZERO_PROBE_BYTES            16              // leading bytes checked to flag a filesystem block as possibly all zeros
+#define RING_ENTRIES                64              // io_uring submission queue depth
+#define RING_BUFFERS                8               // number of registered io_uring bounce buffers
+#define RING_BATCH_MAX              2               // max operations submitted together
+#define DIRECT_BOUNCE_MAX           8               // max number of idle O_DIRECT bounce buffers kept around
+#define DIR_BUFFER_MAX              256             // max number of buffered directory entry updates
+#define DIR_WRITE_MAX               65536           // max length of one coalesced directory write
+#define ALLOC_NEAR_WORDS            8               // how far past the preferred dslot to look (in free map words)
+#define ALLOC_SCAN_WORDS            1024            // how far to look for a completely free free map word
 
 #define HDR_SIZE(flags)             (((flags) & HDRFLG_NEW_FORMAT) == 0 ? sizeof(struct ofile_header) : sizeof(struct file_header))
-#define DIR_ENTSIZE(flags)          (((flags) & HDRFLG_NEW_FORMAT) == 0 ? sizeof(struct odir_entry) : sizeof(struct dir_entry))
+#define DIR_ENTSIZE(flags)          (((flags) & HDRFLG_NEW_FORMAT) == 0 ? sizeof(struct odir_entry) :                 \
+                                      ((flags) & HDRFLG_CHECKSUMS) == 0 ? offsetof(struct dir_entry, checksum) :       \
+                                      sizeof(struct dir_entry))
 #define DIR_OFFSET(flags, dslot)    ((off_t)HDR_SIZE(flags) + (off_t)(dslot) * DIR_ENTSIZE(flags))
 #define DATA_OFFSET(priv, dslot)    ((off_t)(priv)->data + (off_t)(dslot) * (priv)->block_size)
+#define LOAD_BUCKET_SIZE            1024            // max average number of entries per load index bucket
+#define LOAD_BUCKET(priv, block_num) ((u_int)(((uint64_t)(block_num) * 0x9e3779b97f4a7c15ULL) >> (64 - (priv)->load_bucket_bits)))
+#define STRIPE_HASH(dcache, block_num) ((u_int)(((uint64_t)(block_num) * 0x9e3779b97f4a7c15ULL) >> 32) % (dcache)->num_files)
+#define DSLOT(dcache, index, fslot) ((fslot) * (dcache)->num_files + (index))
+#define DSLOT_FILE(dcache, dslot)   ((dcache)->files[(dslot) % (dcache)->num_files])
+#define DSLOT_FSLOT(dcache, dslot)  ((dslot) / (dcache)->num_files)
 
 // Bits for file_header.flags
 #define HDRFLG_NEW_FORMAT           0x00000001
-#define HDRFLG_MASK                 0x00000001
+#define HDRFLG_CHECKSUMS            0x00000002      // directory entries include data checksums
+#define HDRFLG_CLEAN                0x00000004      // file was closed normally (checksum format only)
+#define HDRFLG_MASK                 0x00000007
 
 // Bits for dir_entry.flags
 #define ENTFLG_DIRTY                0x00000001
@@ -118,52 +169,235 @@ struct dir_entry {
     s3b_block_t                     block_num;
     u_char                          etag[MD5_DIGEST_LENGTH];
     uint32_t                        flags;
+    uint32_t                        checksum;           // CRC-32 of clean block's data (HDRFLG_CHECKSUMS only)
 } __attribute__ ((packed));
 
-// Private structure
-struct s3b_dcache {
+// One io_uring operation
+struct ring_op {
+    struct ring_batch               *batch;             // batch containing this operation
+    u_char                          opcode;             // IORING_OP_READ, IORING_OP_WRITE, or IORING_OP_FSYNC
+    uintptr_t                       addr;               // caller's buffer
+    u_int                           len;                // length of the transfer
+    off_t                           offset;             // file offset
+    int                             buf_index;          // registered buffer index, or -1 if none
+    int                             res;                // result from the completion queue entry
+};
+
+// A batch of io_uring operations submitted together and executed in order
+struct ring_batch {
+    struct ring_op                  ops[RING_BATCH_MAX];
+    u_int                           num_ops;
+    u_int                           pending;            // number of operations not yet completed
+};
+
+// io_uring(7) state; the thread that waits for completions on behalf of everyone is the "reaper"
+struct dcache_ring {
+    int                             fd;
+    pthread_mutex_t                 mutex;
+    pthread_cond_t                  cond;               // signaled after completions are reaped
+    int                             reaping;            // some thread is the reaper
+    u_int                           in_flight;          // number of submitted but unreaped operations
+    u_int                           sq_entries;
+    u_int                           *sq_tail;
+    u_int                           *sq_mask;
+    u_int                           *sq_array;
+    struct io_uring_sqe             *sqes;
+    u_int                           *cq_head;
+    u_int                           *cq_tail;
+    u_int                           *cq_mask;
+    struct io_uring_cqe             *cqes;
+    void                            *sq_ptr;
+    size_t                          sq_len;
+    void                            *cq_ptr;
+    size_t                          cq_len;
+    size_t                          sqes_len;
+    int                             fixed_file;         // cache file is registered as fixed file #0
+    char                            *bufs;              // registered bounce buffers, or NULL if none
+    u_int                           buf_size;
+    u_int                           free_bufs;          // bit mask of free bounce buffers
+};
+
+// One buffered directory entry update
+struct dir_update {
+    u_int                           dslot;
+    struct dir_entry                entry;
+};
+
+// Lazy loading index entry
+struct load_entry {
+    s3b_block_t                     block_num;
+    u_int                           dslot;
+};
+
+// One directory scan thread's share of the directory
+struct dcache_scan {
+    struct dcache_file              *priv;
+    bitmap_t                        *used;              // non-empty dslots
+    bitmap_t                        *dirty;             // dirty dslots
+    u_int                           min_dslot;          // first dslot (a multiple of DIRECTORY_READ_CHUNK)
+    u_int                           max_dslot;          // one past the last dslot
+    u_int                           *counts;            // per load index bucket: # clean dslots, then next fill position
+    int                             fill;               // second pass: fill in the load index
+    pthread_t                       thread;
+    int                             error;
+};
+
+// One cache file
+struct dcache_file {
     int                             fd;
+    int                             dfd;                // O_DIRECT descriptor for the data area, or -1 if none
     log_func_t                      *log;
     char                            *filename;
     u_int                           block_size;
     u_int                           max_blocks;
     u_int                           num_alloc;
     u_int                           fadvise;
-    uint32_t                        flags;              // copy of file_header.flags
+    uint32_t                        flags;              // copy of file_header.flags (except HDRFLG_CLEAN)
+    u_int                           want_checksums;     // create or convert the file to include checksums
+    int                             mark_clean;         // set HDRFLG_CLEAN when closed
+    uint32_t                        *checksums;         // data checksum for each dslot (HDRFLG_CHECKSUMS only)
+    bitmap_t                        *checksum_ok;       // dslots whose "checksums" entry is current
+    bitmap_t                        *unverified;        // clean dslots from a previous run not yet verified
     off_t                           data;
     off_t                           file_size;
     u_int                           file_block_size;
-    u_int                           free_list_len;
-    u_int                           free_list_alloc;
-    s3b_block_t                     *free_list;
+    bitmap_t                        *free_map;          // free dslots below "limit"
+    u_int                           num_free;
+    u_int                           limit;              // dslots at or beyond this are not allocated (online shrink)
+    bitmap_t                        *parked;            // free dslots at or beyond "limit", or NULL if never shrunk
+    u_int                           num_parked;
+    bitmap_t                        *reclaim;           // dslots with disk space to reclaim, or NULL if not reclaiming
+    u_int                           num_reclaim;
+    u_int                           reclaim_cursor;     // where s3b_dcache_file_reclaim() resumes
+    u_int                           reclaim_start;      // dslots whose disk space is being reclaimed, up to...
+    u_int                           reclaim_end;        // ...but not including this one
+    pthread_cond_t                  reclaim_done;       // signaled when those dslots are no longer being reclaimed
+    u_int                           free_low;           // free map words before this one are all zero
+    u_int                           free_cursor;        // where the search for a completely free word resumes
+    bitmap_t                        *writing;           // dslots being written
+    pthread_mutex_t                 mutex;              // protects what changes after opening, except the bounce pool
+    struct dcache_ring              *ring;              // io_uring engine, or NULL for pread(2)/pwrite(2)
+    pthread_mutex_t                 bounce_mutex;       // protects the bounce buffer pool
+    void                            *bounce[DIRECT_BOUNCE_MAX];     // idle O_DIRECT bounce buffers
+    u_int                           num_bounce;
+    char                            *dir;               // memory mapped header and directory, or NULL if not mapped
+    size_t                          dir_len;
+    bitmap_t                        *unloaded;          // clean dslots not yet visited (lazy loading), or NULL
+    u_int                           num_unloaded;
+    u_int                           load_cursor;        // where s3b_dcache_file_load_next() resumes
+    struct load_entry               *load_index;        // clean dslots at startup, grouped into buckets by block number
+    u_int                           *load_buckets;      // offset of each load index bucket, plus one for the end
+    u_int                           load_bucket_bits;   // log2 of the number of load index buckets
+    struct dir_update               *dir_buf;           // directory entry updates not yet written
+    u_int                           dir_buf_len;
+    bitmap_t                        *dir_pending;       // dslots having an update in dir_buf
+    char                            *dir_write;         // buffer for coalescing directory writes
+};
+
+// Striped cache files; the dslots in file #i are the dslots congruent to i modulo the number of files
+struct s3b_dcache {
+    u_int                           num_files;
+    struct dcache_file              **files;
+    struct s3b_dcache_stats         *stats;             // per-file statistics, each protected by that file's mutex
+    u_int                           stripe_hash;        // choose files by block number hash instead of round-robin
+    u_int                           next_file;          // where the next round-robin allocation starts
+    u_int                           next_reclaim;       // which file s3b_dcache_reclaim() tries first
+};
+
+// Visitor context for one cache file
+struct dcache_visit {
+    struct s3b_dcache               *dcache;
+    u_int                           index;
+    s3b_dcache_visit_t              *visitor;
+    void                            *arg;
 };
 
 // Internal functions
-static int s3b_dcache_write_entry(struct s3b_dcache *priv, u_int dslot, const struct dir_entry *entry);
+static s3b_dcache_visit_t s3b_dcache_visit;
+static uint64_t s3b_dcache_get_time_micros(void);
+static int s3b_dcache_file_open(struct dcache_file **dcachep, struct block_cache_conf *config,
+  s3b_dcache_visit_t *visitor, void *arg, u_int visit_dirty);
+static void s3b_dcache_file_close(struct dcache_file *priv);
+static int s3b_dcache_file_has_mount_token(struct dcache_file *priv);
+static int s3b_dcache_file_set_mount_token(struct dcache_file *priv, int32_t *old_valuep, int32_t new_value);
+static u_int s3b_dcache_file_size(struct dcache_file *priv);
+static u_int s3b_dcache_file_num_unloaded(struct dcache_file *priv);
+static int s3b_dcache_file_load_next(struct dcache_file *priv, u_int max, s3b_dcache_visit_t *visitor, void *arg);
+static int s3b_dcache_file_load_block(struct dcache_file *priv, s3b_block_t block_num, s3b_dcache_visit_t *visitor, void *arg);
+static int s3b_dcache_file_alloc_block(struct dcache_file *priv, u_int near, u_int *dslotp);
+static int s3b_dcache_file_alloc_at(struct dcache_file *priv, u_int dslot);
+static int s3b_dcache_file_set_limit(struct dcache_file *priv, u_int limit);
+static int s3b_dcache_file_reclaim(struct dcache_file *priv, void *buf, u_int max, uint64_t *reclaimedp);
+static int s3b_dcache_file_verify_block(struct dcache_file *priv, u_int dslot, void *buf);
+static int s3b_dcache_file_get_checksum(struct dcache_file *priv, u_int dslot, uint32_t *checksump);
+static uint32_t s3b_dcache_checksum(struct dcache_file *priv, const void *data);
+static int s3b_dcache_set_clean(struct dcache_file *priv, int clean);
+static int s3b_dcache_file_record_block(struct dcache_file *priv, u_int dslot, s3b_block_t block_num, const u_char *etag);
+static int s3b_dcache_file_erase_block(struct dcache_file *priv, u_int dslot);
+static int s3b_dcache_file_free_block(struct dcache_file *priv, u_int dslot);
+static int s3b_dcache_file_read_block(struct dcache_file *priv, u_int dslot, void *dest, u_int off, u_int len);
+static int s3b_dcache_file_write_block(struct dcache_file *priv, u_int dslot, const void *src, u_int off, u_int len);
+static int s3b_dcache_write_block_simple(struct dcache_file *priv, u_int dslot, const void *src, u_int off, u_int len);
+static void s3b_dcache_fadvise(struct dcache_file *priv, u_int dslot);
+static int s3b_dcache_file_fsync(struct dcache_file *priv);
+static int s3b_dcache_write_entry(struct dcache_file *priv, u_int dslot, const struct dir_entry *entry);
+static int s3b_dcache_update_entry(struct dcache_file *priv, u_int dslot, const struct dir_entry *entry);
+static struct dir_update *s3b_dcache_find_update(struct dcache_file *priv, u_int dslot);
+static int s3b_dcache_commit(struct dcache_file *priv, int sync);
+static int s3b_dcache_commit_write(struct dcache_file *priv, int erased);
+static int s3b_dcache_update_is_erase(const struct dir_update *update);
+static int s3b_dcache_update_cmp(const void *ptr1, const void *ptr2);
+static void s3b_dcache_fdatasync(struct dcache_file *priv);
+static int s3b_dcache_read_entry(struct dcache_file *priv, u_int dslot, struct dir_entry *entryp);
 #ifndef NDEBUG
-static int s3b_dcache_entry_is_empty(struct s3b_dcache *priv, u_int dslot);
-static int s3b_dcache_entry_write_ok(struct s3b_dcache *priv, u_int dslot, s3b_block_t block_num, u_int dirty);
-static int s3b_dcache_read_entry(struct s3b_dcache *priv, u_int dslot, struct dir_entry *entryp);
+static int s3b_dcache_entry_is_empty(struct dcache_file *priv, u_int dslot);
+static int s3b_dcache_entry_write_ok(struct dcache_file *priv, u_int dslot, s3b_block_t block_num, u_int dirty);
 #endif
-static int s3b_dcache_create_file(struct s3b_dcache *priv, int *fdp, const char *filename, u_int max_blocks,
+static int s3b_dcache_create_file(struct dcache_file *priv, int *fdp, const char *filename, u_int max_blocks,
             struct file_header *headerp);
-static int s3b_dcache_resize_file(struct s3b_dcache *priv, const struct file_header *header);
-static int s3b_dcache_init_free_list(struct s3b_dcache *priv, s3b_dcache_visit_t *visitor, void *arg, u_int visit_dirty);
-static int s3b_dcache_push(struct s3b_dcache *priv, u_int dslot);
-static void s3b_dcache_pop(struct s3b_dcache *priv, u_int *dslotp);
-static int s3b_dcache_read(struct s3b_dcache *priv, off_t offset, void *data, size_t len);
-static int s3b_dcache_write(struct s3b_dcache *priv, off_t offset, const void *data, size_t len);
-static int s3b_dcache_write2(struct s3b_dcache *priv, int fd, const char *filename, off_t offset, const void *data, size_t len);
+static int s3b_dcache_resize_file(struct dcache_file *priv, const struct file_header *header);
+static int s3b_dcache_init_free_map(struct dcache_file *priv, s3b_dcache_visit_t *visitor, void *arg, u_int visit_dirty,
+            u_int lazy);
+static void s3b_dcache_map_dir(struct dcache_file *priv);
+static int s3b_dcache_scan_dir(struct dcache_file *priv, bitmap_t *used, bitmap_t *dirty);
+static int s3b_dcache_scan_run(struct dcache_file *priv, struct dcache_scan *scans, u_int num_scans);
+static void *s3b_dcache_scan_main(void *arg);
+static int s3b_dcache_load_slot(struct dcache_file *priv, u_int dslot, s3b_dcache_visit_t *visitor, void *arg);
+static void s3b_dcache_load_done(struct dcache_file *priv);
+static int s3b_dcache_read(struct dcache_file *priv, off_t offset, void *data, size_t len);
+static int s3b_dcache_write(struct dcache_file *priv, off_t offset, const void *data, size_t len);
+static int s3b_dcache_write2(struct dcache_file *priv, int fd, const char *filename, off_t offset, const void *data, size_t len);
+static void s3b_dcache_direct_open(struct dcache_file *priv);
+static int s3b_dcache_direct_read(struct dcache_file *priv, off_t offset, void *data, size_t len);
+static int s3b_dcache_direct_write(struct dcache_file *priv, off_t offset, const void *data, size_t len);
+static int s3b_dcache_direct_xfer(struct dcache_file *priv, int write, off_t offset, void *buf, size_t len, int zero_fill);
+static void *s3b_dcache_bounce_get(struct dcache_file *priv);
+static void s3b_dcache_bounce_put(struct dcache_file *priv, void *buf);
 
 // fallocate(2) stuff
 #if HAVE_DECL_FALLOCATE && HAVE_DECL_FALLOC_FL_PUNCH_HOLE && HAVE_DECL_FALLOC_FL_KEEP_SIZE
 #define USE_FALLOCATE   1
 #endif
+static void s3b_dcache_set_reclaim(struct dcache_file *priv, u_int dslot, int value);
 #if USE_FALLOCATE
-static int s3b_dcache_write_block_falloc(struct s3b_dcache *priv, u_int dslot, const char *src, u_int doff, u_int len);
-static u_int s3b_dcache_count_zero_fs_blocks(struct s3b_dcache *priv, const char *src, u_int len);
-#else
-static int s3b_dcache_write_block_simple(struct s3b_dcache *priv, u_int dslot, const void *src, u_int off, u_int len);
+static int s3b_dcache_dslot_unused(struct dcache_file *priv, u_int dslot);
+static int s3b_dcache_reclaim_zeros(struct dcache_file *priv, u_int dslot, char *buf);
+static int s3b_dcache_may_have_zero_fs_block(struct dcache_file *priv, off_t offset, const char *src, u_int len);
+static u_int s3b_dcache_count_zero_fs_blocks(struct dcache_file *priv, const char *src, u_int len);
+static int s3b_dcache_punch(struct dcache_file *priv, off_t offset, off_t len);
+#endif
+
+// io_uring(7) stuff
+#if HAVE_LINUX_IO_URING_H && HAVE_DECL___NR_IO_URING_SETUP && HAVE_DECL___NR_IO_URING_ENTER && HAVE_DECL___NR_IO_URING_REGISTER
+#define USE_IO_URING    1
+#endif
+#if USE_IO_URING
+static int s3b_dcache_ring_open(struct dcache_file *priv);
+static void s3b_dcache_ring_close(struct dcache_file *priv);
+static void s3b_dcache_ring_prep(struct ring_batch *batch, u_char opcode, off_t offset, uintptr_t addr, u_int len);
+static int s3b_dcache_ring_submit(struct dcache_file *priv, struct ring_batch *batch);
+static int s3b_dcache_ring_result(struct dcache_file *priv, const struct ring_op *op, size_t *donep);
+static void s3b_dcache_ring_reap(struct dcache_ring *ring);
 #endif
 
 // Internal variables
@@ -171,673 +405,2089 @@ static const struct dir_entry zero_entry;
 
 // Public functions
 
+/*
+ * Open the cache file(s). The cache is striped across multiple files when "config->cache_files"
+ * has more than one, each file getting its share of the total capacity.
+ */
 int
 s3b_dcache_open(struct s3b_dcache **dcachep, struct block_cache_conf *config,
   s3b_dcache_visit_t *visitor, void *arg, u_int visit_dirty)
 {
-    struct ofile_header oheader;
-    struct file_header header;
-    struct s3b_dcache *priv;
-#if HAVE_SYS_STATVFS_H
-    struct statvfs vfs;
-#endif
-    struct stat sb;
+    const u_int capacity = config->max_size > config->cache_size ? config->max_size : config->cache_size;
+    struct block_cache_conf file_config;
+    struct dcache_visit visit;
+    struct s3b_dcache *dcache;
+    u_int i = 0;
     int r;
 
     // Sanity check
-    if (config->cache_size == 0)
+    if (capacity == 0 || config->num_cache_files == 0)
         return EINVAL;
 
-    // Initialize private structure
-    if ((priv = malloc(sizeof(*priv))) == NULL)
+    // Initialize structure
+    if ((dcache = calloc(1, sizeof(*dcache))) == NULL)
         return errno;
-    memset(priv, 0, sizeof(*priv));
-    priv->fd = -1;
-    priv->log = config->log;
-    priv->block_size = config->block_size;
-    priv->max_blocks = config->cache_size;
-    priv->fadvise = config->fadvise;
-    if ((priv->filename = strdup(config->cache_file)) == NULL) {
-        r = errno;
-        goto fail1;
-    }
-
-    // Create cache file if it doesn't already exist
-    if (stat(priv->filename, &sb) == -1 && errno == ENOENT) {
-        (*priv->log)(LOG_NOTICE, "creating new cache file \"%s\" with capacity %u blocks", priv->filename, priv->max_blocks);
-        if ((r = s3b_dcache_create_file(priv, &priv->fd, priv->filename, priv->max_blocks, NULL)) != 0)
-            goto fail2;
-        (void)close(priv->fd);
-        priv->fd = -1;
-    }
-
-retry:
-    // Open cache file
-    assert(priv->fd == -1);
-    if ((priv->fd = open(priv->filename, O_RDWR|O_CLOEXEC, 0)) == -1) {
-        r = errno;
-        (*priv->log)(LOG_ERR, "can't open cache file \"%s\": %s", priv->filename, strerror(r));
-        goto fail2;
-    }
-
-    // Get file info
-    if (fstat(priv->fd, &sb) == -1) {
-        r = errno;
-        goto fail3;
-    }
-    priv->file_size = sb.st_size;
-
-    // Get filesystem block size, but if not supported force into a reasonable value
-    priv->file_block_size = (u_int)sb.st_blksize;
-    if (priv->file_block_size < MIN_FILESYSTEM_BLOCK_SIZE)
-        priv->file_block_size = MIN_FILESYSTEM_BLOCK_SIZE;
-    if (priv->file_block_size > priv->block_size
-      || priv->file_block_size != ((u_int)1 << (ffs(priv->file_block_size) - 1)))  // must be a power of 2
-        priv->file_block_size = priv->block_size;
-
-    // Read in header with backward compatible support for older header format
-    if (sb.st_size < sizeof(oheader)) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": file is truncated (size %ju < %u)",
-          priv->filename, (uintmax_t)sb.st_size, (u_int)sizeof(oheader));
-        r = EINVAL;
-        goto fail3;
-    }
-    if ((r = s3b_dcache_read(priv, (off_t)0, &oheader, sizeof(oheader))) != 0) {
-        (*priv->log)(LOG_ERR, "can't read cache file \"%s\" header: %s", priv->filename, strerror(r));
-        goto fail3;
-    }
-    switch (oheader.header_size) {
-    case sizeof(oheader):                               // old format
-        memset(&header, 0, sizeof(header));
-        memcpy(&header, &oheader, sizeof(oheader));
-        break;
-    case sizeof(header):                                // new format
-        if ((r = s3b_dcache_read(priv, (off_t)0, &header, sizeof(header))) != 0) {
-            (*priv->log)(LOG_ERR, "can't read cache file \"%s\" header: %s", priv->filename, strerror(r));
-            goto fail3;
-        }
-        break;
-    default:
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": %s %d", priv->filename, "invalid header size", (int)oheader.header_size);
+    dcache->stripe_hash = config->stripe_hash;
+    dcache->num_files = config->num_cache_files;
+    if (dcache->num_files > BLOCK_CACHE_MAX_FILES || dcache->num_files > capacity) {
         r = EINVAL;
-        goto fail3;
-    }
-
-    // Verify header - all but number of blocks
-    r = EINVAL;
-    if (header.signature != DCACHE_SIGNATURE) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": wrong signature %08x != %08x",
-          priv->filename, header.signature, DCACHE_SIGNATURE);
-        goto fail3;
-    }
-    if (header.header_size != HDR_SIZE(header.flags)) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": %s %d != %d",
-          priv->filename, "invalid header size", (int)header.header_size, (int)HDR_SIZE(header.flags));
-        goto fail3;
-    }
-    if (header.u_int_size != sizeof(u_int)) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": created with sizeof(u_int) %u != %u",
-          priv->filename, header.u_int_size, (u_int)sizeof(u_int));
-        goto fail3;
-    }
-    if (header.s3b_block_t_size != sizeof(s3b_block_t)) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": created with sizeof(s3b_block_t) %u != %u",
-          priv->filename, header.s3b_block_t_size, (u_int)sizeof(s3b_block_t));
-        goto fail3;
-    }
-    if (header.block_size != priv->block_size) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": created with block size %u != %u",
-          priv->filename, header.block_size, priv->block_size);
-        goto fail3;
-    }
-    if (header.data_align != getpagesize()) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": created with alignment %u != %u",
-          priv->filename, header.data_align, getpagesize());
-        goto fail3;
-    }
-    if ((header.flags & ~HDRFLG_MASK) != 0) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": %s", priv->filename, "unrecognized flags present");
-        goto fail3;
+        goto fail;
     }
-    priv->flags = header.flags;
-
-    // Check number of blocks, shrinking or expanding if necessary
-    if (header.max_blocks != priv->max_blocks) {
-        (*priv->log)(LOG_NOTICE, "cache file \"%s\" was created with capacity %u != %u blocks, automatically %s",
-          priv->filename, header.max_blocks, priv->max_blocks, header.max_blocks < priv->max_blocks ?
-           "expanding" : "shrinking");
-        if ((r = s3b_dcache_resize_file(priv, &header)) != 0)
-            goto fail3;
-        (*priv->log)(LOG_INFO, "successfully resized cache file \"%s\" from %u to %u blocks",
-          priv->filename, header.max_blocks, priv->max_blocks);
-        goto retry;
+    if ((dcache->files = calloc(dcache->num_files, sizeof(*dcache->files))) == NULL
+      || (dcache->stats = calloc(dcache->num_files, sizeof(*dcache->stats))) == NULL) {
+        r = errno;
+        goto fail;
     }
 
-    // Verify file's directory is not truncated
-    if (sb.st_size < DIR_OFFSET(priv->flags, priv->max_blocks)) {
-        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": file is truncated (size %ju < %ju)",
-          priv->filename, (uintmax_t)sb.st_size, (uintmax_t)DIR_OFFSET(priv->flags, priv->max_blocks));
-        goto fail3;
+    // Open each file with its share of the capacity; with online resizing, that's the maximum size
+    for (i = 0; i < dcache->num_files; i++) {
+        memcpy(&file_config, config, sizeof(file_config));
+        file_config.cache_file = config->cache_files[i];
+        file_config.cache_size = capacity / dcache->num_files + (i < capacity % dcache->num_files);
+        file_config.max_size = 0;
+        visit.dcache = dcache;
+        visit.index = i;
+        visit.visitor = visitor;
+        visit.arg = arg;
+        if ((r = s3b_dcache_file_open(&dcache->files[i], &file_config,
+          visitor != NULL ? s3b_dcache_visit : NULL, &visit, visit_dirty)) != 0)
+            goto fail;
     }
 
-    // Compute offset of first data block
-    priv->data = ROUNDUP2(DIR_OFFSET(priv->flags, priv->max_blocks), header.data_align);
+    // Done
+    *dcachep = dcache;
+    return 0;
 
-    // Read the directory to build the free list and visit allocated blocks
-    if (visitor != NULL && (r = s3b_dcache_init_free_list(priv, visitor, arg, visit_dirty)) != 0)
-        goto fail3;
+fail:
+    while (i-- > 0)
+        s3b_dcache_file_close(dcache->files[i]);
+    free(dcache->stats);
+    free(dcache->files);
+    free(dcache);
+    return r;
+}
 
-#if HAVE_SYS_STATVFS_H
+/*
+ * Determine whether any of the cache file(s) exist.
+ *
+ * Returns zero if so, ENOENT if not, or other error.
+ */
+int
+s3b_dcache_exists(const struct block_cache_conf *config)
+{
+    struct stat sb;
+    int r = ENOENT;
+    u_int i;
 
-    // Warn if insufficient disk space exists on the partition
-    if (fstatvfs(priv->fd, &vfs) == 0) {
-        const uintmax_t free = (uintmax_t)vfs.f_bavail * (uintmax_t)vfs.f_bsize;
-        const uintmax_t need = (uintmax_t)DATA_OFFSET(priv, priv->max_blocks);
-        const uintmax_t used = (uintmax_t)sb.st_blocks * 512;
+    for (i = 0; i < config->num_cache_files && r == ENOENT; i++)
+        r = stat(config->cache_files[i], &sb) == 0 ? 0 : errno;
+    return r;
+}
 
-        if (need >= used + free) {
-            char needbuf[64];
-            char freebuf[64];
+/*
+ * Determine whether all of the cache file(s) include checksums and were closed normally the last time they were used.
+ */
+int
+s3b_dcache_trusted(const struct block_cache_conf *config)
+{
+    struct file_header header;
+    int trusted = 1;
+    u_int i;
+    int fd;
 
-            describe_size(needbuf, sizeof(needbuf), need);
-            describe_size(freebuf, sizeof(freebuf), used + free);
-            (*priv->log)(LOG_WARNING,
-              "cache file \"%s\" will have size %s when completely full, but only %s is available in partition",
-              priv->filename, needbuf, freebuf);
+    for (i = 0; i < config->num_cache_files && trusted; i++) {
+        if ((fd = open(config->cache_files[i], O_RDONLY|O_CLOEXEC)) == -1) {
+            trusted = 0;
+            break;
         }
+        trusted = pread(fd, &header, sizeof(header), 0) == sizeof(header)
+          && header.signature == DCACHE_SIGNATURE
+          && header.header_size == sizeof(header)
+          && (header.flags & (HDRFLG_CHECKSUMS|HDRFLG_CLEAN)) == (HDRFLG_CHECKSUMS|HDRFLG_CLEAN);
+        (void)close(fd);
     }
+    return trusted;
+}
 
-#endif
-
-    // Done
-    *dcachep = priv;
-    return 0;
+void
+s3b_dcache_close(struct s3b_dcache *dcache)
+{
+    u_int i;
 
-fail3:
-    close(priv->fd);
-fail2:
-    free(priv->filename);
-fail1:
-    free(priv->free_list);
-    free(priv);
-    return r;
+    for (i = 0; i < dcache->num_files; i++)
+        s3b_dcache_file_close(dcache->files[i]);
+    free(dcache->stats);
+    free(dcache->files);
+    free(dcache);
 }
 
 int
-s3b_dcache_has_mount_token(struct s3b_dcache *priv)
+s3b_dcache_has_mount_token(struct s3b_dcache *dcache)
 {
-    return (priv->flags & HDRFLG_NEW_FORMAT) != 0;
+    u_int i;
+
+    for (i = 0; i < dcache->num_files; i++) {
+        if (!s3b_dcache_file_has_mount_token(dcache->files[i]))
+            return 0;
+    }
+    return 1;
 }
 
+/*
+ * Read and/or write the mount token. When striping, the token is written to every file,
+ * and the value read is the first non-zero token found, if any.
+ */
 int
-s3b_dcache_set_mount_token(struct s3b_dcache *priv, int32_t *old_valuep, int32_t new_value)
+s3b_dcache_set_mount_token(struct s3b_dcache *dcache, int32_t *old_valuep, int32_t new_value)
 {
+    int32_t old_value;
+    u_int i;
     int r;
 
-    // Read old value
-    if (old_valuep != NULL) {
-        if ((r = s3b_dcache_read(priv, offsetof(struct file_header, mount_token), old_valuep, sizeof(*old_valuep))) != 0)
-            return r;
-    }
-
-    // Write new value
-    if (new_value >= 0) {
+    if (old_valuep != NULL)
+        *old_valuep = 0;
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
 
-        // Update file
-        if ((r = s3b_dcache_write(priv, offsetof(struct file_header, mount_token), &new_value, sizeof(new_value))) != 0)
+        pthread_mutex_lock(&priv->mutex);
+        r = s3b_dcache_file_set_mount_token(priv, old_valuep != NULL ? &old_value : NULL, new_value);
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        if (r != 0)
             return r;
-
-        // Sync to disk
-        s3b_dcache_fsync(priv);
+        if (old_valuep != NULL && *old_valuep == 0)
+            *old_valuep = old_value;
     }
-
-    // Done
     return 0;
 }
 
-void
-s3b_dcache_close(struct s3b_dcache *priv)
+u_int
+s3b_dcache_size(struct s3b_dcache *dcache)
 {
-    close(priv->fd);
-    free(priv->filename);
-    free(priv->free_list);
-    free(priv);
+    u_int size = 0;
+    u_int i;
+
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
+
+        pthread_mutex_lock(&priv->mutex);
+        size += s3b_dcache_file_size(priv);
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    }
+    return size;
 }
 
 u_int
-s3b_dcache_size(struct s3b_dcache *priv)
+s3b_dcache_num_unloaded(struct s3b_dcache *dcache)
 {
-    return priv->num_alloc;
+    u_int num_unloaded = 0;
+    u_int i;
+
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
+
+        pthread_mutex_lock(&priv->mutex);
+        num_unloaded += s3b_dcache_file_num_unloaded(priv);
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    }
+    return num_unloaded;
 }
 
 /*
- * Allocate a dslot for a block's data. We don't record this block in the directory yet;
- * that is done by s3b_dcache_record_block().
+ * Visit up to "max" of the clean blocks that were not visited when the cache file(s) were opened.
+ *
+ * If the visitor fails, that block's dslot is freed. The visitor must not call any of these functions.
  */
 int
-s3b_dcache_alloc_block(struct s3b_dcache *priv, u_int *dslotp)
+s3b_dcache_load_next(struct s3b_dcache *dcache, u_int max, s3b_dcache_visit_t *visitor, void *arg)
 {
-    // Any free dslots?
-    if (priv->free_list_len == 0)
-        return ENOMEM;
-
-    // Pop off the next free dslot
-    s3b_dcache_pop(priv, dslotp);
+    struct dcache_visit visit;
+    u_int i;
+    int r;
 
-    // Directory entry should be empty
-    assert(s3b_dcache_entry_is_empty(priv, *dslotp));
+    for (i = 0; i < dcache->num_files && max > 0; i++) {
+        struct dcache_file *const file = dcache->files[i];
+        u_int before;
 
-    // Done
-    priv->num_alloc++;
+        pthread_mutex_lock(&file->mutex);
+        if ((before = s3b_dcache_file_num_unloaded(file)) == 0) {
+            CHECK_RETURN(pthread_mutex_unlock(&file->mutex));
+            continue;
+        }
+        visit.dcache = dcache;
+        visit.index = i;
+        visit.visitor = visitor;
+        visit.arg = arg;
+        r = s3b_dcache_file_load_next(file, max, s3b_dcache_visit, &visit);
+        max -= before - s3b_dcache_file_num_unloaded(file);
+        CHECK_RETURN(pthread_mutex_unlock(&file->mutex));
+        if (r != 0)
+            return r;
+    }
     return 0;
 }
 
 /*
- * Record a block's dslot in the directory. After this function is called, the block will
- * be visible in the directory and picked up after a restart.
- *
- * If etag != NULL, the block is CLEAN; if etag == NULL, the block is DIRTY.
+ * Visit the given block if it is one of the clean blocks that were not visited when the cache file(s) were opened.
  *
- * This should be called AFTER the data for the block has already been written.
- *
- * There MUST NOT be a directory entry for the block.
+ * Returns ENOENT if not found. If the visitor fails, the block's dslot is freed. The visitor must not call
+ * any of these functions.
  */
 int
-s3b_dcache_record_block(struct s3b_dcache *priv, u_int dslot, s3b_block_t block_num, const u_char *etag)
+s3b_dcache_load_block(struct s3b_dcache *dcache, s3b_block_t block_num, s3b_dcache_visit_t *visitor, void *arg)
 {
-    const u_int dirty = etag == NULL;
-    struct dir_entry entry;
+    const u_int start = dcache->stripe_hash ? STRIPE_HASH(dcache, block_num) : 0;
+    struct dcache_visit visit;
+    u_int i;
     int r;
 
-    // Sanity check
-    assert(dslot < priv->max_blocks);
+    for (i = 0; i < dcache->num_files; i++) {
+        const u_int index = (start + i) % dcache->num_files;
+        struct dcache_file *const file = dcache->files[index];
+
+        visit.dcache = dcache;
+        visit.index = index;
+        visit.visitor = visitor;
+        visit.arg = arg;
+        pthread_mutex_lock(&file->mutex);
+        r = s3b_dcache_file_load_block(file, block_num, s3b_dcache_visit, &visit);
+        CHECK_RETURN(pthread_mutex_unlock(&file->mutex));
+        if (r != ENOENT)
+            return r;
+    }
+    return ENOENT;
+}
 
-    // Directory entry should be writable
-    assert(s3b_dcache_entry_write_ok(priv, dslot, block_num, dirty));
+/*
+ * Allocate a dslot for a block's data, choosing a file round-robin or by block number hash,
+ * and falling back to the other files if that one is full.
+ *
+ * If "prev_dslot" is not S3B_DCACHE_NO_DSLOT, it's where the previous block lives, and we try to
+ * allocate the dslot just after it, or else one nearby, so sequential blocks stay together.
+ */
+int
+s3b_dcache_alloc_block(struct s3b_dcache *dcache, s3b_block_t block_num, u_int prev_dslot, u_int *dslotp)
+{
+    u_int start = dcache->stripe_hash ? STRIPE_HASH(dcache, block_num) : dcache->next_file;
+    u_int near = (u_int)-1;
+    u_int fslot;
+    u_int i;
+    int r;
 
-    // If cache file is older format, it doesn't store dirty blocks, so just erase it instead (prior behavior)
-    if (dirty && (priv->flags & HDRFLG_NEW_FORMAT) == 0) {
-        s3b_dcache_erase_block(priv, dslot);
+    // Prefer the dslot following the previous block's dslot, or else the same position in the chosen file
+    if (prev_dslot != S3B_DCACHE_NO_DSLOT) {
+        if (!dcache->stripe_hash)
+            start = (prev_dslot + 1) % dcache->num_files;
+        near = DSLOT_FSLOT(dcache, start == (prev_dslot + 1) % dcache->num_files ? prev_dslot + 1 : prev_dslot);
+    }
+
+    // Try the preferred file first
+    for (i = 0; i < dcache->num_files; i++) {
+        const u_int index = (start + i) % dcache->num_files;
+        struct dcache_file *const priv = dcache->files[index];
+
+        pthread_mutex_lock(&priv->mutex);
+        r = s3b_dcache_file_alloc_block(priv, i == 0 ? near : (u_int)-1, &fslot);
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        if (r == ENOMEM)
+            continue;
+        if (r != 0)
+            return r;
+        *dslotp = DSLOT(dcache, index, fslot);
+        dcache->next_file = (index + 1) % dcache->num_files;
         return 0;
     }
+    return ENOMEM;
+}
 
-    // Make sure any new data is written to disk before updating the directory
-    if ((r = s3b_dcache_fsync(priv)) != 0)
-        return r;
+/*
+ * Get the total number of dslots, i.e., one more than the largest possible dslot.
+ */
+u_int
+s3b_dcache_num_dslots(struct s3b_dcache *dcache)
+{
+    return dcache->files[0]->max_blocks * dcache->num_files;
+}
 
-    // Update directory
-    memset(&entry, 0, sizeof(entry));
-    entry.block_num = block_num;
-    entry.flags = dirty ? ENTFLG_DIRTY : 0;
-    if (!dirty)
-        memcpy(&entry.etag, etag, MD5_DIGEST_LENGTH);
-    if ((r = s3b_dcache_write_entry(priv, dslot, &entry)) != 0)
-        return r;
+/*
+ * Get the current limit on allocated dslots; only dslots below the limit are allocated.
+ */
+u_int
+s3b_dcache_get_limit(struct s3b_dcache *dcache)
+{
+    u_int limit = 0;
+    u_int i;
 
-    // Done
-    return 0;
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
+
+        pthread_mutex_lock(&priv->mutex);
+        limit += priv->limit;
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    }
+    return limit;
 }
 
 /*
- * Erase the directory entry for a dslot. After this function is called, the block will
- * no longer be visible in the directory after a restart.
- *
- * This should be called BEFORE any new data for the block is written.
+ * Change the limit on allocated dslots, which must be between the number of files and the total capacity.
+ * Because of the striping, the dslots below the limit are exactly the first "limit / num_files" (or so)
+ * dslots in each file.
  *
- * There MUST be a directory entry for the block.
+ * Growing takes effect immediately. When shrinking, free dslots at or beyond the new limit are set aside,
+ * while allocated dslots there are set aside as they are freed (their data is deallocated by s3b_dcache_reclaim());
+ * the caller is responsible for relocating or evicting those blocks. See s3b_dcache_num_excess().
  */
 int
-s3b_dcache_erase_block(struct s3b_dcache *priv, u_int dslot)
+s3b_dcache_set_limit(struct s3b_dcache *dcache, u_int limit)
 {
+    u_int capacity = 0;
+    u_int i;
     int r;
 
     // Sanity check
-    assert(dslot < priv->max_blocks);
-
-    // Update directory
-    if ((r = s3b_dcache_write_entry(priv, dslot, &zero_entry)) != 0)
-        return r;
+    for (i = 0; i < dcache->num_files; i++)
+        capacity += dcache->files[i]->max_blocks;
+    if (limit < dcache->num_files || limit > capacity)
+        return EINVAL;
 
-    // Make sure directory entry is written to disk before any new data is written
-    if ((r = s3b_dcache_fsync(priv)) != 0)
-        return r;
+    // Apply each file's share
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
 
-    // Done
+        pthread_mutex_lock(&priv->mutex);
+        r = s3b_dcache_file_set_limit(priv, limit / dcache->num_files + (i < limit % dcache->num_files));
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        if (r != 0)
+            return r;
+    }
     return 0;
 }
 
 /*
- * Free a no-longer used dslot.
- *
- * There MUST NOT be a directory entry for the block.
+ * Get the number of allocated dslots at or beyond the limit, i.e., how far a shrink has to go.
  */
-int
-s3b_dcache_free_block(struct s3b_dcache *priv, u_int dslot)
+u_int
+s3b_dcache_num_excess(struct s3b_dcache *dcache)
 {
-    int r;
+    u_int num_excess = 0;
+    u_int i;
 
-    // Sanity check
-    assert(dslot < priv->max_blocks);
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
 
-    // Directory entry should be empty
-    assert(s3b_dcache_entry_is_empty(priv, dslot));
+        pthread_mutex_lock(&priv->mutex);
+        num_excess += priv->max_blocks - priv->limit - priv->num_parked;
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    }
+    return num_excess;
+}
 
-    // Push dslot onto free list
-    if ((r = s3b_dcache_push(priv, dslot)) != 0)
-        return r;
+/*
+ * Get the number of dslots having disk space waiting to be reclaimed by s3b_dcache_reclaim().
+ */
+u_int
+s3b_dcache_reclaim_pending(struct s3b_dcache *dcache)
+{
+    u_int num_reclaim = 0;
+    u_int i;
 
-    // Done
-    priv->num_alloc--;
-    return 0;
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
+
+        pthread_mutex_lock(&priv->mutex);
+        num_reclaim += priv->num_reclaim;
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    }
+    return num_reclaim;
 }
 
 /*
- * Read data from one dslot.
+ * Reclaim disk space from up to "max" runs of unused dslots and/or dslots in use in the next file
+ * having any to reclaim, taking the files in turn. The "buf" must have room for one block.
  */
 int
-s3b_dcache_read_block(struct s3b_dcache *priv, u_int dslot, void *dest, u_int off, u_int len)
+s3b_dcache_reclaim(struct s3b_dcache *dcache, void *buf, u_int max)
 {
+    struct dcache_file *priv;
+    uint64_t reclaimed;
+    u_int index;
+    u_int i;
     int r;
 
-    // Sanity check
-    assert(dslot < priv->max_blocks);
-    assert(off <= priv->block_size);
-    assert(len <= priv->block_size);
-    assert(off + len <= priv->block_size);
-
-    // Read data
-    if ((r = s3b_dcache_read(priv, DATA_OFFSET(priv, dslot) + off, dest, len)) != 0)
+    for (i = 0; i < dcache->num_files; i++) {
+        index = dcache->next_reclaim;
+        dcache->next_reclaim = (index + 1) % dcache->num_files;
+        priv = dcache->files[index];
+        pthread_mutex_lock(&priv->mutex);
+        if (priv->num_reclaim == 0) {
+            CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+            continue;
+        }
+        r = s3b_dcache_file_reclaim(priv, buf, max, &reclaimed);
+        dcache->stats[index].reclaimed_bytes += reclaimed;
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
         return r;
-
-    // Advise the kernel to not cache this data block (note this may or may not work if transparent huge pages are being used)
-#if HAVE_DECL_POSIX_FADVISE
-    if (priv->fadvise && (r = posix_fadvise(priv->fd, DATA_OFFSET(priv, dslot), priv->block_size, POSIX_FADV_DONTNEED)) != 0)
-        (*priv->log)(LOG_WARNING, "posix_fadvise(\"%s\"): %s", priv->filename, strerror(r));
-#endif
-
-    // Done
+    }
     return 0;
 }
 
 /*
- * Write data into one dslot.
+ * Get the block stored in a dslot.
+ *
+ * Returns ENOENT if the dslot is empty.
  */
 int
-s3b_dcache_write_block(struct s3b_dcache *priv, u_int dslot, const void *src, u_int off, u_int len)
+s3b_dcache_block_at(struct s3b_dcache *dcache, u_int dslot, s3b_block_t *block_nump)
 {
-    const off_t prev_file_size = priv->file_size;
+    struct dcache_file *const priv = DSLOT_FILE(dcache, dslot);
+    const u_int fslot = DSLOT_FSLOT(dcache, dslot);
+    struct dir_entry entry;
     int r;
 
-    // Write the data info the block
-#if USE_FALLOCATE
-    r = s3b_dcache_write_block_falloc(priv, dslot, src, off, len);
-#else
-    r = s3b_dcache_write_block_simple(priv, dslot, src, off, len);
-#endif
+    if (fslot >= priv->max_blocks)
+        return ENOENT;
+    pthread_mutex_lock(&priv->mutex);
+    r = s3b_dcache_read_entry(priv, fslot, &entry);
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
     if (r != 0)
         return r;
-
-    // Keep the file size a proper multiple of one full data block (issue #222)
-    if (priv->file_size > prev_file_size) {
-#ifndef NDEBUG
-        const off_t dslot_start = DATA_OFFSET(priv, dslot);
-#endif
-        const off_t dslot_end = DATA_OFFSET(priv, dslot + 1);
-
-        assert(priv->file_size > dslot_start);
-        assert(priv->file_size <= dslot_end);
-        if (priv->file_size < dslot_end) {
-            const u_int padding_len = (u_int)(dslot_end - priv->file_size);
-            const u_int padding_off = priv->block_size - padding_len;
-
-#if USE_FALLOCATE
-            r = s3b_dcache_write_block_falloc(priv, dslot, zero_block, padding_off, padding_len);
-#else
-            r = s3b_dcache_write_block_simple(priv, dslot, zero_block, padding_off, padding_len);
-#endif
-            if (r != 0)
-                return r;
-        }
-        assert(priv->file_size == dslot_end);
-    }
-
-    // Done
+    if (memcmp(&entry, &zero_entry, sizeof(entry)) == 0)
+        return ENOENT;
+    *block_nump = entry.block_num;
     return 0;
 }
 
-#if USE_FALLOCATE
-
 /*
- * Write data into one dslot using FALLOC_FL_PUNCH_HOLE for zero filesystem blocks where able.
+ * Move a clean block to another dslot. If that dslot holds another clean block, the two blocks trade places.
+ * The "buf" must have room for two blocks.
+ *
+ * The old entries are erased, and the erasures are on disk, before any data is overwritten or any new entry
+ * can reach the disk, so after a crash each block is either in its new dslot or forgotten.
  *
- * The complexity here comes from the fact that the disk block size is (likely) smaller than the s3backer
- * block size, so for some of the underlying disk blocks we may be able to punch a "zero hole" while for
- * others we may not.
+ * Returns EBUSY if the new dslot is beyond the end of its file or the limit, holds a dirty or not yet loaded block,
+ * or is allocated but not yet recorded; or EINVAL if the old dslot doesn't hold a loaded clean block. In those
+ * cases nothing is changed. If any other error occurs, the block(s) may have been erased from the directory,
+ * and the caller must erase and free their dslot(s).
  */
 int
-s3b_dcache_write_block_falloc(struct s3b_dcache *priv, u_int dslot, const char *src, const u_int doff, u_int len)
+s3b_dcache_move_block(struct s3b_dcache *dcache, u_int dslot, u_int new_dslot, void *buf)
 {
-    const off_t orig_off = DATA_OFFSET(priv, dslot) + doff;
-    off_t off = orig_off;
-    off_t roundup_off;
-    u_int num_zero_blocks;
-    u_int extra_len;
+    struct dcache_file *const src = DSLOT_FILE(dcache, dslot);
+    struct dcache_file *const dst = DSLOT_FILE(dcache, new_dslot);
+    const u_int src_fslot = DSLOT_FSLOT(dcache, dslot);
+    const u_int dst_fslot = DSLOT_FSLOT(dcache, new_dslot);
+    void *const buf2 = (char *)buf + src->block_size;
+    struct dir_entry entry2;
+    struct dir_entry entry;
+    int swap = 0;
     int r;
 
     // Sanity check
-    assert(dslot < priv->max_blocks);
-    assert(doff <= priv->block_size);
-    assert(len <= priv->block_size);
-    assert(doff + len <= priv->block_size);
-
-    // Write unaligned leading bit, if any
-    roundup_off = ROUNDUP2(off, (off_t)priv->file_block_size);
-    extra_len = (u_int)(roundup_off - off);
-    if (extra_len > len)
-        extra_len = len;
-    if (extra_len > 0) {
-        if ((r = s3b_dcache_write(priv, off, src != NULL ? src : zero_block, extra_len)) != 0)
-            return r;
-        if (src != NULL)
-            src += extra_len;
-        off += extra_len;
-        len -= extra_len;
-    }
-    assert(len == 0 || off == roundup_off);
-
-    // Write intermediate aligned bits, using FALLOC_FL_PUNCH_HOLE for zero disk blocks
-    num_zero_blocks = 0;
-    while (len >= priv->file_block_size) {
-        u_int nonzero_len;
-
-        // Scan and write the next range of zero blocks
-        if (num_zero_blocks == 0)
-            num_zero_blocks = s3b_dcache_count_zero_fs_blocks(priv, src, len);
-        if (num_zero_blocks > 0) {
-            const u_int zero_len = num_zero_blocks * priv->file_block_size;
-
-            // Extend file if necessary
-            if (off + zero_len > priv->file_size) {
-                if (fallocate(priv->fd, 0, off, zero_len) != 0)
-                    return errno;
-                priv->file_size = off + zero_len;
-            }
-
-            // "Write" zeros using FALLOC_FL_PUNCH_HOLE
-            if (fallocate(priv->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, zero_len) != 0)
-                return errno;
-            if (src != NULL)
-                src += zero_len;
-            off += zero_len;
-            len -= zero_len;
-            num_zero_blocks = 0;
-        }
+    assert(src_fslot < src->max_blocks);
+    assert(new_dslot != dslot);
+
+    // Get the old entry, which must be clean and loaded
+    pthread_mutex_lock(&src->mutex);
+    if ((r = s3b_dcache_read_entry(src, src_fslot, &entry)) == 0
+      && (memcmp(&entry, &zero_entry, sizeof(entry)) == 0 || (entry.flags & ENTFLG_DIRTY) != 0
+       || (src->unloaded != NULL && bitmap_test(src->unloaded, src_fslot))))
+        r = EINVAL;
+    CHECK_RETURN(pthread_mutex_unlock(&src->mutex));
+    if (r != 0)
+        return r;
 
-        // Scan and write the next range of non-zero blocks
-        for (nonzero_len = 0; len - nonzero_len >= priv->file_block_size; nonzero_len += priv->file_block_size) {
-            assert(src != NULL);
-            if ((num_zero_blocks = s3b_dcache_count_zero_fs_blocks(priv, src + nonzero_len, len - nonzero_len)) != 0)
-                break;
-        }
-        if (nonzero_len > 0) {
-            assert(src != NULL);
-            assert(nonzero_len % priv->file_block_size == 0);
-            if ((r = s3b_dcache_write(priv, off, src, nonzero_len)) != 0)
-                return r;
-            src += nonzero_len;
-            off += nonzero_len;
-            len -= nonzero_len;
-        }
+    // Allocate the new dslot, or else check for a clean and loaded block there to trade places with
+    pthread_mutex_lock(&dst->mutex);
+    if (dst_fslot >= dst->limit)
+        r = EBUSY;
+    else if (s3b_dcache_file_alloc_at(dst, dst_fslot) != 0) {
+        if ((r = s3b_dcache_read_entry(dst, dst_fslot, &entry2)) == 0
+          && (memcmp(&entry2, &zero_entry, sizeof(entry2)) == 0 || (entry2.flags & ENTFLG_DIRTY) != 0
+           || (dst->unloaded != NULL && bitmap_test(dst->unloaded, dst_fslot))))
+            r = EBUSY;
+        swap = 1;
     }
+    CHECK_RETURN(pthread_mutex_unlock(&dst->mutex));
+    if (r != 0)
+        return r;
 
-    // Write unaligned trailing bit, if any
-    if (len > 0) {
-        assert(len < priv->file_block_size);
-        if ((r = s3b_dcache_write(priv, off, src != NULL ? src : zero_block, len)) != 0)
-            return r;
+    // Read the data and erase the old entries
+    pthread_mutex_lock(&src->mutex);
+    if ((r = s3b_dcache_file_read_block(src, src_fslot, buf, 0, src->block_size)) == 0)
+        r = s3b_dcache_file_erase_block(src, src_fslot);
+    CHECK_RETURN(pthread_mutex_unlock(&src->mutex));
+    if (r != 0)
+        goto fail;
+    if (swap) {
+        pthread_mutex_lock(&dst->mutex);
+        if ((r = s3b_dcache_file_read_block(dst, dst_fslot, buf2, 0, dst->block_size)) == 0)
+            r = s3b_dcache_file_erase_block(dst, dst_fslot);
+        CHECK_RETURN(pthread_mutex_unlock(&dst->mutex));
+        if (r != 0)
+            goto fail;
     }
 
-    // Advise the kernel to not cache this data block (note this may or may not work if transparent huge pages are being used)
-#if HAVE_DECL_POSIX_FADVISE
-    if (priv->fadvise && (r = posix_fadvise(priv->fd, DATA_OFFSET(priv, dslot), priv->block_size, POSIX_FADV_DONTNEED)) != 0)
-        (*priv->log)(LOG_WARNING, "posix_fadvise(\"%s\"): %s", priv->filename, strerror(r));
-#endif
-
-    // Done
-    return 0;
-}
-
-static u_int
-s3b_dcache_count_zero_fs_blocks(struct s3b_dcache *priv, const char *src, u_int len)
-{
-    const size_t num_words_per_block = priv->file_block_size / sizeof(uintptr_t);
-    u_int num_blocks;
-
-    // Handle NULL src, which means "all zeros"
-    if (src == NULL)
-        return len / priv->file_block_size;
+    // Write the data; s3b_dcache_file_write_block() puts each dslot's erasure on disk before overwriting it
+    pthread_mutex_lock(&dst->mutex);
+    r = s3b_dcache_file_write_block(dst, dst_fslot, buf, 0, dst->block_size);
+    CHECK_RETURN(pthread_mutex_unlock(&dst->mutex));
+    if (r != 0)
+        goto fail;
+    pthread_mutex_lock(&src->mutex);
+    if (swap)
+        r = s3b_dcache_file_write_block(src, src_fslot, buf2, 0, src->block_size);
+    else if (src != dst)
+        r = s3b_dcache_commit(src, 0);          // the old dslot's erasure must reach the disk first
+    CHECK_RETURN(pthread_mutex_unlock(&src->mutex));
+    if (r != 0)
+        goto fail;
 
-    // Count the number of consecutive zero blocks
-    for (num_blocks = 0; len >= priv->file_block_size; num_blocks++) {
-        const uintptr_t *const word_ptr = (const void *)src;
-        int i;
+    // Record the new entries
+    pthread_mutex_lock(&dst->mutex);
+    r = s3b_dcache_file_record_block(dst, dst_fslot, entry.block_num, entry.etag);
+    CHECK_RETURN(pthread_mutex_unlock(&dst->mutex));
+    if (r != 0)
+        goto fail;
+    pthread_mutex_lock(&src->mutex);
+    if (swap)
+        r = s3b_dcache_file_record_block(src, src_fslot, entry2.block_num, entry2.etag);
+    else
+        r = s3b_dcache_file_free_block(src, src_fslot);
+    CHECK_RETURN(pthread_mutex_unlock(&src->mutex));
+    return r;
 
-        for (i = 0; i < num_words_per_block; i++) {
-            if (word_ptr[i] != 0)
-                goto done;
-        }
-        src += priv->file_block_size;
-        len -= priv->file_block_size;
+fail:
+    if (!swap) {
+        pthread_mutex_lock(&dst->mutex);
+        (void)s3b_dcache_file_free_block(dst, dst_fslot);
+        CHECK_RETURN(pthread_mutex_unlock(&dst->mutex));
     }
-
-done:
-    // Done
-    return num_blocks;
+    return r;
 }
 
-#else   /* !USE_FALLOCATE */
-
 /*
- * Write data into one dslot.
+ * Verify a dslot's data against its checksum, if that hasn't been done yet.
+ *
+ * Returns EBADMSG if the data is corrupt.
  */
-static int
-s3b_dcache_write_block_simple(struct s3b_dcache *priv, u_int dslot, const void *src, u_int off, u_int len)
+int
+s3b_dcache_verify_block(struct s3b_dcache *dcache, u_int dslot)
 {
-    int r;
+    struct dcache_file *const priv = DSLOT_FILE(dcache, dslot);
+    const u_int fslot = DSLOT_FSLOT(dcache, dslot);
+    int r = 0;
+
+    pthread_mutex_lock(&priv->mutex);
+    if (priv->unverified != NULL && bitmap_test(priv->unverified, fslot))
+        r = s3b_dcache_file_verify_block(priv, fslot, NULL);
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return r;
+}
 
-    // Sanity check
-    assert(dslot < priv->max_blocks);
-    assert(off <= priv->block_size);
-    assert(len <= priv->block_size);
-    assert(off + len <= priv->block_size);
+int
+s3b_dcache_record_block(struct s3b_dcache *dcache, u_int dslot, s3b_block_t block_num, const u_char *etag)
+{
+    struct dcache_file *const priv = DSLOT_FILE(dcache, dslot);
+    int r;
 
-    // Write data
-    if ((r = s3b_dcache_write(priv, DATA_OFFSET(priv, dslot) + off, src != NULL ? src : zero_block, len)) != 0)
-        return r;
+    pthread_mutex_lock(&priv->mutex);
+    r = s3b_dcache_file_record_block(priv, DSLOT_FSLOT(dcache, dslot), block_num, etag);
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return r;
+}
 
-    // Advise the kernel to not cache this data block (note this may or may not work if transparent huge pages are being used)
-#if HAVE_DECL_POSIX_FADVISE
-    if (priv->fadvise && (r = posix_fadvise(priv->fd, DATA_OFFSET(priv, dslot), priv->block_size, POSIX_FADV_DONTNEED)) != 0)
-        (*priv->log)(LOG_WARNING, "posix_fadvise(\"%s\"): %s", priv->filename, strerror(r));
-#endif
+int
+s3b_dcache_erase_block(struct s3b_dcache *dcache, u_int dslot)
+{
+    struct dcache_file *const priv = DSLOT_FILE(dcache, dslot);
+    int r;
 
-    // Done
-    return 0;
+    pthread_mutex_lock(&priv->mutex);
+    r = s3b_dcache_file_erase_block(priv, DSLOT_FSLOT(dcache, dslot));
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return r;
 }
 
-#endif  /* !USE_FALLOCATE */
+int
+s3b_dcache_free_block(struct s3b_dcache *dcache, u_int dslot)
+{
+    struct dcache_file *const priv = DSLOT_FILE(dcache, dslot);
+    int r;
+
+    pthread_mutex_lock(&priv->mutex);
+    r = s3b_dcache_file_free_block(priv, DSLOT_FSLOT(dcache, dslot));
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return r;
+}
 
-/*
- * Synchronize outstanding changes to persistent storage.
- */
 int
-s3b_dcache_fsync(struct s3b_dcache *priv)
+s3b_dcache_read_block(struct s3b_dcache *dcache, u_int dslot, void *dest, u_int off, u_int len)
 {
+    struct dcache_file *const priv = DSLOT_FILE(dcache, dslot);
+    struct s3b_dcache_stats *const stats = &dcache->stats[dslot % dcache->num_files];
+    const uint64_t start_micros = s3b_dcache_get_time_micros();
     int r;
 
-#if HAVE_DECL_FDATASYNC
-    r = fdatasync(priv->fd);
-#else
-    r = fsync(priv->fd);
-#endif
-    if (r == -1) {
-        r = errno;
-        (*priv->log)(LOG_ERR, "error fsync'ing cache file \"%s\": %s", priv->filename, strerror(r));
+    pthread_mutex_lock(&priv->mutex);
+    if ((r = s3b_dcache_file_read_block(priv, DSLOT_FSLOT(dcache, dslot), dest, off, len)) == 0) {
+        stats->reads++;
+        stats->read_bytes += len;
+        stats->read_micros += s3b_dcache_get_time_micros() - start_micros;
     }
-    return 0;
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return r;
 }
 
-// Internal functions
-
-#ifndef NDEBUG
-static int
-s3b_dcache_entry_is_empty(struct s3b_dcache *priv, u_int dslot)
+int
+s3b_dcache_write_block(struct s3b_dcache *dcache, u_int dslot, const void *src, u_int off, u_int len)
 {
-    struct dir_entry entry;
+    struct dcache_file *const priv = DSLOT_FILE(dcache, dslot);
+    struct s3b_dcache_stats *const stats = &dcache->stats[dslot % dcache->num_files];
+    const uint64_t start_micros = s3b_dcache_get_time_micros();
+    int r;
 
-    (void)s3b_dcache_read_entry(priv, dslot, &entry);
-    return memcmp(&entry, &zero_entry, sizeof(entry)) == 0;
+    pthread_mutex_lock(&priv->mutex);
+    if ((r = s3b_dcache_file_write_block(priv, DSLOT_FSLOT(dcache, dslot), src, off, len)) == 0) {
+        stats->writes++;
+        stats->write_bytes += len;
+        stats->write_micros += s3b_dcache_get_time_micros() - start_micros;
+    }
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    return r;
 }
 
-static int
-s3b_dcache_entry_write_ok(struct s3b_dcache *priv, u_int dslot, s3b_block_t block_num, u_int dirty)
+int
+s3b_dcache_fsync(struct s3b_dcache *dcache)
 {
-    struct dir_entry entry;
-    u_int old_dirty;
+    u_int i;
+    int r;
 
-    if (s3b_dcache_entry_is_empty(priv, dslot))
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
+
+        pthread_mutex_lock(&priv->mutex);
+        r = s3b_dcache_file_fsync(priv);
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        if (r != 0)
+            return r;
+    }
+    return 0;
+}
+
+/*
+ * Get per-file statistics for up to "max" files. Returns the number of files.
+ */
+u_int
+s3b_dcache_get_stats(struct s3b_dcache *dcache, struct s3b_dcache_stats *stats, u_int max)
+{
+    struct stat sb;
+    u_int i;
+
+    for (i = 0; i < dcache->num_files && i < max; i++) {
+        struct dcache_file *const priv = dcache->files[i];
+
+        pthread_mutex_lock(&priv->mutex);
+        memcpy(&stats[i], &dcache->stats[i], sizeof(*stats));
+        stats[i].size = priv->limit;
+        stats[i].used = s3b_dcache_file_size(priv);
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        if (fstat(priv->fd, &sb) == 0)
+            stats[i].disk_bytes = (uint64_t)sb.st_blocks * 512;
+    }
+    return dcache->num_files;
+}
+
+void
+s3b_dcache_clear_stats(struct s3b_dcache *dcache)
+{
+    u_int i;
+
+    for (i = 0; i < dcache->num_files; i++) {
+        struct dcache_file *const priv = dcache->files[i];
+
+        pthread_mutex_lock(&priv->mutex);
+        memset(&dcache->stats[i], 0, sizeof(dcache->stats[i]));
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    }
+}
+
+// Cache file functions
+
+static int
+s3b_dcache_file_open(struct dcache_file **dcachep, struct block_cache_conf *config,
+  s3b_dcache_visit_t *visitor, void *arg, u_int visit_dirty)
+{
+    struct ofile_header oheader;
+    struct file_header header;
+    struct dcache_file *priv;
+#if HAVE_SYS_STATVFS_H
+    struct statvfs vfs;
+#endif
+    struct stat sb;
+    int r;
+
+    // Sanity check
+    if (config->cache_size == 0)
+        return EINVAL;
+
+    // Initialize private structure
+    if ((priv = malloc(sizeof(*priv))) == NULL)
+        return errno;
+    memset(priv, 0, sizeof(*priv));
+    priv->fd = -1;
+    priv->dfd = -1;
+    priv->log = config->log;
+    priv->block_size = config->block_size;
+    priv->max_blocks = config->cache_size;
+    priv->limit = priv->max_blocks;
+    priv->fadvise = config->fadvise;
+    priv->want_checksums = config->checksums;
+    if ((r = pthread_mutex_init(&priv->mutex, NULL)) != 0)
+        goto fail0;
+    if ((r = pthread_mutex_init(&priv->bounce_mutex, NULL)) != 0) {
+        pthread_mutex_destroy(&priv->mutex);
+        goto fail0;
+    }
+    if ((r = pthread_cond_init(&priv->reclaim_done, NULL)) != 0) {
+        pthread_mutex_destroy(&priv->bounce_mutex);
+        pthread_mutex_destroy(&priv->mutex);
+        goto fail0;
+    }
+    if ((priv->filename = strdup(config->cache_file)) == NULL) {
+        r = errno;
+        goto fail1;
+    }
+    if ((priv->dir_buf = malloc(DIR_BUFFER_MAX * sizeof(*priv->dir_buf))) == NULL
+      || (priv->dir_write = malloc(DIR_WRITE_MAX)) == NULL
+      || (priv->dir_pending = bitmap_init(priv->max_blocks, 0)) == NULL
+      || (priv->writing = bitmap_init(priv->max_blocks, 0)) == NULL) {
+        r = errno;
+        goto fail2;
+    }
+
+    // Create cache file if it doesn't already exist
+    if (stat(priv->filename, &sb) == -1 && errno == ENOENT) {
+        (*priv->log)(LOG_NOTICE, "creating new cache file \"%s\" with capacity %u blocks", priv->filename, priv->max_blocks);
+        if ((r = s3b_dcache_create_file(priv, &priv->fd, priv->filename, priv->max_blocks, NULL)) != 0)
+            goto fail2;
+        (void)close(priv->fd);
+        priv->fd = -1;
+    }
+
+retry:
+    // Open cache file
+    assert(priv->fd == -1);
+    if ((priv->fd = open(priv->filename, O_RDWR|O_CLOEXEC, 0)) == -1) {
+        r = errno;
+        (*priv->log)(LOG_ERR, "can't open cache file \"%s\": %s", priv->filename, strerror(r));
+        goto fail2;
+    }
+
+    // Get file info
+    if (fstat(priv->fd, &sb) == -1) {
+        r = errno;
+        goto fail3;
+    }
+    priv->file_size = sb.st_size;
+
+    // Get filesystem block size, but if not supported force into a reasonable value
+    priv->file_block_size = (u_int)sb.st_blksize;
+    if (priv->file_block_size < MIN_FILESYSTEM_BLOCK_SIZE)
+        priv->file_block_size = MIN_FILESYSTEM_BLOCK_SIZE;
+    if (priv->file_block_size > priv->block_size
+      || priv->file_block_size != ((u_int)1 << (ffs(priv->file_block_size) - 1)))  // must be a power of 2
+        priv->file_block_size = priv->block_size;
+
+    // Read in header with backward compatible support for older header format
+    if (sb.st_size < sizeof(oheader)) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": file is truncated (size %ju < %u)",
+          priv->filename, (uintmax_t)sb.st_size, (u_int)sizeof(oheader));
+        r = EINVAL;
+        goto fail3;
+    }
+    if ((r = s3b_dcache_read(priv, (off_t)0, &oheader, sizeof(oheader))) != 0) {
+        (*priv->log)(LOG_ERR, "can't read cache file \"%s\" header: %s", priv->filename, strerror(r));
+        goto fail3;
+    }
+    switch (oheader.header_size) {
+    case sizeof(oheader):                               // old format
+        memset(&header, 0, sizeof(header));
+        memcpy(&header, &oheader, sizeof(oheader));
+        break;
+    case sizeof(header):                                // new format
+        if ((r = s3b_dcache_read(priv, (off_t)0, &header, sizeof(header))) != 0) {
+            (*priv->log)(LOG_ERR, "can't read cache file \"%s\" header: %s", priv->filename, strerror(r));
+            goto fail3;
+        }
+        break;
+    default:
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": %s %d", priv->filename, "invalid header size", (int)oheader.header_size);
+        r = EINVAL;
+        goto fail3;
+    }
+
+    // Verify header - all but number of blocks
+    r = EINVAL;
+    if (header.signature != DCACHE_SIGNATURE) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": wrong signature %08x != %08x",
+          priv->filename, header.signature, DCACHE_SIGNATURE);
+        goto fail3;
+    }
+    if (header.header_size != HDR_SIZE(header.flags)) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": %s %d != %d",
+          priv->filename, "invalid header size", (int)header.header_size, (int)HDR_SIZE(header.flags));
+        goto fail3;
+    }
+    if (header.u_int_size != sizeof(u_int)) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": created with sizeof(u_int) %u != %u",
+          priv->filename, header.u_int_size, (u_int)sizeof(u_int));
+        goto fail3;
+    }
+    if (header.s3b_block_t_size != sizeof(s3b_block_t)) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": created with sizeof(s3b_block_t) %u != %u",
+          priv->filename, header.s3b_block_t_size, (u_int)sizeof(s3b_block_t));
+        goto fail3;
+    }
+    if (header.block_size != priv->block_size) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": created with block size %u != %u",
+          priv->filename, header.block_size, priv->block_size);
+        goto fail3;
+    }
+    if (header.data_align != getpagesize()) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": created with alignment %u != %u",
+          priv->filename, header.data_align, getpagesize());
+        goto fail3;
+    }
+    if ((header.flags & ~HDRFLG_MASK) != 0) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": %s", priv->filename, "unrecognized flags present");
+        goto fail3;
+    }
+    priv->flags = header.flags & ~HDRFLG_CLEAN;
+
+    // Check number of blocks, shrinking or expanding if necessary
+    if (header.max_blocks != priv->max_blocks) {
+        (*priv->log)(LOG_NOTICE, "cache file \"%s\" was created with capacity %u != %u blocks, automatically %s",
+          priv->filename, header.max_blocks, priv->max_blocks, header.max_blocks < priv->max_blocks ?
+           "expanding" : "shrinking");
+        if ((r = s3b_dcache_resize_file(priv, &header)) != 0)
+            goto fail3;
+        (*priv->log)(LOG_INFO, "successfully resized cache file \"%s\" from %u to %u blocks",
+          priv->filename, header.max_blocks, priv->max_blocks);
+        goto retry;
+    }
+
+    // Add checksums if needed (we never remove them)
+    if (priv->want_checksums && (priv->flags & HDRFLG_CHECKSUMS) == 0) {
+        (*priv->log)(LOG_NOTICE, "cache file \"%s\" was created without checksums, automatically converting",
+          priv->filename);
+        if ((r = s3b_dcache_resize_file(priv, &header)) != 0)
+            goto fail3;
+        (*priv->log)(LOG_INFO, "successfully converted cache file \"%s\"", priv->filename);
+        goto retry;
+    }
+
+    // Verify file's directory is not truncated
+    if (sb.st_size < DIR_OFFSET(priv->flags, priv->max_blocks)) {
+        (*priv->log)(LOG_ERR, "invalid cache file \"%s\": file is truncated (size %ju < %ju)",
+          priv->filename, (uintmax_t)sb.st_size, (uintmax_t)DIR_OFFSET(priv->flags, priv->max_blocks));
+        goto fail3;
+    }
+
+    // Compute offset of first data block
+    priv->data = ROUNDUP2(DIR_OFFSET(priv->flags, priv->max_blocks), header.data_align);
+
+    // Allocate checksum state
+    if ((priv->flags & HDRFLG_CHECKSUMS) != 0) {
+        if ((priv->checksums = calloc(priv->max_blocks, sizeof(*priv->checksums))) == NULL
+          || (priv->checksum_ok = bitmap_init(priv->max_blocks, 0)) == NULL
+          || (priv->unverified = bitmap_init(priv->max_blocks, 0)) == NULL) {
+            r = errno;
+            (*priv->log)(LOG_ERR, "can't allocate checksums for cache file \"%s\": %s", priv->filename, strerror(r));
+            goto fail3;
+        }
+    }
+
+    // If we're really using the file, it won't be closed cleanly until we say so
+    if (visitor != NULL && (priv->flags & HDRFLG_CHECKSUMS) != 0) {
+        if ((header.flags & HDRFLG_CLEAN) != 0 && (r = s3b_dcache_set_clean(priv, 0)) != 0)
+            goto fail3;
+        priv->mark_clean = 1;
+    }
+
+    // Open a separate O_DIRECT descriptor for the data area if configured
+    if (config->direct_io)
+        s3b_dcache_direct_open(priv);
+
+    // Set up io_uring(7) if configured, falling back to pread(2)/pwrite(2) if not available
+    if (config->io_uring) {
+#if USE_IO_URING
+        if ((r = s3b_dcache_ring_open(priv)) != 0) {
+            (*priv->log)(LOG_WARNING, "can't set up io_uring for cache file \"%s\": %s; using pread/pwrite instead",
+              priv->filename, strerror(r));
+        }
+#else
+        (*priv->log)(LOG_WARNING, "io_uring is not supported on this platform; using pread/pwrite for cache file \"%s\"",
+          priv->filename);
+#endif
+    }
+
+    // Read the directory to build the free map and visit allocated blocks
+    if (visitor != NULL) {
+        s3b_dcache_map_dir(priv);
+        if ((r = s3b_dcache_init_free_map(priv, visitor, arg, visit_dirty, config->lazy_load)) != 0)
+            goto fail3;
+    }
+
+#if HAVE_SYS_STATVFS_H
+
+    // Warn if insufficient disk space exists on the partition
+    if (fstatvfs(priv->fd, &vfs) == 0) {
+        const uintmax_t free = (uintmax_t)vfs.f_bavail * (uintmax_t)vfs.f_bsize;
+        const uintmax_t need = (uintmax_t)DATA_OFFSET(priv, priv->max_blocks);
+        const uintmax_t used = (uintmax_t)sb.st_blocks * 512;
+
+        if (need >= used + free) {
+            char needbuf[64];
+            char freebuf[64];
+
+            describe_size(needbuf, sizeof(needbuf), need);
+            describe_size(freebuf, sizeof(freebuf), used + free);
+            (*priv->log)(LOG_WARNING,
+              "cache file \"%s\" will have size %s when completely full, but only %s is available in partition",
+              priv->filename, needbuf, freebuf);
+        }
+    }
+
+#endif
+
+    // Done
+    *dcachep = priv;
+    return 0;
+
+fail3:
+    s3b_dcache_load_done(priv);
+    if (priv->dir != NULL)
+        (void)munmap(priv->dir, priv->dir_len);
+#if USE_IO_URING
+    if (priv->ring != NULL)
+        s3b_dcache_ring_close(priv);
+#endif
+    if (priv->dfd != -1)
+        close(priv->dfd);
+    close(priv->fd);
+fail2:
+    free(priv->filename);
+fail1:
+    pthread_cond_destroy(&priv->reclaim_done);
+    pthread_mutex_destroy(&priv->bounce_mutex);
+    pthread_mutex_destroy(&priv->mutex);
+fail0:
+    bitmap_free(&priv->writing);
+    bitmap_free(&priv->dir_pending);
+    free(priv->dir_write);
+    free(priv->dir_buf);
+    bitmap_free(&priv->free_map);
+    bitmap_free(&priv->parked);
+    bitmap_free(&priv->reclaim);
+    free(priv->checksums);
+    bitmap_free(&priv->checksum_ok);
+    bitmap_free(&priv->unverified);
+    free(priv);
+    return r;
+}
+
+static int
+s3b_dcache_file_has_mount_token(struct dcache_file *priv)
+{
+    return (priv->flags & HDRFLG_NEW_FORMAT) != 0;
+}
+
+static int
+s3b_dcache_file_set_mount_token(struct dcache_file *priv, int32_t *old_valuep, int32_t new_value)
+{
+    int r;
+
+    // Read old value
+    if (old_valuep != NULL) {
+        if ((r = s3b_dcache_read(priv, offsetof(struct file_header, mount_token), old_valuep, sizeof(*old_valuep))) != 0)
+            return r;
+    }
+
+    // Write new value
+    if (new_value >= 0) {
+
+        // Update file
+        if ((r = s3b_dcache_write(priv, offsetof(struct file_header, mount_token), &new_value, sizeof(new_value))) != 0)
+            return r;
+
+        // Sync to disk
+        s3b_dcache_file_fsync(priv);
+    }
+
+    // Done
+    return 0;
+}
+
+static void
+s3b_dcache_file_close(struct dcache_file *priv)
+{
+    if (s3b_dcache_commit(priv, 1) == 0 && priv->mark_clean)
+        (void)s3b_dcache_set_clean(priv, 1);
+#if USE_IO_URING
+    if (priv->ring != NULL)
+        s3b_dcache_ring_close(priv);
+#endif
+    if (priv->dfd != -1)
+        close(priv->dfd);
+    s3b_dcache_load_done(priv);
+    if (priv->dir != NULL)
+        (void)munmap(priv->dir, priv->dir_len);
+    close(priv->fd);
+    while (priv->num_bounce > 0)
+        free(priv->bounce[--priv->num_bounce]);
+    pthread_cond_destroy(&priv->reclaim_done);
+    pthread_mutex_destroy(&priv->bounce_mutex);
+    pthread_mutex_destroy(&priv->mutex);
+    bitmap_free(&priv->writing);
+    bitmap_free(&priv->dir_pending);
+    free(priv->dir_write);
+    free(priv->dir_buf);
+    free(priv->filename);
+    bitmap_free(&priv->free_map);
+    bitmap_free(&priv->parked);
+    bitmap_free(&priv->reclaim);
+    free(priv->checksums);
+    bitmap_free(&priv->checksum_ok);
+    bitmap_free(&priv->unverified);
+    free(priv);
+}
+
+static u_int
+s3b_dcache_file_size(struct dcache_file *priv)
+{
+    return priv->num_alloc;
+}
+
+static u_int
+s3b_dcache_file_num_unloaded(struct dcache_file *priv)
+{
+    return priv->num_unloaded;
+}
+
+/*
+ * Visit up to "max" of the clean blocks that were not visited when the cache file was opened, in dslot order.
+ *
+ * If the visitor fails, that block's dslot is freed.
+ */
+static int
+s3b_dcache_file_load_next(struct dcache_file *priv, u_int max, s3b_dcache_visit_t *visitor, void *arg)
+{
+    const u_int bits_per_word = sizeof(*priv->unloaded) * 8;
+    int r;
+
+    while (max > 0 && priv->num_unloaded > 0) {
+        assert(priv->load_cursor < priv->max_blocks);
+        if (priv->unloaded[priv->load_cursor / bits_per_word] == 0) {       // skip over fully loaded words quickly
+            priv->load_cursor = (priv->load_cursor / bits_per_word + 1) * bits_per_word;
+            continue;
+        }
+        if (bitmap_test(priv->unloaded, priv->load_cursor)) {
+            if ((r = s3b_dcache_load_slot(priv, priv->load_cursor, visitor, arg)) != 0)
+                return r;
+            max--;
+        }
+        priv->load_cursor++;
+    }
+    return 0;
+}
+
+/*
+ * Visit the given block if it is one of the clean blocks that were not visited when the cache file was opened.
+ *
+ * Returns ENOENT if not found. If the visitor fails, the block's dslot is freed.
+ */
+static int
+s3b_dcache_file_load_block(struct dcache_file *priv, s3b_block_t block_num, s3b_dcache_visit_t *visitor, void *arg)
+{
+    const struct load_entry *load;
+    u_int bucket;
+    u_int i;
+
+    if (priv->num_unloaded == 0)
+        return ENOENT;
+    bucket = LOAD_BUCKET(priv, block_num);
+    for (i = priv->load_buckets[bucket]; i < priv->load_buckets[bucket + 1]; i++) {
+        load = &priv->load_index[i];
+        if (load->block_num == block_num && bitmap_test(priv->unloaded, load->dslot))     // else visited already
+            return s3b_dcache_load_slot(priv, load->dslot, visitor, arg);
+    }
+    return ENOENT;
+}
+
+/*
+ * Allocate a dslot for a block's data. We don't record this block in the directory yet;
+ * that is done by s3b_dcache_file_record_block().
+ *
+ * To keep runs of blocks together, we prefer the first free dslot at or shortly after "near", if any.
+ * Otherwise, we start a new run at a completely free free map word, so it has room to grow, or else
+ * just take the lowest numbered free dslot.
+ */
+static int
+s3b_dcache_file_alloc_block(struct dcache_file *priv, u_int near, u_int *dslotp)
+{
+    const u_int bits_per_word = sizeof(*priv->free_map) * 8;
+    const u_int num_words = bitmap_size(priv->max_blocks);
+    bitmap_t bits;
+    u_int word;
+    u_int i;
+
+    // Any free dslots?
+    if (priv->num_free == 0)
+        return ENOMEM;
+
+    // Look at or shortly after the preferred dslot
+    if (near < priv->max_blocks) {
+        word = near / bits_per_word;
+        bits = priv->free_map[word] & (~(bitmap_t)0 << (near % bits_per_word));
+        for (i = 0; bits == 0 && i < ALLOC_NEAR_WORDS && word + 1 < num_words; i++)
+            bits = priv->free_map[++word];
+        if (bits != 0)
+            goto found;
+    }
+
+    // Look for a completely free word
+    for (i = 0; i < ALLOC_SCAN_WORDS && i < num_words; i++) {
+        word = priv->free_cursor;
+        priv->free_cursor = (priv->free_cursor + 1) % num_words;
+        if ((bits = priv->free_map[word]) == ~(bitmap_t)0)
+            goto found;
+    }
+
+    // Take the lowest numbered free dslot
+    while (priv->free_map[priv->free_low] == 0)
+        priv->free_low++;
+    word = priv->free_low;
+    bits = priv->free_map[word];
+
+found:
+    // Allocate it
+    assert(bits != 0);
+    *dslotp = word * bits_per_word + (u_int)ffs((int)bits) - 1;
+    assert(*dslotp < priv->max_blocks);
+    bitmap_set(priv->free_map, *dslotp, 0);
+    priv->num_free--;
+    s3b_dcache_set_reclaim(priv, *dslotp, 0);
+
+    // Directory entry should be empty
+    assert(s3b_dcache_entry_is_empty(priv, *dslotp));
+
+    // Done
+    priv->num_alloc++;
+    return 0;
+}
+
+/*
+ * Allocate a specific dslot, if it's free.
+ *
+ * Returns EBUSY if not.
+ */
+static int
+s3b_dcache_file_alloc_at(struct dcache_file *priv, u_int dslot)
+{
+    assert(dslot < priv->max_blocks);
+    if (priv->free_map == NULL || !bitmap_test(priv->free_map, dslot))
+        return EBUSY;
+    bitmap_set(priv->free_map, dslot, 0);
+    priv->num_free--;
+    s3b_dcache_set_reclaim(priv, dslot, 0);
+    assert(s3b_dcache_entry_is_empty(priv, dslot));
+    priv->num_alloc++;
+    return 0;
+}
+
+/*
+ * Change the limit on allocated dslots in this file.
+ */
+static int
+s3b_dcache_file_set_limit(struct dcache_file *priv, u_int limit)
+{
+    const u_int bits_per_word = sizeof(*priv->free_map) * 8;
+    u_int dslot;
+
+    // Sanity check
+    assert(limit <= priv->max_blocks);
+    assert(priv->free_map != NULL);
+
+    // Allocate the map of set aside dslots the first time we shrink
+    if (limit < priv->max_blocks && priv->parked == NULL && (priv->parked = bitmap_init(priv->max_blocks, 0)) == NULL)
+        return errno;
+
+    // Growing: make the set aside dslots below the new limit available again
+    for (dslot = priv->limit; dslot < limit; dslot++) {
+        if (!bitmap_test(priv->parked, dslot))
+            continue;
+        bitmap_set(priv->parked, dslot, 0);
+        priv->num_parked--;
+        bitmap_set(priv->free_map, dslot, 1);
+        priv->num_free++;
+        if (dslot / bits_per_word < priv->free_low)
+            priv->free_low = dslot / bits_per_word;
+    }
+
+    // Shrinking: set aside free dslots at or beyond the new limit (any data they still hold is already due to be reclaimed)
+    for (dslot = limit; dslot < priv->limit; dslot++) {
+        if (!bitmap_test(priv->free_map, dslot))
+            continue;
+        bitmap_set(priv->free_map, dslot, 0);
+        priv->num_free--;
+        bitmap_set(priv->parked, dslot, 1);
+        priv->num_parked++;
+    }
+
+    // Done
+    priv->limit = limit;
+    return 0;
+}
+
+/*
+ * Record a block's dslot in the directory. After this function is called, the block will
+ * be visible in the directory and picked up after a restart.
+ *
+ * If etag != NULL, the block is CLEAN; if etag == NULL, the block is DIRTY.
+ *
+ * This should be called AFTER the data for the block has already been written.
+ *
+ * A DIRTY entry is written out before returning. A CLEAN entry may be buffered for a while,
+ * in which case it's simply forgotten if we crash before it's written.
+ *
+ * There MUST NOT be a directory entry for the block.
+ */
+static int
+s3b_dcache_file_record_block(struct dcache_file *priv, u_int dslot, s3b_block_t block_num, const u_char *etag)
+{
+    const u_int dirty = etag == NULL;
+    struct dir_entry entry;
+    int r;
+
+    // Sanity check
+    assert(dslot < priv->max_blocks);
+
+    // Directory entry should be writable
+    assert(s3b_dcache_entry_write_ok(priv, dslot, block_num, dirty));
+
+    // If cache file is older format, it doesn't store dirty blocks, so just erase it instead (prior behavior)
+    if (dirty && (priv->flags & HDRFLG_NEW_FORMAT) == 0) {
+        s3b_dcache_file_erase_block(priv, dslot);
+        return 0;
+    }
+
+    // Update directory; the entry won't be written until any new data is on disk
+    memset(&entry, 0, sizeof(entry));
+    entry.block_num = block_num;
+    entry.flags = dirty ? ENTFLG_DIRTY : 0;
+    if (!dirty) {
+        memcpy(&entry.etag, etag, MD5_DIGEST_LENGTH);
+        if ((priv->flags & HDRFLG_CHECKSUMS) != 0) {
+            uint32_t checksum;
+
+            if ((r = s3b_dcache_file_get_checksum(priv, dslot, &checksum)) != 0)
+                return r;
+            entry.checksum = checksum;
+        }
+    }
+    if ((r = s3b_dcache_update_entry(priv, dslot, &entry)) != 0)
+        return r;
+
+    // Don't let a dirty entry linger in the buffer
+    if (dirty && (r = s3b_dcache_commit(priv, 0)) != 0)
+        return r;
+
+    // Done
+    return 0;
+}
+
+/*
+ * Erase the directory entry for a dslot. After this function is called, the block will
+ * no longer be visible in the directory after a restart.
+ *
+ * This should be called BEFORE any new data for the block is written. The erasure may be
+ * buffered for a while, but s3b_dcache_file_write_block() ensures it's on disk before the dslot's
+ * data is overwritten.
+ *
+ * There MUST be a directory entry for the block.
+ */
+static int
+s3b_dcache_file_erase_block(struct dcache_file *priv, u_int dslot)
+{
+    int r;
+
+    // Sanity check
+    assert(dslot < priv->max_blocks);
+
+    // Update directory
+    if ((r = s3b_dcache_update_entry(priv, dslot, &zero_entry)) != 0)
+        return r;
+
+    // Done
+    return 0;
+}
+
+/*
+ * Free a no-longer used dslot. If it's at or beyond the limit, it's set aside instead.
+ * Either way, its data is deallocated later by s3b_dcache_file_reclaim().
+ *
+ * There MUST NOT be a directory entry for the block.
+ */
+static int
+s3b_dcache_file_free_block(struct dcache_file *priv, u_int dslot)
+{
+    const u_int bits_per_word = sizeof(*priv->free_map) * 8;
+
+    // Sanity check
+    assert(dslot < priv->max_blocks);
+    assert(!bitmap_test(priv->free_map, dslot));
+
+    // Directory entry should be empty
+    assert(s3b_dcache_entry_is_empty(priv, dslot));
+
+    // Mark dslot free, or set it aside
+    if (dslot >= priv->limit) {
+        assert(!bitmap_test(priv->parked, dslot));
+        bitmap_set(priv->parked, dslot, 1);
+        priv->num_parked++;
+    } else {
+        bitmap_set(priv->free_map, dslot, 1);
+        priv->num_free++;
+        if (dslot / bits_per_word < priv->free_low)
+            priv->free_low = dslot / bits_per_word;
+    }
+    s3b_dcache_set_reclaim(priv, dslot, 1);
+
+    // Forget its checksum
+    if (priv->checksums != NULL) {
+        bitmap_set(priv->checksum_ok, dslot, 0);
+        bitmap_set(priv->unverified, dslot, 0);
+    }
+
+    // Done
+    priv->num_alloc--;
+    return 0;
+}
+
+/*
+ * Read data from one dslot. The file's mutex is released while reading.
+ */
+static int
+s3b_dcache_file_read_block(struct dcache_file *priv, u_int dslot, void *dest, u_int off, u_int len)
+{
+    int r;
+
+    // Sanity check
+    assert(dslot < priv->max_blocks);
+    assert(off <= priv->block_size);
+    assert(len <= priv->block_size);
+    assert(off + len <= priv->block_size);
+
+    // Verify data left by a previous run the first time it's read
+    if (priv->unverified != NULL && bitmap_test(priv->unverified, dslot)) {
+        if (off == 0 && len == priv->block_size)
+            return s3b_dcache_file_verify_block(priv, dslot, dest);
+        if ((r = s3b_dcache_file_verify_block(priv, dslot, NULL)) != 0)
+            return r;
+    }
+
+    // Read data
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    if ((r = s3b_dcache_read(priv, DATA_OFFSET(priv, dslot) + off, dest, len)) == 0)
+        s3b_dcache_fadvise(priv, dslot);
+    pthread_mutex_lock(&priv->mutex);
+
+    // Done
+    return r;
+}
+
+/*
+ * Read a dslot's data into "buf" (or a temporary buffer if NULL) and verify it against its checksum.
+ * The file's mutex is released while reading.
+ *
+ * Returns EBADMSG if the data is corrupt.
+ */
+static int
+s3b_dcache_file_verify_block(struct dcache_file *priv, u_int dslot, void *buf)
+{
+    const uint32_t checksum = priv->checksums[dslot];
+    void *data = buf;
+    int r;
+
+    // Sanity check
+    assert(bitmap_test(priv->checksum_ok, dslot));
+
+    // Read data and verify checksum
+    if (data == NULL && (data = malloc(priv->block_size)) == NULL)
+        return errno;
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    if ((r = s3b_dcache_read(priv, DATA_OFFSET(priv, dslot), data, priv->block_size)) == 0
+      && s3b_dcache_checksum(priv, data) != checksum)
+        r = EBADMSG;
+    if (r == 0 && buf != NULL)
+        s3b_dcache_fadvise(priv, dslot);
+    pthread_mutex_lock(&priv->mutex);
+    if (r == 0)
+        bitmap_set(priv->unverified, dslot, 0);
+
+    // Done
+    if (data != buf)
+        free(data);
+    return r;
+}
+
+/*
+ * Get the checksum of a dslot's data, reading the data back if we don't know it.
+ * The file's mutex is released while reading.
+ */
+static int
+s3b_dcache_file_get_checksum(struct dcache_file *priv, u_int dslot, uint32_t *checksump)
+{
+    uint32_t checksum = 0;
+    void *data;
+    int r;
+
+    if (!bitmap_test(priv->checksum_ok, dslot)) {
+        if ((data = malloc(priv->block_size)) == NULL)
+            return ENOMEM;
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        if ((r = s3b_dcache_read(priv, DATA_OFFSET(priv, dslot), data, priv->block_size)) == 0)
+            checksum = s3b_dcache_checksum(priv, data);
+        pthread_mutex_lock(&priv->mutex);
+        free(data);
+        if (r != 0)
+            return r;
+        priv->checksums[dslot] = checksum;
+        bitmap_set(priv->checksum_ok, dslot, 1);
+    }
+    *checksump = priv->checksums[dslot];
+    return 0;
+}
+
+static uint32_t
+s3b_dcache_checksum(struct dcache_file *priv, const void *data)
+{
+    return (uint32_t)crc32(crc32(0L, Z_NULL, 0), data, priv->block_size);
+}
+
+/*
+ * Set or clear HDRFLG_CLEAN in the file header and sync it to disk.
+ */
+static int
+s3b_dcache_set_clean(struct dcache_file *priv, int clean)
+{
+    const uint32_t flags = priv->flags | (clean ? HDRFLG_CLEAN : 0);
+    int r;
+
+    if ((r = s3b_dcache_write(priv, offsetof(struct file_header, flags), &flags, sizeof(flags))) != 0) {
+        (*priv->log)(LOG_ERR, "error updating cache file \"%s\" header: %s", priv->filename, strerror(r));
+        return r;
+    }
+    s3b_dcache_fdatasync(priv);
+    return 0;
+}
+
+/*
+ * Write data into one dslot. The file's mutex is released while writing.
+ */
+static int
+s3b_dcache_file_write_block(struct dcache_file *priv, u_int dslot, const void *src, u_int off, u_int len)
+{
+    const off_t dslot_start = DATA_OFFSET(priv, dslot);
+    const int full = off == 0 && len == priv->block_size;
+    const struct dir_update *update;
+    u_int padding_off = priv->block_size;
+    off_t end = dslot_start + off + len;
+    uint32_t checksum = 0;
+    int zeros;
+    int r;
+
+    // Sanity check
+    assert(dslot < priv->max_blocks);
+    assert(off <= priv->block_size);
+    assert(len <= priv->block_size);
+    assert(off + len <= priv->block_size);
+    assert(!bitmap_test(priv->writing, dslot));
+
+    // Wait for any reclaiming of the dslot's disk space to finish, so it can't deallocate what we write
+    while (dslot >= priv->reclaim_start && dslot < priv->reclaim_end)
+        pthread_cond_wait(&priv->reclaim_done, &priv->mutex);
+
+    // Keep track of the data's checksum; a partial write must not cover up corruption in the rest of the block
+    if (priv->checksums != NULL) {
+        if (!full && bitmap_test(priv->unverified, dslot) && (r = s3b_dcache_file_verify_block(priv, dslot, NULL)) != 0)
+            return r;
+        bitmap_set(priv->checksum_ok, dslot, 0);
+        bitmap_set(priv->unverified, dslot, 0);
+    }
+
+    // Make sure any erasure of the dslot's previous directory entry is on disk before overwriting its data
+    if ((update = s3b_dcache_find_update(priv, dslot)) != NULL
+      && s3b_dcache_update_is_erase(update) && (r = s3b_dcache_commit(priv, 0)) != 0)
+        return r;
+
+    // If this write extends the file, pad it to keep the file size a proper multiple of one full data block (issue #222)
+    if (end > priv->file_size) {
+        padding_off = off + len;
+        if (priv->file_size > dslot_start + padding_off)
+            padding_off = (u_int)(priv->file_size - dslot_start);
+        end = dslot_start + priv->block_size;
+    }
+
+    // Write the data into the block, and any padding
+    zeros = priv->reclaim != NULL;                  // whether to look for zero filesystem blocks
+    bitmap_set(priv->writing, dslot, 1);
+    CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+    if ((r = s3b_dcache_write_block_simple(priv, dslot, src, off, len)) == 0 && padding_off < priv->block_size)
+        r = s3b_dcache_write_block_simple(priv, dslot, NULL, padding_off, priv->block_size - padding_off);
+    if (r == 0) {
+        if (priv->checksums != NULL && full)
+            checksum = s3b_dcache_checksum(priv, src != NULL ? src : zero_block);
+#if USE_FALLOCATE
+        // If any filesystem blocks may have been written with zeros, check them and reclaim their disk space later
+        zeros = zeros && (s3b_dcache_may_have_zero_fs_block(priv, dslot_start + off, src, len)
+          || (padding_off < priv->block_size
+            && s3b_dcache_may_have_zero_fs_block(priv, dslot_start + padding_off, NULL, priv->block_size - padding_off)));
+#endif
+        s3b_dcache_fadvise(priv, dslot);
+    }
+    pthread_mutex_lock(&priv->mutex);
+    bitmap_set(priv->writing, dslot, 0);
+    if (r != 0)
+        return r;
+
+    // Update state
+    if (priv->checksums != NULL && full) {
+        priv->checksums[dslot] = checksum;
+        bitmap_set(priv->checksum_ok, dslot, 1);
+    }
+    if (end > priv->file_size)
+        priv->file_size = end;
+    if (zeros)
+        s3b_dcache_set_reclaim(priv, dslot, 1);
+
+    // Done
+    return 0;
+}
+
+/*
+ * Write data (or zeros if "src" is NULL) into one dslot.
+ */
+static int
+s3b_dcache_write_block_simple(struct dcache_file *priv, u_int dslot, const void *src, u_int off, u_int len)
+{
+    return s3b_dcache_write(priv, DATA_OFFSET(priv, dslot) + off, src != NULL ? src : zero_block, len);
+}
+
+/*
+ * Advise the kernel to not cache a data block (note this may or may not work if transparent huge pages are being used).
+ */
+static void
+s3b_dcache_fadvise(struct dcache_file *priv, u_int dslot)
+{
+#if HAVE_DECL_POSIX_FADVISE
+    int r;
+
+    if (priv->fadvise && (r = posix_fadvise(priv->fd, DATA_OFFSET(priv, dslot), priv->block_size, POSIX_FADV_DONTNEED)) != 0)
+        (*priv->log)(LOG_WARNING, "posix_fadvise(\"%s\"): %s", priv->filename, strerror(r));
+#endif
+}
+
+/*
+ * Write out any buffered directory entry updates and synchronize outstanding changes to persistent storage.
+ */
+static int
+s3b_dcache_file_fsync(struct dcache_file *priv)
+{
+    return s3b_dcache_commit(priv, 1);
+}
+
+/*
+ * Reclaim disk space from up to "max" runs of unused dslots and/or dslots in use, resuming where we left off.
+ * Each run of unused dslots is deallocated entirely, once any erasures of their directory entries are on disk;
+ * each dslot in use is read back, and its runs of zero filesystem blocks are deallocated. The "buf" must have
+ * room for one block.
+ *
+ * The mutex is released while reading and deallocating; meanwhile, writes to the dslots involved wait.
+ *
+ * The amount of disk space actually freed is returned in "*reclaimedp".
+ */
+static int
+s3b_dcache_file_reclaim(struct dcache_file *priv, void *buf, u_int max, uint64_t *reclaimedp)
+{
+#if USE_FALLOCATE
+    const u_int bits_per_word = sizeof(*priv->reclaim) * 8;
+    struct stat sb;
+    blkcnt_t blocks;
+    int committed = 0;
+    int unused;
+    u_int dslot;
+    u_int end;
+    u_int i;
+    int r = 0;
+
+    // Note the disk space in use before
+    *reclaimedp = 0;
+    if (fstat(priv->fd, &sb) == -1)
+        return errno;
+    blocks = sb.st_blocks;
+
+    // Find and deallocate the next run(s); if punching holes turns out not to be supported, priv->num_reclaim drops to zero
+    while (max > 0 && priv->num_reclaim > 0) {
+        if (priv->reclaim_cursor >= priv->max_blocks)
+            priv->reclaim_cursor = 0;
+        if (priv->reclaim[priv->reclaim_cursor / bits_per_word] == 0) {     // skip over empty words quickly
+            priv->reclaim_cursor = (priv->reclaim_cursor / bits_per_word + 1) * bits_per_word;
+            continue;
+        }
+        dslot = priv->reclaim_cursor++;
+        if (!bitmap_test(priv->reclaim, dslot))
+            continue;
+        max--;
+
+        // Take a dslot in use by itself, unless it's being written (then try again later)
+        if (!(unused = s3b_dcache_dslot_unused(priv, dslot))) {
+            if (bitmap_test(priv->writing, dslot))
+                continue;
+            end = dslot + 1;
+        } else {
+
+            // Find the run of unused dslots, and make sure any erasures are on disk (once per step is enough)
+            for (end = dslot; end < priv->max_blocks && bitmap_test(priv->reclaim, end) && s3b_dcache_dslot_unused(priv, end); end++) {
+                if (!committed && bitmap_test(priv->dir_pending, end)) {
+                    if ((r = s3b_dcache_commit(priv, 0)) != 0)
+                        goto done;
+                    committed = 1;
+                }
+            }
+            priv->reclaim_cursor = end;
+        }
+        for (i = dslot; i < end; i++)
+            s3b_dcache_set_reclaim(priv, i, 0);
+
+        // Deallocate the disk space without holding the mutex; writes to these dslots wait until we're done
+        priv->reclaim_start = dslot;
+        priv->reclaim_end = end;
+        CHECK_RETURN(pthread_mutex_unlock(&priv->mutex));
+        if (unused)
+            r = s3b_dcache_punch(priv, DATA_OFFSET(priv, dslot), DATA_OFFSET(priv, end) - DATA_OFFSET(priv, dslot));
+        else
+            r = s3b_dcache_reclaim_zeros(priv, dslot, buf);
+        pthread_mutex_lock(&priv->mutex);
+        priv->reclaim_start = 0;
+        priv->reclaim_end = 0;
+        pthread_cond_broadcast(&priv->reclaim_done);
+
+        // If the filesystem doesn't support punching holes, stop reclaiming
+        if (r == EOPNOTSUPP) {
+            (*priv->log)(LOG_INFO, "cache file \"%s\" doesn't support punching holes; not reclaiming disk space",
+              priv->filename);
+            bitmap_free(&priv->reclaim);
+            priv->num_reclaim = 0;
+            r = 0;
+        }
+        if (r != 0)
+            break;
+    }
+
+done:
+    // Measure the disk space freed
+    if (fstat(priv->fd, &sb) == 0 && sb.st_blocks < blocks)
+        *reclaimedp = (uint64_t)(blocks - sb.st_blocks) * 512;
+    return r;
+#else
+    *reclaimedp = 0;
+    return 0;
+#endif
+}
+
+/*
+ * Flag or unflag a dslot as having disk space to reclaim.
+ */
+static void
+s3b_dcache_set_reclaim(struct dcache_file *priv, u_int dslot, int value)
+{
+    if (priv->reclaim == NULL || bitmap_test(priv->reclaim, dslot) == value)
+        return;
+    bitmap_set(priv->reclaim, dslot, value);
+    if (value)
+        priv->num_reclaim++;
+    else
+        priv->num_reclaim--;
+}
+
+#if USE_FALLOCATE
+
+/*
+ * Determine whether a dslot is free or set aside.
+ */
+static int
+s3b_dcache_dslot_unused(struct dcache_file *priv, u_int dslot)
+{
+    return bitmap_test(priv->free_map, dslot) || (priv->parked != NULL && bitmap_test(priv->parked, dslot));
+}
+
+/*
+ * Read back the data in a dslot in use, and deallocate its runs of zero filesystem blocks.
+ *
+ * This is called without the mutex held.
+ */
+static int
+s3b_dcache_reclaim_zeros(struct dcache_file *priv, u_int dslot, char *buf)
+{
+    const off_t start = DATA_OFFSET(priv, dslot);
+    const off_t end = start + priv->block_size;
+    off_t off = ROUNDUP2(start, (off_t)priv->file_block_size);
+    u_int num_zero_blocks;
+    int r;
+
+    if ((r = s3b_dcache_read(priv, start, buf, priv->block_size)) != 0)
+        return r;
+    while (end - off >= priv->file_block_size) {
+        if ((num_zero_blocks = s3b_dcache_count_zero_fs_blocks(priv, buf + (off - start), (u_int)(end - off))) == 0) {
+            off += priv->file_block_size;
+            continue;
+        }
+        if ((r = s3b_dcache_punch(priv, off, (off_t)num_zero_blocks * priv->file_block_size)) != 0)
+            return r;
+        off += (off_t)num_zero_blocks * priv->file_block_size;
+    }
+    return 0;
+}
+
+/*
+ * Determine whether any whole filesystem blocks within the given range of file offsets might be written with zeros.
+ * This only looks at the first ZERO_PROBE_BYTES of each, which is cheap enough for the write path;
+ * s3b_dcache_reclaim_zeros() checks them fully later.
+ */
+static int
+s3b_dcache_may_have_zero_fs_block(struct dcache_file *priv, off_t offset, const char *src, u_int len)
+{
+    const u_int skip = (u_int)(ROUNDUP2(offset, (off_t)priv->file_block_size) - offset);
+
+    // Skip the unaligned leading bit, if any
+    if (len < skip + priv->file_block_size)
+        return 0;
+    if (src == NULL)
         return 1;
-    (void)s3b_dcache_read_entry(priv, dslot, &entry);
-    old_dirty = (entry.flags & ENTFLG_DIRTY) != 0;
-    return entry.block_num == block_num && old_dirty != dirty;
+    src += skip;
+    len -= skip;
+
+    // Check the start of each whole filesystem block
+    for ( ; len >= priv->file_block_size; src += priv->file_block_size, len -= priv->file_block_size) {
+        if (memcmp(src, zero_block, ZERO_PROBE_BYTES) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Count the number of consecutive zero filesystem blocks. This compares each against the zero block using memcmp(3),
+ * which the C library typically vectorizes, and which gives up quickly on the usual non-zero data.
+ */
+static u_int
+s3b_dcache_count_zero_fs_blocks(struct dcache_file *priv, const char *src, u_int len)
+{
+    u_int num_blocks;
+
+    for (num_blocks = 0; len >= priv->file_block_size; num_blocks++) {
+        if (memcmp(src, zero_block, priv->file_block_size) != 0)
+            break;
+        src += priv->file_block_size;
+        len -= priv->file_block_size;
+    }
+    return num_blocks;
+}
+
+/*
+ * Deallocate a range of the file using FALLOC_FL_PUNCH_HOLE.
+ *
+ * Returns EOPNOTSUPP if the filesystem doesn't support that; other errors are just logged.
+ */
+static int
+s3b_dcache_punch(struct dcache_file *priv, off_t offset, off_t len)
+{
+    if (fallocate(priv->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+        return 0;
+    if (errno == EOPNOTSUPP)
+        return EOPNOTSUPP;
+    (*priv->log)(LOG_WARNING, "can't deallocate space in cache file \"%s\": %s", priv->filename, strerror(errno));
+    return 0;
+}
+
+#endif  /* USE_FALLOCATE */
+
+// Internal functions
+
+/*
+ * Translate a cache file's dslot into the overall dslot and visit it.
+ */
+static int
+s3b_dcache_visit(void *arg, s3b_block_t dslot, s3b_block_t block_num, const u_char *etag)
+{
+    const struct dcache_visit *const visit = arg;
+
+    return (*visit->visitor)(visit->arg, DSLOT(visit->dcache, visit->index, dslot), block_num, etag);
+}
+
+static uint64_t
+s3b_dcache_get_time_micros(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+/*
+ * Synchronize outstanding changes to persistent storage. Errors are logged but otherwise ignored.
+ */
+static void
+s3b_dcache_fdatasync(struct dcache_file *priv)
+{
+    int r;
+
+#if USE_IO_URING
+    if (priv->ring != NULL) {
+        struct ring_batch batch;
+
+        memset(&batch, 0, sizeof(batch));
+        s3b_dcache_ring_prep(&batch, IORING_OP_FSYNC, 0, 0, 0);
+        if ((r = s3b_dcache_ring_submit(priv, &batch)) == 0 && batch.ops[0].res < 0)
+            r = -batch.ops[0].res;
+        if (r != 0)
+            (*priv->log)(LOG_ERR, "error fsync'ing cache file \"%s\": %s", priv->filename, strerror(r));
+        return;
+    }
+#endif
+#if HAVE_DECL_FDATASYNC
+    r = fdatasync(priv->fd);
+#else
+    r = fsync(priv->fd);
+#endif
+    if (r == -1) {
+        r = errno;
+        (*priv->log)(LOG_ERR, "error fsync'ing cache file \"%s\": %s", priv->filename, strerror(r));
+    }
 }
 
+/*
+ * Read a directory entry, from the directory buffer or the memory mapped directory if we have it.
+ */
 static int
-s3b_dcache_read_entry(struct s3b_dcache *priv, u_int dslot, struct dir_entry *entry)
+s3b_dcache_read_entry(struct dcache_file *priv, u_int dslot, struct dir_entry *entry)
 {
+    const struct dir_update *update;
+
     assert(dslot < priv->max_blocks);
+    if ((update = s3b_dcache_find_update(priv, dslot)) != NULL) {
+        memcpy(entry, &update->entry, sizeof(*entry));
+        return 0;
+    }
     memset(entry, 0, sizeof(*entry));
+    if (priv->dir != NULL) {
+        memcpy(entry, priv->dir + DIR_OFFSET(priv->flags, dslot), DIR_ENTSIZE(priv->flags));
+        return 0;
+    }
     return s3b_dcache_read(priv, DIR_OFFSET(priv->flags, dslot), entry, DIR_ENTSIZE(priv->flags));
 }
+
+#ifndef NDEBUG
+static int
+s3b_dcache_entry_is_empty(struct dcache_file *priv, u_int dslot)
+{
+    struct dir_entry entry;
+
+    (void)s3b_dcache_read_entry(priv, dslot, &entry);
+    return memcmp(&entry, &zero_entry, sizeof(entry)) == 0;
+}
+
+static int
+s3b_dcache_entry_write_ok(struct dcache_file *priv, u_int dslot, s3b_block_t block_num, u_int dirty)
+{
+    struct dir_entry entry;
+    u_int old_dirty;
+
+    if (s3b_dcache_entry_is_empty(priv, dslot))
+        return 1;
+    (void)s3b_dcache_read_entry(priv, dslot, &entry);
+    old_dirty = (entry.flags & ENTFLG_DIRTY) != 0;
+    return entry.block_num == block_num && old_dirty != dirty;
+}
 #endif
 
 /*
  * Write a directory entry.
  */
 static int
-s3b_dcache_write_entry(struct s3b_dcache *priv, u_int dslot, const struct dir_entry *entry)
+s3b_dcache_write_entry(struct dcache_file *priv, u_int dslot, const struct dir_entry *entry)
 {
     assert(dslot < priv->max_blocks);
     assert((entry->flags & ~((priv->flags & HDRFLG_NEW_FORMAT) != 0 ? ENTFLG_MASK : 0)) == 0);
     return s3b_dcache_write(priv, DIR_OFFSET(priv->flags, dslot), entry, DIR_ENTSIZE(priv->flags));
 }
 
+/*
+ * Buffer an update to a directory entry, first writing out the buffer if it's full.
+ */
+static int
+s3b_dcache_update_entry(struct dcache_file *priv, u_int dslot, const struct dir_entry *entry)
+{
+    struct dir_update *update;
+    int r;
+
+    // Sanity check
+    assert(dslot < priv->max_blocks);
+    assert((entry->flags & ~((priv->flags & HDRFLG_NEW_FORMAT) != 0 ? ENTFLG_MASK : 0)) == 0);
+
+    // Replace any existing update for the same dslot, otherwise add a new one
+    if ((update = s3b_dcache_find_update(priv, dslot)) == NULL) {
+        if (priv->dir_buf_len == DIR_BUFFER_MAX && (r = s3b_dcache_commit(priv, 0)) != 0)
+            return r;
+        update = &priv->dir_buf[priv->dir_buf_len++];
+        update->dslot = dslot;
+        bitmap_set(priv->dir_pending, dslot, 1);
+    }
+    memcpy(&update->entry, entry, sizeof(update->entry));
+    return 0;
+}
+
+/*
+ * Find the buffered update for a dslot, if any.
+ */
+static struct dir_update *
+s3b_dcache_find_update(struct dcache_file *priv, u_int dslot)
+{
+    u_int i;
+
+    if (!bitmap_test(priv->dir_pending, dslot))
+        return NULL;
+    for (i = 0; i < priv->dir_buf_len; i++) {
+        if (priv->dir_buf[i].dslot == dslot)
+            return &priv->dir_buf[i];
+    }
+    assert(0);
+    return NULL;
+}
+
+/*
+ * Write out all buffered directory entry updates, using a single fdatasync(2) to order them:
+ * erased entries are written first, then the file is synced, then recorded entries are written.
+ * The sync ensures erased entries are on disk before their dslots are reused, and that the data
+ * for recorded entries is on disk before the entries themselves.
+ *
+ * If "sync" is true, the file is synced again afterward. On failure, the updates remain buffered.
+ */
+static int
+s3b_dcache_commit(struct dcache_file *priv, int sync)
+{
+    u_int i;
+    int r;
+
+    if (priv->dir_buf_len > 0) {
+        qsort(priv->dir_buf, priv->dir_buf_len, sizeof(*priv->dir_buf), s3b_dcache_update_cmp);
+        if ((r = s3b_dcache_commit_write(priv, 1)) != 0)
+            return r;
+        s3b_dcache_fdatasync(priv);
+        if ((r = s3b_dcache_commit_write(priv, 0)) != 0)
+            return r;
+        for (i = 0; i < priv->dir_buf_len; i++)
+            bitmap_set(priv->dir_pending, priv->dir_buf[i].dslot, 0);
+        priv->dir_buf_len = 0;
+    }
+    if (sync)
+        s3b_dcache_fdatasync(priv);
+    return 0;
+}
+
+/*
+ * Write out either the erased or the recorded entries in the (sorted) directory buffer.
+ *
+ * Updates that are adjacent or within the same page are coalesced into one write, with any
+ * gaps in between filled in from the current directory contents.
+ */
+static int
+s3b_dcache_commit_write(struct dcache_file *priv, int erased)
+{
+    const off_t page_size = getpagesize();
+    const u_int entsize = DIR_ENTSIZE(priv->flags);
+    off_t start;
+    off_t end;
+    u_int i;
+    u_int j;
+    u_int k;
+    int r;
+
+    for (i = 0; i < priv->dir_buf_len; i = j) {
+
+        // Skip updates of the other kind
+        if (s3b_dcache_update_is_erase(&priv->dir_buf[i]) != erased) {
+            j = i + 1;
+            continue;
+        }
+
+        // Extend this write to cover subsequent updates that are adjacent or within the same page
+        start = DIR_OFFSET(priv->flags, priv->dir_buf[i].dslot);
+        end = start + entsize;
+        for (j = i + 1; j < priv->dir_buf_len; j++) {
+            const struct dir_update *const update = &priv->dir_buf[j];
+            const off_t offset = DIR_OFFSET(priv->flags, update->dslot);
+
+            if (s3b_dcache_update_is_erase(update) != erased)
+                continue;
+            if (offset != end && offset / page_size != (end - 1) / page_size)
+                break;
+            if (offset + entsize - start > DIR_WRITE_MAX)
+                break;
+            end = offset + entsize;
+        }
+
+        // Fill in the gaps, if any
+        if (end - start > entsize) {
+            if (priv->dir != NULL)
+                memcpy(priv->dir_write, priv->dir + start, (size_t)(end - start));
+            else if ((r = s3b_dcache_read(priv, start, priv->dir_write, (size_t)(end - start))) != 0)
+                return r;
+        }
+
+        // Apply the updates and write them out
+        for (k = i; k < j; k++) {
+            const struct dir_update *const update = &priv->dir_buf[k];
+
+            if (s3b_dcache_update_is_erase(update) == erased)
+                memcpy(priv->dir_write + (DIR_OFFSET(priv->flags, update->dslot) - start), &update->entry, entsize);
+        }
+        if ((r = s3b_dcache_write(priv, start, priv->dir_write, (size_t)(end - start))) != 0)
+            return r;
+    }
+    return 0;
+}
+
+static int
+s3b_dcache_update_is_erase(const struct dir_update *update)
+{
+    return memcmp(&update->entry, &zero_entry, sizeof(zero_entry)) == 0;
+}
+
+static int
+s3b_dcache_update_cmp(const void *ptr1, const void *ptr2)
+{
+    const struct dir_update *const update1 = ptr1;
+    const struct dir_update *const update2 = ptr2;
+
+    return update1->dslot < update2->dslot ? -1 : update1->dslot > update2->dslot ? 1 : 0;
+}
+
 /*
  * Resize (and compress) an existing cache file. Upon successful return, priv->fd is closed
  * and the cache file must be re-opened.
  */
 static int
-s3b_dcache_resize_file(struct s3b_dcache *priv, const struct file_header *old_header)
+s3b_dcache_resize_file(struct dcache_file *priv, const struct file_header *old_header)
 {
     const u_int old_max_blocks = old_header->max_blocks;
     const u_int new_max_blocks = priv->max_blocks;
@@ -908,12 +2558,6 @@ s3b_dcache_resize_file(struct s3b_dcache *priv, const struct file_header *old_he
                 goto done;
             }
 
-            // Copy the directory entry
-            assert(DIR_ENTSIZE(new_header.flags) == sizeof(entry));
-            if ((r = s3b_dcache_write2(priv, new_fd, tempfile,
-              DIR_OFFSET(new_header.flags, new_dslot), &entry, sizeof(entry))) != 0)
-                goto fail;
-
             // Copy the data block
             old_data = old_data_base + (off_t)old_dslot * priv->block_size;
             new_data = new_data_base + (off_t)new_dslot * priv->block_size;
@@ -922,6 +2566,14 @@ s3b_dcache_resize_file(struct s3b_dcache *priv, const struct file_header *old_he
             if ((r = s3b_dcache_write2(priv, new_fd, tempfile, new_data, block_buf, priv->block_size)) != 0)
                 goto fail;
 
+            // Copy the directory entry, adding the checksum of a clean block if converting
+            if ((old_header->flags & HDRFLG_CHECKSUMS) == 0 && (new_header.flags & HDRFLG_CHECKSUMS) != 0
+              && (entry.flags & ENTFLG_DIRTY) == 0)
+                entry.checksum = s3b_dcache_checksum(priv, block_buf);
+            if ((r = s3b_dcache_write2(priv, new_fd, tempfile,
+              DIR_OFFSET(new_header.flags, new_dslot), &entry, DIR_ENTSIZE(new_header.flags))) != 0)
+                goto fail;
+
             // Advance to the next slot
             new_dslot++;
         }
@@ -966,7 +2618,7 @@ fail:
 }
 
 static int
-s3b_dcache_create_file(struct s3b_dcache *priv, int *fdp, const char *filename, u_int max_blocks, struct file_header *headerp)
+s3b_dcache_create_file(struct dcache_file *priv, int *fdp, const char *filename, u_int max_blocks, struct file_header *headerp)
 {
     struct file_header header;
     int r;
@@ -974,7 +2626,7 @@ s3b_dcache_create_file(struct s3b_dcache *priv, int *fdp, const char *filename,
     // Initialize header
     memset(&header, 0, sizeof(header));
     header.signature = DCACHE_SIGNATURE;
-    header.flags = HDRFLG_NEW_FORMAT;
+    header.flags = HDRFLG_NEW_FORMAT | (priv->want_checksums || (priv->flags & HDRFLG_CHECKSUMS) != 0 ? HDRFLG_CHECKSUMS : 0);
     header.header_size = HDR_SIZE(header.flags);
     header.u_int_size = sizeof(u_int);
     header.s3b_block_t_size = sizeof(s3b_block_t);
@@ -989,188 +2641,612 @@ s3b_dcache_create_file(struct s3b_dcache *priv, int *fdp, const char *filename,
         return r;
     }
 
-    // Write header
-    if ((r = s3b_dcache_write2(priv, *fdp, filename, (off_t)0, &header, sizeof(header))) != 0) {
-        (*priv->log)(LOG_ERR, "error initializing cache file \"%s\": %s", filename, strerror(r));
-        goto fail;
+    // Write header
+    if ((r = s3b_dcache_write2(priv, *fdp, filename, (off_t)0, &header, sizeof(header))) != 0) {
+        (*priv->log)(LOG_ERR, "error initializing cache file \"%s\": %s", filename, strerror(r));
+        goto fail;
+    }
+
+    // Extend the file to the required length; the directory will be filled with zeros
+    if (ftruncate(*fdp, sizeof(header)) == -1 || ftruncate(*fdp, DIR_OFFSET(header.flags, max_blocks)) == -1) {
+        r = errno;
+        (*priv->log)(LOG_ERR, "error initializing cache file \"%s\": %s", filename, strerror(r));
+        goto fail;
+    }
+
+    // Done
+    if (headerp != NULL)
+        *headerp = header;
+    return 0;
+
+fail:
+    (void)unlink(filename);
+    (void)close(*fdp);
+    *fdp = -1;
+    return r;
+}
+
+static int
+s3b_dcache_init_free_map(struct dcache_file *priv, s3b_dcache_visit_t *visitor, void *arg, u_int visit_dirty, u_int lazy)
+{
+    const u_int bits_per_word = sizeof(bitmap_t) * 8;
+    bitmap_t *used = NULL;
+    bitmap_t *dirty = NULL;
+    off_t required_size;
+    struct stat sb;
+    u_int num_dslots_used;
+    u_int dslot;
+    size_t word;
+    int r;
+
+    // Logging
+    (*priv->log)(LOG_INFO, "reading meta-data from cache file \"%s\"", priv->filename);
+    assert(visitor != NULL);
+
+    // Allocate bitmaps
+    if ((used = bitmap_init(priv->max_blocks, 0)) == NULL || (dirty = bitmap_init(priv->max_blocks, 0)) == NULL) {
+        r = errno;
+        (*priv->log)(LOG_ERR, "can't allocate bitmap: %s", strerror(r));
+        goto done;
+    }
+
+    // If loading clean blocks lazily, size the load index buckets; the scan will fill in the load index
+    if (lazy) {
+        for (priv->load_bucket_bits = 1; ((u_int)1 << priv->load_bucket_bits) < priv->max_blocks / LOAD_BUCKET_SIZE; )
+            priv->load_bucket_bits++;
+        if ((priv->unloaded = bitmap_init(priv->max_blocks, 0)) == NULL
+          || (priv->load_buckets = calloc(((size_t)1 << priv->load_bucket_bits) + 1, sizeof(*priv->load_buckets))) == NULL) {
+            r = errno;
+            (*priv->log)(LOG_ERR, "can't allocate lazy loading index: %s", strerror(r));
+            goto done;
+        }
+    }
+
+    // Inspect all directory entries
+    if ((r = s3b_dcache_scan_dir(priv, used, dirty)) != 0)
+        goto done;
+
+    // For each used dslot: nuke it if it's dirty and the visitor doesn't want dirties, otherwise visit it now or later
+    for (num_dslots_used = dslot = 0; dslot < priv->max_blocks; dslot++) {
+        struct dir_entry entry;
+
+        if (dslot % bits_per_word == 0 && used[dslot / bits_per_word] == 0) {     // skip over empty words quickly
+            dslot += bits_per_word - 1;
+            continue;
+        }
+        if (!bitmap_test(used, dslot))
+            continue;
+        if (bitmap_test(dirty, dslot) && !visit_dirty) {
+            if ((r = s3b_dcache_write_entry(priv, dslot, &zero_entry)) != 0)
+                goto done;
+            bitmap_set(used, dslot, 0);
+            continue;
+        }
+        priv->num_alloc++;
+        num_dslots_used = dslot + 1;                                    // keep track of the number of dslots in use
+        if (priv->unloaded != NULL && !bitmap_test(dirty, dslot)) {
+            bitmap_set(priv->unloaded, dslot, 1);
+            priv->num_unloaded++;
+            continue;
+        }
+        if ((r = s3b_dcache_read_entry(priv, dslot, &entry)) != 0)
+            goto done;
+        if ((r = (*visitor)(arg, dslot, entry.block_num, (entry.flags & ENTFLG_DIRTY) == 0 ? entry.etag : NULL)) != 0)
+            goto done;
+    }
+    if (priv->num_unloaded == 0)
+        s3b_dcache_load_done(priv);
+
+    // The data in clean dslots has to be verified against the checksums we found
+    if (priv->checksums != NULL) {
+        for (word = 0; word < bitmap_size(priv->max_blocks); word++)
+            priv->checksum_ok[word] = priv->unverified[word] = used[word] & ~dirty[word];
+    }
+
+    // The free map is the complement of the used map, excluding any bits beyond the last dslot
+    priv->free_map = used;
+    used = NULL;
+    bitmap_not(priv->free_map, priv->max_blocks);
+    if (priv->max_blocks % bits_per_word != 0)
+        priv->free_map[priv->max_blocks / bits_per_word] &= ((bitmap_t)1 << (priv->max_blocks % bits_per_word)) - 1;
+    priv->num_free = priv->max_blocks - priv->num_alloc;
+
+#if USE_FALLOCATE
+    // Free dslots may still hold data from before, so reclaim their disk space in the background
+    if ((priv->reclaim = bitmap_init(priv->max_blocks, 0)) == NULL) {
+        r = errno;
+        (*priv->log)(LOG_ERR, "can't allocate bitmap: %s", strerror(r));
+        goto done;
+    }
+    memcpy(priv->reclaim, priv->free_map, bitmap_size(priv->max_blocks) * sizeof(*priv->reclaim));
+    priv->num_reclaim = priv->num_free;
+#endif
+
+    // From now on, directory lookups are random
+    if (priv->dir != NULL)
+        (void)posix_madvise(priv->dir, priv->dir_len, POSIX_MADV_RANDOM);
+
+    // Verify the cache file is not truncated
+    required_size = DIR_OFFSET(priv->flags, priv->max_blocks);
+    if (num_dslots_used > 0) {
+        if (required_size < DATA_OFFSET(priv, num_dslots_used))
+            required_size = DATA_OFFSET(priv, num_dslots_used);
+    }
+    if (fstat(priv->fd, &sb) == -1) {
+        r = errno;
+        (*priv->log)(LOG_ERR, "error reading cache file \"%s\" length: %s", priv->filename, strerror(r));
+        goto done;
+    }
+    if (sb.st_size < required_size) {
+        (*priv->log)(LOG_ERR, "cache file \"%s\" is truncated (has size %ju < %ju bytes)",
+          priv->filename, (uintmax_t)sb.st_size, (uintmax_t)required_size);
+        r = EINVAL;
+        goto done;
+    }
+
+    // Discard any unreferenced data beyond the last entry
+    if (sb.st_size > required_size && ftruncate(priv->fd, required_size) == -1) {
+        r = errno;
+        (*priv->log)(LOG_ERR, "error trimming cache file \"%s\" to %ju bytes: %s",
+          priv->filename, (uintmax_t)required_size, strerror(r));
+        r = EINVAL;
+        goto done;
+    }
+
+    // Report results
+    (*priv->log)(LOG_INFO, "loaded cache file \"%s\" with %u free and %u used blocks (max index %u)",
+      priv->filename, priv->num_free, priv->num_alloc, num_dslots_used);
+    if (priv->num_unloaded > 0) {
+        (*priv->log)(LOG_INFO, "%u clean blocks in cache file \"%s\" will be loaded lazily",
+          priv->num_unloaded, priv->filename);
+    }
+
+    // Done
+    r = 0;
+
+done:
+    // Clean up
+    bitmap_free(&used);
+    bitmap_free(&dirty);
+    return r;
+}
+
+/*
+ * Memory map the header and directory so scanning and lookups read entries in place.
+ *
+ * If this fails, we fall back to pread(2).
+ */
+static void
+s3b_dcache_map_dir(struct dcache_file *priv)
+{
+    const off_t len = DIR_OFFSET(priv->flags, priv->max_blocks);
+    void *dir;
+
+    if ((off_t)(size_t)len != len)
+        return;
+    if ((dir = mmap(NULL, (size_t)len, PROT_READ, MAP_SHARED, priv->fd, 0)) == MAP_FAILED) {
+        (*priv->log)(LOG_WARNING, "can't mmap cache file \"%s\" directory: %s (ignored)", priv->filename, strerror(errno));
+        return;
+    }
+    priv->dir = dir;
+    priv->dir_len = (size_t)len;
+    (void)posix_madvise(priv->dir, priv->dir_len, POSIX_MADV_SEQUENTIAL);
+}
+
+/*
+ * Scan the directory, recording which dslots are non-empty and dirty, using multiple threads if it's big enough.
+ *
+ * The directory is divided into ranges that are multiples of DIRECTORY_READ_CHUNK entries, so no two threads
+ * ever modify the same bitmap word. If lazy loading, a second pass fills in the load index: the first pass
+ * counts each thread's clean dslots per bucket, so each thread then knows exactly where its entries go.
+ */
+static int
+s3b_dcache_scan_dir(struct dcache_file *priv, bitmap_t *used, bitmap_t *dirty)
+{
+    struct dcache_scan scans[DIRECTORY_SCAN_THREADS];
+    const u_int num_buckets = (u_int)1 << priv->load_bucket_bits;
+    u_int num_scans;
+    u_int per_scan;
+    u_int offset;
+    u_int count;
+    u_int bucket;
+    long ncpu;
+    u_int i;
+    int r;
+
+    // Decide how many threads to use
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    num_scans = ncpu < 1 ? 1 : ncpu > DIRECTORY_SCAN_THREADS ? DIRECTORY_SCAN_THREADS : (u_int)ncpu;
+    while (num_scans > 1 && priv->max_blocks / num_scans < DIRECTORY_SCAN_MIN)
+        num_scans--;
+    per_scan = ROUNDUP2((priv->max_blocks + num_scans - 1) / num_scans, DIRECTORY_READ_CHUNK);
+
+    // Divide up the directory
+    memset(scans, 0, sizeof(scans));
+    for (i = 0; i < num_scans; i++) {
+        struct dcache_scan *const scan = &scans[i];
+
+        scan->priv = priv;
+        scan->used = used;
+        scan->dirty = dirty;
+        scan->min_dslot = i * per_scan < priv->max_blocks ? i * per_scan : priv->max_blocks;
+        scan->max_dslot = priv->max_blocks - scan->min_dslot > per_scan ? scan->min_dslot + per_scan : priv->max_blocks;
+        if (priv->load_buckets != NULL && (scan->counts = calloc(num_buckets, sizeof(*scan->counts))) == NULL) {
+            r = errno;
+            (*priv->log)(LOG_ERR, "can't allocate lazy loading index: %s", strerror(r));
+            goto done;
+        }
+    }
+
+    // First pass
+    if ((r = s3b_dcache_scan_run(priv, scans, num_scans)) != 0 || priv->load_buckets == NULL)
+        goto done;
+
+    // Convert per-thread counts into fill positions and compute bucket offsets
+    for (offset = bucket = 0; bucket < num_buckets; bucket++) {
+        priv->load_buckets[bucket] = offset;
+        for (i = 0; i < num_scans; i++) {
+            count = scans[i].counts[bucket];
+            scans[i].counts[bucket] = offset;
+            offset += count;
+        }
+    }
+    priv->load_buckets[num_buckets] = offset;
+
+    // Second pass
+    if (offset > 0) {
+        if ((priv->load_index = malloc((size_t)offset * sizeof(*priv->load_index))) == NULL) {
+            r = errno;
+            (*priv->log)(LOG_ERR, "can't allocate lazy loading index: %s", strerror(r));
+            goto done;
+        }
+        for (i = 0; i < num_scans; i++)
+            scans[i].fill = 1;
+        r = s3b_dcache_scan_run(priv, scans, num_scans);
+    }
+
+done:
+    // Clean up
+    for (i = 0; i < num_scans; i++)
+        free(scans[i].counts);
+    return r;
+}
+
+/*
+ * Run one directory scan pass. The first range is scanned by the current thread, along with any range
+ * for which we can't start a thread.
+ */
+static int
+s3b_dcache_scan_run(struct dcache_file *priv, struct dcache_scan *scans, u_int num_scans)
+{
+    int started[DIRECTORY_SCAN_THREADS];
+    u_int i;
+    int r;
+
+    // Start threads
+    started[0] = 0;
+    for (i = 1; i < num_scans; i++) {
+        if ((r = pthread_create(&scans[i].thread, NULL, s3b_dcache_scan_main, &scans[i])) != 0)
+            (*priv->log)(LOG_WARNING, "can't create directory scan thread: %s (ignored)", strerror(r));
+        started[i] = r == 0;
     }
 
-    // Extend the file to the required length; the directory will be filled with zeros
-    if (ftruncate(*fdp, sizeof(header)) == -1 || ftruncate(*fdp, DIR_OFFSET(header.flags, max_blocks)) == -1) {
-        r = errno;
-        (*priv->log)(LOG_ERR, "error initializing cache file \"%s\": %s", filename, strerror(r));
-        goto fail;
+    // Scan and/or wait for threads
+    for (i = 0; i < num_scans; i++) {
+        if (started[i])
+            CHECK_RETURN(pthread_join(scans[i].thread, NULL));
+        else
+            (void)s3b_dcache_scan_main(&scans[i]);
     }
 
-    // Done
-    if (headerp != NULL)
-        *headerp = header;
+    // Check for errors
+    for (i = 0; i < num_scans; i++) {
+        if ((r = scans[i].error) != 0)
+            return r;
+    }
     return 0;
-
-fail:
-    (void)unlink(filename);
-    (void)close(*fdp);
-    *fdp = -1;
-    return r;
 }
 
-static int
-s3b_dcache_init_free_list(struct s3b_dcache *priv, s3b_dcache_visit_t *visitor, void *arg, u_int visit_dirty)
+/*
+ * Directory scan thread main entry point.
+ */
+static void *
+s3b_dcache_scan_main(void *arg)
 {
-    off_t required_size;
-    struct stat sb;
+    struct dcache_scan *const scan = arg;
+    struct dcache_file *const priv = scan->priv;
     u_int num_entries;
-    u_int num_dslots_used;
     u_int base_dslot;
     u_int i;
     int r;
 
-    // Logging
-    (*priv->log)(LOG_INFO, "reading meta-data from cache file \"%s\"", priv->filename);
-    assert(visitor != NULL);
-
-    // Inspect all directory entries
-    for (num_dslots_used = base_dslot = 0; base_dslot < priv->max_blocks; base_dslot += num_entries) {
-        char buffer[DIRECTORY_READ_CHUNK * DIR_ENTSIZE(priv->flags)];
+    for (base_dslot = scan->min_dslot; base_dslot < scan->max_dslot; base_dslot += num_entries) {
+        char buffer[DIRECTORY_READ_CHUNK * sizeof(struct dir_entry)];
+        const char *chunk = buffer;
 
-        // Read in the next chunk of directory entries
-        num_entries = priv->max_blocks - base_dslot;
+        // Get the next chunk of directory entries, in place if the directory is mapped
+        num_entries = scan->max_dslot - base_dslot;
         if (num_entries > DIRECTORY_READ_CHUNK)
             num_entries = DIRECTORY_READ_CHUNK;
-        if ((r = s3b_dcache_read(priv, DIR_OFFSET(priv->flags, base_dslot), buffer, num_entries * DIR_ENTSIZE(priv->flags))) != 0) {
+        if (priv->dir != NULL)
+            chunk = priv->dir + DIR_OFFSET(priv->flags, base_dslot);
+        else if ((r = s3b_dcache_read(priv, DIR_OFFSET(priv->flags, base_dslot), buffer, num_entries * DIR_ENTSIZE(priv->flags))) != 0) {
             (*priv->log)(LOG_ERR, "error reading cache file \"%s\" directory: %s", priv->filename, strerror(r));
-            return r;
+            scan->error = r;
+            break;
         }
 
-        // For each dslot: if free, add to the free list, else let visitor decide what to do
+        // Record each non-empty dslot, and count or index the clean ones if lazy loading
         for (i = 0; i < num_entries; i++) {
             const u_int dslot = base_dslot + i;
+            struct load_entry *load;
             struct dir_entry entry;
+            u_int bucket;
 
             memset(&entry, 0, sizeof(entry));
-            memcpy(&entry, buffer + i * DIR_ENTSIZE(priv->flags), DIR_ENTSIZE(priv->flags));
-            if (memcmp(&entry, &zero_entry, sizeof(entry)) == 0) {
-                if ((r = s3b_dcache_push(priv, dslot)) != 0)
-                    return r;
-            } else if ((entry.flags & ENTFLG_DIRTY) != 0 && !visit_dirty) {     // visitor doesn't want dirties, so just nuke it
-                if ((r = s3b_dcache_write_entry(priv, dslot, &zero_entry)) != 0)
-                    return r;
-                if ((r = s3b_dcache_push(priv, dslot)) != 0)
-                    return r;
-            } else {
-                priv->num_alloc++;
-                if (dslot + 1 > num_dslots_used)                    // keep track of the number of dslots in use
-                    num_dslots_used = dslot + 1;
-                if ((r = (*visitor)(arg, dslot, entry.block_num, (entry.flags & ENTFLG_DIRTY) == 0 ? entry.etag : NULL)) != 0)
-                    return r;
+            memcpy(&entry, chunk + i * DIR_ENTSIZE(priv->flags), DIR_ENTSIZE(priv->flags));
+            if (memcmp(&entry, &zero_entry, sizeof(entry)) == 0)
+                continue;
+            if (!scan->fill) {
+                bitmap_set(scan->used, dslot, 1);
+                if ((entry.flags & ENTFLG_DIRTY) != 0)
+                    bitmap_set(scan->dirty, dslot, 1);
+                else if (priv->checksums != NULL)
+                    priv->checksums[dslot] = entry.checksum;
+            }
+            if ((entry.flags & ENTFLG_DIRTY) != 0 || scan->counts == NULL)
+                continue;
+            bucket = LOAD_BUCKET(priv, entry.block_num);
+            if (!scan->fill) {
+                scan->counts[bucket]++;
+                continue;
             }
+            load = &priv->load_index[scan->counts[bucket]++];
+            load->block_num = entry.block_num;
+            load->dslot = dslot;
         }
     }
+    return NULL;
+}
 
-    // Reverse the free list so we allocate lower numbered slots first
-    for (i = 0; i < priv->free_list_len / 2; i++) {
-        const s3b_block_t temp = priv->free_list[i];
+/*
+ * Visit an unloaded dslot. If the visitor fails, the dslot is freed.
+ */
+static int
+s3b_dcache_load_slot(struct dcache_file *priv, u_int dslot, s3b_dcache_visit_t *visitor, void *arg)
+{
+    struct dir_entry entry;
+    int r;
 
-        priv->free_list[i] = priv->free_list[priv->free_list_len - i - 1];
-        priv->free_list[priv->free_list_len - i - 1] = temp;
-    }
+    // Sanity check
+    assert(bitmap_test(priv->unloaded, dslot));
 
-    // Verify the cache file is not truncated
-    required_size = DIR_OFFSET(priv->flags, priv->max_blocks);
-    if (num_dslots_used > 0) {
-        if (required_size < DATA_OFFSET(priv, num_dslots_used))
-            required_size = DATA_OFFSET(priv, num_dslots_used);
-    }
-    if (fstat(priv->fd, &sb) == -1) {
-        r = errno;
-        (*priv->log)(LOG_ERR, "error reading cache file \"%s\" length: %s", priv->filename, strerror(r));
+    // Visit dslot
+    if ((r = s3b_dcache_read_entry(priv, dslot, &entry)) != 0)
         return r;
-    }
-    if (sb.st_size < required_size) {
-        (*priv->log)(LOG_ERR, "cache file \"%s\" is truncated (has size %ju < %ju bytes)",
-          priv->filename, (uintmax_t)sb.st_size, (uintmax_t)required_size);
-        return EINVAL;
-    }
-
-    // Discard any unreferenced data beyond the last entry
-    if (sb.st_size > required_size && ftruncate(priv->fd, required_size) == -1) {
-        r = errno;
-        (*priv->log)(LOG_ERR, "error trimming cache file \"%s\" to %ju bytes: %s",
-          priv->filename, (uintmax_t)required_size, strerror(r));
-        return EINVAL;
+    assert((entry.flags & ENTFLG_DIRTY) == 0);
+    bitmap_set(priv->unloaded, dslot, 0);
+    priv->num_unloaded--;
+    if ((r = (*visitor)(arg, dslot, entry.block_num, entry.etag)) != 0) {
+        if (s3b_dcache_file_erase_block(priv, dslot) != 0 || s3b_dcache_file_free_block(priv, dslot) != 0)
+            (*priv->log)(LOG_ERR, "can't free dslot %u in cache file \"%s\"", dslot, priv->filename);
     }
 
-    // Report results
-    (*priv->log)(LOG_INFO, "loaded cache file \"%s\" with %u free and %u used blocks (max index %u)",
-      priv->filename, priv->free_list_len, priv->max_blocks - priv->free_list_len, num_dslots_used);
-
-    // Done
-    return 0;
+    // Free lazy loading state when no longer needed
+    if (priv->num_unloaded == 0)
+        s3b_dcache_load_done(priv);
+    return r;
 }
 
 /*
- * Push a dslot onto the free list.
+ * Free lazy loading state.
  */
+static void
+s3b_dcache_load_done(struct dcache_file *priv)
+{
+    bitmap_free(&priv->unloaded);
+    free(priv->load_index);
+    priv->load_index = NULL;
+    free(priv->load_buckets);
+    priv->load_buckets = NULL;
+    priv->num_unloaded = 0;
+}
+
 static int
-s3b_dcache_push(struct s3b_dcache *priv, u_int dslot)
+s3b_dcache_read(struct dcache_file *priv, off_t offset, void *data, size_t len)
 {
-    // Sanity check
-    assert(dslot < priv->max_blocks);
-    assert(priv->free_list_len < priv->max_blocks);
+    size_t sofar = 0;
+    ssize_t r;
+
+    // Data area accesses go through the O_DIRECT descriptor, if any
+    if (priv->dfd != -1 && offset >= priv->data)
+        return s3b_dcache_direct_read(priv, offset, data, len);
 
-    // Grow the free list array if necessary
-    if (priv->free_list_alloc == priv->free_list_len) {
-        s3b_block_t *new_free_list;
-        s3b_block_t new_free_list_alloc;
-        int r;
+#if USE_IO_URING
+    // Use io_uring if enabled; any short read is completed below
+    if (priv->ring != NULL && len > 0) {
+        struct ring_batch batch;
+
+        assert(len <= UINT_MAX);
+        memset(&batch, 0, sizeof(batch));
+        s3b_dcache_ring_prep(&batch, IORING_OP_READ, offset, (uintptr_t)data, (u_int)len);
+        if ((r = s3b_dcache_ring_submit(priv, &batch)) != 0 || (r = s3b_dcache_ring_result(priv, &batch.ops[0], &sofar)) != 0)
+            return r;
+    }
+#endif
+    for ( ; sofar < len; sofar += r) {
+        const off_t posn = offset + sofar;
 
-        new_free_list_alloc = priv->free_list_alloc == 0 ? 1024 : 2 * priv->free_list_alloc;
-        if ((new_free_list = realloc(priv->free_list, new_free_list_alloc * sizeof(*new_free_list))) == NULL) {
+        if ((r = pread(priv->fd, (char *)data + sofar, len - sofar, offset + sofar)) == -1) {
             r = errno;
-            (*priv->log)(LOG_ERR, "realloc: %s", strerror(r));
+            (*priv->log)(LOG_ERR, "error reading cache file \"%s\" at offset %ju: %s",
+              priv->filename, (uintmax_t)posn, strerror(r));
             return r;
         }
-        priv->free_list = new_free_list;
-        priv->free_list_alloc = new_free_list_alloc;
+        if (r == 0) {           // truncated input
+            (*priv->log)(LOG_ERR, "error reading cache file \"%s\" at offset %ju: file is truncated",
+              priv->filename, (uintmax_t)posn);
+            return EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int
+s3b_dcache_write(struct dcache_file *priv, off_t offset, const void *data, size_t len)
+{
+    return s3b_dcache_write2(priv, priv->fd, priv->filename, offset, data, len);
+}
+
+static int
+s3b_dcache_write2(struct dcache_file *priv, int fd, const char *filename, off_t offset, const void *data, size_t len)
+{
+    size_t sofar = 0;
+    ssize_t r;
+
+    // Data area accesses go through the O_DIRECT descriptor, if any
+    if (priv->dfd != -1 && fd == priv->fd && offset >= priv->data)
+        return s3b_dcache_direct_write(priv, offset, data, len);
+
+#if USE_IO_URING
+    // Use io_uring if enabled (only for the cache file itself); any short write is completed below
+    if (priv->ring != NULL && fd == priv->fd && len > 0) {
+        struct ring_batch batch;
+
+        assert(len <= UINT_MAX);
+        memset(&batch, 0, sizeof(batch));
+        s3b_dcache_ring_prep(&batch, IORING_OP_WRITE, offset, (uintptr_t)data, (u_int)len);
+        if ((r = s3b_dcache_ring_submit(priv, &batch)) != 0 || (r = s3b_dcache_ring_result(priv, &batch.ops[0], &sofar)) != 0)
+            return r;
     }
+#endif
+    for ( ; sofar < len; sofar += r) {
+        const off_t chunk_off = offset + sofar;
+        const size_t chunk_len = len - sofar;
 
-    // Add new dslot
-    assert(priv->free_list_len < priv->free_list_alloc);
-    priv->free_list[priv->free_list_len++] = dslot;
+        if ((r = pwrite(fd, (const char *)data + sofar, chunk_len, chunk_off)) == -1) {
+            r = errno;
+            (*priv->log)(LOG_ERR, "error writing cache file \"%s\" at offset %ju: %s",
+              filename, (uintmax_t)chunk_off, strerror(r));
+            return r;
+        }
+    }
     return 0;
 }
 
 /*
- * Pop the next dslot off of the free list. There must be one.
+ * Open the cache file a second time with O_DIRECT for reading and writing the data area, so cached blocks
+ * don't also occupy the kernel's page cache. The header and directory still go through the original descriptor.
+ *
+ * Data slots are aligned to the page size, so O_DIRECT works as long as blocks are a multiple of the page size.
+ * If O_DIRECT can't be used, we log a warning and carry on without it.
  */
 static void
-s3b_dcache_pop(struct s3b_dcache *priv, u_int *dslotp)
+s3b_dcache_direct_open(struct dcache_file *priv)
 {
-    // Sanity check
-    assert(priv->free_list_len > 0);
+    // Check alignment
+    if (priv->block_size % getpagesize() != 0 || priv->data % getpagesize() != 0) {
+        (*priv->log)(LOG_WARNING, "can't use O_DIRECT for cache file \"%s\": block size %u is not a multiple of %u",
+          priv->filename, priv->block_size, (u_int)getpagesize());
+        return;
+    }
 
-    // Pop off dslot at the head of the list
-    *dslotp = priv->free_list[--priv->free_list_len];
-    assert(*dslotp < priv->max_blocks);
+    // Open file (this fails with EINVAL if the filesystem doesn't support O_DIRECT, e.g., tmpfs)
+    if ((priv->dfd = open(priv->filename, O_RDWR|O_DIRECT|O_CLOEXEC, 0)) == -1) {
+        (*priv->log)(LOG_WARNING, "can't open cache file \"%s\" with O_DIRECT: %s", priv->filename, strerror(errno));
+        return;
+    }
 
-    // See if we can give back some memory
-    if (priv->free_list_alloc > 1024 && priv->free_list_len <= priv->free_list_alloc / 4) {
-        s3b_block_t *new_free_list;
-        s3b_block_t new_free_list_alloc;
-
-        new_free_list_alloc = priv->free_list_alloc / 4;
-        if ((new_free_list = realloc(priv->free_list, new_free_list_alloc * sizeof(*new_free_list))) == NULL)
-            (*priv->log)(LOG_ERR, "can't shrink dcache free list: realloc: %s (ignored)", strerror(errno));
-        else {
-            priv->free_list = new_free_list;
-            priv->free_list_alloc = new_free_list_alloc;
-        }
+    // The kernel no longer caches our data, so there's nothing for posix_fadvise(2) to do
+    priv->fadvise = 0;
+    (*priv->log)(LOG_INFO, "using O_DIRECT for cache file \"%s\" data", priv->filename);
+}
+
+/*
+ * Read from the data area using O_DIRECT. We read directly into the caller's buffer if everything is aligned,
+ * otherwise via an aligned bounce buffer one chunk at a time. A chunk never crosses a data slot boundary.
+ */
+static int
+s3b_dcache_direct_read(struct dcache_file *priv, off_t offset, void *data, size_t len)
+{
+    const off_t align = getpagesize();
+    char *buf;
+    int r = 0;
+
+    // Handle the aligned case
+    if (offset % align == 0 && len % align == 0 && (uintptr_t)data % align == 0)
+        return s3b_dcache_direct_xfer(priv, 0, offset, data, len, 0);
+
+    // Read via bounce buffer
+    if ((buf = s3b_dcache_bounce_get(priv)) == NULL)
+        return ENOMEM;
+    while (len > 0) {
+        const off_t start = offset - (offset - priv->data) % priv->block_size;     // start of this data slot
+        const off_t chunk_off = offset & ~(align - 1);
+        const size_t skip = (size_t)(offset - chunk_off);
+        size_t chunk_len = ROUNDUP2(skip + len, (size_t)align);
+        size_t n;
+
+        if (chunk_off + chunk_len > start + priv->block_size)
+            chunk_len = (size_t)(start + priv->block_size - chunk_off);
+        n = chunk_len - skip < len ? chunk_len - skip : len;
+        if ((r = s3b_dcache_direct_xfer(priv, 0, chunk_off, buf, chunk_len, 0)) != 0)
+            break;
+        memcpy(data, buf + skip, n);
+        data = (char *)data + n;
+        offset += n;
+        len -= n;
+    }
+    s3b_dcache_bounce_put(priv, buf);
+    return r;
+}
+
+/*
+ * Write to the data area using O_DIRECT. Unaligned pieces are merged with the existing data (read-modify-write)
+ * in an aligned bounce buffer. Bytes beyond the end of the file read as zero.
+ */
+static int
+s3b_dcache_direct_write(struct dcache_file *priv, off_t offset, const void *data, size_t len)
+{
+    const off_t align = getpagesize();
+    char *buf;
+    int r = 0;
+
+    // Handle the aligned case
+    if (offset % align == 0 && len % align == 0 && (uintptr_t)data % align == 0)
+        return s3b_dcache_direct_xfer(priv, 1, offset, (void *)(uintptr_t)data, len, 0);
+
+    // Write via bounce buffer
+    if ((buf = s3b_dcache_bounce_get(priv)) == NULL)
+        return ENOMEM;
+    while (len > 0) {
+        const off_t start = offset - (offset - priv->data) % priv->block_size;     // start of this data slot
+        const off_t chunk_off = offset & ~(align - 1);
+        const size_t skip = (size_t)(offset - chunk_off);
+        size_t chunk_len = ROUNDUP2(skip + len, (size_t)align);
+        size_t n;
+
+        if (chunk_off + chunk_len > start + priv->block_size)
+            chunk_len = (size_t)(start + priv->block_size - chunk_off);
+        n = chunk_len - skip < len ? chunk_len - skip : len;
+        if ((skip != 0 || n != chunk_len) && (r = s3b_dcache_direct_xfer(priv, 0, chunk_off, buf, chunk_len, 1)) != 0)
+            break;
+        memcpy(buf + skip, data, n);
+        if ((r = s3b_dcache_direct_xfer(priv, 1, chunk_off, buf, chunk_len, 0)) != 0)
+            break;
+        data = (const char *)data + n;
+        offset += n;
+        len -= n;
     }
-    assert(priv->free_list_len <= priv->free_list_alloc);
+    s3b_dcache_bounce_put(priv, buf);
+    return r;
 }
 
+/*
+ * Perform an aligned O_DIRECT transfer. For reads, if "zero_fill" is set, data beyond the end of the file reads as zeros.
+ */
 static int
-s3b_dcache_read(struct s3b_dcache *priv, off_t offset, void *data, size_t len)
+s3b_dcache_direct_xfer(struct dcache_file *priv, int write, off_t offset, void *buf, size_t len, int zero_fill)
 {
     size_t sofar;
     ssize_t r;
@@ -1178,13 +3254,19 @@ s3b_dcache_read(struct s3b_dcache *priv, off_t offset, void *data, size_t len)
     for (sofar = 0; sofar < len; sofar += r) {
         const off_t posn = offset + sofar;
 
-        if ((r = pread(priv->fd, (char *)data + sofar, len - sofar, offset + sofar)) == -1) {
+        r = write ? pwrite(priv->dfd, (char *)buf + sofar, len - sofar, posn) : pread(priv->dfd, (char *)buf + sofar, len - sofar, posn);
+        if (r == -1) {
             r = errno;
-            (*priv->log)(LOG_ERR, "error reading cache file \"%s\" at offset %ju: %s",
-              priv->filename, (uintmax_t)posn, strerror(r));
+            (*priv->log)(LOG_ERR, "error %s cache file \"%s\" at offset %ju: %s",
+              write ? "writing" : "reading", priv->filename, (uintmax_t)posn, strerror(r));
             return r;
         }
-        if (r == 0) {           // truncated input
+        if (r == 0) {
+            assert(!write);
+            if (zero_fill) {
+                memset((char *)buf + sofar, 0, len - sofar);
+                return 0;
+            }
             (*priv->log)(LOG_ERR, "error reading cache file \"%s\" at offset %ju: file is truncated",
               priv->filename, (uintmax_t)posn);
             return EINVAL;
@@ -1193,30 +3275,332 @@ s3b_dcache_read(struct s3b_dcache *priv, off_t offset, void *data, size_t len)
     return 0;
 }
 
+/*
+ * Get an aligned bounce buffer, big enough for one data slot, from the pool.
+ */
+static void *
+s3b_dcache_bounce_get(struct dcache_file *priv)
+{
+    void *buf = NULL;
+    int r;
+
+    pthread_mutex_lock(&priv->bounce_mutex);
+    if (priv->num_bounce > 0)
+        buf = priv->bounce[--priv->num_bounce];
+    pthread_mutex_unlock(&priv->bounce_mutex);
+    if (buf == NULL && (r = posix_memalign(&buf, getpagesize(), priv->block_size)) != 0) {
+        (*priv->log)(LOG_ERR, "can't allocate O_DIRECT buffer: %s", strerror(r));
+        buf = NULL;
+    }
+    return buf;
+}
+
+/*
+ * Return a bounce buffer to the pool.
+ */
+static void
+s3b_dcache_bounce_put(struct dcache_file *priv, void *buf)
+{
+    pthread_mutex_lock(&priv->bounce_mutex);
+    if (priv->num_bounce < DIRECT_BOUNCE_MAX) {
+        priv->bounce[priv->num_bounce++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&priv->bounce_mutex);
+    free(buf);
+}
+
+#if USE_IO_URING
+
+/*
+ * Set up io_uring(7) for the cache file. We register the file and (if permitted) a few bounce buffers.
+ */
 static int
-s3b_dcache_write(struct s3b_dcache *priv, off_t offset, const void *data, size_t len)
+s3b_dcache_ring_open(struct dcache_file *priv)
 {
-    return s3b_dcache_write2(priv, priv->fd, priv->filename, offset, data, len);
+    struct iovec iov[RING_BUFFERS];
+    struct io_uring_params params;
+    struct dcache_ring *ring;
+    int r;
+    int i;
+
+    // Initialize structure
+    if ((ring = calloc(1, sizeof(*ring))) == NULL)
+        return errno;
+    ring->sq_ptr = MAP_FAILED;
+    ring->cq_ptr = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    if ((r = pthread_mutex_init(&ring->mutex, NULL)) != 0)
+        goto fail1;
+    if ((r = pthread_cond_init(&ring->cond, NULL)) != 0)
+        goto fail2;
+
+    // Create ring
+    memset(&params, 0, sizeof(params));
+    if ((ring->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params)) == -1) {
+        r = errno;
+        goto fail3;
+    }
+    if ((params.features & IORING_FEAT_RW_CUR_POS) == 0) {      // proxy for IORING_OP_READ and IORING_OP_WRITE (Linux 5.6)
+        r = ENOTSUP;
+        goto fail4;
+    }
+    ring->sq_entries = params.sq_entries;
+
+    // Map submission and completion queues
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(u_int);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED
+      || (ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED
+      || (ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        r = errno;
+        goto fail5;
+    }
+    ring->sq_tail = (u_int *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (u_int *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (u_int *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (u_int *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (u_int *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (u_int *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+
+    // Register the cache file
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &priv->fd, 1) == 0)
+        ring->fixed_file = 1;
+
+    // Register bounce buffers; this can fail due to RLIMIT_MEMLOCK, in which case we do without
+    ring->buf_size = ROUNDUP2(priv->block_size, (u_int)getpagesize());
+    if ((r = posix_memalign((void **)&ring->bufs, getpagesize(), (size_t)RING_BUFFERS * ring->buf_size)) != 0)
+        goto fail5;
+    for (i = 0; i < RING_BUFFERS; i++) {
+        iov[i].iov_base = ring->bufs + (size_t)i * ring->buf_size;
+        iov[i].iov_len = ring->buf_size;
+    }
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, RING_BUFFERS) == 0)
+        ring->free_bufs = (1 << RING_BUFFERS) - 1;
+    else {
+        free(ring->bufs);
+        ring->bufs = NULL;
+    }
+
+    // Done
+    (*priv->log)(LOG_INFO, "using io_uring for cache file \"%s\" (%s file, %s buffers)", priv->filename,
+      ring->fixed_file ? "fixed" : "unregistered", ring->bufs != NULL ? "registered" : "unregistered");
+    priv->ring = ring;
+    return 0;
+
+fail5:
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != MAP_FAILED)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+fail4:
+    close(ring->fd);
+fail3:
+    pthread_cond_destroy(&ring->cond);
+fail2:
+    pthread_mutex_destroy(&ring->mutex);
+fail1:
+    free(ring);
+    return r;
+}
+
+static void
+s3b_dcache_ring_close(struct dcache_file *priv)
+{
+    struct dcache_ring *const ring = priv->ring;
+
+    assert(ring->in_flight == 0);
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->cq_ptr, ring->cq_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);                                    // this also unregisters the file and buffers
+    free(ring->bufs);
+    pthread_cond_destroy(&ring->cond);
+    pthread_mutex_destroy(&ring->mutex);
+    free(ring);
+    priv->ring = NULL;
 }
 
+/*
+ * Add an operation to a batch.
+ */
+static void
+s3b_dcache_ring_prep(struct ring_batch *batch, u_char opcode, off_t offset, uintptr_t addr, u_int len)
+{
+    struct ring_op *const op = &batch->ops[batch->num_ops++];
+
+    assert(batch->num_ops <= RING_BATCH_MAX);
+    op->batch = batch;
+    op->opcode = opcode;
+    op->offset = offset;
+    op->addr = addr;
+    op->len = len;
+    op->buf_index = -1;
+}
+
+/*
+ * Submit a batch of operations with a single io_uring_enter(2) call and wait for all of them to complete.
+ *
+ * The operations are hard-linked, so they execute in order even if an earlier one fails.
+ * While waiting, one thread at a time reaps completions for all threads.
+ *
+ * Returns zero if all operations completed (check their "res" fields for the outcome), else an error.
+ */
 static int
-s3b_dcache_write2(struct s3b_dcache *priv, int fd, const char *filename, off_t offset, const void *data, size_t len)
+s3b_dcache_ring_submit(struct dcache_file *priv, struct ring_batch *batch)
 {
-    size_t sofar;
-    ssize_t r;
+    struct dcache_ring *const ring = priv->ring;
+    u_int submitted;
+    u_int tail;
+    int r = 0;
+    u_int i;
 
-    for (sofar = 0; sofar < len; sofar += r) {
-        const off_t chunk_off = offset + sofar;
-        const size_t chunk_len = len - sofar;
+    // Sanity check
+    assert(batch->num_ops > 0 && batch->num_ops <= ring->sq_entries);
+
+    // Wait for room in the queues
+    pthread_mutex_lock(&ring->mutex);
+    while (ring->in_flight + batch->num_ops > ring->sq_entries)
+        pthread_cond_wait(&ring->cond, &ring->mutex);
+
+    // Fill in submission queue entries, using registered buffers when available
+    tail = *ring->sq_tail;
+    for (i = 0; i < batch->num_ops; i++) {
+        struct ring_op *const op = &batch->ops[i];
+        const u_int index = tail++ & *ring->sq_mask;
+        struct io_uring_sqe *const sqe = &ring->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = op->opcode;
+        sqe->fd = ring->fixed_file ? 0 : priv->fd;
+        if (ring->fixed_file)
+            sqe->flags |= IOSQE_FIXED_FILE;
+        if (i < batch->num_ops - 1)
+            sqe->flags |= IOSQE_IO_HARDLINK;
+        sqe->off = op->offset;
+        sqe->addr = op->addr;
+        sqe->len = op->len;
+        if (op->opcode == IORING_OP_FSYNC)
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        else if (ring->free_bufs != 0 && op->len <= ring->buf_size) {
+            char *const buf = ring->bufs + (size_t)(ffs(ring->free_bufs) - 1) * ring->buf_size;
+
+            op->buf_index = ffs(ring->free_bufs) - 1;
+            ring->free_bufs &= ~(1 << op->buf_index);
+            if (op->opcode == IORING_OP_WRITE)
+                memcpy(buf, (const void *)op->addr, op->len);
+            sqe->opcode = op->opcode == IORING_OP_WRITE ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+            sqe->addr = (uintptr_t)buf;
+            sqe->buf_index = op->buf_index;
+        }
+        sqe->user_data = (uintptr_t)op;
+        ring->sq_array[index] = index;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+    ring->in_flight += batch->num_ops;
+    batch->pending = batch->num_ops;
 
-        if ((r = pwrite(fd, (const char *)data + sofar, chunk_len, chunk_off)) == -1) {
-            r = errno;
-            (*priv->log)(LOG_ERR, "error writing cache file \"%s\" at offset %ju: %s",
-              filename, (uintmax_t)chunk_off, strerror(r));
-            return r;
+    // Submit them all at once
+    for (submitted = 0; submitted < batch->num_ops; ) {
+        const int ret = (int)syscall(__NR_io_uring_enter, ring->fd, batch->num_ops - submitted, 0, 0, NULL, 0);
+
+        if (ret >= 0) {
+            submitted += ret;
+            continue;
+        }
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            continue;
+
+        // Hard error: take back the operations the kernel did not consume (it only looks at the queue when we call it)
+        r = errno;
+        (*priv->log)(LOG_ERR, "error submitting I/O for cache file \"%s\": %s", priv->filename, strerror(r));
+        __atomic_store_n(ring->sq_tail, tail - (batch->num_ops - submitted), __ATOMIC_RELEASE);
+        ring->in_flight -= batch->num_ops - submitted;
+        batch->pending -= batch->num_ops - submitted;
+        break;
+    }
+
+    // Wait for the submitted operations to complete
+    while (batch->pending > 0) {
+        if (ring->reaping) {
+            pthread_cond_wait(&ring->cond, &ring->mutex);
+            continue;
         }
-        if (chunk_off + chunk_len > priv->file_size)
-            priv->file_size = chunk_off + chunk_len;
+        ring->reaping = 1;
+        pthread_mutex_unlock(&ring->mutex);
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+            (*priv->log)(LOG_ERR, "error waiting for I/O on cache file \"%s\": %s", priv->filename, strerror(errno));
+        pthread_mutex_lock(&ring->mutex);
+        s3b_dcache_ring_reap(ring);
+        ring->reaping = 0;
+        pthread_cond_broadcast(&ring->cond);
+    }
+
+    // Copy out read data and release registered buffers
+    for (i = 0; i < batch->num_ops; i++) {
+        struct ring_op *const op = &batch->ops[i];
+
+        if (op->buf_index == -1)
+            continue;
+        if (op->opcode == IORING_OP_READ && op->res > 0)
+            memcpy((void *)op->addr, ring->bufs + (size_t)op->buf_index * ring->buf_size, op->res);
+        ring->free_bufs |= 1 << op->buf_index;
+        op->buf_index = -1;
+    }
+    pthread_mutex_unlock(&ring->mutex);
+
+    // Done
+    return r;
+}
+
+/*
+ * Check the result of a completed read or write and report how many bytes were transferred.
+ */
+static int
+s3b_dcache_ring_result(struct dcache_file *priv, const struct ring_op *op, size_t *donep)
+{
+    int r;
+
+    assert(op->opcode == IORING_OP_READ || op->opcode == IORING_OP_WRITE);
+    if (op->res < 0) {
+        r = -op->res;
+        (*priv->log)(LOG_ERR, "error %s cache file \"%s\" at offset %ju: %s",
+          op->opcode == IORING_OP_READ ? "reading" : "writing", priv->filename, (uintmax_t)op->offset, strerror(r));
+        return r;
     }
+    *donep = (size_t)op->res;
     return 0;
 }
+
+/*
+ * Reap all available completions.
+ *
+ * This assumes the mutex is held.
+ */
+static void
+s3b_dcache_ring_reap(struct dcache_ring *ring)
+{
+    const u_int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    u_int head;
+
+    for (head = *ring->cq_head; head != tail; head++) {
+        const struct io_uring_cqe *const cqe = &ring->cqes[head & *ring->cq_mask];
+        struct ring_op *const op = (struct ring_op *)(uintptr_t)cqe->user_data;
+
+        op->res = cqe->res;
+        assert(op->batch->pending > 0);
+        op->batch->pending--;
+        assert(ring->in_flight > 0);
+        ring->in_flight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif  /* USE_IO_URING */
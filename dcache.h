@@ -46,21 +46,56 @@ struct block_cache_conf;
  * Startup visitor callback. Each non-empty slot in the disk cache is visited.
  *
  * The "etag" pointer is NULL for dirty blocks, and not NULL for clean blocks.
+ *
+ * With lazy loading, clean blocks are instead visited later via s3b_dcache_load_next() and s3b_dcache_load_block().
  */
 typedef int s3b_dcache_visit_t(void *arg, s3b_block_t dslot, s3b_block_t block_num, const u_char *etag);
 
+// Passed to s3b_dcache_alloc_block() when there is no previous block
+#define S3B_DCACHE_NO_DSLOT     ((u_int)-1)
+
+// Statistics for one cache file
+struct s3b_dcache_stats {
+    u_int           size;                   // capacity in blocks (current limit)
+    u_int           used;                   // number of dslots in use
+    u_int           reads;
+    u_int           writes;
+    uint64_t        read_bytes;
+    uint64_t        write_bytes;
+    uint64_t        read_micros;            // cumulative time spent reading data
+    uint64_t        write_micros;           // cumulative time spent writing data
+    uint64_t        reclaimed_bytes;        // disk space freed by s3b_dcache_reclaim()
+    uint64_t        disk_bytes;             // disk space currently allocated to the file
+};
+
 // dcache.c
 extern int s3b_dcache_open(struct s3b_dcache **dcachep,
   struct block_cache_conf *config, s3b_dcache_visit_t *visitor, void *arg, u_int visit_dirty);
 extern void s3b_dcache_close(struct s3b_dcache *dcache);
+extern int s3b_dcache_exists(const struct block_cache_conf *config);
+extern int s3b_dcache_trusted(const struct block_cache_conf *config);
 extern u_int s3b_dcache_size(struct s3b_dcache *dcache);
-extern int s3b_dcache_alloc_block(struct s3b_dcache *priv, u_int *dslotp);
+extern u_int s3b_dcache_num_unloaded(struct s3b_dcache *dcache);
+extern int s3b_dcache_load_next(struct s3b_dcache *dcache, u_int max, s3b_dcache_visit_t *visitor, void *arg);
+extern int s3b_dcache_load_block(struct s3b_dcache *dcache, s3b_block_t block_num, s3b_dcache_visit_t *visitor, void *arg);
+extern int s3b_dcache_alloc_block(struct s3b_dcache *priv, s3b_block_t block_num, u_int prev_dslot, u_int *dslotp);
+extern u_int s3b_dcache_num_dslots(struct s3b_dcache *dcache);
+extern u_int s3b_dcache_get_limit(struct s3b_dcache *dcache);
+extern int s3b_dcache_set_limit(struct s3b_dcache *dcache, u_int limit);
+extern u_int s3b_dcache_num_excess(struct s3b_dcache *dcache);
+extern u_int s3b_dcache_reclaim_pending(struct s3b_dcache *dcache);
+extern int s3b_dcache_reclaim(struct s3b_dcache *dcache, void *buf, u_int max);
+extern int s3b_dcache_block_at(struct s3b_dcache *dcache, u_int dslot, s3b_block_t *block_nump);
+extern int s3b_dcache_move_block(struct s3b_dcache *dcache, u_int dslot, u_int new_dslot, void *buf);
+extern int s3b_dcache_verify_block(struct s3b_dcache *dcache, u_int dslot);
 extern int s3b_dcache_record_block(struct s3b_dcache *priv, u_int dslot, s3b_block_t block_num, const u_char *etag);
 extern int s3b_dcache_erase_block(struct s3b_dcache *priv, u_int dslot);
 extern int s3b_dcache_free_block(struct s3b_dcache *dcache, u_int dslot);
 extern int s3b_dcache_read_block(struct s3b_dcache *dcache, u_int dslot, void *dest, u_int off, u_int len);
 extern int s3b_dcache_write_block(struct s3b_dcache *dcache, u_int dslot, const void *src, u_int off, u_int len);
 extern int s3b_dcache_fsync(struct s3b_dcache *dcache);
+extern u_int s3b_dcache_get_stats(struct s3b_dcache *dcache, struct s3b_dcache_stats *stats, u_int max);
+extern void s3b_dcache_clear_stats(struct s3b_dcache *dcache);
 extern int s3b_dcache_has_mount_token(struct s3b_dcache *priv);
 extern int s3b_dcache_set_mount_token(struct s3b_dcache *priv, int32_t *old_valuep, int32_t new_value);
 
@@ -91,6 +91,7 @@ static void fuse_op_getattr_stats(struct fuse_ops_private *priv, struct stat_fil
 // Stats functions
 static struct stat_file *fuse_op_stats_create(struct fuse_ops_private *priv);
 static void fuse_op_stats_destroy(struct stat_file *sfile);
+static int fuse_op_stats_control(const char *buf, size_t size);
 static printer_t fuse_op_stats_printer;
 static printer_t stats_mirror_printer;
 static void *stats_mirror_thread(void *arg);
@@ -315,6 +316,8 @@ static void
 fuse_op_getattr_stats(struct fuse_ops_private *priv, struct stat_file *sfile, struct stat *st)
 {
     st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    if (config->control != NULL)
+        st->st_mode |= S_IWUSR;
     st->st_nlink = 1;
     st->st_ino = STATS_INODE;
     st->st_uid = config->uid;
@@ -453,14 +456,14 @@ fuse_op_write(const char *path, const char *buf, size_t size, off_t offset, stru
     size_t orig_size = size;
     int r;
 
+    // Handle stats file
+    if (fi->fh != 0)
+        return fuse_op_stats_control(buf, size);
+
     // Handle read-only flag
     if (config->read_only)
         return -EROFS;
 
-    // Handle stats file
-    if (fi->fh != 0)
-        return -EINVAL;
-
     // Check for end of file
     if (offset > priv->file_size) {
         (*config->log)(LOG_ERR, "write offset=0x%jx size=0x%jx out of range", (uintmax_t)offset, (uintmax_t)size);
@@ -620,6 +623,29 @@ fuse_op_stats_destroy(struct stat_file *sfile)
     free(sfile);
 }
 
+/*
+ * Handle a command written to the stats file, e.g., "blockCacheSize=1000", ignoring trailing whitespace.
+ */
+static int
+fuse_op_stats_control(const char *buf, size_t size)
+{
+    char command[128];
+    size_t len = size;
+    int r;
+
+    if (config->control == NULL)
+        return -EINVAL;
+    while (len > 0 && isspace((u_char)buf[len - 1]))
+        len--;
+    if (len >= sizeof(command))
+        return -EINVAL;
+    memcpy(command, buf, len);
+    command[len] = '\0';
+    if ((r = (*config->control)(command)) != 0)
+        return -r;
+    return size;
+}
+
 static void
 fuse_op_stats_printer(void *prarg, const char *fmt, ...)
 {
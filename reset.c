@@ -50,7 +50,6 @@ s3backer_reset(struct s3b_config *config)
 {
     struct s3backer_store *s3b = NULL;
     struct s3b_dcache *dcache = NULL;
-    struct stat cache_file_stat;
     int ok = 0;
     int r;
 
@@ -72,9 +71,9 @@ s3backer_reset(struct s3b_config *config)
 
     // Open disk cache file, if any, and clear the mount token there too
     if (config->block_cache.cache_file != NULL) {
-        if (stat(config->block_cache.cache_file, &cache_file_stat) == -1) {
-            if (errno != ENOENT) {
-                warnx("error opening cache file \"%s\"", config->block_cache.cache_file);
+        if ((r = s3b_dcache_exists(&config->block_cache)) != 0) {
+            if (r != ENOENT) {
+                warnx("error opening cache file \"%s\": %s", config->block_cache.cache_file, strerror(r));
                 goto fail;
             }
         } else {
@@ -82,12 +82,28 @@
 #define S3BACKER_DEFAULT_BLOCK_CACHE_WRITE_DELAY    250             // 250ms
 #define S3BACKER_DEFAULT_BLOCK_CACHE_TIMEOUT        0
 #define S3BACKER_DEFAULT_BLOCK_CACHE_MAX_DIRTY      0
+#define S3BACKER_DEFAULT_BLOCK_CACHE_WRITE_BATCH    1
+#define S3BACKER_DEFAULT_BLOCK_CACHE_MIN_SIZE       0
+#define S3BACKER_DEFAULT_BLOCK_CACHE_PRESSURE       10              // 10%
+#define S3BACKER_DEFAULT_BLOCK_CACHE_PRESSURE_FILE  "/proc/pressure/memory"
 #define S3BACKER_DEFAULT_READ_AHEAD                 4
 #define S3BACKER_DEFAULT_READ_AHEAD_TRIGGER         2
+#define S3BACKER_DEFAULT_READ_AHEAD_STREAMS         8
+#define S3BACKER_DEFAULT_READ_AHEAD_MAX             32
+#define S3BACKER_DEFAULT_READ_AHEAD_THREADS         8
 #define S3BACKER_DEFAULT_COMPRESSION                "deflate"
+#if ZSTD
+#define S3BACKER_DEFAULT_BLOCK_CACHE_COMPRESSION    "zstd"
+#else
+#define S3BACKER_DEFAULT_BLOCK_CACHE_COMPRESSION    "deflate"
+#endif
+#define S3BACKER_BLOCK_CACHE_COMPRESSION_LEVEL      "1"
 #define S3BACKER_DEFAULT_ENCRYPTION                 "AES-128-CBC"
 #define S3BACKER_DEFAULT_LIST_BLOCKS_THREADS        16
 
+// Keys for command line flags that need special handling
+#define OPT_KEY_BLOCK_CACHE_FILE                    1               // "--blockCacheFile", which may be repeated
+
 // Macro for quoting stuff
 #define s3bquote0(x)                    #x
 #define s3bquote(x)                     s3bquote0(x)
@@ -106,6 +122,7 @@
 
 static print_stats_t s3b_config_print_stats;
 static clear_stats_t s3b_config_clear_stats;
+static control_t s3b_config_control;
 
 static int option_flag_appears(const char *option_flag);
 static void insert_fuse_arg(int pos, const char *arg);
@@ -114,7 +131,10 @@ static void remove_fuse_arg(int pos);
 static void read_fuse_args(const char *filename, int pos);
 static int search_access_for(const char *file, const char *accessId, char **idptr, char **pwptr);
 static int handle_unknown_option(void *data, const char *arg, int key, struct fuse_args *outargs);
+static int handle_keyed_option(void *data, const char *arg, int key, struct fuse_args *outargs);
 static int validate_config(int parse_only);
+static int parse_block_cache_ranges(const char *list);
+static int block_cache_range_cmp(const void *ptr1, const void *ptr2);
 
 /****************************************************************************
  *                          VARIABLE DEFINITIONS                            *
@@ -154,6 +174,9 @@ static const char *const s3_storage_classes[] = {
 
 // Configuration structure
 static char user_agent_buf[64];
+
+// Handler for command line flags we don't recognize
+static fuse_opt_proc_t unknown_option_handler;
 static struct s3b_config config = {
 
     // HTTP config
@@ -186,9 +209,16 @@ static struct s3b_config config = {
         .num_threads=           S3BACKER_DEFAULT_BLOCK_CACHE_NUM_THREADS,
         .write_delay=           S3BACKER_DEFAULT_BLOCK_CACHE_WRITE_DELAY,
         .max_dirty=             S3BACKER_DEFAULT_BLOCK_CACHE_MAX_DIRTY,
+        .write_batch=           S3BACKER_DEFAULT_BLOCK_CACHE_WRITE_BATCH,
+        .min_size=              S3BACKER_DEFAULT_BLOCK_CACHE_MIN_SIZE,
+        .pressure=              S3BACKER_DEFAULT_BLOCK_CACHE_PRESSURE,
+        .pressure_file=         NULL,           // default S3BACKER_DEFAULT_BLOCK_CACHE_PRESSURE_FILE
         .timeout=               S3BACKER_DEFAULT_BLOCK_CACHE_TIMEOUT,
         .read_ahead=            S3BACKER_DEFAULT_READ_AHEAD,
         .read_ahead_trigger=    S3BACKER_DEFAULT_READ_AHEAD_TRIGGER,
+        .read_ahead_streams=    S3BACKER_DEFAULT_READ_AHEAD_STREAMS,
+        .read_ahead_max=        S3BACKER_DEFAULT_READ_AHEAD_MAX,
+        .read_ahead_threads=    S3BACKER_DEFAULT_READ_AHEAD_THREADS,
     },
 
     // FUSE operations config
@@ -295,6 +325,14 @@ static const struct fuse_opt option_list[] = {
         .templ=     "--blockCacheTimeout=%u",
         .offset=    offsetof(struct s3b_config, block_cache.timeout),
     },
+    {
+        .templ=     "--blockCacheShutdownThreads=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.shutdown_threads),
+    },
+    {
+        .templ=     "--blockCacheShutdownTimeout=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.shutdown_timeout),
+    },
     {
         .templ=     "--blockCacheWriteDelay=%u",
         .offset=    offsetof(struct s3b_config, block_cache.write_delay),
@@ -303,11 +341,42 @@ static const struct fuse_opt option_list[] = {
         .templ=     "--blockCacheMaxDirty=%u",
         .offset=    offsetof(struct s3b_config, block_cache.max_dirty),
     },
+    {
+        .templ=     "--blockCacheWriteBatch=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.write_batch),
+    },
+    {
+        .templ=     "--blockCacheCompress=%s",
+        .offset=    offsetof(struct s3b_config, block_cache_compress_str),
+    },
+    {
+        .templ=     "--blockCacheCompressAlg=%s",
+        .offset=    offsetof(struct s3b_config, block_cache_compress_alg),
+    },
+    {
+        .templ=     "--blockCacheDedup",
+        .offset=    offsetof(struct s3b_config, block_cache.dedup),
+        .value=     1
+    },
+    {
+        .templ=     "--blockCacheSkipUnchanged",
+        .offset=    offsetof(struct s3b_config, block_cache.skip_unchanged),
+        .value=     1
+    },
+    {
+        .templ=     "--blockCachePartialWrites",
+        .offset=    offsetof(struct s3b_config, block_cache.partial_writes),
+        .value=     1
+    },
     {
         .templ=     "--blockCacheRecoverDirtyBlocks",
         .offset=    offsetof(struct s3b_config, block_cache.recover_dirty_blocks),
         .value=     1
     },
+    {
+        .templ=     "--blockCacheRecoverThreads=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.recover_threads),
+    },
     {
         .templ=     "--readAhead=%u",
         .offset=    offsetof(struct s3b_config, block_cache.read_ahead),
@@ -316,13 +385,51 @@ static const struct fuse_opt option_list[] = {
         .templ=     "--readAheadTrigger=%u",
         .offset=    offsetof(struct s3b_config, block_cache.read_ahead_trigger),
     },
+    {
+        .templ=     "--readAheadStreams=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.read_ahead_streams),
+    },
+    {
+        .templ=     "--readAheadMax=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.read_ahead_max),
+    },
+    {
+        .templ=     "--readAheadReverse",
+        .offset=    offsetof(struct s3b_config, block_cache.read_ahead_reverse),
+        .value=     1
+    },
+    {
+        .templ=     "--readAheadStride=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.read_ahead_stride),
+    },
+    {
+        .templ=     "--readAheadThreads=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.read_ahead_threads),
+    },
     {
         .templ=     "--blockCacheNumProtected=%u",
         .offset=    offsetof(struct s3b_config, block_cache.num_protected),
     },
+    {
+        .templ=     "--blockCachePriority=%s",
+        .offset=    offsetof(struct s3b_config, block_cache_priority_str),
+    },
+    {
+        .templ=     "--blockCacheMinSize=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.min_size),
+    },
+    {
+        .templ=     "--blockCachePressure=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.pressure),
+    },
+    {
+        .templ=     "--blockCachePressureFile=%s",
+        .offset=    offsetof(struct s3b_config, block_cache.pressure_file),
+    },
     {
         .templ=     "--blockCacheFile=%s",
-        .offset=    offsetof(struct s3b_config, block_cache.cache_file),
+        .offset=    -1U,                                // see FUSE_OPT_KEY()
+        .value=     OPT_KEY_BLOCK_CACHE_FILE
     },
     {
         .templ=     "--blockCacheNoVerify",
@@ -334,6 +441,49 @@ static const struct fuse_opt option_list[] = {
         .offset=    offsetof(struct s3b_config, block_cache.fadvise),
         .value=     1
     },
+    {
+        .templ=     "--blockCacheFileIOUring",
+        .offset=    offsetof(struct s3b_config, block_cache.io_uring),
+        .value=     1
+    },
+    {
+        .templ=     "--blockCacheFileDirectIO",
+        .offset=    offsetof(struct s3b_config, block_cache.direct_io),
+        .value=     1
+    },
+    {
+        .templ=     "--blockCacheFileLazyLoad",
+        .offset=    offsetof(struct s3b_config, block_cache.lazy_load),
+        .value=     1
+    },
+    {
+        .templ=     "--blockCacheFileMemory=%s",
+        .offset=    offsetof(struct s3b_config, block_cache_memory_str),
+    },
+    {
+        .templ=     "--blockCacheFileMaxSize=%u",
+        .offset=    offsetof(struct s3b_config, block_cache.max_size),
+    },
+    {
+        .templ=     "--blockCacheFileStripeHash",
+        .offset=    offsetof(struct s3b_config, block_cache.stripe_hash),
+        .value=     1
+    },
+    {
+        .templ=     "--blockCacheFileDefrag",
+        .offset=    offsetof(struct s3b_config, block_cache.defrag),
+        .value=     1
+    },
+    {
+        .templ=     "--blockCacheFileChecksums",
+        .offset=    offsetof(struct s3b_config, block_cache.checksums),
+        .value=     1
+    },
+    {
+        .templ=     "--blockCacheFileTrusted",
+        .offset=    offsetof(struct s3b_config, block_cache.trusted),
+        .value=     1
+    },
     {
         .templ=     "--blockSize=%s",
         .offset=    offsetof(struct s3b_config, block_size_str),
@@ -601,7 +751,8 @@ s3backer_get_config2(int argc, char **argv, int nbd, int parse_only, fuse_opt_pr
       || (config.http_io.authVersion = strdup(S3BACKER_DEFAULT_AUTH_VERSION)) == NULL
       || (config.prefix = strdup(S3BACKER_DEFAULT_PREFIX)) == NULL
       || (config.fuse_ops.filename = strdup(S3BACKER_DEFAULT_FILENAME)) == NULL
-      || (config.fuse_ops.stats_filename = strdup(S3BACKER_DEFAULT_STATS_FILENAME)) == NULL)
+      || (config.fuse_ops.stats_filename = strdup(S3BACKER_DEFAULT_STATS_FILENAME)) == NULL
+      || (config.block_cache.pressure_file = strdup(S3BACKER_DEFAULT_BLOCK_CACHE_PRESSURE_FILE)) == NULL)
         err(1, "strdup");
 
     // NBDKit adjustments
@@ -631,6 +782,8 @@ s3backer_get_config2(int argc, char **argv, int nbd, int parse_only, fuse_opt_pr
     if (nbd && !parse_only) {
         config.block_cache.read_ahead = 0;
         config.block_cache.read_ahead_trigger = 0;
+        config.block_cache.read_ahead_max = 0;
+        config.block_cache.read_ahead_threads = 0;
     }
 
     // Append command line args
@@ -710,12 +863,30 @@ s3backer_get_config2(int argc, char **argv, int nbd, int parse_only, fuse_opt_pr
             "blockCacheSync",
             "blockCacheThreads",
             "blockCacheTimeout",
+            "blockCacheShutdownThreads",
+            "blockCacheShutdownTimeout",
             "blockCacheWriteDelay",
             "blockCacheMaxDirty",
+            "blockCacheWriteBatch",
+            "blockCacheCompress",
+            "blockCacheCompressAlg",
+            "blockCacheDedup",
+            "blockCacheSkipUnchanged",
+            "blockCachePartialWrites",
             "blockCacheRecoverDirtyBlocks",
+            "blockCacheRecoverThreads",
             "readAhead",
             "readAheadTrigger",
+            "readAheadStreams",
+            "readAheadMax",
+            "readAheadReverse",
+            "readAheadStride",
+            "readAheadThreads",
             "blockCacheNumProtected",
+            "blockCachePriority",
+            "blockCacheMinSize",
+            "blockCachePressure",
+            "blockCachePressureFile",
             "blockCacheFile",
             "blockCacheNoVerify",
             "blockCacheFileAdvise",
@@ -734,7 +905,8 @@ s3backer_get_config2(int argc, char **argv, int nbd, int parse_only, fuse_opt_pr
     }
 
     // Parse command line flags
-    if (fuse_opt_parse(&config.fuse_args, &config, dup_option_list, unknown_handler) != 0)
+    unknown_option_handler = unknown_handler;
+    if (fuse_opt_parse(&config.fuse_args, &config, dup_option_list, handle_keyed_option) != 0)
         return NULL;
 
     // Validate configuration
@@ -748,6 +920,8 @@ s3backer_get_config2(int argc, char **argv, int nbd, int parse_only, fuse_opt_pr
     // Set up fuse_ops callbacks
     config.fuse_ops.print_stats = s3b_config_print_stats;
     config.fuse_ops.clear_stats = s3b_config_clear_stats;
+    if (config.block_cache.cache_size > 0 && config.block_cache.cache_file != NULL)
+        config.fuse_ops.control = s3b_config_control;
     config.fuse_ops.s3bconf = &config;
 
     // Debug
@@ -944,8 +1118,16 @@ s3b_cleanup(void)
     FREE_NULL(config.http_io.region);
     FREE_NULL(config.http_io.sse);
     FREE_NULL(config.http_io.sse_key_id);
-    FREE_NULL(config.block_cache.cache_file);
+    while (config.block_cache.num_cache_files > 0)
+        free(config.block_cache.cache_files[--config.block_cache.num_cache_files]);
+    FREE_NULL(config.block_cache.cache_files);
+    config.block_cache.cache_file = NULL;
+    FREE_NULL(config.block_cache.pressure_file);
     FREE_NULL(config.block_size_str);
+    FREE_NULL(config.block_cache_compress_str);
+    FREE_NULL(config.block_cache_compress_alg);
+    FREE_NULL(config.block_cache_memory_str);
+    FREE_NULL(config.block_cache_priority_str);
     FREE_NULL(config.max_speed_str[HTTP_UPLOAD]);
     FREE_NULL(config.max_speed_str[HTTP_DOWNLOAD]);
     FREE_NULL(config.prefix);
@@ -969,11 +1151,16 @@ s3b_cleanup(void)
 
     // Misc
     FREE_NULL(zero_block);
+    FREE_NULL(config.block_cache.ranges);
     fuse_opt_free_args(&config.fuse_args);
     if (config.http_io.compress_alg != NULL) {
         (*config.http_io.compress_alg->lfree)(config.http_io.compress_level);
         config.http_io.compress_level = NULL;
     }
+    if (config.block_cache.compress_alg != NULL) {
+        (*config.block_cache.compress_alg->lfree)(config.block_cache.compress_level);
+        config.block_cache.compress_level = NULL;
+    }
 
     // Done
     memset(&config, 0, sizeof(config));
@@ -1057,8 +1244,10 @@ s3b_config_print_stats(void *prarg, printer_t *printer)
     if (block_cache_store != NULL) {
         double read_hit_ratio = 0.0;
         double write_hit_ratio = 0.0;
+        double read_ahead_hit_ratio = 0.0;
         u_int total_reads;
         u_int total_writes;
+        u_int i;
 
         total_reads = block_cache_stats.read_hits + block_cache_stats.read_misses;
         if (total_reads != 0)
@@ -1066,6 +1255,8 @@ s3b_config_print_stats(void *prarg, printer_t *printer)
         total_writes = block_cache_stats.write_hits + block_cache_stats.write_misses;
         if (total_writes != 0)
             write_hit_ratio = (double)block_cache_stats.write_hits / (double)total_writes;
+        if (block_cache_stats.read_ahead_blocks != 0)
+            read_ahead_hit_ratio = (double)block_cache_stats.read_ahead_hits / (double)block_cache_stats.read_ahead_blocks;
         (*printer)(prarg, "%-28s %u blocks\n", "block_cache_current_size", block_cache_stats.current_size);
         (*printer)(prarg, "%-28s %u blocks\n", "block_cache_initial_size", block_cache_stats.initial_size);
         (*printer)(prarg, "%-28s %.8f\n", "block_cache_dirty_ratio", block_cache_stats.dirty_ratio);
@@ -1077,6 +1268,112 @@ s3b_config_print_stats(void *prarg, printer_t *printer)
         (*printer)(prarg, "%-28s %.8f\n", "block_cache_write_hit_ratio", write_hit_ratio);
         (*printer)(prarg, "%-28s %u\n", "block_cache_verified", block_cache_stats.verified);
         (*printer)(prarg, "%-28s %u\n", "block_cache_mismatch", block_cache_stats.mismatch);
+        (*printer)(prarg, "%-28s %u\n", "block_cache_writes_skipped", block_cache_stats.writes_skipped);
+        (*printer)(prarg, "%-28s %u\n", "block_cache_ra_streams", block_cache_stats.read_ahead_streams);
+        (*printer)(prarg, "%-28s %u\n", "block_cache_ra_blocks", block_cache_stats.read_ahead_blocks);
+        (*printer)(prarg, "%-28s %u\n", "block_cache_ra_hits", block_cache_stats.read_ahead_hits);
+        (*printer)(prarg, "%-28s %.8f\n", "block_cache_ra_hit_ratio", read_ahead_hit_ratio);
+        (*printer)(prarg, "%-28s %u\n", "block_cache_ra_reverse_hits", block_cache_stats.read_ahead_reverse_hits);
+        (*printer)(prarg, "%-28s %u\n", "block_cache_ra_stride_hits", block_cache_stats.read_ahead_stride_hits);
+        (*printer)(prarg, "%-28s %u\n", "block_cache_ra_wasted", block_cache_stats.read_ahead_wasted);
+        (*printer)(prarg, "%-28s %u blocks\n", "block_cache_ra_window", block_cache_stats.read_ahead_window);
+        (*printer)(prarg, "%-28s %u blocks\n", "block_cache_ra_queue", block_cache_stats.read_ahead_queue);
+        (*printer)(prarg, "%-28s %u threads\n", "block_cache_ra_threads", block_cache_stats.read_ahead_threads);
+        (*printer)(prarg, "%-28s %u threads\n", "block_cache_ra_busy", block_cache_stats.read_ahead_busy);
+        (*printer)(prarg, "%-28s %.8f\n", "block_cache_ra_utilization", block_cache_stats.read_ahead_utilization);
+        (*printer)(prarg, "%-28s %u blocks\n", "block_cache_wb_queue", block_cache_stats.writeback_queue);
+        (*printer)(prarg, "%-28s %u threads\n", "block_cache_wb_busy", block_cache_stats.writeback_busy);
+        (*printer)(prarg, "%-28s %.8f\n", "block_cache_wb_utilization", block_cache_stats.writeback_utilization);
+        for (i = 0; i < BLOCK_CACHE_WRITE_BATCH_BUCKETS; i++) {
+            char name[32];
+
+            if (i == BLOCK_CACHE_WRITE_BATCH_BUCKETS - 1)
+                snvprintf(name, sizeof(name), "block_cache_wb_batch_%u+", 1U << i);
+            else if (i == 0)
+                snvprintf(name, sizeof(name), "block_cache_wb_batch_%u", 1U << i);
+            else
+                snvprintf(name, sizeof(name), "block_cache_wb_batch_%u-%u", 1U << i, (2U << i) - 1);
+            (*printer)(prarg, "%-28s %u\n", name, block_cache_stats.write_batches[i]);
+        }
+        if (config.block_cache.compress_size > 0) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_zc_size", block_cache_stats.compressed_blocks);
+            (*printer)(prarg, "%-28s %ju bytes\n", "block_cache_zc_bytes", block_cache_stats.compressed_bytes);
+            (*printer)(prarg, "%-28s %.8f\n", "block_cache_zc_ratio", block_cache_stats.compressed_ratio);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_zc_hits", block_cache_stats.compressed_hits);
+            (*printer)(prarg, "%-28s %.3f usec\n", "block_cache_zc_decompress", block_cache_stats.decompress_micros);
+        }
+        if (config.block_cache.dedup) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_dedup_blocks", block_cache_stats.dedup_blocks);
+            (*printer)(prarg, "%-28s %u buffers\n", "block_cache_dedup_buffers", block_cache_stats.dedup_buffers);
+            (*printer)(prarg, "%-28s %.8f\n", "block_cache_dedup_ratio", block_cache_stats.dedup_ratio);
+        }
+        if (config.block_cache.partial_writes) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_partial_blocks", block_cache_stats.partial_blocks);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_partial_fills", block_cache_stats.partial_fills);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_partial_completed", block_cache_stats.partial_completed);
+        }
+        if (config.block_cache.recover_threads > 0) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_recover_total", block_cache_stats.recover_total);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_recover_written", block_cache_stats.recover_written);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_recover_remaining", block_cache_stats.recover_remaining);
+        }
+        if (config.block_cache.lazy_load) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_lazy_remaining", block_cache_stats.lazy_remaining);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_lazy_on_demand", block_cache_stats.lazy_on_demand);
+        }
+        if (config.block_cache.defrag)
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_defrag_moves", block_cache_stats.defrag_moves);
+        if (config.block_cache.cache_file != NULL) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_target_size", block_cache_stats.target_size);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_resize_shrinks", block_cache_stats.resize_shrinks);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_resize_grows", block_cache_stats.resize_grows);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_shrink_moves", block_cache_stats.shrink_moves);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_shrink_remaining", block_cache_stats.shrink_remaining);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_reclaim_pending", block_cache_stats.reclaim_pending);
+        }
+        if (config.block_cache.memory_size > 0) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_mem_size", block_cache_stats.memory_blocks);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_mem_hits", block_cache_stats.memory_hits);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_disk_hits", block_cache_stats.disk_hits);
+        }
+        if (config.block_cache.checksums)
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_checksum_errors", block_cache_stats.checksum_errors);
+        for (i = 0; i < block_cache_stats.num_files; i++) {
+            const struct block_cache_file_stats *const fstats = &block_cache_stats.files[i];
+            char name[32];
+
+            snvprintf(name, sizeof(name), "block_cache_file%u_used", i);
+            (*printer)(prarg, "%-28s %u/%u blocks\n", name, fstats->used, fstats->size);
+            snvprintf(name, sizeof(name), "block_cache_file%u_reads", i);
+            (*printer)(prarg, "%-28s %u\n", name, fstats->reads);
+            snvprintf(name, sizeof(name), "block_cache_file%u_read_rate", i);
+            (*printer)(prarg, "%-28s %.3f MB/s\n", name, fstats->read_rate / (1024.0 * 1024.0));
+            snvprintf(name, sizeof(name), "block_cache_file%u_read_lat", i);
+            (*printer)(prarg, "%-28s %.3f usec\n", name, fstats->read_latency);
+            snvprintf(name, sizeof(name), "block_cache_file%u_writes", i);
+            (*printer)(prarg, "%-28s %u\n", name, fstats->writes);
+            snvprintf(name, sizeof(name), "block_cache_file%u_write_rate", i);
+            (*printer)(prarg, "%-28s %.3f MB/s\n", name, fstats->write_rate / (1024.0 * 1024.0));
+            snvprintf(name, sizeof(name), "block_cache_file%u_write_lat", i);
+            (*printer)(prarg, "%-28s %.3f usec\n", name, fstats->write_latency);
+            snvprintf(name, sizeof(name), "block_cache_file%u_disk", i);
+            (*printer)(prarg, "%-28s %ju bytes\n", name, (uintmax_t)fstats->disk_bytes);
+            snvprintf(name, sizeof(name), "block_cache_file%u_reclaimed", i);
+            (*printer)(prarg, "%-28s %ju bytes\n", name, (uintmax_t)fstats->reclaimed_bytes);
+        }
+        if (config.block_cache.num_ranges > 0 || config.block_cache.num_protected > 0) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_prio_normal", block_cache_stats.prio_blocks[BLOCK_CACHE_PRIO_NORMAL]);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_prio_high", block_cache_stats.prio_blocks[BLOCK_CACHE_PRIO_HIGH]);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_prio_pinned", block_cache_stats.prio_blocks[BLOCK_CACHE_PRIO_PINNED]);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_pinned_total", block_cache_stats.pinned_blocks);
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_preloaded", block_cache_stats.preload_blocks);
+        }
+        if (config.block_cache.min_size > 0) {
+            (*printer)(prarg, "%-28s %u blocks\n", "block_cache_target_size", block_cache_stats.target_size);
+            (*printer)(prarg, "%-28s %.2f%%\n", "block_cache_mem_pressure", block_cache_stats.memory_pressure);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_resize_shrinks", block_cache_stats.resize_shrinks);
+            (*printer)(prarg, "%-28s %u\n", "block_cache_resize_grows", block_cache_stats.resize_grows);
+        }
         total_oom += block_cache_stats.out_of_memory_errors;
     }
     if (zero_cache_store != NULL) {
@@ -1116,6 +1413,31 @@ s3b_config_clear_stats(void)
         block_cache_clear_stats(block_cache_store);
 }
 
+/*
+ * Handle a command written to the stats file. The only command is "blockCacheSize=NUM", which resizes the block cache.
+ */
+static int
+s3b_config_control(const char *command)
+{
+    static const char *const prefix = "blockCacheSize=";
+    const char *const value_str = command + strlen(prefix);
+    unsigned long value;
+    char *end;
+
+    // Parse command
+    if (strncmp(command, prefix, strlen(prefix)) != 0)
+        return EINVAL;
+    errno = 0;
+    value = strtoul(value_str, &end, 10);
+    if (errno != 0 || end == value_str || *end != '\0' || value > UINT_MAX)
+        return EINVAL;
+
+    // Resize block cache
+    if (block_cache_store == NULL)
+        return ENOTSUP;
+    return block_cache_resize(block_cache_store, (u_int)value);
+}
+
 static void
 insert_fuse_arg(int pos, const char *arg)
 {
@@ -1226,6 +1548,34 @@ handle_unknown_option(void *data, const char *arg, int key, struct fuse_args *ou
     return 1;
 }
 
+/*
+ * Handle command line flags that have a key in the option list, passing everything else on to the unknown option handler.
+ */
+static int
+handle_keyed_option(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    char **new_files;
+
+    switch (key) {
+    case OPT_KEY_BLOCK_CACHE_FILE:
+        if (config.block_cache.num_cache_files >= BLOCK_CACHE_MAX_FILES) {
+            warnx("the block cache can't be striped across more than %u files", BLOCK_CACHE_MAX_FILES);
+            return -1;
+        }
+        if ((new_files = realloc(config.block_cache.cache_files,
+          (config.block_cache.num_cache_files + 1) * sizeof(*new_files))) == NULL)
+            err(1, "realloc");
+        config.block_cache.cache_files = new_files;
+        if ((new_files[config.block_cache.num_cache_files] = strdup(strchr(arg, '=') + 1)) == NULL)
+            err(1, "strdup");
+        config.block_cache.cache_file = new_files[0];
+        config.block_cache.num_cache_files++;
+        return 0;
+    default:
+        return (*unknown_option_handler)(data, arg, key, outargs);
+    }
+}
+
 static int
 search_access_for(const char *file, const char *accessId, char **idptr, char **pwptr)
 {
@@ -1682,17 +2032,66 @@ validate_config(int parse_only)
         warnx("invalid block cache thread pool size %u", config.block_cache.num_threads);
         return -1;
     }
+    if (config.block_cache.cache_size > 0 && config.block_cache.write_batch == 0) {
+        warnx("invalid block cache write batch size %u", config.block_cache.write_batch);
+        return -1;
+    }
     if (config.block_cache.write_delay > 0 && config.block_cache.synchronous) {
         warnx("\"--blockCacheSync\" requires setting \"--blockCacheWriteDelay=0\"");
         return -1;
     }
+    if (config.block_cache.cache_file != NULL && config.block_cache.cache_size < config.block_cache.num_cache_files) {
+        warnx("the block cache size (%u blocks) must be at least the number of cache files (%u)",
+          config.block_cache.cache_size, config.block_cache.num_cache_files);
+        return -1;
+    }
+    if (config.block_cache_memory_str != NULL) {
+        if (parse_size_string(config.block_cache_memory_str, "block cache memory tier size", sizeof(size_t), &value) == -1)
+            return -1;
+        config.block_cache.memory_size = value;
+    }
+    if (config.block_cache.memory_size > 0 && config.block_cache.cache_file == NULL) {
+        warnx("\"--blockCacheFileMemory\" requires specifying \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.memory_size > 0 && config.block_cache.memory_size < config.block_size) {
+        warnx("\"--blockCacheFileMemory\" size must be at least the block size");
+        return -1;
+    }
+    if (config.block_cache.max_size > 0 && config.block_cache.cache_file == NULL) {
+        warnx("\"--blockCacheFileMaxSize\" requires specifying \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.max_size > 0 && config.block_cache.max_size < config.block_cache.cache_size) {
+        warnx("the block cache maximum size (%u blocks) must be at least the block cache size (%u blocks)",
+          config.block_cache.max_size, config.block_cache.cache_size);
+        return -1;
+    }
+    if (config.block_cache.stripe_hash && config.block_cache.cache_file == NULL) {
+        warnx("\"--blockCacheFileStripeHash\" requires specifying \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.defrag && config.block_cache.cache_file == NULL) {
+        warnx("\"--blockCacheFileDefrag\" requires specifying \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.checksums && config.block_cache.cache_file == NULL) {
+        warnx("\"--blockCacheFileChecksums\" requires specifying \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.trusted && !config.block_cache.checksums) {
+        warnx("\"--blockCacheFileTrusted\" requires specifying \"--blockCacheFileChecksums\"");
+        return -1;
+    }
     if (config.block_cache.cache_size > 0 && config.block_cache.cache_file != NULL) {
+        const u_int num_files = config.block_cache.num_cache_files;
+        const u_int capacity = config.block_cache.max_size > 0 ? config.block_cache.max_size : config.block_cache.cache_size;
         int bs_bits = ffs(config.block_size) - 1;
-        int cs_bits = ffs(config.block_cache.cache_size);
+        int cs_bits = ffs((capacity + num_files - 1) / num_files);
 
         if (bs_bits + cs_bits >= sizeof(off_t) * 8 - 1) {
             warnx("the block cache is too big to fit within a single file (%u blocks x %u bytes)",
-              config.block_cache.cache_size, config.block_size);
+              capacity, config.block_size);
             return -1;
         }
     }
@@ -1700,8 +2099,73 @@ validate_config(int parse_only)
         warnx("\"--blockCacheRecoverDirtyBlocks\" requires specifying \"--blockCacheFile\"");
         return -1;
     }
+    if (config.block_cache.shutdown_timeout > 0 && config.block_cache.cache_file == NULL) {
+        warnx("\"--blockCacheShutdownTimeout\" requires specifying \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.lazy_load && config.block_cache.cache_file == NULL) {
+        warnx("\"--blockCacheFileLazyLoad\" requires specifying \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.recover_threads > 0 && !config.block_cache.recover_dirty_blocks) {
+        warnx("\"--blockCacheRecoverThreads\" requires specifying \"--blockCacheRecoverDirtyBlocks\"");
+        return -1;
+    }
+    if (config.block_cache.read_ahead_streams == 0
+      || config.block_cache.read_ahead_streams > BLOCK_CACHE_MAX_READ_AHEAD_STREAMS) {
+        warnx("invalid read ahead stream count %u", config.block_cache.read_ahead_streams);
+        return -1;
+    }
+    if (config.block_cache.read_ahead_max < config.block_cache.read_ahead)
+        config.block_cache.read_ahead_max = config.block_cache.read_ahead;
+    if (config.block_cache.read_ahead_stride > INT_MAX) {
+        warnx("invalid read ahead stride %u", config.block_cache.read_ahead_stride);
+        return -1;
+    }
+    if (config.block_cache_compress_str != NULL) {
+        if (parse_size_string(config.block_cache_compress_str, "block cache compressed size", sizeof(size_t), &value) == -1)
+            return -1;
+        config.block_cache.compress_size = value;
+    }
+    if (config.block_cache_compress_alg != NULL && config.block_cache.compress_size == 0) {
+        warnx("the \"--blockCacheCompressAlg\" flag requires the \"--blockCacheCompress\" flag");
+        return -1;
+    }
+    if (config.block_cache.dedup && config.block_cache.cache_file != NULL) {
+        warnx("\"--blockCacheDedup\" is incompatible with \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.partial_writes && config.block_cache.cache_file != NULL) {
+        warnx("\"--blockCachePartialWrites\" is incompatible with \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.compress_size > 0 && config.block_cache.cache_file != NULL) {
+        warnx("\"--blockCacheCompress\" is incompatible with \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.compress_size > 0) {
+        const char *const name = config.block_cache_compress_alg != NULL ?
+          config.block_cache_compress_alg : S3BACKER_DEFAULT_BLOCK_CACHE_COMPRESSION;
+
+        if ((config.block_cache.compress_alg = comp_find(name)) == NULL) {
+            warnx("unknown compression algorithm \"%s\"", name);
+            return -1;
+        }
+        if ((config.block_cache.compress_level = (*config.block_cache.compress_alg->lparse)(S3BACKER_BLOCK_CACHE_COMPRESSION_LEVEL)) == NULL)
+            return -1;
+    }
     if (config.block_cache.num_protected > config.block_cache.cache_size)
         warnx("\"--blockCacheNumProtected\" is larger than cache size; this may cause performance problems");
+    if (config.block_cache_priority_str != NULL && parse_block_cache_ranges(config.block_cache_priority_str) == -1)
+        return -1;
+    if (config.block_cache.min_size > 0 && config.block_cache.cache_file != NULL) {
+        warnx("\"--blockCacheMinSize\" is incompatible with \"--blockCacheFile\"");
+        return -1;
+    }
+    if (config.block_cache.pressure == 0 || config.block_cache.pressure > 100) {
+        warnx("invalid block cache memory pressure threshold %u%%", config.block_cache.pressure);
+        return -1;
+    }
 
     // Check mount point, flag combinations
     if (config.nbd) {
@@ -1877,6 +2341,51 @@ validate_config(int parse_only)
           (uintmax_t)config.block_cache.cache_size, (uintmax_t)config.num_blocks);
         config.block_cache.cache_size = config.num_blocks;
     }
+    if (config.block_cache.max_size > config.num_blocks) {
+        warnx("block cache maximum size (%ju) is greater that the total number of blocks (%ju); automatically reducing",
+          (uintmax_t)config.block_cache.max_size, (uintmax_t)config.num_blocks);
+        config.block_cache.max_size = config.num_blocks;
+    }
+    if (config.block_cache.min_size >= config.block_cache.cache_size && config.block_cache.min_size > 0) {
+        warnx("block cache minimum size (%u) is not less than the block cache size (%u); disabling resizing",
+          config.block_cache.min_size, config.block_cache.cache_size);
+        config.block_cache.min_size = 0;
+    }
+
+    // Check block cache priority ranges; pinned blocks must leave room in the cache for everything else
+    if (config.block_cache.num_ranges > 0) {
+        uintmax_t num_pinned = 0;
+        u_int j;
+
+        for (j = 0; j < config.block_cache.num_ranges; j++) {
+            struct block_cache_range *const range = &config.block_cache.ranges[j];
+
+            if (range->min >= config.num_blocks) {
+                warnx("block cache priority range starting at block %ju is beyond the last block (%ju)",
+                  (uintmax_t)range->min, (uintmax_t)config.num_blocks - 1);
+                return -1;
+            }
+            if (range->max >= config.num_blocks)
+                range->max = config.num_blocks - 1;
+            if (range->prio == BLOCK_CACHE_PRIO_PINNED)
+                num_pinned += (uintmax_t)range->max - range->min + 1;
+        }
+        if (num_pinned > 0 && config.block_cache.cache_size == 0) {
+            warnx("pinned blocks in \"--blockCachePriority\" require the block cache");
+            return -1;
+        }
+        if (num_pinned > 0 && num_pinned >= config.block_cache.cache_size) {
+            warnx("%ju pinned blocks do not fit in the block cache (%u blocks)", num_pinned, config.block_cache.cache_size);
+            return -1;
+        }
+        if (num_pinned > 0 && config.block_cache.min_size > 0 && num_pinned >= config.block_cache.min_size) {
+            warnx("%ju pinned blocks do not fit in the block cache minimum size (%u blocks)",
+              num_pinned, config.block_cache.min_size);
+            return -1;
+        }
+        if (num_pinned > config.block_cache.cache_size / 2)
+            warnx("%ju pinned blocks use more than half of the block cache; this may cause performance problems", num_pinned);
+    }
 
 #ifdef __APPLE__
     // On MacOS, warn if kernel timeouts can happen prior to our own timeout
@@ -1913,6 +2422,7 @@ validate_config(int parse_only)
     // Copy common stuff into sub-module configs
     set_config_log(&config, config.log);
     config.block_cache.block_size = config.block_size;
+    config.block_cache.num_blocks = config.num_blocks;
     config.http_io.prefix = config.prefix;
     config.http_io.bucket = config.bucket;
     config.http_io.blockHashPrefix = config.blockHashPrefix;
@@ -1969,13 +2479,12 @@ validate_config(int parse_only)
          */
         if (config.block_cache.cache_file != NULL) {
             int32_t cache_mount_token = -1;
-            struct stat cache_file_stat;
             struct s3b_dcache *dcache;
 
             // Open disk cache file, if any, and read the mount token therein, if any
-            if (stat(config.block_cache.cache_file, &cache_file_stat) == -1) {
-                if (errno != ENOENT)
-                    err(1, "can't open cache file \"%s\"", config.block_cache.cache_file);
+            if ((r = s3b_dcache_exists(&config.block_cache)) != 0) {
+                if (r != ENOENT)
+                    errx(1, "can't open cache file \"%s\": %s", config.block_cache.cache_file, strerror(r));
             } else {
                 if ((r = s3b_dcache_open(&dcache, &config.block_cache, NULL, NULL, 0)) != 0)
                     errx(1, "error opening cache file \"%s\": %s", config.block_cache.cache_file, strerror(r));
@@ -2021,6 +2530,105 @@ validate_config(int parse_only)
     return 0;
 }
 
+/*
+ * Parse the "--blockCachePriority" list, which is a comma-separated list of
+ * CLASS:FIRST[-LAST] items, into sorted, non-overlapping block ranges.
+ */
+static int
+parse_block_cache_ranges(const char *list)
+{
+    static const char *const prio_names[BLOCK_CACHE_NUM_PRIOS] = {
+        [BLOCK_CACHE_PRIO_NORMAL]=  "normal",
+        [BLOCK_CACHE_PRIO_HIGH]=    "high",
+        [BLOCK_CACHE_PRIO_PINNED]=  "pinned",
+    };
+    struct block_cache_range *ranges = NULL;
+    struct block_cache_range *range;
+    u_int num_ranges = 0;
+    uintmax_t min;
+    uintmax_t max;
+    const char *s;
+    size_t len;
+    char *eptr;
+    u_int prio;
+    u_int i;
+
+    for (s = list; *s != '\0'; s = *eptr == ',' ? eptr + 1 : eptr) {
+
+        // Parse class name
+        for (prio = 0; prio < BLOCK_CACHE_NUM_PRIOS; prio++) {
+            len = strlen(prio_names[prio]);
+            if (strncmp(s, prio_names[prio], len) == 0 && s[len] == ':')
+                break;
+        }
+        if (prio == BLOCK_CACHE_NUM_PRIOS) {
+            warnx("invalid block cache priority list \"%s\": expected \"pinned\", \"high\", or \"normal\" at \"%s\"", list, s);
+            goto fail;
+        }
+        s += len + 1;
+
+        // Parse block range
+        if (!isdigit((u_char)*s) || (min = strtoull(s, &eptr, 10), eptr == s)) {
+            warnx("invalid block cache priority list \"%s\": expected block number at \"%s\"", list, s);
+            goto fail;
+        }
+        max = min;
+        if (*eptr == '-') {
+            s = eptr + 1;
+            if (!isdigit((u_char)*s) || (max = strtoull(s, &eptr, 10), eptr == s)) {
+                warnx("invalid block cache priority list \"%s\": expected block number at \"%s\"", list, s);
+                goto fail;
+            }
+        }
+        if (*eptr != ',' && *eptr != '\0') {
+            warnx("invalid block cache priority list \"%s\": unexpected \"%s\"", list, eptr);
+            goto fail;
+        }
+        if (max < min || max > (s3b_block_t)~0) {
+            warnx("invalid block cache priority list \"%s\": invalid block range %ju-%ju", list, min, max);
+            goto fail;
+        }
+
+        // Add range
+        if ((range = realloc(ranges, (num_ranges + 1) * sizeof(*ranges))) == NULL)
+            err(1, "realloc");
+        ranges = range;
+        range = &ranges[num_ranges++];
+        range->min = (s3b_block_t)min;
+        range->max = (s3b_block_t)max;
+        range->prio = prio;
+    }
+
+    // Sort ranges and check for overlap
+    qsort(ranges, num_ranges, sizeof(*ranges), block_cache_range_cmp);
+    for (i = 1; i < num_ranges; i++) {
+        if (ranges[i].min <= ranges[i - 1].max) {
+            warnx("invalid block cache priority list \"%s\": block ranges %ju-%ju and %ju-%ju overlap", list,
+              (uintmax_t)ranges[i - 1].min, (uintmax_t)ranges[i - 1].max, (uintmax_t)ranges[i].min, (uintmax_t)ranges[i].max);
+            goto fail;
+        }
+    }
+
+    // Done
+    free(config.block_cache.ranges);
+    config.block_cache.ranges = ranges;
+    config.block_cache.num_ranges = num_ranges;
+    return 0;
+
+fail:
+    free(ranges);
+    return -1;
+}
+
+static int
+block_cache_range_cmp(const void *ptr1, const void *ptr2)
+{
+    const struct block_cache_range *const range1 = ptr1;
+    const struct block_cache_range *const range2 = ptr2;
+
+    return range1->min < range2->min ? -1 : range1->min > range2->min ? 1 : 0;
+}
+
 void
 dump_config(const struct s3b_config *const c)
 {
@@ -2081,15 +2689,47 @@ dump_config(const struct s3b_config *const c)
     (*c->log)(LOG_DEBUG, "%24s: %u threads", "block_cache_threads", c->block_cache.num_threads);
     (*c->log)(LOG_DEBUG, "%24s: %ums", "block_cache_timeout", c->block_cache.timeout);
     (*c->log)(LOG_DEBUG, "%24s: %ums", "block_cache_write_delay", c->block_cache.write_delay);
+    (*c->log)(LOG_DEBUG, "%24s: %u threads", "block_cache_shutdown_threads", c->block_cache.shutdown_threads);
+    (*c->log)(LOG_DEBUG, "%24s: %ums", "block_cache_shutdown_timeout", c->block_cache.shutdown_timeout);
     (*c->log)(LOG_DEBUG, "%24s: %u blocks", "block_cache_max_dirty", c->block_cache.max_dirty);
+    (*c->log)(LOG_DEBUG, "%24s: %u blocks", "block_cache_write_batch", c->block_cache.write_batch);
+    (*c->log)(LOG_DEBUG, "%24s: %u blocks", "block_cache_protected", c->block_cache.num_protected);
+    (*c->log)(LOG_DEBUG, "%24s: \"%s\"", "block_cache_priority",
+      c->block_cache_priority_str != NULL ? c->block_cache_priority_str : "");
+    (*c->log)(LOG_DEBUG, "%24s: %u blocks", "block_cache_min_size", c->block_cache.min_size);
+    (*c->log)(LOG_DEBUG, "%24s: %u%%", "block_cache_pressure", c->block_cache.pressure);
+    (*c->log)(LOG_DEBUG, "%24s: \"%s\"", "block_cache_pressure_file", c->block_cache.pressure_file);
+    (*c->log)(LOG_DEBUG, "%24s: %ju bytes", "block_cache_compress", (uintmax_t)c->block_cache.compress_size);
+    (*c->log)(LOG_DEBUG, "%24s: %s", "block_cache_compress_alg",
+      c->block_cache.compress_alg != NULL ? c->block_cache.compress_alg->name : "(none)");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "block_cache_dedup", c->block_cache.dedup ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "block_cache_skip_unchanged", c->block_cache.skip_unchanged ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "block_cache_partial_writes", c->block_cache.partial_writes ? "true" : "false");
     (*c->log)(LOG_DEBUG, "%24s: %s", "block_cache_sync", c->block_cache.synchronous ? "true" : "false");
     (*c->log)(LOG_DEBUG, "%24s: %s", "recover_dirty_blocks", c->block_cache.recover_dirty_blocks ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %u threads", "recover_threads", c->block_cache.recover_threads);
     (*c->log)(LOG_DEBUG, "%24s: %u blocks", "read_ahead", c->block_cache.read_ahead);
     (*c->log)(LOG_DEBUG, "%24s: %u blocks", "read_ahead_trigger", c->block_cache.read_ahead_trigger);
-    (*c->log)(LOG_DEBUG, "%24s: \"%s\"", "block_cache_cache_file",
-      c->block_cache.cache_file != NULL ? c->block_cache.cache_file : "");
+    (*c->log)(LOG_DEBUG, "%24s: %u", "read_ahead_streams", c->block_cache.read_ahead_streams);
+    (*c->log)(LOG_DEBUG, "%24s: %u blocks", "read_ahead_max", c->block_cache.read_ahead_max);
+    (*c->log)(LOG_DEBUG, "%24s: %s", "read_ahead_reverse", c->block_cache.read_ahead_reverse ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %u blocks", "read_ahead_stride", c->block_cache.read_ahead_stride);
+    (*c->log)(LOG_DEBUG, "%24s: %u threads", "read_ahead_threads", c->block_cache.read_ahead_threads);
+    if (c->block_cache.num_cache_files == 0)
+        (*c->log)(LOG_DEBUG, "%24s: \"%s\"", "block_cache_cache_file", "");
+    for (i = 0; i < (int)c->block_cache.num_cache_files; i++)
+        (*c->log)(LOG_DEBUG, "%24s: \"%s\"", "block_cache_cache_file", c->block_cache.cache_files[i]);
     (*c->log)(LOG_DEBUG, "%24s: %s", "block_cache_no_verify", c->block_cache.no_verify ? "true" : "false");
     (*c->log)(LOG_DEBUG, "%24s: %s", "fadvise", c->block_cache.fadvise ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "io_uring", c->block_cache.io_uring ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "direct_io", c->block_cache.direct_io ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "lazy_load", c->block_cache.lazy_load ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %ju bytes", "block_cache_memory", (uintmax_t)c->block_cache.memory_size);
+    (*c->log)(LOG_DEBUG, "%24s: %u blocks", "block_cache_max_size", c->block_cache.max_size);
+    (*c->log)(LOG_DEBUG, "%24s: %s", "stripe_hash", c->block_cache.stripe_hash ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "defrag", c->block_cache.defrag ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "checksums", c->block_cache.checksums ? "true" : "false");
+    (*c->log)(LOG_DEBUG, "%24s: %s", "trusted", c->block_cache.trusted ? "true" : "false");
     if (!c->nbd) {
         (*c->log)(LOG_DEBUG, "fuse_main arguments:");
         for (i = 0; i < c->fuse_args.argc; i++)
@@ -2128,17 +2768,39 @@ usage(void)
     fprintf(stderr, "\t--%-27s %s\n", "accessEC2IAM=ROLE", "Acquire S3 credentials from EC2 machine via IAM role");
     fprintf(stderr, "\t--%-27s %s\n", "accessEC2IAM-IMDSv2", "Acquire S3 credentials using IMDSv2 instead of IMDSv1");
     fprintf(stderr, "\t--%-27s %s\n", "baseURL=URL", "Base URL for all requests");
-    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFile=FILE", "Block cache persistent file");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFile=FILE", "Block cache persistent file (repeat to stripe)");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheMaxDirty=NUM", "Block cache maximum number of dirty blocks");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheWriteBatch=NUM", "Max # of adjacent dirty blocks to write together");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheCompress=SIZE", "Keep evicted clean blocks compressed, up to SIZE bytes");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheCompressAlg=ALG", "Compression algorithm for \"--blockCacheCompress\"");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheDedup", "Share memory between clean blocks with identical content");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheSkipUnchanged", "Don't write back blocks whose content is unchanged");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCachePartialWrites", "Don't read uncached blocks before partially writing them");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheNoVerify", "Disable verification of data loaded from cache file");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileAdvise", "Use posix_fadvise(2) after reading from cache file");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileIOUring", "Use io_uring(7) for cache file I/O");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileDirectIO", "Bypass the kernel page cache for cache file data");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileLazyLoad", "Load clean cache file blocks in the background");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileMemory=SIZE", "Keep hot cache file blocks in memory, up to SIZE bytes");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileMaxSize=NUM", "Let the block cache grow to NUM blocks while mounted");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileStripeHash", "Stripe cache files by block number hash");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileDefrag", "Defragment cache file(s) while idle");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileChecksums", "Checksum cached data and verify it after restart");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheFileTrusted", "Don't verify ETags after a clean shutdown");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheSize=NUM", "Block cache size (in number of blocks)");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheSync", "Block cache performs all writes synchronously");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheRecoverDirtyBlocks", "Recover dirty cache file blocks on startup");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheRecoverThreads=NUM", "Write recovered dirty blocks using NUM dedicated threads");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheThreads=NUM", "Block cache write-back thread pool size");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheShutdownThreads=NUM", "Extra threads for flushing dirty blocks on shutdown");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheShutdownTimeout=MILLIS", "Leave dirty blocks in cache file if flush takes longer");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheTimeout=MILLIS", "Block cache entry timeout (zero = infinite)");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheWriteDelay=MILLIS", "Block cache maximum write-back delay");
     fprintf(stderr, "\t--%-27s %s\n", "blockCacheNumProtected=NUM", "Preferentially retain NUM blocks in the block cache");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCachePriority=LIST", "Block cache priority (pinned, high, normal) of block ranges");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCacheMinSize=NUM", "Shrink block cache under memory pressure, down to NUM");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCachePressure=PCT", "Memory pressure at which the block cache shrinks");
+    fprintf(stderr, "\t--%-27s %s\n", "blockCachePressureFile=FILE", "PSI file from which to read memory pressure");
     fprintf(stderr, "\t--%-27s %s\n", "blockSize=SIZE", "Block size (with optional suffix 'K', 'M', 'G', etc.)");
     fprintf(stderr, "\t--%-27s %s\n", "blockHashPrefix", "Prepend hash to block names for even distribution");
     fprintf(stderr, "\t--%-27s %s\n", "cacert=FILE", "Specify SSL certificate authority file");
@@ -2177,6 +2839,11 @@ usage(void)
     fprintf(stderr, "\t--%-27s %s\n", "quiet", "Omit progress output at startup");
     fprintf(stderr, "\t--%-27s %s\n", "readAhead=NUM", "Number of blocks to read-ahead");
     fprintf(stderr, "\t--%-27s %s\n", "readAheadTrigger=NUM", "# of sequentially read blocks to trigger read-ahead");
+    fprintf(stderr, "\t--%-27s %s\n", "readAheadStreams=NUM", "# of concurrent sequential streams to track for read-ahead");
+    fprintf(stderr, "\t--%-27s %s\n", "readAheadMax=NUM", "Maximum number of blocks the read-ahead window can grow to");
+    fprintf(stderr, "\t--%-27s %s\n", "readAheadReverse", "Also read-ahead for descending sequential reads");
+    fprintf(stderr, "\t--%-27s %s\n", "readAheadStride=NUM", "Also read-ahead for constant strides up to NUM blocks");
+    fprintf(stderr, "\t--%-27s %s\n", "readAheadThreads=NUM", "Read-ahead thread pool size (zero disables read-ahead)");
     fprintf(stderr, "\t--%-27s %s\n", "readOnly", "Return \"Read-only file system\" error for write attempts");
     fprintf(stderr, "\t--%-27s %s\n", "region=region", "Specify AWS region");
     fprintf(stderr, "\t--%-27s %s\n", "reset-mounted-flag", "Reset \"already mounted\" flag in the filesystem");
@@ -2204,6 +2871,9 @@ usage(void)
     fprintf(stderr, "\t--%-27s %u\n", "blockCacheThreads", S3BACKER_DEFAULT_BLOCK_CACHE_NUM_THREADS);
     fprintf(stderr, "\t--%-27s %u\n", "blockCacheTimeout", S3BACKER_DEFAULT_BLOCK_CACHE_TIMEOUT);
     fprintf(stderr, "\t--%-27s %u\n", "blockCacheWriteDelay", S3BACKER_DEFAULT_BLOCK_CACHE_WRITE_DELAY);
+    fprintf(stderr, "\t--%-27s \"%s\"\n", "blockCacheCompressAlg", S3BACKER_DEFAULT_BLOCK_CACHE_COMPRESSION);
+    fprintf(stderr, "\t--%-27s %u\n", "blockCachePressure", S3BACKER_DEFAULT_BLOCK_CACHE_PRESSURE);
+    fprintf(stderr, "\t--%-27s \"%s\"\n", "blockCachePressureFile", S3BACKER_DEFAULT_BLOCK_CACHE_PRESSURE_FILE);
     fprintf(stderr, "\t--%-27s %d\n", "blockSize", S3BACKER_DEFAULT_BLOCKSIZE);
     fprintf(stderr, "\t--%-27s \"%s\"\n", "filename", S3BACKER_DEFAULT_FILENAME);
     fprintf(stderr, "\t--%-27s %u\n", "initialRetryPause", S3BACKER_DEFAULT_INITIAL_RETRY_PAUSE);
@@ -2217,6 +2887,9 @@ usage(void)
     fprintf(stderr, "\t--%-27s \"%s\"\n", "prefix", S3BACKER_DEFAULT_PREFIX);
     fprintf(stderr, "\t--%-27s %u\n", "readAhead", S3BACKER_DEFAULT_READ_AHEAD);
     fprintf(stderr, "\t--%-27s %u\n", "readAheadTrigger", S3BACKER_DEFAULT_READ_AHEAD_TRIGGER);
+    fprintf(stderr, "\t--%-27s %u\n", "readAheadStreams", S3BACKER_DEFAULT_READ_AHEAD_STREAMS);
+    fprintf(stderr, "\t--%-27s %u\n", "readAheadMax", S3BACKER_DEFAULT_READ_AHEAD_MAX);
+    fprintf(stderr, "\t--%-27s %u\n", "readAheadThreads", S3BACKER_DEFAULT_READ_AHEAD_THREADS);
     fprintf(stderr, "\t--%-27s \"%s\"\n", "region", S3BACKER_DEFAULT_REGION);
     fprintf(stderr, "\t--%-27s \"%s\"\n", "statsFilename", S3BACKER_DEFAULT_STATS_FILENAME);
     fprintf(stderr, "\t--%-27s %u\n", "timeout", S3BACKER_DEFAULT_TIMEOUT);
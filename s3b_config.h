@@ -74,6 +74,10 @@ struct s3b_config {
     // These are only used during command line parsing
     const char                  *file_size_str;
     const char                  *block_size_str;
+    const char                  *block_cache_compress_str;
+    const char                  *block_cache_compress_alg;
+    const char                  *block_cache_memory_str;
+    const char                  *block_cache_priority_str;
     const char                  *password_file;
     const char                  *max_speed_str[2];
     char                        *compress_alg;
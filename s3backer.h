@@ -38,14 +38,21 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #if HAVE_SYS_STATVFS_H
 #include <sys/statvfs.h>
 #endif
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #if HAVE_DECL_PRCTL
 #include <sys/prctl.h>
 #endif
+#if HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
 
 // Add some queue.h definitions missing on Linux
 #ifndef LIST_FIRST
@@ -44,22 +44,58 @@
 #include "s3b_config.h"
 #include "util.h"
 
+/*
+ * By default, random reads and writes are performed and verified until a termination signal is received.
+ * The following flags, which must precede any s3backer flags, select other modes:
+ *
+ *  --crash=FILE    Record every write in journal FILE and abort() after a random delay, while writes
+ *                  are in progress and cache file directory updates are still buffered. Start with no
+ *                  existing cache file.
+ *  --verify=FILE   Verify the content of every block against journal FILE from a previous --crash run:
+ *                  each block must contain the data from its last completed write, or else from the write
+ *                  that was in progress when the crash occurred. Use the same cache file along with
+ *                  --blockCacheRecoverDirtyBlocks and --blockCacheNoVerify, so blocks are read as recovered
+ *                  from the cache file instead of being verified with the server. Verifying again afterward
+ *                  without --blockCacheFile checks that the recovered dirty blocks were written back.
+ *  --hot=NUM       Confine reads and writes to the first NUM blocks, without any delay between them,
+ *                  to generate contention. The number of operations per second and of times threads
+ *                  had to block (voluntary context switches) per operation are reported on exit.
+ *  --threads=NUM   Use NUM tester threads instead of the default.
+ */
+
 // Definitions
 #define NUM_THREADS     10
 #define DELAY_BASE      0
 #define DELAY_RANGE     50
 #define READ_FACTOR     2
 #define ZERO_FACTOR     3
+#define CRASH_READ_FACTOR   8
+#define CRASH_BASE      500
+#define CRASH_RANGE     2000
 
 // Block states
 struct block_state {
     u_int               writing;        // block is currently being written by a thread
+    u_int               reading;        // number of threads currently reading the block
     u_int               counter;        // counts writes to the block
     u_int               content;        // most recently written content
+    u_int               pending;        // content being written, if "writing" (--verify only)
+};
+
+// Crash test journal records
+struct journal_record {
+    s3b_block_t         block_num;
+    u_int               content;
+    u_int               complete;       // zero when the write is started, one when it has completed
 };
 
 // Internal functions
 static void *test_thread_main(void *arg);
+static int tester_option(const char *arg);
+static u_int verify_blocks(const char *journal);
+static void journal_append(s3b_block_t block_num, u_int content, u_int complete);
+static void fill_block(u_char *data, u_int content);
+static int block_matches(const u_char *data, u_int content);
 static void logit(int id, const char *fmt, ...) __attribute__ ((__format__ (__printf__, 2, 3)));
 static void catch_signal(int sig);
 static uint64_t get_time(void);
@@ -70,24 +106,54 @@ static pthread_mutex_t log_mutex;
 static struct s3b_config *config;
 static struct s3backer_store *store;
 static struct block_state *blocks;
+static uint64_t *thread_ops;
 static uint64_t start_time;
 static volatile int stop_threads;
+static const char *crash_journal;
+static const char *verify_journal;
+static int journal_fd = -1;
+static u_int hot_blocks;
+static u_int num_threads = NUM_THREADS;
 
 int
 main(int argc, char **argv)
 {
     s3b_block_t block_num;
-    pthread_t threads[NUM_THREADS];
+    pthread_t *threads;
+    struct rusage usage_start;
+    struct rusage usage;
+    uint64_t threads_start;
+    uint64_t elapsed;
+    uint64_t total_ops;
+    uint64_t switches;
     sigset_t sigs;
+    u_int num_bad;
     int sig;
     int i;
     int r;
 
+    // Pull out our own flags
+    for (i = 1; i < argc && tester_option(argv[i]); i++)
+        ;
+    argv[i - 1] = argv[0];
+    argc -= i - 1;
+    argv += i - 1;
+    if (num_threads == 0)
+        errx(1, "invalid --threads value");
+    if (crash_journal != NULL && verify_journal != NULL)
+        errx(1, "--crash and --verify are mutually exclusive");
+
     // Get configuration
     if ((config = s3backer_get_config(argc, argv, 0, 0)) == NULL)
         exit(1);
     if (config->block_size < sizeof(u_int))
         err(1, "block size too small");
+    if (hot_blocks > config->num_blocks)
+        errx(1, "--hot value exceeds the number of blocks");
+
+    // In test mode, s3backer_get_config() skips the mount token check that would enable recovery of dirty blocks
+    if (verify_journal != NULL)
+        config->block_cache.perform_flush = config->block_cache.recover_dirty_blocks;
 
     // Open store
     logit(-1, "creating s3backer store");
@@ -111,6 +177,21 @@ main(int argc, char **argv)
         err(1, "mutex init");
     start_time = get_time();
 
+    // Verify against crash test journal, if requested
+    if (verify_journal != NULL) {
+        num_bad = verify_blocks(verify_journal);
+        logit(-1, "shutting down s3backer store");
+        if ((r = (*store->shutdown)(store)) != 0)
+            errx(1, "shutdown: %s", strerror(r));
+        (*store->destroy)(store);
+        logit(-1, "done");
+        return num_bad != 0;
+    }
+
+    // Open crash test journal, if requested; an empty journal means all blocks are zero
+    if (crash_journal != NULL && (journal_fd = open(crash_journal, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1)
+        err(1, "%s", crash_journal);
+
     // Zero all blocks
     logit(-1, "started zeroing all blocks");
     for (block_num = 0; block_num < config->num_blocks; block_num++) {
@@ -122,10 +203,22 @@ main(int argc, char **argv)
     logit(-1, "finished zeroing all blocks");
 
     // Create my threads
-    logit(-1, "starting tester threads");
-    for (i = 0; i < NUM_THREADS; i++)
+    logit(-1, "starting %u tester threads", num_threads);
+    if ((threads = calloc(num_threads, sizeof(*threads))) == NULL
+      || (thread_ops = calloc(num_threads, sizeof(*thread_ops))) == NULL)
+        err(1, "calloc");
+    threads_start = get_time();
+    getrusage(RUSAGE_SELF, &usage_start);
+    for (i = 0; i < num_threads; i++)
         pthread_create(&threads[i], NULL, test_thread_main, (void *)(intptr_t)i);
 
+    // If doing a crash test, crash while the threads are busy
+    if (crash_journal != NULL) {
+        usleep((CRASH_BASE + (random() % CRASH_RANGE)) * 1000);
+        logit(-1, "crashing");
+        abort();
+    }
+
     // Wait for signal
     logit(-1, "waiting for termination signal");
     signal(SIGHUP, catch_signal);
@@ -144,8 +237,20 @@ main(int argc, char **argv)
     // Stop threads and wait for them to exit
     logit(-1, "stopping tester threads");
     stop_threads = 1;
-    for (i = 0; i < NUM_THREADS; i++)
+    elapsed = get_time() - threads_start;
+    getrusage(RUSAGE_SELF, &usage);
+    total_ops = 0;
+    for (i = 0; i < num_threads; i++) {
         pthread_join(threads[i], NULL);
+        total_ops += thread_ops[i];
+    }
+
+    // Report throughput, and how often threads had to block (for I/O, or waiting on each other)
+    switches = usage.ru_nvcsw - usage_start.ru_nvcsw;
+    logit(-1, "%ju operations in %u.%03u seconds (%ju per second), %ju voluntary context switches (%ju.%02ju per operation)",
+      (uintmax_t)total_ops, (u_int)(elapsed / 1000), (u_int)(elapsed % 1000),
+      (uintmax_t)(elapsed > 0 ? total_ops * 1000 / elapsed : 0), (uintmax_t)switches,
+      (uintmax_t)(total_ops > 0 ? switches / total_ops : 0), (uintmax_t)(total_ops > 0 ? switches * 100 / total_ops % 100 : 0));
 
     // Done
     logit(-1, "done");
@@ -158,74 +263,93 @@ test_thread_main(void *arg)
     const int id = (int)(intptr_t)arg;
     u_char data[config->block_size];
     s3b_block_t block_num;
+    u_int seed;
     int millis;
     int r;
 
+    // Each thread has its own random sequence, so threads don't contend on random()
+    seed = (u_int)random();
+
     // Loop
     while (!stop_threads) {
 
-        // Sleep
-        millis = DELAY_BASE + (random() % DELAY_RANGE);
-        usleep(millis * 1000);
+        // Sleep, unless we're generating contention or a burst of activity to crash in the middle of
+        if (hot_blocks == 0 && journal_fd == -1) {
+            millis = DELAY_BASE + (rand_r(&seed) % DELAY_RANGE);
+            usleep(millis * 1000);
+        }
 
         // Pick a random block
-        block_num = random() % config->num_blocks;
+        block_num = rand_r(&seed) % (hot_blocks != 0 ? hot_blocks : config->num_blocks);
 
         // Randomly read or write it
-        if ((random() % READ_FACTOR) != 0) {
+        if ((rand_r(&seed) % (journal_fd != -1 ? CRASH_READ_FACTOR : READ_FACTOR)) != 0) {
             struct block_state *const state = &blocks[block_num];
             struct block_state before;
-            struct block_state after;
 
-            // Snapshot block state
+            // Snapshot block state; like the kernel, don't read a block while it's being written (see zero_cache.c)
             pthread_mutex_lock(&mutex);
+            if (state->writing) {
+                CHECK_RETURN(pthread_mutex_unlock(&mutex));
+                continue;
+            }
+            state->reading++;
             memcpy(&before, state, sizeof(before));
             CHECK_RETURN(pthread_mutex_unlock(&mutex));
 
             // Do the read
-            logit(id, "rd %0*jx START", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num);
-            if ((r = (*store->read_block)(store, block_num, data, NULL, NULL, 0)) != 0) {
+            if (hot_blocks == 0)
+                logit(id, "rd %0*jx START", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num);
+            r = (*store->read_block)(store, block_num, data, NULL, NULL, 0);
+            pthread_mutex_lock(&mutex);
+            state->reading--;
+            CHECK_RETURN(pthread_mutex_unlock(&mutex));
+            if (r != 0) {
                 logit(id, "****** READ ERROR: %s", strerror(r));
                 continue;
             }
 
-            // Snapshot block state again
-            pthread_mutex_lock(&mutex);
-            memcpy(&after, state, sizeof(before));
-            CHECK_RETURN(pthread_mutex_unlock(&mutex));
-
-            // Verify content, but only if no write occurred while we were reading
-            if (before.writing == 0 && after.writing == 0 && before.counter == after.counter) {
-                if (memcmp(data, &before.content, sizeof(before.content)) != 0) {
-                    logit(id, "got wrong content block %0*jx", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num);
-                    exit(1);
-                }
+            // Verify content
+            if (!block_matches(data, before.content)) {
+                logit(id, "got wrong content block %0*jx: content=0x%02x%02x%02x%02x expected=0x%08x",
+                  S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num, data[0], data[1], data[2], data[3], before.content);
+                exit(1);
+            }
+            if (hot_blocks == 0) {
+                logit(id, "rd %0*jx content=0x%02x%02x%02x%02x COMPLETE", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num,
+                  data[0], data[1], data[2], data[3]);
             }
-            logit(id, "rd %0*jx content=0x%02x%02x%02x%02x COMPLETE", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num,
-              data[0], data[1], data[2], data[3]);
         } else {
             struct block_state *const state = &blocks[block_num];
             u_int content;
 
             // Update block state
             pthread_mutex_lock(&mutex);
-            if (state->writing) {                   // only one writer at a time
+            if (state->writing || state->reading) { // only one writer at a time, and no readers
                 CHECK_RETURN(pthread_mutex_unlock(&mutex));
                 continue;
             }
             state->writing = 1;
             CHECK_RETURN(pthread_mutex_unlock(&mutex));
 
-            // Write block
-            content = (random() % ZERO_FACTOR) != 0 ? 0 : (u_int)random();
-            memcpy(data, &content, sizeof(content));
-            memset(data + sizeof(content), 0, config->block_size - sizeof(content));
-            logit(id, "wr %0*jx content=0x%02x%02x%02x%02x START", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num,
-              data[0], data[1], data[2], data[3]);
+            // Write block (never zeros if generating contention, otherwise the zero cache would absorb
+            // much of it), recording it in the journal before and after (if doing a crash test)
+            content = hot_blocks == 0 && (rand_r(&seed) % ZERO_FACTOR) != 0 ? 0 : (u_int)rand_r(&seed) | 1;
+            fill_block(data, content);
+            if (hot_blocks == 0) {
+                logit(id, "wr %0*jx content=0x%02x%02x%02x%02x START", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num,
+                  data[0], data[1], data[2], data[3]);
+            }
+            if (journal_fd != -1)
+                journal_append(block_num, content, 0);
             if ((r = (*store->write_block)(store, block_num, data, NULL, NULL, NULL)) != 0)
                 logit(id, "****** WRITE ERROR: %s", strerror(r));
-            logit(id, "wr %0*jx content=0x%02x%02x%02x%02x %s%s", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num,
-              data[0], data[1], data[2], data[3], r != 0 ? "FAILED: " : "COMPLETE", r != 0 ? strerror(r) : "");
+            else if (journal_fd != -1)
+                journal_append(block_num, content, 1);
+            if (hot_blocks == 0 || r != 0) {
+                logit(id, "wr %0*jx content=0x%02x%02x%02x%02x %s%s", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num,
+                  data[0], data[1], data[2], data[3], r != 0 ? "FAILED: " : "COMPLETE", r != 0 ? strerror(r) : "");
+            }
 
             // Update block state
             pthread_mutex_lock(&mutex);
@@ -236,12 +360,136 @@ test_thread_main(void *arg)
             state->writing = 0;
             CHECK_RETURN(pthread_mutex_unlock(&mutex));
         }
+        thread_ops[id]++;
     }
 
     // Done
     return NULL;
 }
 
+/*
+ * Parse a tester flag, if "arg" is one.
+ */
+static int
+tester_option(const char *arg)
+{
+    if (strncmp(arg, "--crash=", 8) == 0)
+        crash_journal = arg + 8;
+    else if (strncmp(arg, "--verify=", 9) == 0)
+        verify_journal = arg + 9;
+    else if (strncmp(arg, "--hot=", 6) == 0)
+        hot_blocks = (u_int)strtoul(arg + 6, NULL, 10);
+    else if (strncmp(arg, "--threads=", 10) == 0)
+        num_threads = (u_int)strtoul(arg + 10, NULL, 10);
+    else
+        return 0;
+    return 1;
+}
+
+/*
+ * Verify every block against a crash test journal and return the number of blocks that were wrong.
+ *
+ * This catches a cache file directory that was updated out of order, e.g., a dirty entry recorded
+ * before its data, or a dslot's data overwritten before the erasure of its previous entry was on disk:
+ * either way, a block would be recovered with data belonging to some other block or an older write.
+ */
+static u_int
+verify_blocks(const char *journal)
+{
+    u_char data[config->block_size];
+    struct journal_record record;
+    s3b_block_t block_num;
+    u_int num_records = 0;
+    u_int num_in_progress = 0;
+    u_int num_bad = 0;
+    FILE *fp;
+    int r;
+
+    // Replay the journal
+    if ((fp = fopen(journal, "r")) == NULL)
+        err(1, "%s", journal);
+    while (fread(&record, sizeof(record), 1, fp) == 1) {
+        struct block_state *state;
+
+        if (record.block_num >= config->num_blocks)
+            errx(1, "%s: invalid block number 0x%0*jx", journal, S3B_BLOCK_NUM_DIGITS, (uintmax_t)record.block_num);
+        state = &blocks[record.block_num];
+        if (record.complete) {
+            state->counter++;
+            state->content = record.content;
+            state->writing = 0;
+        } else {
+            state->pending = record.content;
+            state->writing = 1;
+        }
+        num_records++;
+    }
+    if (ferror(fp))
+        err(1, "%s", journal);
+    fclose(fp);
+    logit(-1, "read %u records from journal \"%s\"", num_records, journal);
+
+    // Read back every block; a write that was in progress when the crash occurred may or may not have taken effect
+    for (block_num = 0; block_num < config->num_blocks; block_num++) {
+        struct block_state *const state = &blocks[block_num];
+
+        if ((r = (*store->read_block)(store, block_num, data, NULL, NULL, 0)) != 0) {
+            logit(-1, "****** READ ERROR: block %0*jx: %s", S3B_BLOCK_NUM_DIGITS, (uintmax_t)block_num, strerror(r));
+            num_bad++;
+            continue;
+        }
+        if (block_matches(data, state->content))
+            continue;
+        if (state->writing && block_matches(data, state->pending)) {
+            num_in_progress++;
+            continue;
+        }
+        logit(-1, "got wrong content block %0*jx: content=0x%02x%02x%02x%02x expected=0x%08x%s", S3B_BLOCK_NUM_DIGITS,
+          (uintmax_t)block_num, data[0], data[1], data[2], data[3], state->content, state->writing ? " (or in-progress write)" : "");
+        num_bad++;
+    }
+    logit(-1, "verified %ju blocks: %u got an in-progress write, %u were wrong",
+      (uintmax_t)config->num_blocks, num_in_progress, num_bad);
+    return num_bad;
+}
+
+static void
+journal_append(s3b_block_t block_num, u_int content, u_int complete)
+{
+    struct journal_record record;
+
+    memset(&record, 0, sizeof(record));
+    record.block_num = block_num;
+    record.content = content;
+    record.complete = complete;
+    if (write(journal_fd, &record, sizeof(record)) != sizeof(record))
+        err(1, "%s", crash_journal);
+}
+
+/*
+ * Fill a block with repeated copies of "content", so that a torn or misplaced write is detectable.
+ */
+static void
+fill_block(u_char *data, u_int content)
+{
+    u_int off;
+
+    for (off = 0; off < config->block_size; off += sizeof(content))
+        memcpy(data + off, &content, config->block_size - off < sizeof(content) ? config->block_size - off : sizeof(content));
+}
+
+static int
+block_matches(const u_char *data, u_int content)
+{
+    u_int off;
+
+    for (off = 0; off < config->block_size; off += sizeof(content)) {
+        if (memcmp(data + off, &content, config->block_size - off < sizeof(content) ? config->block_size - off : sizeof(content)) != 0)
+            return 0;
+    }
+    return 1;
+}
+
 static void
 logit(int id, const char *fmt, ...)
 {
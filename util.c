@@ -1032,3 +1032,89 @@ md5_quick(const void *data, size_t len, u_char *result)
     (void)r;                // avoid unused variable warning
 #endif
 }
+
+#define HASH128_ROTL(x, n)      (((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t
+hash128_fmix(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/*
+ * Compute a fast, non-cryptographic 128-bit hash of some data (this is the x64 version of MurmurHash3).
+ *
+ * Unlike MD5, it's easy to construct different data having the same hash, so equal hashes must not be taken
+ * as proof of equal data.
+ */
+void
+hash128_quick(const void *data, size_t len, u_char *result)
+{
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    const u_char *const bytes = data;
+    const size_t nblocks = len / 16;
+    const u_char *const tail = bytes + nblocks * 16;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    uint64_t k1;
+    uint64_t k2;
+    size_t i;
+
+    // Body
+    for (i = 0; i < nblocks; i++) {
+        memcpy(&k1, bytes + i * 16, sizeof(k1));
+        memcpy(&k2, bytes + i * 16 + 8, sizeof(k2));
+        k1 *= c1;
+        k1 = HASH128_ROTL(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = HASH128_ROTL(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2;
+        k2 = HASH128_ROTL(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = HASH128_ROTL(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    // Tail
+    k1 = 0;
+    k2 = 0;
+    for (i = len & 15; i > 8; i--)
+        k2 |= (uint64_t)tail[i - 1] << ((i - 9) * 8);
+    if ((len & 15) > 8) {
+        k2 *= c2;
+        k2 = HASH128_ROTL(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    for (i = (len & 15) < 8 ? len & 15 : 8; i > 0; i--)
+        k1 |= (uint64_t)tail[i - 1] << ((i - 1) * 8);
+    if ((len & 15) > 0) {
+        k1 *= c1;
+        k1 = HASH128_ROTL(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    // Finalization
+    h1 ^= (uint64_t)len;
+    h2 ^= (uint64_t)len;
+    h1 += h2;
+    h2 += h1;
+    h1 = hash128_fmix(h1);
+    h2 = hash128_fmix(h2);
+    h1 += h2;
+    h2 += h1;
+    memcpy(result, &h1, sizeof(h1));
+    memcpy(result + sizeof(h1), &h2, sizeof(h2));
+}
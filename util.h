@@ -140,6 +140,8 @@ extern void block_list_free(struct block_list *list);
 extern int generic_bulk_zero(struct s3backer_store *s3b, const s3b_block_t *block_nums, u_int num_blocks);
 
 // Hashing
+#define HASH128_LENGTH      16                      // length of the result of hash128_quick()
+
 struct hmac_engine;
 struct hmac_ctx;
 
@@ -154,3 +156,4 @@ extern int hmac_result_length(struct hmac_ctx *ctx);
 extern void hmac_free(struct hmac_ctx *ctx);
 
 extern void md5_quick(const void *data, size_t len, u_char *result);
+extern void hash128_quick(const void *data, size_t len, u_char *result);